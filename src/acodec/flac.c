@@ -14,7 +14,10 @@ static const fmed_queue *qu;
 typedef struct flac {
 	ffflac fl;
 	int64 abs_seek;
+	uint64 until;
 	uint state;
+	ffflac_info info;
+	uint stmcopy :1;
 } flac;
 
 typedef struct flac_enc {
@@ -54,6 +57,7 @@ static const fmed_filter fmed_flac_input = {
 };
 
 static void flac_meta(flac *f, fmed_filt *d);
+static int flac_copy_hdr(flac *f, fmed_filt *d);
 
 //ENCODE
 static void* flac_enc_create(fmed_filt *d);
@@ -148,6 +152,11 @@ static void* flac_in_create(fmed_filt *d)
 
 	if ((int64)d->input.size != FMED_NULL)
 		f->fl.total_size = d->input.size;
+
+	if (d->stream_copy) {
+		f->stmcopy = 1;
+		f->until = (uint64)-1;
+	}
 	return f;
 }
 
@@ -199,11 +208,13 @@ again:
 	}
 
 	for (;;) {
-		r = ffflac_decode(&f->fl);
+		r = (f->stmcopy) ? ffflac_read(&f->fl) : ffflac_decode(&f->fl);
 		switch (r) {
 		case FFFLAC_RMORE:
 			if (d->flags & FMED_FLAST) {
 				warnlog(core, d->trk, "flac", "file is incomplete");
+				if (f->stmcopy && f->state == I_DATA)
+					goto copy_fin;
 				d->outlen = 0;
 				return FMED_RDONE;
 			}
@@ -220,6 +231,17 @@ again:
 			}
 
 			d->audio.total = ffflac_totalsamples(&f->fl) - f->abs_seek;
+
+			if (f->stmcopy) {
+				d->datatype = "flac";
+				d->audio.convfmt = d->audio.fmt;
+				if ((int64)d->audio.until != FMED_NULL) {
+					// handle 'until' here so that the final STREAMINFO block is passed to flac.out
+					f->until = fmed_apos_samples(d->audio.until, f->fl.fmt.sample_rate);
+					d->audio.until = FMED_NULL;
+					d->audio.total = ffmin64(d->audio.total, f->until);
+				}
+			}
 			break;
 
 		case FFFLAC_RTAG:
@@ -238,6 +260,9 @@ again:
 			f->state = I_DATA;
 			if (f->abs_seek != 0)
 				ffflac_seek(&f->fl, f->abs_seek);
+
+			if (f->stmcopy)
+				return flac_copy_hdr(f, d);
 			goto again;
 
 		case FFFLAC_RDATA:
@@ -248,6 +273,8 @@ again:
 			return FMED_RMORE;
 
 		case FFFLAC_RDONE:
+			if (f->stmcopy)
+				goto copy_fin;
 			d->outlen = 0;
 			return FMED_RDONE;
 
@@ -263,6 +290,19 @@ again:
 	}
 
 data:
+	if (f->stmcopy) {
+		d->audio.pos = ffflac_cursample(&f->fl) - f->abs_seek;
+		if (d->audio.pos >= f->until) {
+			dbglog(core, d->trk, "flac", "reached sample #%U", f->until);
+			goto copy_fin;
+		}
+		d->data = (void*)f->fl.data;
+		d->datalen = f->fl.datalen;
+		d->out = f->fl.out.ptr;
+		d->outlen = f->fl.out.len;
+		return FMED_RDATA;
+	}
+
 	dbglog(core, d->trk, "flac", "decoded %L samples (%U)"
 		, f->fl.pcmlen / ffpcm_size1(&f->fl.fmt), ffflac_cursample(&f->fl));
 	d->audio.pos = ffflac_cursample(&f->fl) - f->abs_seek;
@@ -272,6 +312,31 @@ data:
 	d->outni = f->fl.pcm;
 	d->outlen = f->fl.pcmlen;
 	return FMED_RDATA;
+
+copy_fin:
+	// flac.out expects STREAMINFO as the last data block
+	d->out = (void*)&f->info,  d->outlen = sizeof(f->info);
+	return FMED_RDONE;
+}
+
+/** Pass STREAMINFO to flac.out before the first copied frame. */
+static int flac_copy_hdr(flac *f, fmed_filt *d)
+{
+	f->info = f->fl.info;
+	if (f->abs_seek != 0 || (int64)d->audio.seek != FMED_NULL || f->until != (uint64)-1) {
+		// MD5 of the copied range is unknown
+		ffmem_zero(f->info.md5, sizeof(f->info.md5));
+	}
+
+	d->audio.pos = 0;
+	if ((int64)d->audio.seek != FMED_NULL)
+		d->audio.pos = ffpcm_samples(d->audio.seek, f->fl.fmt.sample_rate);
+
+	fmed_setval("flac_in_frsamples", f->fl.info.minblock);
+	d->data = (void*)f->fl.data;
+	d->datalen = f->fl.datalen;
+	d->out = (void*)&f->info,  d->outlen = sizeof(f->info);
+	return FMED_RDATA;
 }
 
 
@@ -401,25 +466,21 @@ static int flac_out_config(ffpars_ctx *conf)
 
 static int flac_out_addmeta(flac_out *f, fmed_filt *d)
 {
-	uint i;
-	ffstr name, *val;
-	void *qent;
+	fmed_trk_meta meta;
+	ffmem_tzero(&meta);
+	meta.flags = FMED_QUE_UNIQ;
 
 	const char *vendor = flac_vendor();
 	if (0 != ffflac_addtag(&f->fl, NULL, vendor, ffsz_len(vendor))) {
-		syserrlog(core, d->trk, "flac", "can't add tag: %S", &name);
+		syserrlog(core, d->trk, "flac", "can't add tag: %s", "vendor");
 		return -1;
 	}
 
-	if (FMED_PNULL == (qent = (void*)fmed_getval("queue_item")))
-		return 0;
-
-	for (i = 0;  NULL != (val = qu->meta(qent, i, &name, FMED_QUE_UNIQ));  i++) {
-		if (val == FMED_QUE_SKIP
-			|| ffstr_eqcz(&name, "vendor"))
+	while (0 == d->track->cmd2(d->trk, FMED_TRACK_META_ENUM, &meta)) {
+		if (ffstr_eqcz(&meta.name, "vendor"))
 			continue;
-		if (0 != ffflac_addtag(&f->fl, name.ptr, val->ptr, val->len)) {
-			syserrlog(core, d->trk, "flac", "can't add tag: %S", &name);
+		if (0 != ffflac_addtag(&f->fl, meta.name.ptr, meta.val.ptr, meta.val.len)) {
+			syserrlog(core, d->trk, "flac", "can't add tag: %S", &meta.name);
 			return -1;
 		}
 	}
@@ -455,10 +516,13 @@ static int flac_out_encode(void *ctx, fmed_filt *d)
 
 	switch (f->state) {
 	case I_FIRST:
-		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, "flac.encode"))
-			return FMED_RERR;
-		f->state = I_INIT;
-		return FMED_RMORE;
+		if (!ffsz_eq(d->datatype, "flac")) {
+			if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, "flac.encode"))
+				return FMED_RERR;
+			f->state = I_INIT;
+			return FMED_RMORE;
+		}
+		// fall through: frames are copied from flac input (--stream-copy)
 
 	case I_INIT:
 		if (!ffsz_eq(d->datatype, "flac")) {
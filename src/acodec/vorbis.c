@@ -287,19 +287,15 @@ static void vorbis_out_free(void *ctx)
 
 static int vorbis_out_addmeta(vorbis_out *v, fmed_filt *d)
 {
-	uint i;
-	ffstr name, *val;
-	void *qent;
+	fmed_trk_meta meta;
+	ffmem_tzero(&meta);
+	meta.flags = FMED_QUE_UNIQ;
 
-	if (FMED_PNULL == (qent = (void*)fmed_getval("queue_item")))
-		return 0;
-
-	for (i = 0;  NULL != (val = qu->meta(qent, i, &name, FMED_QUE_UNIQ));  i++) {
-		if (val == FMED_QUE_SKIP
-			|| ffstr_eqcz(&name, "vendor"))
+	while (0 == d->track->cmd2(d->trk, FMED_TRACK_META_ENUM, &meta)) {
+		if (ffstr_eqcz(&meta.name, "vendor"))
 			continue;
-		if (0 != ffvorbis_addtag(&v->vorbis, name.ptr, val->ptr, val->len))
-			warnlog(core, d->trk, NULL, "can't add tag: %S", &name);
+		if (0 != ffvorbis_addtag(&v->vorbis, meta.name.ptr, meta.val.ptr, meta.val.len))
+			warnlog(core, d->trk, NULL, "can't add tag: %S", &meta.name);
 	}
 
 	if ((int64)d->audio.total != FMED_NULL) {
@@ -15,6 +15,7 @@ static const fmed_queue *qu;
 
 typedef struct fmed_wav {
 	ffwav wav;
+	int64 abs_seek;
 	uint state;
 } fmed_wav;
 
@@ -144,7 +145,7 @@ again:
 
 	case I_DATA:
 		if ((int64)d->audio.seek != FMED_NULL) {
-			ffwav_seek(&w->wav, ffpcm_samples(d->audio.seek, ffwav_rate(&w->wav)));
+			ffwav_seek(&w->wav, w->abs_seek + ffpcm_samples(d->audio.seek, ffwav_rate(&w->wav)));
 			d->audio.seek = FMED_NULL;
 		}
 		break;
@@ -179,6 +180,19 @@ again:
 			d->audio.total = w->wav.total_samples;
 			d->audio.bitrate = w->wav.bitrate;
 			d->datatype = "pcm";
+
+			if (d->audio.abs_seek != 0) {
+				w->abs_seek = fmed_apos_samples(d->audio.abs_seek, ffwav_rate(&w->wav));
+				d->audio.total -= w->abs_seek;
+				if ((int64)d->audio.seek == FMED_NULL)
+					ffwav_seek(&w->wav, w->abs_seek);
+			}
+
+			if (d->stream_copy) {
+				// PCM data is passed to the output as-is
+				d->audio.convfmt = d->audio.fmt;
+			}
+
 			w->state = I_DATA;
 			goto again;
 
@@ -202,7 +216,7 @@ again:
 	}
 
 data:
-	d->audio.pos = ffwav_cursample(&w->wav);
+	d->audio.pos = ffwav_cursample(&w->wav) - w->abs_seek;
 	d->data = w->wav.data;
 	d->datalen = w->wav.datalen;
 	d->out = w->wav.pcm;
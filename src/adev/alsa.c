@@ -4,44 +4,85 @@ Copyright (c) 2015 Simon Zolin */
 #include <fmedia.h>
 
 #include <FF/adev/alsa.h>
+#include <adev/audio-out.h>
 
 
 static const fmed_core *core;
 
 typedef struct alsa_out alsa_out;
+typedef struct alsa_dev alsa_dev;
 
-typedef struct alsa_mod {
+/** Opened playback device.
+It's used either by one track exclusively, or by several tracks which data is mixed together. */
+struct alsa_dev {
+	fflist_item sib;
 	ffalsa_buf out;
-	ffpcmex fmt;
-	alsa_out *usedby;
-	const fmed_track *track;
+	audio_dev dev; //dev.usedby: the track that exclusively uses the device
+	ffpcmex fmt; //dev.fmt + interleaving
+	uint devidx;
+	fflist clients; //alsa_out[]: mixed tracks
+	ffarr mix; //mixed data not yet written to the device
+	uint frsize;
+	fftask task; //wake up the mixed tracks
+};
+
+/** Device ID cache: a device is enumerated only once. */
+struct alsa_devid {
+	uint devidx;
+	char *id; //"plughw:..."
+};
+
+/** Format cache: the result of format negotiation with a device. */
+struct alsa_fmtent {
 	uint devidx;
-	uint out_valid :1;
+	ffpcmex req; //format requested by track
+	ffpcmex fmt; //format supported by device
+	uint plug :1; //"plughw" is used
+};
+
+typedef struct alsa_mod {
+	fflist devs; //alsa_dev[]
+	ffarr devids; //struct alsa_devid[]
+	ffarr fmts; //struct alsa_fmtent[]
+	const fmed_track *track;
 	uint init_ok :1;
+
+	// pre-opening the device in a separate thread
+	struct alsa_preopen {
+		ffthd thd;
+		alsa_dev *ad; //not in 'devs' until the thread is joined
+		char *id;
+		ffpcmex req, fmt;
+		int r;
+	} pre;
 } alsa_mod;
 
 static alsa_mod *mod;
 
 struct alsa_out {
-	uint state;
-	size_t dataoff;
-
-	ffalsa_dev dev;
-	uint devidx;
-
-	struct {
-		fftask_handler handler;
-		void *param;
-	} task;
-	uint stop :1;
+	audio_out ao; //ao.idev: device index
+	const char *dev_id; //"plughw:..."
+	ffpcmex req_fmt; //format requested before negotiation
+	alsa_dev *ad;
+
+	fflist_item sib;
+	size_t mixoff; //the end of our data in alsa_dev.mix
+
+	uint mixed :1;
+	uint fin :1; //all data is passed to mixer
+	uint paused :1;
+	uint wait :1; //waiting for free space in mix buffer
+	uint switching :1; //moving to another device
 };
 
-enum { I_TRYOPEN, I_OPEN, I_DATA };
-
 static struct alsa_out_conf_t {
-	uint idev;
-	uint buflen;
+	struct audio_conf a;
 	uint nfy_rate;
+	byte mix;
+	byte lowlat;
+	uint lowlat_buflen;
+	uint lowlat_periods;
+	byte preopen;
 } alsa_out_conf;
 
 //FMEDIA MODULE
@@ -56,6 +97,7 @@ static const fmed_mod fmed_alsa_mod = {
 
 static int alsa_init(fmed_trk *trk);
 static int alsa_create(alsa_out *a, fmed_filt *d);
+static void alsadev_free(alsa_dev *ad);
 
 //OUTPUT
 static void* alsa_open(fmed_filt *d);
@@ -67,12 +109,40 @@ static const fmed_filter fmed_alsa_out = {
 };
 
 static const ffpars_arg alsa_out_conf_args[] = {
-	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct alsa_out_conf_t, idev) },
-	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_out_conf_t, buflen) },
+	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct alsa_out_conf_t, a.idev) },
+	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_out_conf_t, a.buflen) },
 	{ "notify_rate",	FFPARS_TINT,  FFPARS_DSTOFF(struct alsa_out_conf_t, nfy_rate) },
+	{ "io_thread",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct alsa_out_conf_t, a.io_thread) },
+	{ "io_thread_priority",	FFPARS_TINT,  FFPARS_DSTOFF(struct alsa_out_conf_t, a.io_prio) },
+	{ "software_mix",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct alsa_out_conf_t, mix) },
+	{ "low_latency",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct alsa_out_conf_t, lowlat) },
+	{ "low_latency_buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_out_conf_t, lowlat_buflen) },
+	{ "low_latency_periods",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_out_conf_t, lowlat_periods) },
+	{ "preopen",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct alsa_out_conf_t, preopen) },
 };
 
 static void alsa_onplay(void *udata);
+static void alsa_preopen_start(void);
+static void alsa_preopen_wait(void);
+static void alsa_detach(alsa_out *a);
+static int alsa_mixattach(alsa_out *a, alsa_dev *ad, fmed_filt *d);
+static void alsa_mixwake(void *param);
+
+static void alsa_drv_close(audio_dev *dev);
+static int alsa_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff);
+static int alsa_drv_drain(audio_dev *dev);
+static int alsa_drv_stop(audio_dev *dev);
+static void alsa_drv_clear(audio_dev *dev);
+static void alsa_drv_async(audio_dev *dev, uint enable);
+static size_t alsa_drv_filled(audio_dev *dev);
+static size_t alsa_drv_bufsize(audio_dev *dev);
+static const char* alsa_drv_errstr(int e);
+static const audio_drv alsa_drv = {
+	"alsa",
+	NULL, &alsa_drv_close, //the device is opened by alsa_create()
+	&alsa_drv_write, &alsa_drv_drain, &alsa_drv_stop, &alsa_drv_clear, &alsa_drv_async,
+	&alsa_drv_filled, &alsa_drv_bufsize, &alsa_drv_errstr
+};
 
 //INPUT
 static void* alsa_in_open(fmed_filt *d);
@@ -96,17 +166,24 @@ typedef struct alsa_in {
 		void *param;
 	} cb;
 	uint64 total_samps;
+	ffpcmex fmt;
 	uint ileaved :1;
 } alsa_in;
 
 static struct alsa_in_conf_t {
 	uint idev;
 	uint buflen;
+	byte lowlat;
+	uint lowlat_buflen;
+	uint lowlat_periods;
 } alsa_in_conf;
 
 static const ffpars_arg alsa_in_conf_args[] = {
 	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct alsa_in_conf_t, idev) },
 	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_in_conf_t, buflen) },
+	{ "low_latency",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct alsa_in_conf_t, lowlat) },
+	{ "low_latency_buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_in_conf_t, lowlat_buflen) },
+	{ "low_latency_periods",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct alsa_in_conf_t, lowlat_periods) },
 };
 
 static void alsa_in_oncapt(void *udata);
@@ -164,7 +241,14 @@ static int alsa_sig(uint signo)
 			return -1;
 		}
 
+		fflist_init(&mod->devs);
 		mod->track = core->getmod("#core.track");
+
+		if (alsa_out_conf.preopen && core->props->playback) {
+			const fmed_modinfo *mi = core->getmod2(FMED_MOD_INFO_ADEV_OUT, NULL, 0);
+			if (mi != NULL && mi->m == &fmed_alsa_mod)
+				alsa_preopen_start();
+		}
 		return 0;
 	}
 	return 0;
@@ -173,8 +257,18 @@ static int alsa_sig(uint signo)
 static void alsa_destroy(void)
 {
 	if (mod != NULL) {
-		if (mod->out_valid)
-			ffalsa_close(&mod->out);
+		alsa_dev *ad;
+		fflist_item *next;
+		alsa_preopen_wait();
+		FFLIST_WALKSAFE(&mod->devs, ad, sib, next) {
+			alsadev_free(ad);
+		}
+		struct alsa_devid *di;
+		FFARR_WALKT(&mod->devids, di, struct alsa_devid) {
+			ffmem_free(di->id);
+		}
+		ffarr_free(&mod->devids);
+		ffarr_free(&mod->fmts);
 		ffmem_free(mod);
 		mod = NULL;
 	}
@@ -256,9 +350,16 @@ static void alsa_adev_listfree(fmed_adev_ent *ents)
 
 static int alsa_out_config(ffpars_ctx *ctx)
 {
-	alsa_out_conf.idev = 0;
-	alsa_out_conf.buflen = 500;
+	alsa_out_conf.a.idev = 0;
+	alsa_out_conf.a.buflen = 500;
 	alsa_out_conf.nfy_rate = 0;
+	alsa_out_conf.a.io_thread = 0;
+	alsa_out_conf.a.io_prio = 0;
+	alsa_out_conf.mix = 0;
+	alsa_out_conf.lowlat = 0;
+	alsa_out_conf.lowlat_buflen = 8;
+	alsa_out_conf.lowlat_periods = 2;
+	alsa_out_conf.preopen = 0;
 	ffpars_setargs(ctx, &alsa_out_conf, alsa_out_conf_args, FFCNT(alsa_out_conf_args));
 	return 0;
 }
@@ -276,36 +377,122 @@ static void* alsa_open(fmed_filt *d)
 	alsa_out *a;
 	if (NULL == (a = ffmem_tcalloc1(alsa_out)))
 		return NULL;
-	a->task.handler = d->handler;
-	a->task.param = d->trk;
+	audio_out_init(&a->ao, NULL, d);
 	return a;
 }
 
 static void alsa_close(void *ctx)
 {
 	alsa_out *a = ctx;
-	int r;
+	alsa_detach(a);
+	if (a->ao.nunderruns != 0)
+		dbglog(core, a->ao.task.param, "alsa", "underruns: %U", a->ao.nunderruns);
+	core->task(&a->ao.task, FMED_TASK_DEL);
+	ffmem_free(a);
+}
+
+static alsa_dev* alsadev_find(uint idx)
+{
+	alsa_dev *ad;
+	FFLIST_WALK(&mod->devs, ad, sib) {
+		if (ad->devidx == idx)
+			return ad;
+	}
+	return NULL;
+}
 
-	if (mod->usedby == a) {
-		void *trk = a->task.param;
+static alsa_dev* alsadev_alloc(uint idx)
+{
+	alsa_dev *ad;
+	if (NULL == (ad = ffmem_tcalloc1(alsa_dev)))
+		return NULL;
+	ad->devidx = idx;
+	fflist_init(&ad->clients);
+	ad->task.handler = &alsa_mixwake;
+	ad->task.param = ad;
+	audio_dev_init(&ad->dev, core, &alsa_drv, &alsa_out_conf.a, &ad->out);
+	return ad;
+}
 
-		if (FMED_NULL != mod->track->getval(trk, "stopped")) {
-			ffalsa_close(&mod->out);
-			ffmem_tzero(&mod->out);
-			mod->out_valid = 0;
+static alsa_dev* alsadev_new(uint idx)
+{
+	alsa_dev *ad;
+	if (NULL == (ad = alsadev_alloc(idx)))
+		return NULL;
+	fflist_ins(&mod->devs, &ad->sib);
+	return ad;
+}
 
-		} else {
-			if (0 != (r = ffalsa_stop(&mod->out)))
-				errlog(core, trk,  "alsa", "ffalsa_stop(): (%d) %s", r, ffalsa_errstr(r));
-			ffalsa_clear(&mod->out);
-			ffalsa_async(&mod->out, 0);
-		}
+/** Close device. */
+static void alsadev_free(alsa_dev *ad)
+{
+	audio_dev_free(&ad->dev);
+	core->task(&ad->task, FMED_TASK_DEL);
+	ffarr_free(&ad->mix);
+	fflist_rm(&mod->devs, &ad->sib);
+	ffmem_free(ad);
+}
 
-		mod->usedby = NULL;
+/** Stop playback and discard buffered data.  The device stays opened. */
+static void alsadev_reset(alsa_dev *ad, void *trk)
+{
+	audio_dev_reset(&ad->dev, trk);
+	ad->mix.len = 0;
+}
+
+/** Stop all tracks that use the device. */
+static void alsadev_steal(alsa_dev *ad)
+{
+	alsa_out *a;
+	fflist_item *next;
+
+	audio_thd_stop(&ad->dev, 1);
+	ad->mix.len = 0;
+
+	if (ad->dev.usedby != NULL) {
+		a = FF_GETPTR(alsa_out, ao, ad->dev.usedby);
+		ad->dev.usedby = NULL;
+		a->ad = NULL;
+		a->ao.stop = 1;
+		a->ao.task.handler(a->ao.task.param);
 	}
 
-	ffalsa_devdestroy(&a->dev);
-	ffmem_free(a);
+	FFLIST_WALKSAFE(&ad->clients, a, sib, next) {
+		fflist_rm(&ad->clients, &a->sib);
+		a->mixed = 0;
+		a->ad = NULL;
+		a->ao.stop = 1;
+		a->ao.task.handler(a->ao.task.param);
+	}
+}
+
+/** Stop using the device. */
+static void alsa_detach(alsa_out *a)
+{
+	alsa_dev *ad = a->ad;
+	void *trk = a->ao.task.param;
+
+	if (ad == NULL)
+		return;
+	a->ad = NULL;
+
+	if (a->mixed) {
+		fflist_rm(&ad->clients, &a->sib);
+		a->mixed = 0;
+		if (ad->clients.len != 0) {
+			alsa_mixwake(ad); //the other tracks may wait for our data
+			return;
+		}
+
+	} else if (ad->dev.usedby == &a->ao)
+		ad->dev.usedby = NULL;
+	else
+		return;
+
+	if (FMED_NULL != mod->track->getval(trk, "stopped"))
+		alsadev_free(ad);
+	else
+		alsadev_reset(ad, trk);
 }
 
 static int alsa_devbyidx(ffalsa_dev *d, uint idev, uint flags)
@@ -321,198 +508,590 @@ static int alsa_devbyidx(ffalsa_dev *d, uint idev, uint flags)
 	return 0;
 }
 
+/** Get device ID by index.  Enumerate devices only on the first call for this index. */
+static const char* alsa_devid(uint idx)
+{
+	struct alsa_devid *di;
+	ffalsa_dev dev;
+
+	FFARR_WALKT(&mod->devids, di, struct alsa_devid) {
+		if (di->devidx == idx)
+			return di->id;
+	}
+
+	if (0 != alsa_devbyidx(&dev, idx, FFALSA_DEV_PLAYBACK))
+		return NULL;
+	if (NULL == (di = ffarr_pushgrowT(&mod->devids, 4, struct alsa_devid))
+		|| NULL == (di->id = ffsz_alcopyz(dev.id))) {
+		ffalsa_devdestroy(&dev);
+		return NULL;
+	}
+	di->devidx = idx;
+	ffalsa_devdestroy(&dev);
+	return di->id;
+}
+
+static struct alsa_fmtent* alsa_fmtcache_find(uint idx, const ffpcmex *req)
+{
+	struct alsa_fmtent *e;
+	FFARR_WALKT(&mod->fmts, e, struct alsa_fmtent) {
+		if (e->devidx == idx && !ffmemcmp(&e->req, req, sizeof(ffpcmex)))
+			return e;
+	}
+	return NULL;
+}
+
+static void alsa_fmtcache_add(uint idx, const ffpcmex *req, const ffpcmex *fmt, uint plug)
+{
+	struct alsa_fmtent *e;
+	if (NULL == (e = alsa_fmtcache_find(idx, req))) {
+		if (NULL == (e = ffarr_pushgrowT(&mod->fmts, 4, struct alsa_fmtent)))
+			return;
+		e->devidx = idx;
+		e->req = *req;
+	}
+	e->fmt = *fmt;
+	e->plug = plug;
+}
+
 static int alsa_create(alsa_out *a, fmed_filt *d)
 {
 	ffpcmex fmt, in_fmt;
 	int r, reused = 0;
 	const char *dev_id;
+	alsa_dev *ad;
+	struct alsa_fmtent *fc;
+	uint buflen = alsa_out_conf.a.buflen, nfy_rate = alsa_out_conf.nfy_rate;
 
-	if (FMED_NULL == (int)(a->devidx = (int)d->track->getval(d->trk, "playdev_name")))
-		a->devidx = alsa_out_conf.idev;
-	a->devidx = ffmax(a->devidx, 1);
+	alsa_preopen_wait();
+
+	if (alsa_out_conf.lowlat) {
+		buflen = alsa_out_conf.lowlat_buflen;
+		nfy_rate = alsa_out_conf.lowlat_periods;
+	}
+
+	if (!a->switching) {
+		if (FMED_NULL == (int)(a->ao.idev = (int)d->track->getval(d->trk, "playdev_name")))
+			a->ao.idev = alsa_out_conf.a.idev;
+		a->ao.idev = ffmax(a->ao.idev, 1);
+	}
 
 	fmt = d->audio.convfmt;
+	if (a->ao.state == AUDIO_TRYOPEN && !a->switching)
+		a->req_fmt = fmt;
+
+	fc = (!a->switching) ? alsa_fmtcache_find(a->ao.idev, &a->req_fmt) : NULL;
+	if (fc != NULL && a->ao.state == AUDIO_TRYOPEN
+		&& audio_convfmt(d, &fmt, &fc->fmt)) {
+		// the device is known not to support this format
+		a->ao.state = AUDIO_OPEN;
+		return FMED_RMORE;
+	}
 
-	if (mod->out_valid) {
+	if (NULL != (ad = alsadev_find(a->ao.idev)) && ad->dev.out_valid) {
 
-		if (mod->usedby != NULL) {
-			alsa_out *a = mod->usedby;
-			mod->usedby = NULL;
-			a->stop = 1;
-			alsa_onplay(a);
-		}
+		if (alsa_out_conf.mix && ad->fmt.ileaved
+			&& (ad->dev.usedby != NULL || ad->clients.len != 0))
+			return alsa_mixattach(a, ad, d);
 
-		if (!ffmemcmp(&fmt, &mod->fmt, sizeof(ffpcmex))
-			&& mod->devidx == a->devidx) {
+		alsadev_steal(ad);
 
-			ffalsa_stop(&mod->out);
-			ffalsa_clear(&mod->out);
-			ffalsa_async(&mod->out, 0);
+		if (!ffmemcmp(&fmt, &ad->fmt, sizeof(ffpcmex))) {
+			alsadev_reset(ad, d->trk);
 			reused = 1;
 			goto fin;
 		}
 
-		ffalsa_close(&mod->out);
-		ffmem_tzero(&mod->out);
-		mod->out_valid = 0;
+		audio_dev_close(&ad->dev);
 	}
 
-	if (a->state == I_TRYOPEN
-		&& 0 != alsa_devbyidx(&a->dev, a->devidx, FFALSA_DEV_PLAYBACK)) {
-		errlog(core, d->trk, "alsa", "no audio device by index #%u", a->devidx);
+	if (ad == NULL
+		&& NULL == (ad = alsadev_new(a->ao.idev))) {
+		errlog(core, d->trk, "alsa", "%s", ffmem_alloc_S);
+		return FMED_RERR;
+	}
+
+	if (NULL == (a->dev_id = alsa_devid(a->ao.idev))) {
+		errlog(core, d->trk, "alsa", "no audio device by index #%u", a->ao.idev);
 		goto done;
 	}
 
-	mod->out.handler = &alsa_onplay;
-	mod->out.autostart = 1;
-	if (alsa_out_conf.nfy_rate != 0)
-		mod->out.nfy_interval = ffpcm_samples(alsa_out_conf.buflen / alsa_out_conf.nfy_rate, fmt.sample_rate);
+	ad->out.handler = &alsa_onplay;
+	ad->out.udata = ad;
+	ad->out.autostart = 1;
+	if (nfy_rate != 0)
+		ad->out.nfy_interval = ffpcm_samples(buflen, fmt.sample_rate) / nfy_rate;
 	in_fmt = fmt;
-	dev_id = FFALSA_DEVID_HW(a->dev.id); //try "hw" first
+	dev_id = FFALSA_DEVID_HW(a->dev_id); //try "hw" first
+	if (fc != NULL && fc->plug) {
+		dev_id = a->dev_id;
+		a->ao.state = AUDIO_OPEN;
+	}
 
 	for (;;) {
 
 		dbglog(core, d->trk, NULL, "opening device \"%s\", %s/%u/%u/%s"
 			, dev_id, ffpcm_fmtstr(fmt.format), fmt.sample_rate, fmt.channels, (fmt.ileaved) ? "i" : "ni");
 
-		r = ffalsa_open(&mod->out, dev_id, &fmt, alsa_out_conf.buflen);
-
-		if (r == -FFALSA_EFMT && a->state == I_TRYOPEN) {
-
-			if (!!ffmemcmp(&fmt, &in_fmt, sizeof(ffpcmex))) {
-
-				if (fmt.format != in_fmt.format)
-					d->audio.convfmt.format = fmt.format;
+		r = ffalsa_open(&ad->out, dev_id, &fmt, buflen);
 
-				if (fmt.sample_rate != in_fmt.sample_rate)
-					d->audio.convfmt.sample_rate = fmt.sample_rate;
-
-				if (fmt.channels != in_fmt.channels)
-					d->audio.convfmt.channels = fmt.channels;
+		if (r == -FFALSA_EFMT && a->switching && dev_id != a->dev_id) {
+			// the track's audio format can't be changed while playing
+			fmt = in_fmt;
+			dev_id = a->dev_id; //try "plughw"
+			continue;
 
-				if (fmt.ileaved != in_fmt.ileaved)
-					d->audio.convfmt.ileaved = fmt.ileaved;
+		} else if (r == -FFALSA_EFMT && a->ao.state == AUDIO_TRYOPEN) {
 
-				a->state = I_OPEN;
+			if (audio_convfmt(d, &in_fmt, &fmt)) {
+				a->ao.state = AUDIO_OPEN;
 				return FMED_RMORE;
 			}
 
-			dev_id = a->dev.id; //try "plughw"
-			a->state = I_OPEN;
+			dev_id = a->dev_id; //try "plughw"
+			a->ao.state = AUDIO_OPEN;
 			continue;
 
 		} else if (r != 0) {
 			errlog(core, d->trk, "alsa", "ffalsa_open(): %s(): \"%s\": (%d) %s"
-				, (mod->out.errfunc != NULL) ? mod->out.errfunc : "", dev_id, r, ffalsa_errstr(r));
+				, (ad->out.errfunc != NULL) ? ad->out.errfunc : "", dev_id, r, ffalsa_errstr(r));
 			goto done;
 		}
 		break;
 	}
 
-	ffalsa_devdestroy(&a->dev);
-	mod->out_valid = 1;
-	mod->fmt = fmt;
-	mod->devidx = a->devidx;
+	ad->dev.out_valid = 1;
+	ad->fmt = fmt;
+	ffpcm_fmtcopy(&ad->dev.fmt, &fmt);
+	if (!a->switching)
+		alsa_fmtcache_add(a->ao.idev, &a->req_fmt, &fmt, (dev_id == a->dev_id));
 
 fin:
-	mod->out.udata = a;
-	mod->usedby = a;
-	dbglog(core, d->trk, "alsa", "%s buffer %ums, %uHz"
-		, reused ? "reused" : "opened", ffpcm_bytes2time(&fmt, ffalsa_bufsize(&mod->out))
+	ad->dev.usedby = &a->ao;
+	a->ad = ad;
+	a->ao.dev = &ad->dev;
+	dbglog(core, d->trk, "alsa", "%s device #%u: buffer %ums, %uHz"
+		, reused ? "reused" : "opened", ad->devidx, ffpcm_bytes2time(&fmt, ffalsa_bufsize(&ad->out))
 		, fmt.sample_rate);
+	if (alsa_out_conf.lowlat)
+		fmed_infolog(core, d->trk, "alsa", "low latency: buffer %ums, %u periods"
+			, ffpcm_bytes2time(&fmt, ffalsa_bufsize(&ad->out)), nfy_rate);
+	d->track->setval(d->trk, "output_latency", ffpcm_bytes2time(&fmt, ffalsa_bufsize(&ad->out)));
+
+	ad->dev.use_thd = 0;
+	if (alsa_out_conf.a.io_thread) {
+		if (!fmt.ileaved)
+			dbglog(core, d->trk, "alsa", "I/O thread isn't used for non-interleaved data");
+		else if (ad->dev.thd.buf == NULL
+			&& 0 != adthd_init(&ad->dev.thd, ffalsa_bufsize(&ad->out)))
+			errlog(core, d->trk, "alsa", "%s", ffmem_alloc_S);
+		else {
+			ad->dev.thd.task = &a->ao.task;
+			ad->dev.thd.period = ffmax(buflen / 4, 1);
+			ad->dev.thd.prio = alsa_out_conf.a.io_prio;
+			ffatom_set(&ad->dev.thd.xruns, 0);
+			ad->dev.use_thd = 1;
+		}
+	}
 	d->datatype = "pcm";
 	return 0;
 
 done:
+	if (!ad->dev.out_valid)
+		alsadev_free(ad);
 	return FMED_RERR;
 }
 
+/** Enumerate devices and open the device.
+Doesn't touch the module's shared data: the result is stored in 'alsa_preopen' and is applied by alsa_preopen_wait(). */
+static FFTHDCALL int alsa_preopen(void *param)
+{
+	struct alsa_preopen *p = param;
+	alsa_dev *ad = p->ad;
+	ffalsa_dev dev;
+	uint buflen = (alsa_out_conf.lowlat) ? alsa_out_conf.lowlat_buflen : alsa_out_conf.a.buflen;
+	uint nfy_rate = (alsa_out_conf.lowlat) ? alsa_out_conf.lowlat_periods : alsa_out_conf.nfy_rate;
+	const char *dev_id;
+
+	p->r = -1;
+	if (0 != alsa_devbyidx(&dev, ad->devidx, FFALSA_DEV_PLAYBACK))
+		return 0;
+	p->id = ffsz_alcopyz(dev.id);
+	ffalsa_devdestroy(&dev);
+	if (p->id == NULL)
+		return 0;
+
+	ad->out.handler = &alsa_onplay;
+	ad->out.udata = ad;
+	ad->out.autostart = 1;
+	if (nfy_rate != 0)
+		ad->out.nfy_interval = ffpcm_samples(buflen, p->fmt.sample_rate) / nfy_rate;
+	dev_id = FFALSA_DEVID_HW(p->id);
+
+	p->r = ffalsa_open(&ad->out, dev_id, &p->fmt, buflen);
+	if (p->r == -FFALSA_EFMT) {
+		// open "hw" device with the format it supports
+		p->r = ffalsa_open(&ad->out, dev_id, &p->fmt, buflen);
+	}
+	return 0;
+}
+
+/** Start opening the playback device in a separate thread, so that it's ready when the first track needs it.
+The format is the one requested by user, CD audio format by default.
+The first track reuses the device if its format matches, otherwise the device ID and the negotiated format are cached. */
+static void alsa_preopen_start(void)
+{
+	struct alsa_preopen *p = &mod->pre;
+	const ffpcm *ufmt = &core->props->playback_fmt;
+	uint idx = (core->props->playdev != 0) ? core->props->playdev : alsa_out_conf.a.idev;
+
+	if (0 != alsa_init(NULL))
+		return;
+
+	p->fmt.format = (ufmt->format != 0) ? ufmt->format : FFPCM_16;
+	p->fmt.sample_rate = (ufmt->sample_rate != 0) ? ufmt->sample_rate : 44100;
+	p->fmt.channels = (ufmt->channels != 0) ? ufmt->channels : 2;
+	p->fmt.ileaved = 1;
+	p->req = p->fmt;
+
+	if (NULL == (p->ad = alsadev_alloc(ffmax(idx, 1))))
+		return;
+	if (NULL == (p->thd = ffthd_create(&alsa_preopen, p, 0))) {
+		syserrlog(core, NULL, "alsa", "%s", "ffthd_create()");
+		ffmem_free0(p->ad);
+	}
+}
+
+/** Wait until the pre-opening thread exits and take the opened device. */
+static void alsa_preopen_wait(void)
+{
+	struct alsa_preopen *p = &mod->pre;
+	alsa_dev *ad = p->ad;
+	struct alsa_devid *di;
+
+	if (p->thd == NULL)
+		return;
+	ffthd_join(p->thd, -1, NULL);
+	p->thd = NULL;
+	p->ad = NULL;
+
+	if (p->id == NULL)
+		dbglog(core, NULL, "alsa", "pre-open: no audio device by index #%u", ad->devidx);
+	else if (p->r != 0)
+		dbglog(core, NULL, "alsa", "pre-open: device #%u: ffalsa_open(): (%d) %s"
+			, ad->devidx, p->r, ffalsa_errstr(p->r));
+
+	if (p->id != NULL) {
+		if (NULL != (di = ffarr_pushgrowT(&mod->devids, 4, struct alsa_devid))) {
+			di->devidx = ad->devidx;
+			di->id = p->id;
+		} else
+			ffmem_free(p->id);
+		p->id = NULL;
+	}
+
+	fflist_ins(&mod->devs, &ad->sib);
+	if (p->r != 0) {
+		alsadev_free(ad);
+		return;
+	}
+
+	ad->dev.out_valid = 1;
+	ad->fmt = p->fmt;
+	ffpcm_fmtcopy(&ad->dev.fmt, &p->fmt);
+	alsa_fmtcache_add(ad->devidx, &p->req, &p->fmt, 0);
+	dbglog(core, NULL, "alsa", "pre-opened device #%u: %s/%u/%u"
+		, ad->devidx, ffpcm_fmtstr(p->fmt.format), p->fmt.sample_rate, p->fmt.channels);
+}
+
+/** Switch to another device without stopping the track. */
+static int alsa_switch(alsa_out *a, fmed_filt *d, uint idx)
+{
+	int r;
+	dbglog(core, d->trk, "alsa", "switching from device #%u to #%u", a->ao.idev, idx);
+	alsa_detach(a);
+	a->mixoff = 0;
+	a->fin = 0;
+	a->wait = 0;
+	a->ao.idev = idx;
+	a->switching = 1;
+	r = alsa_create(a, d);
+	a->switching = 0;
+	return r;
+}
+
+/** Mix the track's data with the other tracks playing on the same device. */
+static int alsa_mixattach(alsa_out *a, alsa_dev *ad, fmed_filt *d)
+{
+	alsa_out *u;
+
+	if (!!ffmemcmp(&d->audio.convfmt, &ad->fmt, sizeof(ffpcmex))) {
+		if (a->switching) {
+			errlog(core, d->trk, "alsa", "device #%u is used with another audio format", ad->devidx);
+			return FMED_RERR;
+		}
+		d->audio.convfmt = ad->fmt;
+		a->ao.state = AUDIO_OPEN;
+		return FMED_RMORE;
+	}
+
+	if (ad->mix.cap == 0
+		&& NULL == ffarr_alloc(&ad->mix, ffalsa_bufsize(&ad->out))) {
+		errlog(core, d->trk, "alsa", "%s", ffmem_alloc_S);
+		return FMED_RERR;
+	}
+	ad->frsize = ffpcm_size(ad->fmt.format, ad->fmt.channels);
+
+	if (ad->dev.usedby != NULL) {
+		// the device is used exclusively: mix its track too
+		u = FF_GETPTR(alsa_out, ao, ad->dev.usedby);
+		ad->dev.usedby = NULL;
+		u->mixed = 1;
+		u->mixoff = 0;
+		u->wait = 1;
+		fflist_ins(&ad->clients, &u->sib);
+	}
+
+	a->mixed = 1;
+	a->mixoff = 0;
+	a->ad = ad;
+	a->ao.dev = &ad->dev;
+	fflist_ins(&ad->clients, &a->sib);
+	ad->dev.thd.task = &ad->task;
+	dbglog(core, d->trk, "alsa", "device #%u: mixing %L tracks", ad->devidx, ad->clients.len);
+	d->datatype = "pcm";
+	return 0;
+}
+
+/** Wake up the mixed tracks waiting for free space. */
+static void alsa_mixwake(void *param)
+{
+	alsa_dev *ad = param;
+	alsa_out *a;
+	FFLIST_WALK(&ad->clients, a, sib) {
+		if (a->wait) {
+			a->wait = 0;
+			core->task(&a->ao.task, FMED_TASK_POST);
+		}
+	}
+}
+
+/** Pass to the device the mixed data provided by all tracks. */
+static int alsa_mixflush(alsa_dev *ad, fmed_filt *d)
+{
+	alsa_out *a;
+	size_t n = ad->mix.len;
+	int r, flushed = 0;
+
+	FFLIST_WALK(&ad->clients, a, sib) {
+		if (!a->fin && !a->paused)
+			n = ffmin(n, a->mixoff);
+	}
+
+	while (n != 0) {
+
+		if (ad->dev.use_thd) {
+			r = adthd_put(&ad->dev.thd, ad->mix.ptr, n);
+			if (0 != adthd_start(&ad->dev.thd)) {
+				syserrlog(core, d->trk, "alsa", "%s", "ffthd_create()");
+				return FMED_RERR;
+			}
+
+		} else if (0 > (r = ffalsa_write(&ad->out, ad->mix.ptr, n, 0))) {
+			errlog(core, d->trk, "alsa", "ffalsa_write(): (%d) %s", r, ffalsa_errstr(r));
+			return FMED_RERR;
+		}
+
+		if (r == 0) {
+			if (!ad->dev.use_thd)
+				ffalsa_async(&ad->out, 1);
+			break;
+		}
+
+		ffmemmove(ad->mix.ptr, ad->mix.ptr + r, ad->mix.len - r);
+		ad->mix.len -= r;
+		n -= r;
+		FFLIST_WALK(&ad->clients, a, sib) {
+			a->mixoff = (a->mixoff > (size_t)r) ? a->mixoff - r : 0;
+		}
+		flushed = 1;
+	}
+
+	if (flushed)
+		alsa_mixwake(ad);
+	return 0;
+}
+
+static int alsa_write_mix(alsa_out *a, fmed_filt *d)
+{
+	alsa_dev *ad = a->ad;
+	ffpcm fmt;
+	size_t n;
+	int r;
+
+	a->paused = 0;
+
+	n = ffmin(d->datalen, ad->mix.cap - a->mixoff);
+	n -= n % ad->frsize;
+	if (n != 0) {
+		if (a->mixoff + n > ad->mix.len) {
+			ffmem_zero(ad->mix.ptr + ad->mix.len, a->mixoff + n - ad->mix.len);
+			ad->mix.len = a->mixoff + n;
+		}
+		ffpcm_fmtcopy(&fmt, &ad->fmt);
+		ffpcm_mix(&fmt, ad->mix.ptr + a->mixoff, (char*)d->data + a->ao.dataoff, n / ad->frsize);
+		a->mixoff += n;
+		a->ao.dataoff += n;
+		d->datalen -= n;
+	}
+
+	if (d->datalen == 0) {
+		a->ao.dataoff = 0;
+		if (d->flags & FMED_FLAST)
+			a->fin = 1;
+	}
+
+	if (0 != (r = alsa_mixflush(ad, d)))
+		return r;
+
+	if (d->datalen != 0) {
+		a->wait = 1;
+		return FMED_RASYNC; //mix buffer is full
+	}
+
+	if (a->fin) {
+		if (a->mixoff != 0) {
+			a->wait = 1;
+			return FMED_RASYNC;
+		}
+		if (ad->clients.len == 1) {
+			// we're the last track playing on this device
+			a->wait = 1;
+			return audio_drain(&a->ao, d);
+		}
+		return FMED_RDONE;
+	}
+
+	return FMED_ROK;
+}
+
 static void alsa_onplay(void *udata)
 {
-	alsa_out *a = udata;
-	a->task.handler(a->task.param);
+	alsa_dev *ad = udata;
+	if (ad->dev.usedby != NULL) {
+		audio_onplay(&ad->dev);
+		return;
+	}
+	alsa_mixwake(ad);
+}
+
+static void alsa_drv_close(audio_dev *dev)
+{
+	ffalsa_close((ffalsa_buf*)dev->out);
+	ffmem_tzero((ffalsa_buf*)dev->out);
+}
+
+static int alsa_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff)
+{
+	return ffalsa_write((ffalsa_buf*)dev->out, data, len, dataoff);
+}
+
+static int alsa_drv_drain(audio_dev *dev)
+{
+	return ffalsa_stoplazy((ffalsa_buf*)dev->out);
+}
+
+static int alsa_drv_stop(audio_dev *dev)
+{
+	return ffalsa_stop((ffalsa_buf*)dev->out);
+}
+
+static void alsa_drv_clear(audio_dev *dev)
+{
+	ffalsa_clear((ffalsa_buf*)dev->out);
+}
+
+static void alsa_drv_async(audio_dev *dev, uint enable)
+{
+	ffalsa_async((ffalsa_buf*)dev->out, enable);
+}
+
+static size_t alsa_drv_filled(audio_dev *dev)
+{
+	return ffalsa_filled((ffalsa_buf*)dev->out);
+}
+
+static size_t alsa_drv_bufsize(audio_dev *dev)
+{
+	return ffalsa_bufsize((ffalsa_buf*)dev->out);
+}
+
+static const char* alsa_drv_errstr(int e)
+{
+	return ffalsa_errstr(e);
 }
 
 static int alsa_write(void *ctx, fmed_filt *d)
 {
 	alsa_out *a = ctx;
-	int r;
+	alsa_dev *ad;
+	int r, idx;
 
-	switch (a->state) {
-	case I_TRYOPEN:
-	case I_OPEN:
+	switch (a->ao.state) {
+	case AUDIO_TRYOPEN:
+	case AUDIO_OPEN:
 		if (0 != (r = alsa_create(a, d)))
 			return r;
-		a->state = I_DATA;
+		a->ao.state = AUDIO_DATA;
 		return FMED_RMORE;
 
-	case I_DATA:
+	case AUDIO_DATA:
 		break;
 	}
 
-	if (a->stop || (d->flags & FMED_FSTOP)) {
+	if (a->ao.stop || (d->flags & FMED_FSTOP)) {
 		d->outlen = 0;
 		return FMED_RDONE;
 	}
 
+	if (FMED_NULL != (idx = (int)d->track->getval(d->trk, "playdev_name"))
+		&& (uint)ffmax(idx, 1) != a->ao.idev) {
+		if (0 != (r = alsa_switch(a, d, ffmax(idx, 1))))
+			return r;
+	}
+	ad = a->ad;
+
+	if (!a->mixed) {
+		r = audio_out_data(&a->ao, d);
+		if (r == FMED_RERR) {
+			ad->dev.usedby = NULL;
+			a->ad = NULL;
+			alsadev_free(ad);
+		}
+		return r;
+	}
+
 	if (d->snd_output_clear) {
 		d->snd_output_clear = 0;
-		ffalsa_stop(&mod->out);
-		ffalsa_clear(&mod->out);
-		ffalsa_async(&mod->out, 0);
-		a->dataoff = 0;
-		return FMED_RMORE;
+		a->ao.dataoff = 0;
+		return FMED_RMORE; //the data already mixed with other tracks can't be removed
 	}
 
 	if (d->snd_output_pause) {
 		d->snd_output_pause = 0;
 		d->track->cmd(d->trk, FMED_TRACK_PAUSE);
-		ffalsa_stop(&mod->out);
+		// don't block the other tracks
+		a->paused = 1;
+		alsa_mixwake(ad);
 		return FMED_RASYNC;
 	}
 
-	while (d->datalen != 0) {
-
-		r = ffalsa_write(&mod->out, d->data, d->datalen, a->dataoff);
-		if (r < 0) {
-			errlog(core, d->trk, "alsa", "ffalsa_write(): (%d) %s", r, ffalsa_errstr(r));
-			goto err;
-
-		} else if (r == 0) {
-			ffalsa_async(&mod->out, 1);
-			return FMED_RASYNC;
-		}
-
-		a->dataoff += r;
-		d->datalen -= r;
-		dbglog(core, d->trk, "alsa", "written %u bytes (%u%% filled)"
-			, r, ffalsa_filled(&mod->out) * 100 / ffalsa_bufsize(&mod->out));
-	}
-
-	a->dataoff = 0;
-
-	if ((d->flags & FMED_FLAST) && d->datalen == 0) {
-
-		r = ffalsa_stoplazy(&mod->out);
-		if (r == 1)
-			return FMED_RDONE;
-		else if (r < 0) {
-			errlog(core, d->trk,  "alsa", "ffalsa_stoplazy(): (%d) %s", r, ffalsa_errstr(r));
-			goto err;
-		}
-
-		ffalsa_async(&mod->out, 1);
-		return FMED_RASYNC; //wait until all filled bytes are played
+	if (!a->ao.sound && d->datalen != 0) {
+		a->ao.sound = 1;
+		audio_firstsound(core, d, "alsa");
 	}
 
-	return FMED_ROK;
-
-err:
-	ffalsa_close(&mod->out);
-	ffmem_tzero(&mod->out);
-	mod->out_valid = 0;
-	mod->usedby = NULL;
-	return FMED_RERR;
+	return alsa_write_mix(a, d);
 }
 
 
@@ -520,6 +1099,9 @@ static int alsa_in_config(ffpars_ctx *ctx)
 {
 	alsa_in_conf.idev = 0;
 	alsa_in_conf.buflen = 500;
+	alsa_in_conf.lowlat = 0;
+	alsa_in_conf.lowlat_buflen = 8;
+	alsa_in_conf.lowlat_periods = 2;
 	ffpars_setargs(ctx, &alsa_in_conf, alsa_in_conf_args, FFCNT(alsa_in_conf_args));
 	return 0;
 }
@@ -532,6 +1114,7 @@ static void* alsa_in_open(fmed_filt *d)
 	ffalsa_dev dev = {0};
 	ffbool try_open = 1;
 	const char *dev_id;
+	uint buflen = alsa_in_conf.buflen;
 
 	if (0 != alsa_init(d->trk))
 		return NULL;
@@ -552,6 +1135,10 @@ static void* alsa_in_open(fmed_filt *d)
 	ain->snd.handler = &alsa_in_oncapt;
 	ain->snd.udata = a;
 	fmt = d->audio.fmt;
+	if (alsa_in_conf.lowlat) {
+		buflen = alsa_in_conf.lowlat_buflen;
+		ain->snd.nfy_interval = ffpcm_samples(buflen, fmt.sample_rate) / alsa_in_conf.lowlat_periods;
+	}
 	in_fmt = fmt;
 	dev_id = FFALSA_DEVID_HW(dev.id); //try "hw" first
 
@@ -559,7 +1146,7 @@ static void* alsa_in_open(fmed_filt *d)
 
 		dbglog(core, d->trk, NULL, "opening device \"%s\", %s/%u/%u/%s"
 			, dev_id, ffpcm_fmtstr(fmt.format), fmt.sample_rate, fmt.channels, (fmt.ileaved) ? "i" : "ni");
-		r = ffalsa_capt_open(&ain->snd, dev_id, &fmt, alsa_in_conf.buflen);
+		r = ffalsa_capt_open(&ain->snd, dev_id, &fmt, buflen);
 
 		if (r == -FFALSA_EFMT && try_open) {
 
@@ -599,7 +1186,7 @@ static void* alsa_in_open(fmed_filt *d)
 
 		} else if (r != 0) {
 			errlog(core, d->trk, "alsa", "ffalsa_open(): %s(): \"%s\": (%d) %s"
-				, (mod->out.errfunc != NULL) ? mod->out.errfunc : "", dev_id, r, ffalsa_errstr(r));
+				, (ain->snd.errfunc != NULL) ? ain->snd.errfunc : "", dev_id, r, ffalsa_errstr(r));
 			goto fail;
 		}
 
@@ -614,6 +1201,10 @@ static void* alsa_in_open(fmed_filt *d)
 	ffalsa_devdestroy(&dev);
 	dbglog(core, d->trk, "alsa", "opened capture buffer %ums"
 		, ffpcm_bytes2time(&fmt, ffalsa_bufsize(&ain->snd)));
+	if (alsa_in_conf.lowlat)
+		fmed_infolog(core, d->trk, "alsa", "low latency: capture buffer %ums, %u periods"
+			, ffpcm_bytes2time(&fmt, ffalsa_bufsize(&ain->snd)), alsa_in_conf.lowlat_periods);
+	a->fmt = fmt;
 	a->ileaved = fmt.ileaved;
 	d->datatype = "pcm";
 	return a;
@@ -664,5 +1255,7 @@ static int alsa_in_read(void *ctx, fmed_filt *d)
 	dbglog(core, d->trk, "alsa", "read %L bytes", d->outlen);
 	a->total_samps += d->outlen / ain->snd.frsize;
 	d->audio.pos = a->total_samps;
+	// the captured data was waiting in device buffer since the first sample was recorded
+	d->track->setval(d->trk, "input_latency", ffpcm_bytes2time(&a->fmt, d->outlen));
 	return FMED_ROK;
 }
@@ -0,0 +1,495 @@
+/** Audio device output: the part shared by device modules.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+A device module provides a driver (audio_drv) which wraps its device buffer functions;
+ audio_out_write() implements the rest:
+  . open the device buffer or reuse the one opened by the previous track
+  . request the audio format supported by device via d->audio.convfmt
+  . audio_out_data():
+    . write data directly to device or via I/O thread (devthread.h)
+    . handle stop, pause and clear requests
+    . drain the device buffer on the last data
+    . update "output_latency" track value, count underruns
+    . print the time to first sound (--print-time)
+
+The device buffer is shared by all tracks (audio_dev), only one track can use it at a time:
+ the new track stops the previous one.
+
+A module which manages several devices itself (alsa: device cache, switching, software mixing)
+ opens the device on its own and then uses audio_out_data() and the other functions here.
+*/
+
+#include <adev/devthread.h>
+#include <FF/time.h>
+
+
+typedef struct audio_out audio_out;
+typedef struct audio_dev audio_dev;
+
+enum AUDIO_E {
+	AUDIO_EFORMAT = 1, //the format isn't supported;  'fmt' is set to the supported one
+	AUDIO_EDEV, //no device by index
+};
+
+typedef struct audio_drv {
+	const char *name; //module name for logs
+
+	/** Open device buffer.  Used by audio_out_write() only.
+	buflen: msec
+	The driver calls audio_onplay(dev) when there's free space in device buffer.
+	Return 0 on success;  enum AUDIO_E;  <0: driver's error code. */
+	int (*open)(audio_dev *dev, uint idev, ffpcm *fmt, uint buflen);
+	void (*close)(audio_dev *dev);
+
+	/** Return the number of bytes written;  0 if device buffer is full;  <0 on error. */
+	int (*write)(audio_dev *dev, const void *data, size_t len, size_t dataoff);
+	/** Return 1 if all data is played;  0 if still playing;  <0 on error. */
+	int (*drain)(audio_dev *dev);
+	int (*stop)(audio_dev *dev);
+	void (*clear)(audio_dev *dev);
+	/** Enable or disable notifications via audio_onplay().  Optional. */
+	void (*async)(audio_dev *dev, uint enable);
+
+	size_t (*filled)(audio_dev *dev);
+	size_t (*bufsize)(audio_dev *dev);
+	const char* (*errstr)(int e);
+} audio_drv;
+
+struct audio_conf {
+	uint idev;
+	uint buflen; //msec
+	byte io_thread;
+	uint io_prio;
+};
+
+struct audio_dev {
+	const fmed_core *core;
+	const fmed_track *track;
+	const audio_drv *drv;
+	const struct audio_conf *conf;
+	void *out; //driver's device buffer object
+
+	ffpcm fmt;
+	uint idev;
+	audio_out *usedby;
+	adthd thd; //I/O thread for "io_thread" mode
+	uint out_valid :1;
+	uint use_thd :1; //the current output uses I/O thread
+};
+
+struct audio_out {
+	audio_dev *dev;
+	uint state;
+	size_t dataoff;
+	uint idev;
+	fftask task;
+
+	uint64 nunderruns;
+	uint stop :1
+		, started :1 //device has started playing
+		, sound :1; //the first data is passed to device
+};
+
+enum { AUDIO_TRYOPEN, AUDIO_OPEN, AUDIO_DATA };
+
+static int audio_thd_write(void *udata, const void *data, size_t len)
+{
+	audio_dev *dev = udata;
+	return dev->drv->write(dev, data, len, 0);
+}
+
+static int audio_thd_drain(void *udata)
+{
+	audio_dev *dev = udata;
+	return dev->drv->drain(dev);
+}
+
+static size_t audio_thd_filled(void *udata)
+{
+	audio_dev *dev = udata;
+	return dev->drv->filled(dev);
+}
+
+static void audio_dev_init(audio_dev *dev, const fmed_core *core, const audio_drv *drv, const struct audio_conf *conf, void *out)
+{
+	dev->core = core;
+	dev->track = core->getmod("#core.track");
+	dev->drv = drv;
+	dev->conf = conf;
+	dev->out = out;
+	dev->thd.core = core;
+	dev->thd.udata = dev;
+	dev->thd.write = &audio_thd_write;
+	dev->thd.drain = &audio_thd_drain;
+	dev->thd.filled = &audio_thd_filled;
+}
+
+static void audio_dev_close(audio_dev *dev)
+{
+	if (dev->out_valid) {
+		dev->drv->close(dev);
+		dev->out_valid = 0;
+	}
+}
+
+static void audio_dev_free(audio_dev *dev)
+{
+	adthd_free(&dev->thd);
+	audio_dev_close(dev);
+}
+
+/** Wake the track which uses the device. */
+static void audio_onplay(void *udata)
+{
+	audio_dev *dev = udata;
+	if (dev->usedby != NULL)
+		dev->core->task(&dev->usedby->task, FMED_TASK_POST);
+}
+
+static void audio_dev_async(audio_dev *dev, uint enable)
+{
+	if (dev->drv->async != NULL)
+		dev->drv->async(dev, enable);
+}
+
+/** Stop I/O thread so that the device can be used by the caller.
+clear: discard the data not yet passed to the device */
+static void audio_thd_stop(audio_dev *dev, uint clear)
+{
+	uint64 n;
+	if (!dev->use_thd)
+		return;
+	adthd_stop(&dev->thd);
+	if (clear)
+		adthd_clear(&dev->thd);
+	if (0 != (n = ffatom_get(&dev->thd.xruns))) {
+		warnlog(dev->core, NULL, dev->drv->name, "I/O thread: %U underruns", n);
+		ffatom_set(&dev->thd.xruns, 0);
+	}
+}
+
+/** Stop playback and discard the data in device buffer. */
+static void audio_dev_reset(audio_dev *dev, void *trk)
+{
+	int r;
+	audio_thd_stop(dev, 1);
+	if (0 != (r = dev->drv->stop(dev)))
+		errlog(dev->core, trk, dev->drv->name, "stop: (%d) %s", r, dev->drv->errstr(r));
+	dev->drv->clear(dev);
+	audio_dev_async(dev, 0);
+}
+
+/** Set the format for the previous filters to convert audio to.
+Return 1 if the requested format differs from the supported one. */
+static int audio_convfmt(fmed_filt *d, const ffpcmex *in_fmt, const ffpcmex *fmt)
+{
+	if (!ffmemcmp(fmt, in_fmt, sizeof(ffpcmex)))
+		return 0;
+
+	if (fmt->format != in_fmt->format)
+		d->audio.convfmt.format = fmt->format;
+
+	if (fmt->sample_rate != in_fmt->sample_rate)
+		d->audio.convfmt.sample_rate = fmt->sample_rate;
+
+	if (fmt->channels != in_fmt->channels)
+		d->audio.convfmt.channels = fmt->channels;
+
+	if (fmt->ileaved != in_fmt->ileaved)
+		d->audio.convfmt.ileaved = fmt->ileaved;
+	return 1;
+}
+
+/** Print the time passed since the track's start (--print-time). */
+static void audio_firstsound(const fmed_core *core, fmed_filt *d, const char *name)
+{
+	int64 start = d->track->getval(d->trk, "start_time");
+	fftime now;
+	if (start == FMED_NULL)
+		return;
+	fftime_now(&now);
+	fmed_infolog(core, d->trk, name, "time to first sound: %Ums", (fftime_mcs(&now) - start) / 1000);
+}
+
+static void audio_out_init(audio_out *a, audio_dev *dev, fmed_filt *d)
+{
+	a->dev = dev;
+	a->task.handler = d->handler;
+	a->task.param = d->trk;
+}
+
+static void audio_out_close(audio_out *a)
+{
+	audio_dev *dev = a->dev;
+	void *trk = a->task.param;
+
+	if (dev->usedby == a) {
+		if (FMED_NULL != dev->track->getval(trk, "stopped")) {
+			audio_thd_stop(dev, 1);
+			audio_dev_close(dev);
+		} else
+			audio_dev_reset(dev, trk);
+		dev->usedby = NULL;
+	}
+
+	if (a->nunderruns != 0)
+		dbglog(dev->core, trk, dev->drv->name, "underruns: %U", a->nunderruns);
+	dev->core->task(&a->task, FMED_TASK_DEL);
+}
+
+static int audio_out_create(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	const char *name = dev->drv->name;
+	ffpcmex fmt, in_fmt;
+	ffpcm f;
+	int r, reused = 0;
+
+	if (FMED_NULL == (int)(a->idev = (int)d->track->getval(d->trk, "playdev_name")))
+		a->idev = dev->conf->idev;
+
+	fmt = d->audio.convfmt;
+
+	if (dev->out_valid) {
+
+		if (dev->usedby != NULL) {
+			audio_out *prev = dev->usedby;
+			audio_thd_stop(dev, 1);
+			dev->usedby = NULL;
+			prev->stop = 1;
+			dev->core->task(&prev->task, FMED_TASK_POST);
+		}
+
+		if (fmt.channels == dev->fmt.channels
+			&& fmt.format == dev->fmt.format
+			&& fmt.sample_rate == dev->fmt.sample_rate
+			&& dev->idev == a->idev) {
+
+			audio_dev_reset(dev, d->trk);
+			reused = 1;
+			goto fin;
+		}
+
+		audio_dev_close(dev);
+	}
+
+	in_fmt = fmt;
+	ffpcm_fmtcopy(&f, &fmt);
+	r = dev->drv->open(dev, a->idev, &f, dev->conf->buflen);
+	ffpcm_fmtcopy(&fmt, &f);
+
+	if (r == AUDIO_EFORMAT && a->state == AUDIO_TRYOPEN) {
+		if (audio_convfmt(d, &in_fmt, &fmt)) {
+			a->state = AUDIO_OPEN;
+			return FMED_RMORE;
+		}
+	}
+
+	if (r == AUDIO_EDEV) {
+		errlog(dev->core, d->trk, name, "no audio device by index #%u", a->idev);
+		return FMED_RERR;
+	} else if (r != 0) {
+		errlog(dev->core, d->trk, name, "open: (%d) %s"
+			, r, (r < 0) ? dev->drv->errstr(r) : "unsupported format");
+		return FMED_RERR;
+	}
+
+	dev->out_valid = 1;
+	ffpcm_fmtcopy(&dev->fmt, &fmt);
+	dev->idev = a->idev;
+
+fin:
+	dev->usedby = a;
+	dbglog(dev->core, d->trk, name, "%s buffer %ums, %uHz"
+		, reused ? "reused" : "opened", ffpcm_bytes2time(&dev->fmt, dev->drv->bufsize(dev))
+		, dev->fmt.sample_rate);
+
+	dev->use_thd = 0;
+	if (dev->conf->io_thread) {
+		if (dev->thd.buf == NULL
+			&& 0 != adthd_init(&dev->thd, dev->drv->bufsize(dev)))
+			errlog(dev->core, d->trk, name, "%s", ffmem_alloc_S);
+		else {
+			dev->thd.task = &a->task;
+			dev->thd.period = ffmax(dev->conf->buflen / 4, 1);
+			dev->thd.prio = dev->conf->io_prio;
+			ffatom_set(&dev->thd.xruns, 0);
+			dev->use_thd = 1;
+		}
+	}
+	return 0;
+}
+
+/** Set "output_latency" track value: msec of audio data queued for playback. */
+static void audio_latency(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	size_t n = (dev->use_thd) ? adthd_latency(&dev->thd) : dev->drv->filled(dev);
+	d->track->setval(d->trk, "output_latency", ffpcm_bytes2time(&dev->fmt, n));
+}
+
+/** Wait until all data is played. */
+static int audio_drain(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	int r;
+
+	if (dev->use_thd) {
+		if (ffatom_get(&dev->thd.done))
+			return FMED_RDONE;
+		if (adthd_filled(&dev->thd) == 0 && !dev->thd.running)
+			return FMED_RDONE;
+		if (0 != adthd_start(&dev->thd)) {
+			syserrlog(dev->core, d->trk, dev->drv->name, "%s", "ffthd_create()");
+			return FMED_RERR;
+		}
+		ffatom_set(&dev->thd.fin, 1);
+		return FMED_RASYNC; //wait until all data is played
+	}
+
+	r = dev->drv->drain(dev);
+	if (r == 1)
+		return FMED_RDONE;
+	else if (r < 0) {
+		errlog(dev->core, d->trk, dev->drv->name, "drain: (%d) %s", r, dev->drv->errstr(r));
+		return FMED_RERR;
+	}
+
+	audio_dev_async(dev, 1);
+	return FMED_RASYNC; //wait until all filled bytes are played
+}
+
+/** Pass data to I/O thread. */
+static int audio_write_thd(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	int r;
+	size_t n;
+
+	if (0 != (r = (int)ffatom_get(&dev->thd.err))) {
+		errlog(dev->core, d->trk, dev->drv->name, "I/O thread: (%d) %s", r, dev->drv->errstr(r));
+		audio_thd_stop(dev, 1);
+		return FMED_RERR;
+	}
+
+	while (d->datalen != 0) {
+		n = adthd_put(&dev->thd, d->data, d->datalen);
+		d->data += n;
+		d->datalen -= n;
+		if (0 != adthd_start(&dev->thd)) {
+			syserrlog(dev->core, d->trk, dev->drv->name, "%s", "ffthd_create()");
+			return FMED_RERR;
+		}
+		if (n == 0)
+			return FMED_RASYNC; //the ring buffer is full
+	}
+
+	if (d->flags & FMED_FLAST)
+		return audio_drain(a, d);
+
+	audio_latency(a, d);
+	dbglog(dev->core, d->trk, dev->drv->name, "ring buffer: %L bytes", adthd_filled(&dev->thd));
+	return FMED_ROK;
+}
+
+/** Pass data to the device opened by this track.
+Return FMED_RERR on error: the caller closes the device. */
+static int audio_out_data(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	const char *name = dev->drv->name;
+	int r;
+
+	if (a->stop || (d->flags & FMED_FSTOP)) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (d->snd_output_clear) {
+		d->snd_output_clear = 0;
+		audio_dev_reset(dev, d->trk);
+		a->dataoff = 0;
+		a->started = 0;
+		return FMED_RMORE;
+	}
+
+	if (d->snd_output_pause) {
+		d->snd_output_pause = 0;
+		d->track->cmd(d->trk, FMED_TRACK_PAUSE);
+		audio_thd_stop(dev, 0);
+		dev->drv->stop(dev);
+		audio_dev_async(dev, 0);
+		a->started = 0;
+		return FMED_RMORE;
+	}
+
+	if (!a->sound && d->datalen != 0) {
+		a->sound = 1;
+		audio_firstsound(dev->core, d, name);
+	}
+
+	if (dev->use_thd)
+		return audio_write_thd(a, d);
+
+	if (a->started && a->dataoff == 0 && d->datalen != 0
+		&& dev->drv->filled(dev) == 0) {
+		// the track couldn't provide data in time
+		a->nunderruns++;
+	}
+
+	while (d->datalen != 0) {
+
+		r = dev->drv->write(dev, d->data, d->datalen, a->dataoff);
+		if (r < 0) {
+			errlog(dev->core, d->trk, name, "write: (%d) %s", r, dev->drv->errstr(r));
+			return FMED_RERR;
+
+		} else if (r == 0) {
+			audio_dev_async(dev, 1);
+			audio_latency(a, d);
+			return FMED_RASYNC;
+		}
+
+		a->dataoff += r;
+		d->datalen -= r;
+		a->started = 1;
+		dbglog(dev->core, d->trk, name, "written %u bytes (%u%% filled)"
+			, r, dev->drv->filled(dev) * 100 / dev->drv->bufsize(dev));
+	}
+
+	a->dataoff = 0;
+
+	if ((d->flags & FMED_FLAST) && d->datalen == 0)
+		return audio_drain(a, d);
+
+	audio_latency(a, d);
+	return FMED_ROK;
+}
+
+/** Process data for an output filter. */
+static int audio_out_write(audio_out *a, fmed_filt *d)
+{
+	audio_dev *dev = a->dev;
+	int r;
+
+	switch (a->state) {
+	case AUDIO_TRYOPEN:
+	case AUDIO_OPEN:
+		d->audio.convfmt.ileaved = 1;
+		if (0 != (r = audio_out_create(a, d)))
+			return r;
+		a->state = AUDIO_DATA;
+		return FMED_RMORE;
+
+	case AUDIO_DATA:
+		break;
+	}
+
+	r = audio_out_data(a, d);
+	if (r == FMED_RERR) {
+		audio_dev_close(dev);
+		dev->usedby = NULL;
+	}
+	return r;
+}
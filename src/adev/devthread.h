@@ -0,0 +1,243 @@
+/** Audio device output in a separate I/O thread.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+track:  TRACK -> adthd_put() -> ring buffer
+I/O thread:  ring buffer -> write() -> audio device
+
+The ring buffer is single-producer, single-consumer and lock-free:
+ the track only moves 'wpos', the I/O thread only moves 'rpos'.
+When the ring buffer is full, the track waits until the I/O thread frees a half of it.
+The I/O thread polls the device: it sleeps for 'period' msec when the device buffer is full.
+It doesn't wait for device events (poll descriptors), so it may wake up later than necessary:
+ 'period' should be small enough compared to the device buffer length.
+While the I/O thread is running, the device handle is used only by this thread:
+ the track gets the device buffer fill level from 'dev_filled'.
+*/
+
+#include <FFOS/thread.h>
+#include <FFOS/atomic.h>
+
+#ifdef FF_UNIX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+typedef struct adthd adthd;
+
+struct adthd {
+	const fmed_core *core;
+	ffthd thd;
+	char *buf;
+	size_t cap; //power of 2
+	ffatomic rpos; //bytes read by the I/O thread
+	ffatomic wpos; //bytes written by the track
+	ffatomic stop; //the I/O thread must exit
+	ffatomic fin; //no more data: drain the device
+	ffatomic done; //the device is drained
+	ffatomic err; //the I/O thread has failed
+	ffatomic waiting; //the track waits for free space
+	ffatomic dev_filled; //bytes in device buffer;  updated by the I/O thread
+
+	uint period; //msec
+	int prio; //SCHED_FIFO priority;  0: don't change
+	fftask *task; //the track's task
+	void *udata;
+
+	/** Return the number of bytes written;  0 if device buffer is full;  <0 on error. */
+	int (*write)(void *udata, const void *data, size_t len);
+	/** Return 1 if all data is played;  0 if still playing;  <0 on error. */
+	int (*drain)(void *udata);
+	/** Get the number of bytes in device buffer. */
+	size_t (*filled)(void *udata);
+
+	ffatomic xruns; //device buffer underruns
+	uint running :1;
+};
+
+/** Allocate ring buffer of at least 'size' bytes. */
+static int adthd_init(adthd *t, size_t size)
+{
+	size_t cap = 4096;
+	while (cap < size)
+		cap *= 2;
+	if (NULL == (t->buf = ffmem_alloc(cap)))
+		return -1;
+	t->cap = cap;
+	return 0;
+}
+
+static void adthd_post(adthd *t)
+{
+	if (t->task != NULL)
+		t->core->task(t->task, FMED_TASK_POST);
+}
+
+static void adthd_setprio(adthd *t)
+{
+#ifdef FF_UNIX
+	struct sched_param sp = {0};
+	int r;
+	if (t->prio == 0)
+		return;
+	sp.sched_priority = t->prio;
+	if (0 != (r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)))
+		t->core->log(FMED_LOG_DEBUG, NULL, "adev", "can't set SCHED_FIFO priority %d: (%d)", t->prio, r);
+#endif
+}
+
+static FFTHDCALL int adthd_loop(void *param)
+{
+	adthd *t = param;
+	size_t rpos, avail, n;
+	uint played = 0, starving = 0;
+	int r;
+
+	adthd_setprio(t);
+
+	while (0 == ffatom_get(&t->stop)) {
+
+		rpos = ffatom_get(&t->rpos);
+		avail = ffatom_get(&t->wpos) - rpos;
+		ffatom_fence_acq();
+
+		if (avail != 0) {
+			n = ffmin(avail, t->cap - (rpos & (t->cap - 1)));
+			r = t->write(t->udata, t->buf + (rpos & (t->cap - 1)), n);
+			if (r < 0)
+				goto err;
+			else if (r == 0) {
+				ffthd_sleep(t->period);
+				continue;
+			}
+
+			ffatom_fence_rel();
+			ffatom_set(&t->rpos, rpos + r);
+			ffatom_set(&t->dev_filled, t->filled(t->udata));
+			played = 1;
+			starving = 0;
+
+			if (ffatom_get(&t->waiting) && avail - r <= t->cap / 2) {
+				ffatom_set(&t->waiting, 0);
+				adthd_post(t);
+			}
+			continue;
+		}
+
+		if (ffatom_get(&t->fin)) {
+			r = t->drain(t->udata);
+			if (r < 0)
+				goto err;
+			else if (r == 1) {
+				ffatom_set(&t->done, 1);
+				adthd_post(t);
+				break;
+			}
+			ffthd_sleep(t->period);
+			continue;
+		}
+
+		n = t->filled(t->udata);
+		ffatom_set(&t->dev_filled, n);
+		if (played && !starving && n == 0) {
+			// the track couldn't provide data in time
+			ffatom_incret(&t->xruns);
+			starving = 1;
+		}
+
+		if (ffatom_get(&t->waiting)) {
+			ffatom_set(&t->waiting, 0);
+			adthd_post(t);
+		}
+		ffthd_sleep(ffmin(t->period, 10));
+	}
+
+	return 0;
+
+err:
+	ffatom_set(&t->err, r);
+	adthd_post(t);
+	return 0;
+}
+
+static int adthd_start(adthd *t)
+{
+	if (t->running)
+		return 0;
+	ffatom_set(&t->stop, 0);
+	ffatom_set(&t->fin, 0);
+	ffatom_set(&t->done, 0);
+	ffatom_set(&t->err, 0);
+	ffatom_set(&t->dev_filled, t->filled(t->udata));
+	if (NULL == (t->thd = ffthd_create(&adthd_loop, t, 0)))
+		return -1;
+	t->running = 1;
+	return 0;
+}
+
+/** Stop the I/O thread.  Data in ring buffer is kept. */
+static void adthd_stop(adthd *t)
+{
+	if (t->running) {
+		ffatom_set(&t->stop, 1);
+		ffthd_join(t->thd, -1, NULL);
+		t->running = 0;
+	}
+}
+
+/** Discard data in ring buffer.  The I/O thread must be stopped. */
+static void adthd_clear(adthd *t)
+{
+	ffatom_set(&t->rpos, 0);
+	ffatom_set(&t->wpos, 0);
+	ffatom_set(&t->waiting, 0);
+}
+
+static size_t adthd_filled(adthd *t)
+{
+	return ffatom_get(&t->wpos) - ffatom_get(&t->rpos);
+}
+
+/** Get the number of bytes in device buffer and in ring buffer.
+The device is accessed directly only if the I/O thread isn't running. */
+static size_t adthd_latency(adthd *t)
+{
+	size_t n = (t->running) ? ffatom_get(&t->dev_filled) : t->filled(t->udata);
+	return n + adthd_filled(t);
+}
+
+static void adthd_free(adthd *t)
+{
+	adthd_stop(t);
+	adthd_clear(t);
+	ffmem_safefree0(t->buf);
+}
+
+/** Copy data into ring buffer.
+Return the number of bytes copied;  0 if the ring buffer is full (the track's task will be posted). */
+static size_t adthd_put(adthd *t, const void *data, size_t len)
+{
+	size_t wpos = ffatom_get(&t->wpos), n, i, off;
+	size_t unused = t->cap - (wpos - ffatom_get(&t->rpos));
+	ffatom_fence_acq();
+
+	if (unused == 0) {
+		ffatom_set(&t->waiting, 1);
+		// the I/O thread may have read some data before it saw 'waiting'
+		if (wpos - ffatom_get(&t->rpos) != t->cap) {
+			ffatom_set(&t->waiting, 0);
+			return adthd_put(t, data, len);
+		}
+		return 0;
+	}
+
+	n = ffmin(len, unused);
+	off = wpos & (t->cap - 1);
+	i = ffmin(n, t->cap - off);
+	ffmemcpy(t->buf + off, data, i);
+	ffmemcpy(t->buf, (char*)data + i, n - i);
+	ffatom_fence_rel();
+	ffatom_set(&t->wpos, wpos + n);
+	return n;
+}
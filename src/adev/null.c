@@ -0,0 +1,457 @@
+/** Null audio device: consumes (null.out) or produces silence (null.in) at real-time rate.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+The device is clocked by the core timer: every 'period' msec (+/- random 'jitter' msec)
+ the playback position is updated from the wall clock.
+null.out: the device buffer is 'buffer_length' msec;  it's played at real-time rate starting when it's full,
+ the buffer becoming empty before the end of data is an underrun.
+null.in: the data not read by the track within 'buffer_length' msec is lost (overrun).
+Statistics are printed when the track is closed.
+*/
+
+#include <fmedia.h>
+
+#include <FF/audio/pcm.h>
+#include <FF/array.h>
+#include <FFOS/random.h>
+#include <FFOS/timer.h>
+
+
+#undef dbglog
+#undef errlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "null", __VA_ARGS__)
+#define infolog(trk, ...)  fmed_infolog(core, trk, "null", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "null", __VA_ARGS__)
+
+
+static const fmed_core *core;
+
+struct null_conf_t {
+	uint buflen; //msec
+	uint period; //msec
+	uint jitter; //msec
+};
+static struct null_conf_t null_out_conf, null_in_conf;
+
+/** Device clock. */
+typedef struct nclock {
+	fftmrq_entry tmr;
+	fftask task;
+	const struct null_conf_t *conf;
+	fftime t0; //start time
+	fftime tlast; //the last tick
+	uint next; //msec: expected interval until the next tick
+	uint64 nticks;
+	uint64 err_sum, err_max; //msec: deviation of the actual tick intervals from the expected
+	uint wait :1 //the track waits for the next tick
+		, started :1;
+} nclock;
+
+//FMEDIA MODULE
+static const void* null_iface(const char *name);
+static int null_conf(const char *name, ffpars_ctx *ctx);
+static int null_sig(uint signo);
+static void null_destroy(void);
+static const fmed_mod fmed_null_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&null_iface, &null_sig, &null_destroy, &null_conf
+};
+
+static const ffpars_arg null_conf_args[] = {
+	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct null_conf_t, buflen) },
+	{ "period",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct null_conf_t, period) },
+	{ "jitter",	FFPARS_TINT,  FFPARS_DSTOFF(struct null_conf_t, jitter) },
+};
+
+//OUTPUT
+static void* nullout_open(fmed_filt *d);
+static int nullout_write(void *ctx, fmed_filt *d);
+static void nullout_close(void *ctx);
+static const fmed_filter fmed_null_out = {
+	&nullout_open, &nullout_write, &nullout_close
+};
+
+//INPUT
+static void* nullin_open(fmed_filt *d);
+static int nullin_read(void *ctx, fmed_filt *d);
+static void nullin_close(void *ctx);
+static const fmed_filter fmed_null_in = {
+	&nullin_open, &nullin_read, &nullin_close
+};
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	core = _core;
+	return &fmed_null_mod;
+}
+
+
+static const void* null_iface(const char *name)
+{
+	if (!ffsz_cmp(name, "out"))
+		return &fmed_null_out;
+	else if (!ffsz_cmp(name, "in"))
+		return &fmed_null_in;
+	return NULL;
+}
+
+static int null_conf(const char *name, ffpars_ctx *ctx)
+{
+	struct null_conf_t *c;
+	if (!ffsz_cmp(name, "out"))
+		c = &null_out_conf;
+	else if (!ffsz_cmp(name, "in"))
+		c = &null_in_conf;
+	else
+		return -1;
+	c->buflen = 500;
+	c->period = 10;
+	c->jitter = 0;
+	ffpars_setargs(ctx, c, null_conf_args, FFCNT(null_conf_args));
+	return 0;
+}
+
+static int null_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT: {
+		ffmem_init();
+		fftime t;
+		fftime_now(&t);
+		ffrnd_seed(fftime_sec(&t));
+		return 0;
+	}
+	}
+	return 0;
+}
+
+static void null_destroy(void)
+{
+}
+
+
+static void nclk_init(nclock *c, const struct null_conf_t *conf, fmed_filt *d, void (*ontmr)(void*), void *udata)
+{
+	c->conf = conf;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+	c->tmr.handler = ontmr;
+	c->tmr.param = udata;
+}
+
+/** Set one-shot timer for the next tick. */
+static void nclk_arm(nclock *c)
+{
+	int interval = c->conf->period;
+	if (c->conf->jitter != 0)
+		interval += (int)(ffrnd_get() % (c->conf->jitter * 2 + 1)) - (int)c->conf->jitter;
+	c->next = ffmax(interval, 1);
+	core->timer(&c->tmr, -(int)c->next, 0);
+}
+
+static void nclk_start(nclock *c)
+{
+	ffclk_get(&c->t0);
+	c->tlast = c->t0;
+	c->started = 1;
+	nclk_arm(c);
+}
+
+static void nclk_stop(nclock *c)
+{
+	core->timer(&c->tmr, 0, 0);
+	c->started = 0;
+}
+
+static void nclk_close(nclock *c)
+{
+	nclk_stop(c);
+	core->task(&c->task, FMED_TASK_DEL);
+}
+
+/** Get msec passed since start. */
+static uint64 nclk_elapsed(nclock *c)
+{
+	fftime t;
+	ffclk_get(&t);
+	ffclk_diff(&c->t0, &t);
+	return fftime_ms(&t);
+}
+
+/** Update timing statistics on timer signal, wake the track if it waits, set the next tick. */
+static void nclk_tick(nclock *c)
+{
+	fftime t, now;
+	uint64 ms, err;
+
+	ffclk_get(&now);
+	t = now;
+	ffclk_diff(&c->tlast, &t);
+	c->tlast = now;
+	ms = fftime_ms(&t);
+	err = (ms > c->next) ? ms - c->next : c->next - ms;
+	c->err_sum += err;
+	c->err_max = ffmax(c->err_max, err);
+	c->nticks++;
+
+	if (c->wait) {
+		c->wait = 0;
+		core->task(&c->task, FMED_TASK_POST);
+	}
+	nclk_arm(c);
+}
+
+static void nclk_print(nclock *c, const char *name, uint64 ms)
+{
+	infolog(NULL, "%s: wall clock: %Ums, timer ticks: %U, timer error avg: %Ums, max: %Ums"
+		, name, ms, c->nticks, (c->nticks != 0) ? c->err_sum / c->nticks : 0, c->err_max);
+}
+
+
+typedef struct null_out {
+	uint state;
+	nclock clk;
+	ffpcm fmt;
+	uint sampsize;
+	size_t cap; //bytes
+	size_t filled; //bytes in device buffer
+	uint64 played; //samples played by the device (including silence)
+	uint64 nunderruns;
+	uint64 total; //bytes written by the track
+	uint starving :1
+		, fin :1;
+} null_out;
+
+static void nullout_ontmr(void *param);
+
+static void* nullout_open(fmed_filt *d)
+{
+	null_out *o;
+	if (!ffsz_eq(d->datatype, "pcm")) {
+		errlog(d->trk, "unsupported input data type: %s", d->datatype);
+		return NULL;
+	}
+	if (NULL == (o = ffmem_new(null_out)))
+		return NULL;
+	nclk_init(&o->clk, &null_out_conf, d, &nullout_ontmr, o);
+	return o;
+}
+
+static void nullout_close(void *ctx)
+{
+	null_out *o = ctx;
+	if (o->clk.started || o->clk.nticks != 0) {
+		infolog(NULL, "null.out: played: %Ums, underruns: %U"
+			, (o->fmt.sample_rate != 0) ? ffpcm_time(o->total / o->sampsize, o->fmt.sample_rate) : 0
+			, o->nunderruns);
+		nclk_print(&o->clk, "null.out", o->clk.started ? nclk_elapsed(&o->clk) : 0);
+	}
+	nclk_close(&o->clk);
+	ffmem_free(o);
+}
+
+/** Consume data from device buffer according to the wall clock. */
+static void nullout_update(null_out *o)
+{
+	uint64 total, n;
+
+	if (!o->clk.started)
+		return;
+
+	total = nclk_elapsed(&o->clk) * o->fmt.sample_rate / 1000;
+	n = (total - o->played) * o->sampsize;
+	o->played = total;
+
+	if (n > o->filled) {
+		if (!o->fin && !o->starving) {
+			o->nunderruns++;
+			o->starving = 1;
+			dbglog(NULL, "null.out: underrun");
+		}
+		o->filled = 0;
+	} else
+		o->filled -= n;
+}
+
+static void nullout_ontmr(void *param)
+{
+	null_out *o = param;
+	nullout_update(o);
+	nclk_tick(&o->clk);
+}
+
+static int nullout_write(void *ctx, fmed_filt *d)
+{
+	enum { I_OPEN, I_CREATE, I_DATA };
+	null_out *o = ctx;
+	size_t n;
+
+	switch (o->state) {
+	case I_OPEN:
+		d->audio.convfmt.ileaved = 1;
+		o->state = I_CREATE;
+		return FMED_RMORE;
+
+	case I_CREATE:
+		ffpcm_fmtcopy(&o->fmt, &d->audio.convfmt);
+		o->sampsize = ffpcm_size1(&o->fmt);
+		o->cap = ffpcm_samples(null_out_conf.buflen, o->fmt.sample_rate) * o->sampsize;
+		dbglog(d->trk, "buffer %ums, %uHz", null_out_conf.buflen, o->fmt.sample_rate);
+		o->state = I_DATA;
+		// break
+
+	case I_DATA:
+		break;
+	}
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (d->snd_output_clear) {
+		d->snd_output_clear = 0;
+		nclk_stop(&o->clk);
+		o->filled = 0;
+		o->played = 0;
+		return FMED_RMORE;
+	}
+
+	if (d->snd_output_pause) {
+		d->snd_output_pause = 0;
+		d->track->cmd(d->trk, FMED_TRACK_PAUSE);
+		nullout_update(o);
+		nclk_stop(&o->clk);
+		o->played = 0;
+		return FMED_RASYNC;
+	}
+
+	nullout_update(o);
+
+	n = ffmin(d->datalen, o->cap - o->filled);
+	if (n != 0) {
+		o->filled += n;
+		o->total += n;
+		d->data += n;
+		d->datalen -= n;
+		o->starving = 0;
+	}
+
+	if (!o->clk.started
+		&& (o->filled == o->cap || (d->flags & FMED_FLAST)))
+		nclk_start(&o->clk);
+
+	if (d->datalen != 0) {
+		o->clk.wait = 1;
+		return FMED_RASYNC; //the buffer is full
+	}
+
+	if (d->flags & FMED_FLAST) {
+		if (o->filled == 0)
+			return FMED_RDONE;
+		o->fin = 1;
+		o->clk.wait = 1;
+		return FMED_RASYNC; //wait until all data is played
+	}
+
+	return FMED_ROK;
+}
+
+
+typedef struct null_in {
+	nclock clk;
+	ffpcm fmt;
+	uint sampsize;
+	uint cap; //samples
+	uint min; //samples: return data by 'period' blocks
+	ffarr buf; //silence
+	uint64 pos; //samples returned to the track
+	uint64 noverruns, lost; //samples
+} null_in;
+
+static void nullin_ontmr(void *param)
+{
+	null_in *n = param;
+	nclk_tick(&n->clk);
+}
+
+static void* nullin_open(fmed_filt *d)
+{
+	null_in *n;
+
+	if (NULL == (n = ffmem_new(null_in)))
+		return NULL;
+	nclk_init(&n->clk, &null_in_conf, d, &nullin_ontmr, n);
+
+	if (d->audio.fmt.format == 0)
+		d->audio.fmt.format = FFPCM_16;
+	if (d->audio.fmt.channels == 0)
+		d->audio.fmt.channels = 2;
+	if (d->audio.fmt.sample_rate == 0)
+		d->audio.fmt.sample_rate = 44100;
+	d->audio.fmt.ileaved = 1;
+	ffpcm_fmtcopy(&n->fmt, &d->audio.fmt);
+	n->sampsize = ffpcm_size1(&n->fmt);
+	n->cap = ffpcm_samples(null_in_conf.buflen, n->fmt.sample_rate);
+	n->min = ffmin(ffpcm_samples(null_in_conf.period, n->fmt.sample_rate), n->cap);
+
+	if (NULL == ffarr_alloc(&n->buf, n->cap * n->sampsize)) {
+		nullin_close(n);
+		return NULL;
+	}
+	ffmem_zero(n->buf.ptr, n->cap * n->sampsize);
+
+	d->datatype = "pcm";
+	nclk_start(&n->clk);
+	dbglog(d->trk, "capture buffer %ums, %uHz", null_in_conf.buflen, n->fmt.sample_rate);
+	return n;
+}
+
+static void nullin_close(void *ctx)
+{
+	null_in *n = ctx;
+	if (n->clk.started) {
+		infolog(NULL, "null.in: captured: %Ums, overruns: %U, lost: %Ums"
+			, ffpcm_time(n->pos, n->fmt.sample_rate), n->noverruns, ffpcm_time(n->lost, n->fmt.sample_rate));
+		nclk_print(&n->clk, "null.in", nclk_elapsed(&n->clk));
+	}
+	nclk_close(&n->clk);
+	ffarr_free(&n->buf);
+	ffmem_free(n);
+}
+
+static int nullin_read(void *ctx, fmed_filt *d)
+{
+	null_in *n = ctx;
+	uint64 total, avail;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	total = nclk_elapsed(&n->clk) * n->fmt.sample_rate / 1000;
+	avail = total - n->pos;
+	if (avail > n->cap) {
+		// the track didn't read data in time
+		n->noverruns++;
+		n->lost += avail - n->cap;
+		dbglog(d->trk, "overrun: lost %U samples", avail - n->cap);
+		n->pos = total - n->cap;
+		avail = n->cap;
+	}
+
+	if (avail < n->min) {
+		n->clk.wait = 1;
+		return FMED_RASYNC;
+	}
+
+	d->audio.pos = n->pos;
+	n->pos += avail;
+	d->out = n->buf.ptr;
+	d->outlen = avail * n->sampsize;
+	dbglog(d->trk, "read %L bytes", d->outlen);
+	return FMED_ROK;
+}
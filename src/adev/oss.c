@@ -4,41 +4,20 @@ Copyright (c) 2017 Simon Zolin */
 #include <fmedia.h>
 
 #include <FF/adev/oss.h>
+#include <adev/audio-out.h>
 
 
 static const fmed_core *core;
 
-typedef struct oss_out oss_out;
-
 typedef struct oss_mod {
 	ffoss_buf out;
-	ffpcm fmt;
-	oss_out *usedby;
-	const fmed_track *track;
-	uint devidx;
-	uint out_valid :1;
+	audio_dev dev;
 	uint init_ok :1;
 } oss_mod;
 
 static oss_mod *mod;
 
-struct oss_out {
-	uint state;
-	size_t dataoff;
-
-	ffoss_dev dev;
-	uint devidx;
-
-	fftask task;
-	uint stop :1;
-};
-
-enum { I_TRYOPEN, I_OPEN, I_DATA };
-
-static struct oss_out_conf_t {
-	uint idev;
-	uint buflen;
-} oss_out_conf;
+static struct audio_conf oss_out_conf;
 
 //FMEDIA MODULE
 static const void* oss_iface(const char *name);
@@ -54,7 +33,6 @@ static const fmed_mod fmed_oss_mod = {
 };
 
 static int oss_init(fmed_trk *trk);
-static int oss_create(oss_out *o, fmed_filt *d);
 
 //OUTPUT
 static void* oss_open(fmed_filt *d);
@@ -66,11 +44,27 @@ static const fmed_filter fmed_oss_out = {
 };
 
 static const ffpars_arg oss_out_conf_args[] = {
-	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct oss_out_conf_t, idev) },
-	{ "buffer_length",	FFPARS_TINT,  FFPARS_DSTOFF(struct oss_out_conf_t, buflen) },
+	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct audio_conf, idev) },
+	{ "buffer_length",	FFPARS_TINT,  FFPARS_DSTOFF(struct audio_conf, buflen) },
+	{ "io_thread",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(struct audio_conf, io_thread) },
+	{ "io_thread_priority",	FFPARS_TINT,  FFPARS_DSTOFF(struct audio_conf, io_prio) },
 };
 
-static void oss_onplay(void *udata);
+static int oss_drv_open(audio_dev *dev, uint idev, ffpcm *fmt, uint buflen);
+static void oss_drv_close(audio_dev *dev);
+static int oss_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff);
+static int oss_drv_drain(audio_dev *dev);
+static int oss_drv_stop(audio_dev *dev);
+static void oss_drv_clear(audio_dev *dev);
+static size_t oss_drv_filled(audio_dev *dev);
+static size_t oss_drv_bufsize(audio_dev *dev);
+static const char* oss_drv_errstr(int e);
+static const audio_drv oss_drv = {
+	"oss",
+	&oss_drv_open, &oss_drv_close,
+	&oss_drv_write, &oss_drv_drain, &oss_drv_stop, &oss_drv_clear, NULL,
+	&oss_drv_filled, &oss_drv_bufsize, &oss_drv_errstr
+};
 
 //ADEV
 static int oss_adev_list(fmed_adev_ent **ents, uint flags);
@@ -116,7 +110,7 @@ static int oss_sig(uint signo)
 		if (NULL == (mod = ffmem_new(oss_mod)))
 			return -1;
 
-		mod->track = core->getmod("#core.track");
+		audio_dev_init(&mod->dev, core, &oss_drv, &oss_out_conf, &mod->out);
 		return 0;
 	}
 	return 0;
@@ -125,8 +119,7 @@ static int oss_sig(uint signo)
 static void oss_destroy(void)
 {
 	if (mod != NULL) {
-		if (mod->out_valid)
-			ffoss_close(&mod->out);
+		audio_dev_free(&mod->dev);
 		ffmem_free(mod);
 		mod = NULL;
 	}
@@ -210,47 +203,29 @@ static int oss_out_config(ffpars_ctx *ctx)
 {
 	oss_out_conf.idev = 0;
 	oss_out_conf.buflen = 500;
+	oss_out_conf.io_thread = 0;
+	oss_out_conf.io_prio = 0;
 	ffpars_setargs(ctx, &oss_out_conf, oss_out_conf_args, FFCNT(oss_out_conf_args));
 	return 0;
 }
 
 static void* oss_open(fmed_filt *d)
 {
-	oss_out *o;
+	audio_out *o;
 
 	if (0 != oss_init(d->trk))
 		return NULL;
 
-	if (NULL == (o = ffmem_new(oss_out)))
+	if (NULL == (o = ffmem_new(audio_out)))
 		return NULL;
-	o->task.handler = d->handler;
-	o->task.param = d->trk;
+	audio_out_init(o, &mod->dev, d);
 	return o;
 }
 
 static void oss_close(void *ctx)
 {
-	oss_out *o = ctx;
-	int r;
-
-	if (mod->usedby == o) {
-		void *trk = o->task.param;
-
-		if (FMED_NULL != mod->track->getval(trk, "stopped")) {
-			ffoss_close(&mod->out);
-			ffmem_tzero(&mod->out);
-			mod->out_valid = 0;
-
-		} else {
-			if (0 != (r = ffoss_stop(&mod->out)))
-				errlog(core, trk,  "oss", "ffoss_stop(): (%d) %s", r, ffoss_errstr(r));
-			ffoss_clear(&mod->out);
-		}
-
-		mod->usedby = NULL;
-	}
-
-	ffoss_devdestroy(&o->dev);
+	audio_out *o = ctx;
+	audio_out_close(o);
 	ffmem_free(o);
 }
 
@@ -267,163 +242,64 @@ static int oss_devbyidx(ffoss_dev *d, uint idev, uint flags)
 	return 0;
 }
 
-static int oss_create(oss_out *o, fmed_filt *d)
+static int oss_drv_open(audio_dev *dev, uint idev, ffpcm *fmt, uint buflen)
 {
-	ffpcm fmt, in_fmt;
-	int r, reused = 0;
-
-	if (FMED_NULL == (int)(o->devidx = (int)d->track->getval(d->trk, "playdev_name")))
-		o->devidx = oss_out_conf.idev;
-
-	ffpcm_fmtcopy(&fmt, &d->audio.convfmt);
-
-	if (mod->out_valid) {
-
-		if (mod->usedby != NULL) {
-			oss_out *o = mod->usedby;
-			mod->usedby = NULL;
-			o->stop = 1;
-			oss_onplay(o);
-		}
-
-		if (fmt.channels == mod->fmt.channels
-			&& fmt.format == mod->fmt.format
-			&& fmt.sample_rate == mod->fmt.sample_rate
-			&& mod->devidx == o->devidx) {
-
-			ffoss_stop(&mod->out);
-			ffoss_clear(&mod->out);
-			reused = 1;
-			goto fin;
-		}
-
-		ffoss_close(&mod->out);
-		ffmem_tzero(&mod->out);
-		mod->out_valid = 0;
-	}
-
-	if (0 != oss_devbyidx(&o->dev, o->devidx, FFOSS_DEV_PLAYBACK)) {
-		errlog(core, d->trk, "oss", "no audio device by index #%u", o->devidx);
-		goto done;
-	}
-
-	in_fmt = fmt;
-	r = ffoss_open(&mod->out, o->dev.id, &fmt, oss_out_conf.buflen, FFOSS_DEV_PLAYBACK);
-
-	if (r == -FFOSS_EFMT && o->state == I_TRYOPEN) {
+	ffoss_dev odev;
+	int r;
 
-		if (!!ffmemcmp(&fmt, &in_fmt, sizeof(ffpcmex))) {
+	if (0 != oss_devbyidx(&odev, idev, FFOSS_DEV_PLAYBACK))
+		return AUDIO_EDEV;
 
-			if (fmt.format != in_fmt.format)
-				d->audio.convfmt.format = fmt.format;
+	r = ffoss_open(dev->out, odev.id, fmt, buflen, FFOSS_DEV_PLAYBACK);
+	ffoss_devdestroy(&odev);
+	if (r == -FFOSS_EFMT)
+		return AUDIO_EFORMAT;
+	return r;
+}
 
-			if (fmt.sample_rate != in_fmt.sample_rate)
-				d->audio.convfmt.sample_rate = fmt.sample_rate;
+static void oss_drv_close(audio_dev *dev)
+{
+	ffoss_close(dev->out);
+	ffmem_tzero((ffoss_buf*)dev->out);
+}
 
-			if (fmt.channels != in_fmt.channels)
-				d->audio.convfmt.channels = fmt.channels;
+static int oss_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff)
+{
+	return ffoss_write(dev->out, data, len, dataoff);
+}
 
-			o->state = I_OPEN;
-			return FMED_RMORE;
-		}
-	}
+static int oss_drv_drain(audio_dev *dev)
+{
+	return ffoss_drain(dev->out);
+}
 
-	if (r != 0) {
-		errlog(core, d->trk, "oss", "ffoss_open(): (%d) %s", r, ffoss_errstr(r));
-		goto done;
-	}
+static int oss_drv_stop(audio_dev *dev)
+{
+	return ffoss_stop(dev->out);
+}
 
-	ffoss_devdestroy(&o->dev);
-	mod->out_valid = 1;
-	mod->fmt = fmt;
-	mod->devidx = o->devidx;
+static void oss_drv_clear(audio_dev *dev)
+{
+	ffoss_clear(dev->out);
+}
 
-fin:
-	mod->usedby = o;
-	dbglog(core, d->trk, "oss", "%s buffer %ums, %uHz"
-		, reused ? "reused" : "opened", ffpcm_bytes2time(&fmt, ffoss_bufsize(&mod->out))
-		, fmt.sample_rate);
-	return 0;
+static size_t oss_drv_filled(audio_dev *dev)
+{
+	return ffoss_filled(dev->out);
+}
 
-done:
-	return FMED_RERR;
+static size_t oss_drv_bufsize(audio_dev *dev)
+{
+	return ffoss_bufsize(dev->out);
 }
 
-static void oss_onplay(void *udata)
+static const char* oss_drv_errstr(int e)
 {
-	oss_out *o = udata;
-	core->task(&o->task, FMED_TASK_POST);
+	return ffoss_errstr(e);
 }
 
 static int oss_write(void *ctx, fmed_filt *d)
 {
-	oss_out *o = ctx;
-	int r;
-
-	switch (o->state) {
-	case I_TRYOPEN:
-	case I_OPEN:
-		d->audio.convfmt.ileaved = 1;
-		if (0 != (r = oss_create(o, d)))
-			return r;
-		o->state = I_DATA;
-		return FMED_RMORE;
-
-	case I_DATA:
-		break;
-	}
-
-	if (o->stop || (d->flags & FMED_FSTOP)) {
-		d->outlen = 0;
-		return FMED_RDONE;
-	}
-
-	if (d->snd_output_clear) {
-		d->snd_output_clear = 0;
-		ffoss_stop(&mod->out);
-		ffoss_clear(&mod->out);
-		o->dataoff = 0;
-		return FMED_RMORE;
-	}
-
-	while (d->datalen != 0) {
-
-		r = ffoss_write(&mod->out, d->data, d->datalen, o->dataoff);
-		if (r < 0) {
-			errlog(core, d->trk, "oss", "ffoss_write(): (%d) %s", r, ffoss_errstr(r));
-			goto err;
-
-		} else if (r == 0) {
-			return FMED_RASYNC;
-		}
-
-		o->dataoff += r;
-		d->datalen -= r;
-		dbglog(core, d->trk, "oss", "written %u bytes (%u%% filled)"
-			, r, ffoss_filled(&mod->out) * 100 / ffoss_bufsize(&mod->out));
-	}
-
-	o->dataoff = 0;
-
-	if ((d->flags & FMED_FLAST) && d->datalen == 0) {
-
-		r = ffoss_drain(&mod->out);
-		if (r == 1)
-			return FMED_RDONE;
-		else if (r < 0) {
-			errlog(core, d->trk,  "oss", "ffoss_drain(): (%d) %s", r, ffoss_errstr(r));
-			goto err;
-		}
-
-		return FMED_RASYNC; //wait until all filled bytes are played
-	}
-
-	return FMED_ROK;
-
-err:
-	ffoss_close(&mod->out);
-	ffmem_tzero(&mod->out);
-	mod->out_valid = 0;
-	mod->usedby = NULL;
-	return FMED_RERR;
+	audio_out *o = ctx;
+	return audio_out_write(o, d);
 }
@@ -4,40 +4,21 @@ Copyright (c) 2017 Simon Zolin */
 #include <fmedia.h>
 
 #include <FF/adev/pulse.h>
+#include <adev/audio-out.h>
 
 
 static const fmed_core *core;
 
-typedef struct pulse_out pulse_out;
-
 typedef struct pulse_mod {
 	ffpulse_buf out;
-	ffpcm fmt;
-	pulse_out *usedby;
-	const fmed_track *track;
-	uint devidx;
-	uint out_valid :1;
+	audio_dev dev;
 	uint init_ok :1;
 } pulse_mod;
 
 static pulse_mod *mod;
 
-struct pulse_out {
-	uint state;
-	size_t dataoff;
-
-	ffpulse_dev dev;
-	uint devidx;
-
-	fftask task;
-	uint stop :1;
-};
-
-enum { I_OPEN, I_DATA };
-
 static struct pulse_out_conf_t {
-	uint idev;
-	uint buflen;
+	struct audio_conf a;
 	uint nfy_rate;
 } pulse_out_conf;
 
@@ -55,7 +36,6 @@ static const fmed_mod fmed_pulse_mod = {
 };
 
 static int pulse_init(fmed_trk *trk);
-static int pulse_create(pulse_out *a, fmed_filt *d);
 
 //OUTPUT
 static void* pulse_open(fmed_filt *d);
@@ -67,12 +47,27 @@ static const fmed_filter fmed_pulse_out = {
 };
 
 static const ffpars_arg pulse_out_conf_args[] = {
-	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct pulse_out_conf_t, idev) },
-	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct pulse_out_conf_t, buflen) },
+	{ "device_index",	FFPARS_TINT,  FFPARS_DSTOFF(struct pulse_out_conf_t, a.idev) },
+	{ "buffer_length",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct pulse_out_conf_t, a.buflen) },
 	{ "notify_rate",	FFPARS_TINT,  FFPARS_DSTOFF(struct pulse_out_conf_t, nfy_rate) },
 };
 
-static void pulse_onplay(void *udata);
+static int pulse_drv_open(audio_dev *dev, uint idev, ffpcm *fmt, uint buflen);
+static void pulse_drv_close(audio_dev *dev);
+static int pulse_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff);
+static int pulse_drv_drain(audio_dev *dev);
+static int pulse_drv_stop(audio_dev *dev);
+static void pulse_drv_clear(audio_dev *dev);
+static void pulse_drv_async(audio_dev *dev, uint enable);
+static size_t pulse_drv_filled(audio_dev *dev);
+static size_t pulse_drv_bufsize(audio_dev *dev);
+static const char* pulse_drv_errstr(int e);
+static const audio_drv pulse_drv = {
+	"pulse",
+	&pulse_drv_open, &pulse_drv_close,
+	&pulse_drv_write, &pulse_drv_drain, &pulse_drv_stop, &pulse_drv_clear, &pulse_drv_async,
+	&pulse_drv_filled, &pulse_drv_bufsize, &pulse_drv_errstr
+};
 
 //ADEV
 static int pulse_adev_list(fmed_adev_ent **ents, uint flags);
@@ -118,7 +113,7 @@ static int pulse_sig(uint signo)
 		if (NULL == (mod = ffmem_new(pulse_mod)))
 			return -1;
 
-		mod->track = core->getmod("#core.track");
+		audio_dev_init(&mod->dev, core, &pulse_drv, &pulse_out_conf.a, &mod->out);
 		return 0;
 	}
 	return 0;
@@ -127,8 +122,7 @@ static int pulse_sig(uint signo)
 static void pulse_destroy(void)
 {
 	if (mod != NULL) {
-		if (mod->out_valid)
-			ffpulse_close(&mod->out);
+		audio_dev_free(&mod->dev);
 		ffmem_free(mod);
 		mod = NULL;
 	}
@@ -210,8 +204,8 @@ static void pulse_adev_listfree(fmed_adev_ent *ents)
 
 static int pulse_out_config(ffpars_ctx *ctx)
 {
-	pulse_out_conf.idev = 0;
-	pulse_out_conf.buflen = 500;
+	pulse_out_conf.a.idev = 0;
+	pulse_out_conf.a.buflen = 500;
 	pulse_out_conf.nfy_rate = 0;
 	ffpars_setargs(ctx, &pulse_out_conf, pulse_out_conf_args, FFCNT(pulse_out_conf_args));
 	return 0;
@@ -219,42 +213,21 @@ static int pulse_out_config(ffpars_ctx *ctx)
 
 static void* pulse_open(fmed_filt *d)
 {
-	pulse_out *a;
+	audio_out *a;
 
 	if (0 != pulse_init(d->trk))
 		return NULL;
 
-	if (NULL == (a = ffmem_new(pulse_out)))
+	if (NULL == (a = ffmem_new(audio_out)))
 		return NULL;
-	a->task.handler = d->handler;
-	a->task.param = d->trk;
+	audio_out_init(a, &mod->dev, d);
 	return a;
 }
 
 static void pulse_close(void *ctx)
 {
-	pulse_out *a = ctx;
-	int r;
-
-	if (mod->usedby == a) {
-		void *trk = a->task.param;
-
-		if (FMED_NULL != mod->track->getval(trk, "stopped")) {
-			ffpulse_close(&mod->out);
-			ffmem_tzero(&mod->out);
-			mod->out_valid = 0;
-
-		} else {
-			if (0 != (r = ffpulse_stop(&mod->out)))
-				errlog(core, trk,  "pulse", "ffpulse_stop(): (%d) %s", r, ffpulse_errstr(r));
-			ffpulse_clear(&mod->out);
-			ffpulse_async(&mod->out, 0);
-		}
-
-		mod->usedby = NULL;
-	}
-
-	ffpulse_devdestroy(&a->dev);
+	audio_out *a = ctx;
+	audio_out_close(a);
 	ffmem_free(a);
 }
 
@@ -271,160 +244,91 @@ static int pulse_devbyidx(ffpulse_dev *d, uint idev, uint flags)
 	return 0;
 }
 
-static int pulse_create(pulse_out *a, fmed_filt *d)
+/** Sample formats the server accepts from a client stream. */
+static int pulse_fmt_supported(uint format)
 {
-	ffpcm fmt;
-	int r, reused = 0;
-
-	if (FMED_NULL == (int)(a->devidx = (int)d->track->getval(d->trk, "playdev_name")))
-		a->devidx = pulse_out_conf.idev;
-
-	ffpcm_fmtcopy(&fmt, &d->audio.convfmt);
-
-	if (mod->out_valid) {
-
-		if (mod->usedby != NULL) {
-			pulse_out *a = mod->usedby;
-			mod->usedby = NULL;
-			a->stop = 1;
-			pulse_onplay(a);
-		}
-
-		if (fmt.channels == mod->fmt.channels
-			&& fmt.format == mod->fmt.format
-			&& fmt.sample_rate == mod->fmt.sample_rate
-			&& mod->devidx == a->devidx) {
-
-			ffpulse_stop(&mod->out);
-			ffpulse_clear(&mod->out);
-			ffpulse_async(&mod->out, 0);
-			reused = 1;
-			goto fin;
-		}
-
-		ffpulse_close(&mod->out);
-		ffmem_tzero(&mod->out);
-		mod->out_valid = 0;
-	}
-
-	if (0 != pulse_devbyidx(&a->dev, a->devidx, FFPULSE_DEV_PLAYBACK)) {
-		errlog(core, d->trk, "pulse", "no audio device by index #%u", a->devidx);
-		goto done;
+	switch (format) {
+	case FFPCM_16:
+	case FFPCM_24:
+	case FFPCM_32:
+	case FFPCM_FLOAT:
+		return 1;
 	}
-
-	mod->out.handler = &pulse_onplay;
-	mod->out.autostart = 1;
-	if (pulse_out_conf.nfy_rate != 0)
-		mod->out.nfy_interval = ffpcm_bytes2time(&fmt, pulse_out_conf.buflen) / pulse_out_conf.nfy_rate;
-	r = ffpulse_open(&mod->out, a->dev.id, &fmt, pulse_out_conf.buflen);
-
-	if (r != 0) {
-		errlog(core, d->trk, "pulse", "ffpulse_open(): (%d) %s", r, ffpulse_errstr(r));
-		goto done;
-	}
-
-	ffpulse_devdestroy(&a->dev);
-	mod->out_valid = 1;
-	mod->fmt = fmt;
-	mod->devidx = a->devidx;
-
-fin:
-	mod->out.udata = a;
-	mod->usedby = a;
-	dbglog(core, d->trk, "pulse", "%s buffer %ums, %uHz"
-		, reused ? "reused" : "opened", ffpcm_bytes2time(&fmt, ffpulse_bufsize(&mod->out))
-		, fmt.sample_rate);
 	return 0;
-
-done:
-	return FMED_RERR;
-}
-
-static void pulse_onplay(void *udata)
-{
-	pulse_out *a = udata;
-	core->task(&a->task, FMED_TASK_POST);
 }
 
-static int pulse_write(void *ctx, fmed_filt *d)
+static int pulse_drv_open(audio_dev *dev, uint idev, ffpcm *fmt, uint buflen)
 {
-	pulse_out *a = ctx;
+	ffpulse_buf *out = dev->out;
+	ffpulse_dev pdev;
 	int r;
 
-	switch (a->state) {
-	case I_OPEN:
-		d->audio.convfmt.ileaved = 1;
-		if (0 != (r = pulse_create(a, d)))
-			return r;
-		a->state = I_DATA;
-		return FMED_RMORE;
-
-	case I_DATA:
-		break;
+	if (!pulse_fmt_supported(fmt->format)) {
+		fmt->format = FFPCM_FLOAT;
+		return AUDIO_EFORMAT;
 	}
 
-	if (a->stop || (d->flags & FMED_FSTOP)) {
-		d->outlen = 0;
-		return FMED_RDONE;
-	}
+	if (0 != pulse_devbyidx(&pdev, idev, FFPULSE_DEV_PLAYBACK))
+		return AUDIO_EDEV;
 
-	if (d->snd_output_clear) {
-		d->snd_output_clear = 0;
-		ffpulse_stop(&mod->out);
-		ffpulse_clear(&mod->out);
-		ffpulse_async(&mod->out, 0);
-		a->dataoff = 0;
-		return FMED_RMORE;
-	}
-
-	if (d->snd_output_pause) {
-		d->snd_output_pause = 0;
-		d->track->cmd(d->trk, FMED_TRACK_PAUSE);
-		ffpulse_stop(&mod->out);
-		ffpulse_async(&mod->out, 0);
-		return FMED_RMORE;
-	}
+	out->handler = &audio_onplay;
+	out->udata = dev;
+	out->autostart = 1;
+	if (pulse_out_conf.nfy_rate != 0)
+		out->nfy_interval = ffpcm_bytes2time(fmt, buflen) / pulse_out_conf.nfy_rate;
+	r = ffpulse_open(out, pdev.id, fmt, buflen);
+	ffpulse_devdestroy(&pdev);
+	return r;
+}
 
-	while (d->datalen != 0) {
+static void pulse_drv_close(audio_dev *dev)
+{
+	ffpulse_close((ffpulse_buf*)dev->out);
+	ffmem_tzero((ffpulse_buf*)dev->out);
+}
 
-		r = ffpulse_write(&mod->out, d->data, d->datalen, a->dataoff);
-		if (r < 0) {
-			errlog(core, d->trk, "pulse", "ffpulse_write(): (%d) %s", r, ffpulse_errstr(r));
-			goto err;
+static int pulse_drv_write(audio_dev *dev, const void *data, size_t len, size_t dataoff)
+{
+	return ffpulse_write((ffpulse_buf*)dev->out, data, len, dataoff);
+}
 
-		} else if (r == 0) {
-			ffpulse_async(&mod->out, 1);
-			return FMED_RASYNC;
-		}
+static int pulse_drv_drain(audio_dev *dev)
+{
+	return ffpulse_drain((ffpulse_buf*)dev->out);
+}
 
-		a->dataoff += r;
-		d->datalen -= r;
-		dbglog(core, d->trk, "pulse", "written %u bytes (%u%% filled)"
-			, r, ffpulse_filled(&mod->out) * 100 / ffpulse_bufsize(&mod->out));
-	}
+static int pulse_drv_stop(audio_dev *dev)
+{
+	return ffpulse_stop((ffpulse_buf*)dev->out);
+}
 
-	a->dataoff = 0;
+static void pulse_drv_clear(audio_dev *dev)
+{
+	ffpulse_clear((ffpulse_buf*)dev->out);
+}
 
-	if ((d->flags & FMED_FLAST) && d->datalen == 0) {
+static void pulse_drv_async(audio_dev *dev, uint enable)
+{
+	ffpulse_async((ffpulse_buf*)dev->out, enable);
+}
 
-		r = ffpulse_drain(&mod->out);
-		if (r == 1)
-			return FMED_RDONE;
-		else if (r < 0) {
-			errlog(core, d->trk,  "pulse", "ffpulse_drain(): (%d) %s", r, ffpulse_errstr(r));
-			goto err;
-		}
+static size_t pulse_drv_filled(audio_dev *dev)
+{
+	return ffpulse_filled((ffpulse_buf*)dev->out);
+}
 
-		ffpulse_async(&mod->out, 1);
-		return FMED_RASYNC; //wait until all filled bytes are played
-	}
+static size_t pulse_drv_bufsize(audio_dev *dev)
+{
+	return ffpulse_bufsize((ffpulse_buf*)dev->out);
+}
 
-	return FMED_ROK;
+static const char* pulse_drv_errstr(int e)
+{
+	return ffpulse_errstr(e);
+}
 
-err:
-	ffpulse_close(&mod->out);
-	ffmem_tzero(&mod->out);
-	mod->out_valid = 0;
-	mod->usedby = NULL;
-	return FMED_RERR;
+static int pulse_write(void *ctx, fmed_filt *d)
+{
+	audio_out *a = ctx;
+	return audio_out_write(a, d);
 }
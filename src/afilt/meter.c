@@ -0,0 +1,500 @@
+/** Real-time peak/RMS/true-peak meter exported via shared memory.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+INPUT -> DECODER -> meter.tap -> ... -> OUTPUT
+meter.tap passes data through unchanged.  For every 'window' msec of audio it computes per-channel values
+ and publishes them into a ring of slots in a memory-mapped file (/dev/shm/fmedia-meter-PID).
+Each process has its own file which is removed on exit.
+The tracks of one process share the ring: a slot has the ID of the track it belongs to.
+
+File layout:
+	struct meter_hdr
+	struct meter_slot[nslots]
+
+Writer (one slot):  slot.seq = odd;  write values;  slot.seq = even;  hdr.seq++
+ Writers are serialized with a lock, because tracks may be processed in worker threads.
+Reader:  i = (hdr.seq - 1) % nslots;  s1 = slot[i].seq;  copy slot[i];  s2 = slot[i].seq;
+ the copy is valid if s1 == s2 and s1 is even.
+No system calls or locks are needed to read the values: a reader just polls the mapped memory.
+To follow one track a reader walks back from the latest slot to the newest one with the needed 'track'.
+
+Values are linear: 1.0 is the full scale (0dBFS).
+True peak is estimated by 4x oversampling with a windowed-sinc interpolation filter.
+*/
+
+#include <fmedia.h>
+
+#include <FF/audio/pcm.h>
+#include <FF/array.h>
+#include <FFOS/atomic.h>
+#include <FFOS/error.h>
+#include <FFOS/file.h>
+
+#include <sys/mman.h>
+#include <math.h>
+
+
+#undef dbglog
+#undef errlog
+#undef syserrlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "meter", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "meter", __VA_ARGS__)
+#define syserrlog(trk, ...)  fmed_syserrlog(core, trk, "meter", __VA_ARGS__)
+
+
+static const fmed_core *core;
+
+enum {
+	METER_MAXCH = 8,
+	METER_VER = 2,
+	TP_PHASES = 4, //oversampling factor
+	TP_TAPS = 12, //interpolation filter length
+	TP_HIST = TP_TAPS - 1,
+};
+
+/** Shared memory header. */
+struct meter_hdr {
+	char magic[4]; //"fmtr"
+	uint version;
+	uint pid; //writer process ID
+	uint nslots;
+	uint slot_size;
+	uint64 seq; //number of slots written;  the latest slot index is (seq - 1) % nslots
+};
+
+/** Values for one window. */
+struct meter_slot {
+	uint64 seq; //odd while the slot is being written
+	uint64 pos; //position of the window (in samples)
+	uint sample_rate;
+	uint channels;
+	uint samples;
+	uint track; //track ID within the process, starting at 1
+	float peak[METER_MAXCH];
+	float rms[METER_MAXCH];
+	float tpeak[METER_MAXCH];
+};
+
+static struct meter_conf_t {
+	char *file;
+	uint window; //msec
+	uint nslots;
+} conf;
+
+/** The shared memory is opened once and used by all tracks. */
+static struct meter_shm {
+	fflk lk;
+	fffd fd;
+	ffarr fn; //"FILE-PID"
+	struct meter_hdr *hdr;
+	size_t size;
+	uint64 seq;
+	uint ntracks;
+} shm = { .fd = FF_BADFD };
+
+/** Interpolation filter coefficients: [phase][tap]. */
+static float tp_coef[TP_PHASES][TP_TAPS];
+
+//FMEDIA MODULE
+static const void* meter_iface(const char *name);
+static int meter_sig(uint signo);
+static void meter_destroy(void);
+static int meter_mconf(const char *name, ffpars_ctx *ctx);
+static const fmed_mod fmed_meter_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&meter_iface, &meter_sig, &meter_destroy, &meter_mconf
+};
+
+//TAP
+static void* meter_open(fmed_filt *d);
+static int meter_process(void *ctx, fmed_filt *d);
+static void meter_close(void *ctx);
+static int meter_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_meter_tap = {
+	&meter_open, &meter_process, &meter_close
+};
+
+static const ffpars_arg meter_conf_args[] = {
+	{ "file",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY | FFPARS_FNOTEMPTY,  FFPARS_DSTOFF(struct meter_conf_t, file) },
+	{ "window",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct meter_conf_t, window) },
+	{ "slots",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct meter_conf_t, nslots) },
+};
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	core = _core;
+	return &fmed_meter_mod;
+}
+
+
+static const void* meter_iface(const char *name)
+{
+	if (ffsz_eq(name, "tap"))
+		return &fmed_meter_tap;
+	return NULL;
+}
+
+static int meter_mconf(const char *name, ffpars_ctx *ctx)
+{
+	if (ffsz_eq(name, "tap"))
+		return meter_conf(ctx);
+	return -1;
+}
+
+/** Hann-windowed sinc filter for interpolation at positions between the two middle taps. */
+static void tp_init(void)
+{
+	uint p, k;
+	double x;
+	for (p = 0;  p != TP_PHASES;  p++) {
+		for (k = 0;  k != TP_TAPS;  k++) {
+			x = (double)k - (TP_TAPS / 2 - 1) - (double)p / TP_PHASES;
+			if (x == 0) {
+				tp_coef[p][k] = 1;
+				continue;
+			}
+			tp_coef[p][k] = sin(M_PI * x) / (M_PI * x)
+				* (0.5 + 0.5 * cos(M_PI * x / (TP_TAPS / 2)));
+		}
+	}
+}
+
+static int meter_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT:
+		ffmem_init();
+		return 0;
+
+	case FMED_OPEN:
+		tp_init();
+		fflk_init(&shm.lk);
+		return 0;
+	}
+	return 0;
+}
+
+static void meter_destroy(void)
+{
+	if (shm.hdr != NULL) {
+		munmap(shm.hdr, shm.size);
+		shm.hdr = NULL;
+	}
+	if (shm.fd != FF_BADFD) {
+		fffile_close(shm.fd);
+		shm.fd = FF_BADFD;
+		if (0 != fffile_rm(shm.fn.ptr))
+			syserrlog(NULL, "fffile_rm(): %s", shm.fn.ptr);
+	}
+	ffarr_free(&shm.fn);
+	ffmem_safefree0(conf.file);
+}
+
+static int meter_conf(ffpars_ctx *ctx)
+{
+	conf.file = NULL;
+	conf.window = 10;
+	conf.nslots = 64;
+	ffpars_setargs(ctx, &conf, meter_conf_args, FFCNT(meter_conf_args));
+	return 0;
+}
+
+/** Create the shared memory file for this process and map it.
+Must be called with the lock held. */
+static int shm_open1(void *trk)
+{
+	const char *fn;
+	struct meter_hdr *h;
+
+	if (shm.hdr != NULL)
+		return 0;
+
+	shm.fn.len = 0;
+	if (0 == ffstr_catfmt(&shm.fn, "%s-%u%Z"
+		, (conf.file != NULL) ? conf.file : "/dev/shm/fmedia-meter", (uint)getpid())) {
+		errlog(trk, "%s", ffmem_alloc_S);
+		return -1;
+	}
+	fn = shm.fn.ptr;
+
+	shm.size = sizeof(struct meter_hdr) + conf.nslots * sizeof(struct meter_slot);
+	if (FF_BADFD == (shm.fd = fffile_open(fn, O_CREAT | O_TRUNC | O_RDWR))) {
+		syserrlog(trk, "%s: %s", fffile_open_S, fn);
+		return -1;
+	}
+	if (0 != ftruncate(shm.fd, shm.size)) {
+		syserrlog(trk, "ftruncate(): %s", fn);
+		goto err;
+	}
+	if (MAP_FAILED == (h = mmap(NULL, shm.size, PROT_READ | PROT_WRITE, MAP_SHARED, shm.fd, 0))) {
+		syserrlog(trk, "mmap(): %s", fn);
+		goto err;
+	}
+
+	ffmem_zero(h, shm.size);
+	ffmemcpy(h->magic, "fmtr", 4);
+	h->version = METER_VER;
+	h->pid = getpid();
+	h->nslots = conf.nslots;
+	h->slot_size = sizeof(struct meter_slot);
+	shm.hdr = h;
+	dbglog(trk, "%s: %L bytes, %u slots", fn, shm.size, conf.nslots);
+	return 0;
+
+err:
+	fffile_close(shm.fd);
+	shm.fd = FF_BADFD;
+	fffile_rm(fn);
+	return -1;
+}
+
+/** Publish the values for one window. */
+static void shm_put(const struct meter_slot *v)
+{
+	struct meter_slot *s = (void*)(shm.hdr + 1);
+
+	fflk_lock(&shm.lk);
+	s += shm.seq % conf.nslots;
+
+	*(volatile uint64*)&s->seq = shm.seq * 2 + 1;
+	ffatom_fence_rel();
+	s->pos = v->pos;
+	s->sample_rate = v->sample_rate;
+	s->channels = v->channels;
+	s->samples = v->samples;
+	s->track = v->track;
+	ffmemcpy(s->peak, v->peak, sizeof(s->peak));
+	ffmemcpy(s->rms, v->rms, sizeof(s->rms));
+	ffmemcpy(s->tpeak, v->tpeak, sizeof(s->tpeak));
+	ffatom_fence_rel();
+	*(volatile uint64*)&s->seq = shm.seq * 2 + 2;
+
+	shm.seq++;
+	ffatom_fence_rel();
+	*(volatile uint64*)&shm.hdr->seq = shm.seq;
+	fflk_unlock(&shm.lk);
+}
+
+
+typedef struct meter {
+	ffpcmex fmt;
+	uint nch;
+	uint track; //ID in meter_slot.track
+	uint window; //samples
+	ffarr fbuf; //float[]: interleaved input converted to float
+	float *ch[METER_MAXCH]; //TP_HIST samples from the previous block, then the current block
+	size_t cap; //samples per channel in 'ch'
+
+	// the current window:
+	uint n;
+	float peak[METER_MAXCH], tpeak[METER_MAXCH];
+	double sum[METER_MAXCH]; //sum of squares
+	uint64 pos;
+} meter;
+
+static void* meter_open(fmed_filt *d)
+{
+	meter *m;
+	ffpcmex f;
+
+	if (d->audio.fmt.channels > METER_MAXCH) {
+		errlog(d->trk, "channels: %u: unsupported", d->audio.fmt.channels);
+		return FMED_FILT_SKIP;
+	}
+	f = d->audio.fmt;
+	f.format = FFPCM_FLOAT;
+	f.ileaved = 1;
+	if (0 != ffpcm_convert(&f, NULL, &d->audio.fmt, NULL, 0)) {
+		errlog(d->trk, "format: %s: unsupported", ffpcm_fmtstr(d->audio.fmt.format));
+		return FMED_FILT_SKIP;
+	}
+	if (NULL == (m = ffmem_new(meter)))
+		return NULL;
+
+	fflk_lock(&shm.lk);
+	if (0 != shm_open1(d->trk)) {
+		fflk_unlock(&shm.lk);
+		ffmem_free(m);
+		return FMED_FILT_SKIP;
+	}
+	m->track = ++shm.ntracks;
+	fflk_unlock(&shm.lk);
+
+	m->fmt = d->audio.fmt;
+	m->nch = m->fmt.channels;
+	m->window = ffmax(ffpcm_samples(conf.window, m->fmt.sample_rate), 1);
+	return m;
+}
+
+static void meter_close(void *ctx)
+{
+	meter *m = ctx;
+	uint i;
+	ffarr_free(&m->fbuf);
+	for (i = 0;  i != m->nch;  i++) {
+		ffmem_safefree(m->ch[i]);
+	}
+	ffmem_free(m);
+}
+
+/** Grow per-channel buffers keeping the history samples. */
+static int meter_grow(meter *m, size_t samples)
+{
+	uint i;
+	float *p;
+	if (TP_HIST + samples <= m->cap)
+		return 0;
+	for (i = 0;  i != m->nch;  i++) {
+		if (NULL == (p = ffmem_realloc(m->ch[i], (TP_HIST + samples) * sizeof(float))))
+			return -1;
+		if (m->ch[i] == NULL)
+			ffmem_zero(p, TP_HIST * sizeof(float));
+		m->ch[i] = p;
+	}
+	m->cap = TP_HIST + samples;
+	return 0;
+}
+
+/*
+The loops below work on contiguous float arrays without branches,
+ so the compiler can vectorize them. */
+
+static float peak_f(const float *d, size_t n)
+{
+	size_t i;
+	float mx = 0, v;
+	for (i = 0;  i != n;  i++) {
+		v = fabsf(d[i]);
+		mx = (v > mx) ? v : mx;
+	}
+	return mx;
+}
+
+static double sumsq_f(const float *d, size_t n)
+{
+	size_t i;
+	double sum = 0;
+	for (i = 0;  i != n;  i++) {
+		sum += (double)d[i] * d[i];
+	}
+	return sum;
+}
+
+/** Get the maximum absolute value of interpolated samples.
+d: TP_HIST samples before the first one are valid */
+static float tpeak_f(const float *d, size_t n)
+{
+	size_t i;
+	uint p, k;
+	float mx = 0, y;
+	d -= TP_HIST;
+	for (i = 0;  i != n;  i++) {
+		for (p = 1;  p != TP_PHASES;  p++) {
+			y = 0;
+			for (k = 0;  k != TP_TAPS;  k++) {
+				y += d[i + k] * tp_coef[p][k];
+			}
+			y = fabsf(y);
+			mx = (y > mx) ? y : mx;
+		}
+	}
+	return mx;
+}
+
+/** Process samples [off..off+n) of the current block. */
+static void meter_update(meter *m, size_t off, size_t n)
+{
+	uint i;
+	float pk, tp;
+	for (i = 0;  i != m->nch;  i++) {
+		const float *d = m->ch[i] + TP_HIST + off;
+		pk = peak_f(d, n);
+		m->peak[i] = ffmax(m->peak[i], pk);
+		tp = ffmax(tpeak_f(d, n), pk);
+		m->tpeak[i] = ffmax(m->tpeak[i], tp);
+		m->sum[i] += sumsq_f(d, n);
+	}
+	m->n += n;
+}
+
+static void meter_publish(meter *m)
+{
+	struct meter_slot s = {0};
+	uint i;
+
+	s.pos = m->pos;
+	s.sample_rate = m->fmt.sample_rate;
+	s.channels = m->nch;
+	s.samples = m->n;
+	s.track = m->track;
+	for (i = 0;  i != m->nch;  i++) {
+		s.peak[i] = m->peak[i];
+		s.tpeak[i] = m->tpeak[i];
+		s.rms[i] = sqrt(m->sum[i] / m->n);
+	}
+	shm_put(&s);
+
+	m->pos += m->n;
+	m->n = 0;
+	ffmem_zero(m->peak, sizeof(m->peak));
+	ffmem_zero(m->tpeak, sizeof(m->tpeak));
+	ffmem_zero(m->sum, sizeof(m->sum));
+}
+
+static int meter_process(void *ctx, fmed_filt *d)
+{
+	meter *m = ctx;
+	size_t samples, off, n, i;
+	uint ich;
+	const float *f;
+	ffpcmex f32;
+
+	samples = d->datalen / ffpcm_size1(&m->fmt);
+	if (samples == 0)
+		goto done;
+
+	if (NULL == ffarr_realloc(&m->fbuf, samples * m->nch * sizeof(float))
+		|| 0 != meter_grow(m, samples)) {
+		errlog(d->trk, "%s", ffmem_alloc_S);
+		return FMED_RERR;
+	}
+
+	// convert to float, deinterleave
+	f32 = m->fmt;
+	f32.format = FFPCM_FLOAT;
+	f32.ileaved = 1;
+	if (0 != ffpcm_convert(&f32, m->fbuf.ptr, &m->fmt, d->data, samples))
+		return FMED_RERR;
+	f = (void*)m->fbuf.ptr;
+	for (ich = 0;  ich != m->nch;  ich++) {
+		float *dst = m->ch[ich] + TP_HIST;
+		for (i = 0;  i != samples;  i++) {
+			dst[i] = f[i * m->nch + ich];
+		}
+	}
+
+	for (off = 0;  off != samples;  off += n) {
+		n = ffmin(samples - off, m->window - m->n);
+		meter_update(m, off, n);
+		if (m->n == m->window)
+			meter_publish(m);
+	}
+
+	// keep the last samples for interpolation
+	for (ich = 0;  ich != m->nch;  ich++) {
+		ffmemmove(m->ch[ich], m->ch[ich] + samples, TP_HIST * sizeof(float));
+	}
+
+done:
+	if ((d->flags & FMED_FLAST) && m->n != 0)
+		meter_publish(m);
+
+	d->out = d->data;
+	d->outlen = d->datalen;
+	d->datalen = 0;
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_ROK;
+}
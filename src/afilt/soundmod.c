@@ -29,9 +29,10 @@ enum {
 static const void* sndmod_iface(const char *name);
 static int sndmod_sig(uint signo);
 static void sndmod_destroy(void);
+static int sndmod_conf(const char *name, ffpars_ctx *ctx);
 static const fmed_mod fmed_sndmod_mod = {
 	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
-	&sndmod_iface, &sndmod_sig, &sndmod_destroy
+	&sndmod_iface, &sndmod_sig, &sndmod_destroy, &sndmod_conf
 };
 
 //CONVERTER
@@ -83,6 +84,25 @@ static const fmed_filter fmed_sndmod_rtpeak = {
 	&sndmod_rtpeak_open, &sndmod_rtpeak_process, &sndmod_rtpeak_close
 };
 
+//DRIFT COMPENSATION
+static void* drift_open(fmed_filt *d);
+static int drift_process(void *ctx, fmed_filt *d);
+static void drift_close(void *ctx);
+static int drift_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_sndmod_drift = {
+	&drift_open, &drift_process, &drift_close
+};
+
+static struct drift_conf_t {
+	uint max_ppm;
+	uint settle; //sec
+} conf_drift;
+
+static const ffpars_arg drift_conf_args[] = {
+	{ "max_correction",	FFPARS_TINT,  FFPARS_DSTOFF(struct drift_conf_t, max_ppm) },
+	{ "settle",	FFPARS_TINT,  FFPARS_DSTOFF(struct drift_conf_t, settle) },
+};
+
 //SILENCE GEN
 static void* silgen_open(fmed_filt *d);
 static void silgen_close(void *ctx);
@@ -109,6 +129,7 @@ static const struct submod submods[] = {
 	{ "until", &fmed_sndmod_until },
 	{ "peaks", &fmed_sndmod_peaks },
 	{ "rtpeak", &fmed_sndmod_rtpeak },
+	{ "drift", &fmed_sndmod_drift },
 	{ "silgen", &sndmod_silgen },
 };
 
@@ -131,6 +152,13 @@ static void sndmod_destroy(void)
 {
 }
 
+static int sndmod_conf(const char *name, ffpars_ctx *ctx)
+{
+	if (ffsz_eq(name, "drift"))
+		return drift_conf(ctx);
+	return -1;
+}
+
 
 static void* sndmod_conv_open(fmed_filt *d)
 {
@@ -324,7 +352,8 @@ struct autoconv {
 static void* autoconv_open(fmed_filt *d)
 {
 	if (d->stream_copy) {
-		if (ffsz_eq(d->datatype, "pcm")) {
+		if (ffsz_eq(d->datatype, "pcm")
+			&& !!ffmemcmp(&d->audio.fmt, &d->audio.convfmt, sizeof(ffpcmex))) {
 			errlog(core, d->trk, "#soundmod.autoconv", "decoder doesn't support --stream-copy", 0);
 			return NULL;
 		}
@@ -476,7 +505,7 @@ static int sndmod_untl_process(void *ctx, fmed_filt *d)
 	if (FMED_NULL == (int64)(pos = d->audio.pos))
 		return FMED_RDONE;
 
-	if (d->stream_copy) {
+	if (d->stream_copy && !ffsz_eq(d->datatype, "pcm")) {
 		if (d->audio.pos >= u->until) {
 			dbglog(core, d->trk, "until", "reached sample #%U", u->until);
 			d->outlen = 0;
@@ -651,6 +680,176 @@ static int sndmod_rtpeak_process(void *ctx, fmed_filt *d)
 }
 
 
+/*
+The playback latency (device buffer + network buffer) is measured after each block
+ ("output_latency" from the audio output, "net_buffer_ms" from the network input).
+After 'settle' seconds, its smoothed value becomes the target:
+ when the latency grows (the source clock is faster than the device clock),
+ input is consumed slightly faster by the linear interpolation resampler, and vice versa.
+100ms of latency error corresponds to 0.1% correction, limited by 'max_correction'. */
+
+struct drift {
+	uint state;
+	ffpcmex fmt;
+	uint nch;
+	uint sampsize;
+	ffarr buf;
+	float prev[8]; //the last frame of the previous block
+	double pos; //position of the next output frame (-1: 'prev')
+	double ratio; //input frames per output frame
+	double lat, target; //msec
+	uint64 nsamples;
+	uint settled :1;
+};
+
+static int drift_conf(ffpars_ctx *ctx)
+{
+	conf_drift.max_ppm = 1000;
+	conf_drift.settle = 10;
+	ffpars_setargs(ctx, &conf_drift, drift_conf_args, FFCNT(drift_conf_args));
+	return 0;
+}
+
+static void* drift_open(fmed_filt *d)
+{
+	struct drift *c;
+	if (NULL == (c = ffmem_new(struct drift)))
+		return NULL;
+	c->ratio = 1;
+	return c;
+}
+
+static void drift_close(void *ctx)
+{
+	struct drift *c = ctx;
+	ffarr_free(&c->buf);
+	ffmem_free(c);
+}
+
+/** Update resampling ratio from the current latency. */
+static void drift_adjust(struct drift *c, fmed_filt *d)
+{
+	int64 out_ms, in_ms;
+	double lat, corr, max;
+
+	out_ms = d->track->getval(d->trk, "output_latency");
+	in_ms = d->track->getval(d->trk, "net_buffer_ms");
+	if (out_ms == FMED_NULL && in_ms == FMED_NULL)
+		return;
+	lat = ((out_ms != FMED_NULL) ? out_ms : 0) + ((in_ms != FMED_NULL) ? in_ms : 0);
+	c->lat = (c->nsamples == 0) ? lat : c->lat + (lat - c->lat) / 64;
+
+	if (!c->settled) {
+		if (ffpcm_time(c->nsamples, c->fmt.sample_rate) < conf_drift.settle * 1000)
+			return;
+		c->settled = 1;
+		c->target = c->lat;
+		dbglog(core, d->trk, "drift", "target latency: %ums", (uint)c->target);
+		return;
+	}
+
+	max = (double)conf_drift.max_ppm / 1000000;
+	corr = (c->lat - c->target) / 100000;
+	corr = ffmax(corr, -max);
+	corr = ffmin(corr, max);
+	c->ratio = 1 + corr;
+}
+
+static FFINL float drift_get(struct drift *c, const void *data, size_t i)
+{
+	if (c->fmt.format == FFPCM_16)
+		return ((short*)data)[i];
+	return ((float*)data)[i];
+}
+
+static FFINL void drift_put(struct drift *c, void *data, size_t i, float val)
+{
+	if (c->fmt.format == FFPCM_16) {
+		int n = (int)(val + ((val < 0) ? -0.5f : 0.5f));
+		((short*)data)[i] = (short)ffmin(ffmax(n, -0x8000), 0x7fff);
+		return;
+	}
+	((float*)data)[i] = val;
+}
+
+static int drift_process(void *ctx, fmed_filt *d)
+{
+	struct drift *c = ctx;
+	size_t n, i, k;
+	uint ich;
+	double x, frac;
+	float a, b;
+
+	switch (c->state) {
+	case 0:
+		// let the output filter set the conversion format
+		c->state = 1;
+		d->out = d->data,  d->outlen = d->datalen;
+		return FMED_RDATA;
+
+	case 1:
+		if (d->datalen == 0 && !(d->flags & FMED_FLAST))
+			return FMED_RMORE;
+
+		c->fmt = d->audio.convfmt;
+		c->nch = c->fmt.channels & FFPCM_CHMASK;
+		if (!c->fmt.ileaved || c->nch > FFCNT(c->prev)
+			|| !(c->fmt.format == FFPCM_16 || c->fmt.format == FFPCM_FLOAT)) {
+			dbglog(core, d->trk, "drift", "unsupported format: %s/%u/%s"
+				, ffpcm_fmtstr(c->fmt.format), c->nch, (c->fmt.ileaved) ? "i" : "ni");
+			d->out = d->data,  d->outlen = d->datalen;
+			return FMED_RDONE;
+		}
+		c->sampsize = ffpcm_size1(&c->fmt);
+		c->state = 2;
+		break;
+	}
+
+	drift_adjust(c, d);
+
+	n = d->datalen / c->sampsize;
+	c->nsamples += n;
+
+	if (c->ratio == 1 && c->pos == 0) {
+		// no correction is needed
+		d->out = d->data,  d->outlen = d->datalen;
+		goto done;
+	}
+
+	if (NULL == ffarr_realloc(&c->buf, (size_t)(n / (1 - (double)conf_drift.max_ppm / 1000000) + 2) * c->sampsize)) {
+		errlog(core, d->trk, "drift", "%s", ffmem_alloc_S);
+		return FMED_RERR;
+	}
+
+	// input frame #i is at position i+1;  position 0 is the last frame of the previous block
+	for (k = 0;  ;  k++) {
+		x = c->pos + 1;
+		i = (size_t)x;
+		if (i >= n || (k + 1) * c->sampsize > c->buf.cap)
+			break;
+		frac = x - i;
+		for (ich = 0;  ich != c->nch;  ich++) {
+			a = (i == 0) ? c->prev[ich] : drift_get(c, d->data, (i - 1) * c->nch + ich);
+			b = drift_get(c, d->data, i * c->nch + ich);
+			drift_put(c, c->buf.ptr, k * c->nch + ich, a + (b - a) * frac);
+		}
+		c->pos += c->ratio;
+	}
+	c->pos -= n;
+	d->out = c->buf.ptr,  d->outlen = k * c->sampsize;
+
+done:
+	if (n != 0) {
+		for (ich = 0;  ich != c->nch;  ich++) {
+			c->prev[ich] = drift_get(c, d->data, (n - 1) * c->nch + ich);
+		}
+	}
+	d->datalen = 0;
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_ROK;
+}
+
 struct silgen {
 	uint state;
 	void *buf;
@@ -0,0 +1,1599 @@
+/** Split PCM data into several tracks processed in parallel.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+                                     -> split.in -> ENCODER -> OUTPUT  (worker thread #1)
+INPUT -> DECODER -> split.cue|split.tee -> split.in -> ENCODER -> OUTPUT  (worker thread #2)
+                                     -> ...
+split.cue: each child track gets its own time range of the input
+split.tee: each child track gets all data and writes it to its own output file
+split.vad: a child track is created when the signal is above threshold, it gets pre-roll data first;
+ the capture track never waits for it: the data that doesn't fit into the buffer is dropped
+
+Monitoring (--record --monitor): split.tee also passes data to a child track which plays it via audio device.
+The capture clock drives both sides: the parent never waits for the monitor track,
+ the data that doesn't fit into its buffer is dropped.
+The monitor track starts playing when its buffer has 'monitor_latency' msec of data;
+ if the device is slower than the capture clock and the buffer grows to twice as much,
+ the oldest data is skipped to return to the initial latency.
+
+INPUT -> DECODER -> split.seg -> mpeg.out -> OUTPUT
+                    <- split.in -> mpeg.encode -> split.segout  (worker thread #1)
+                    <- split.in -> mpeg.encode -> split.segout  (worker thread #2)
+split.seg: each child track encodes a segment of the input (with overlap),
+ the encoded segments are joined into one stream.
+Segments are joined at a frame which doesn't use bit reservoir (main_data_begin = 0).
+If there's no such frame in the overlap, parallel encoding is abandoned:
+ the segments from the failed join onwards are discarded,
+ and one child track encodes the rest of the input, starting at the beginning of the segment being written.
+The encoder is deterministic, so its frames up to the previous join are the same as the segment's,
+ and the output continues from the same frame.
+For this, the parent keeps the input data since the beginning of the segment being written.
+The rest of the output is written when this track finishes.
+*/
+
+#include <fmedia.h>
+
+#include <FF/audio/pcm.h>
+#include <FF/array.h>
+#include <FFOS/atomic.h>
+#include <FFOS/error.h>
+
+
+#undef dbglog
+#undef errlog
+#undef warnlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "split", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "split", __VA_ARGS__)
+#define warnlog(trk, ...)  fmed_warnlog(core, trk, "split", __VA_ARGS__)
+
+
+static const fmed_core *core;
+static const fmed_queue *qu;
+
+struct split_conf_t {
+	uint buf_size; //msec
+};
+static struct split_conf_t conf_cue;
+
+static struct splittee_conf_t {
+	uint buf_size; //msec
+	uint mon_latency; //msec
+} conf_tee;
+
+static struct splitseg_conf_t {
+	uint buf_size; //msec
+	uint seg_len; //sec
+	uint overlap; //msec
+} conf_seg;
+
+static struct splitvad_conf_t {
+	uint buf_size; //msec
+	uint preroll; //msec
+	float threshold; //dB
+	uint silence; //sec
+} conf_vad;
+
+/** Ring buffer shared between the parent track and a child track. */
+typedef struct split_buf {
+	fflk lk;
+	char *ptr;
+	size_t cap;
+	size_t off; //read offset
+	size_t len; //number of filled bytes
+	size_t taken; //number of bytes returned to the child track
+	uint64 pos; //samples
+
+	fftask *ptask; //parent track's task
+	fmed_handler handler; //child track's handler
+	void *trk;
+	uint sampsize;
+	uint nref;
+	ffarr out; //data returned by the child track
+
+	// monitor:
+	size_t prefill; //bytes the child track waits for before it starts reading
+	size_t maxfill; //bytes;  the excess is skipped
+	uint64 nskipped; //bytes
+
+	uint fin :1 //no more input data
+		, nowait :1 //don't make the parent track wait for free space
+		, started :1 //the child track has started reading
+		, wait_in :1 //the child track waits for more data
+		, wait_out :1 //the parent track waits for free space
+		, parent_closed :1
+		, child_closed :1;
+} split_buf;
+
+typedef struct split_out {
+	split_buf *sb;
+	fmed_que_entry *qent;
+	char *fn; //output file name;  NULL: use parent's "output"
+	size_t off; //tee: number of bytes of the current input block passed to the child track
+	uint64 from, to; //samples;  to=0: until the end
+	ffarr enc; //seg: encoded data
+	ffarr frames; //seg: uint[]: offsets of MPEG frames in 'enc'
+	uint64 nlost; //monitor, vad: bytes not passed to the child track
+	uint done :1
+		, monitor :1 //the child track plays data via audio device
+		, nowait :1 //vad: don't wait for the child track, drop the data it can't take
+		, fin :1 //seg: all input data is passed to the child track
+		, parsed :1 //seg: 'frames' is filled
+		, discard :1; //seg: the output isn't used
+} split_out;
+
+typedef struct split_ctx {
+	uint state;
+	fftask task;
+	ffarr outs; //split_out[]
+	uint iout; //the current output
+	uint nactive; //number of active child tracks
+	uint maxactive;
+	uint64 pos;
+	ffpcmex fmt;
+	uint sampsize;
+	uint buf_size; //msec
+
+	// seg:
+	const char *encoder;
+	uint seglen, overlap, spf; //samples
+	uint iwrite; //the segment being written
+	uint wframe, wend; //the current and the last+1 frames of the segment being written
+	uint wnext; //the first frame of the next segment
+	ffarr hist; //input data since the beginning of the segment being written
+	uint64 hist_from; //samples
+	size_t hist_off; //the data from 'hist' passed to the serial track
+	uint wend_ok :1
+		, fin_input :1
+		, serial :1 //the rest of the input is encoded by one child track
+		, replay :1; //'hist' is being passed to the serial track
+
+	// vad:
+	ffarr preroll; //ring buffer
+	split_buf *vad_sb; //buffer for the next child track, allocated in advance
+	size_t proff; //write offset
+	uint silence; //samples below threshold
+	uint silence_max;
+	uint64 nfiles;
+} split_ctx;
+
+//FMEDIA MODULE
+static const void* split_iface(const char *name);
+static int split_conf(const char *name, ffpars_ctx *ctx);
+static int split_sig(uint signo);
+static void split_destroy(void);
+static const fmed_mod fmed_split_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&split_iface, &split_sig, &split_destroy, &split_conf
+};
+
+static void split_close(void *ctx);
+
+//CUE
+static void* splitcue_open(fmed_filt *d);
+static int splitcue_process(void *ctx, fmed_filt *d);
+static int splitcue_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_split_cue = {
+	&splitcue_open, &splitcue_process, &split_close
+};
+
+//TEE
+static void* splittee_open(fmed_filt *d);
+static int splittee_process(void *ctx, fmed_filt *d);
+static int splittee_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_split_tee = {
+	&splittee_open, &splittee_process, &split_close
+};
+
+static const ffpars_arg split_conf_args[] = {
+	{ "buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct split_conf_t, buf_size) },
+};
+
+static const ffpars_arg splittee_conf_args[] = {
+	{ "buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splittee_conf_t, buf_size) },
+	{ "monitor_latency",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splittee_conf_t, mon_latency) },
+};
+
+//VOICE ACTIVITY
+static void* splitvad_open(fmed_filt *d);
+static int splitvad_process(void *ctx, fmed_filt *d);
+static int splitvad_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_split_vad = {
+	&splitvad_open, &splitvad_process, &split_close
+};
+
+static const ffpars_arg splitvad_conf_args[] = {
+	{ "buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splitvad_conf_t, buf_size) },
+	{ "preroll",	FFPARS_TINT,  FFPARS_DSTOFF(struct splitvad_conf_t, preroll) },
+	{ "threshold",	FFPARS_TFLOAT | FFPARS_FSIGN,  FFPARS_DSTOFF(struct splitvad_conf_t, threshold) },
+	{ "silence",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splitvad_conf_t, silence) },
+};
+
+//SEGMENTS
+static void* splitseg_open(fmed_filt *d);
+static int splitseg_process(void *ctx, fmed_filt *d);
+static int splitseg_conf(ffpars_ctx *ctx);
+static const fmed_filter fmed_split_seg = {
+	&splitseg_open, &splitseg_process, &split_close
+};
+
+static const ffpars_arg splitseg_conf_args[] = {
+	{ "buffer",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splitseg_conf_t, buf_size) },
+	{ "segment",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splitseg_conf_t, seg_len) },
+	{ "overlap",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct splitseg_conf_t, overlap) },
+};
+
+//SEGMENT OUTPUT
+static void* splitsegout_open(fmed_filt *d);
+static int splitsegout_write(void *ctx, fmed_filt *d);
+static void splitsegout_close(void *ctx);
+static const fmed_filter fmed_split_segout = {
+	&splitsegout_open, &splitsegout_write, &splitsegout_close
+};
+
+//INPUT
+static void* splitin_open(fmed_filt *d);
+static int splitin_read(void *ctx, fmed_filt *d);
+static void splitin_close(void *ctx);
+static const fmed_filter fmed_split_in = {
+	&splitin_open, &splitin_read, &splitin_close
+};
+
+static void sbuf_unref(split_buf *sb);
+static size_t sbuf_write(split_buf *sb, const char *data, size_t len);
+static void sbuf_fin(split_buf *sb);
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	core = _core;
+	return &fmed_split_mod;
+}
+
+
+static const void* split_iface(const char *name)
+{
+	if (!ffsz_cmp(name, "cue"))
+		return &fmed_split_cue;
+	else if (!ffsz_cmp(name, "tee"))
+		return &fmed_split_tee;
+	else if (!ffsz_cmp(name, "vad"))
+		return &fmed_split_vad;
+	else if (!ffsz_cmp(name, "seg"))
+		return &fmed_split_seg;
+	else if (!ffsz_cmp(name, "segout"))
+		return &fmed_split_segout;
+	else if (!ffsz_cmp(name, "in"))
+		return &fmed_split_in;
+	return NULL;
+}
+
+static int split_conf(const char *name, ffpars_ctx *ctx)
+{
+	if (!ffsz_cmp(name, "cue"))
+		return splitcue_conf(ctx);
+	else if (!ffsz_cmp(name, "tee"))
+		return splittee_conf(ctx);
+	else if (!ffsz_cmp(name, "vad"))
+		return splitvad_conf(ctx);
+	else if (!ffsz_cmp(name, "seg"))
+		return splitseg_conf(ctx);
+	return -1;
+}
+
+static int split_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT:
+		ffmem_init();
+		return 0;
+
+	case FMED_OPEN:
+		qu = core->getmod("#queue.queue");
+		break;
+	}
+	return 0;
+}
+
+static void split_destroy(void)
+{
+}
+
+
+static split_buf* sbuf_alloc(size_t cap, uint sampsize, fftask *ptask)
+{
+	split_buf *sb;
+	if (NULL == (sb = ffmem_new(split_buf)))
+		return NULL;
+	if (NULL == (sb->ptr = ffmem_alloc(cap))) {
+		ffmem_free(sb);
+		return NULL;
+	}
+	sb->cap = cap;
+	sb->sampsize = sampsize;
+	sb->ptask = ptask;
+	sb->nref = 2;
+	fflk_init(&sb->lk);
+	return sb;
+}
+
+static void sbuf_free(split_buf *sb)
+{
+	ffarr_free(&sb->out);
+	ffmem_free(sb->ptr);
+	ffmem_free(sb);
+}
+
+static void sbuf_unref(split_buf *sb)
+{
+	fflk_lock(&sb->lk);
+	uint n = --sb->nref;
+	fflk_unlock(&sb->lk);
+	if (n != 0)
+		return;
+	sbuf_free(sb);
+}
+
+/** Prepare the buffer released by the child track for another child track. */
+static void sbuf_reset(split_buf *sb)
+{
+	size_t cap = sb->cap;
+	uint sampsize = sb->sampsize;
+	fftask *ptask = sb->ptask;
+	char *ptr = sb->ptr;
+	ffarr_free(&sb->out);
+	ffmem_tzero(sb);
+	sb->ptr = ptr;
+	sb->cap = cap;
+	sb->sampsize = sampsize;
+	sb->ptask = ptask;
+	sb->nref = 2;
+	fflk_init(&sb->lk);
+}
+
+/** Wake up the child track.  Called with the lock held. */
+static void sbuf_wake_child(split_buf *sb)
+{
+	if (sb->wait_in && !sb->child_closed) {
+		sb->wait_in = 0;
+		sb->handler(sb->trk);
+	}
+}
+
+/** Copy data into ring buffer.
+Return the number of bytes consumed;  0 if the buffer is full. */
+static size_t sbuf_write(split_buf *sb, const char *data, size_t len)
+{
+	size_t n, w, n1;
+
+	fflk_lock(&sb->lk);
+	if (sb->child_closed) {
+		fflk_unlock(&sb->lk);
+		return len; //the data is skipped
+	}
+	n = ffmin(len, sb->cap - sb->len);
+	if (n == 0 && !sb->nowait)
+		sb->wait_out = 1;
+	w = (sb->off + sb->len) % sb->cap;
+	fflk_unlock(&sb->lk);
+
+	if (n == 0)
+		return 0;
+
+	// the reader never accesses the free space of the buffer, so it's safe to copy without lock
+	n1 = ffmin(n, sb->cap - w);
+	ffmemcpy(sb->ptr + w, data, n1);
+	ffmemcpy(sb->ptr, data + n1, n - n1);
+
+	fflk_lock(&sb->lk);
+	sb->len += n;
+	sbuf_wake_child(sb);
+	fflk_unlock(&sb->lk);
+	return n;
+}
+
+static void sbuf_fin(split_buf *sb)
+{
+	fflk_lock(&sb->lk);
+	sb->fin = 1;
+	sbuf_wake_child(sb);
+	fflk_unlock(&sb->lk);
+}
+
+
+static int splitcue_conf(ffpars_ctx *ctx)
+{
+	conf_cue.buf_size = 120 * 1000;
+	ffpars_setargs(ctx, &conf_cue, split_conf_args, FFCNT(split_conf_args));
+	return 0;
+}
+
+static void* splitcue_open(fmed_filt *d)
+{
+	split_ctx *c;
+	if (NULL == (c = ffmem_new(split_ctx)))
+		return NULL;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+	c->maxactive = ffmax(1, (int)core->getval("workers"));
+	c->buf_size = conf_cue.buf_size;
+	return c;
+}
+
+static void split_close(void *ctx)
+{
+	split_ctx *c = ctx;
+	split_out *o;
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		ffmem_safefree(o->fn);
+		ffarr_free(&o->enc);
+		ffarr_free(&o->frames);
+		if (o->sb == NULL)
+			continue;
+		fflk_lock(&o->sb->lk);
+		o->sb->parent_closed = 1;
+		sbuf_wake_child(o->sb);
+		fflk_unlock(&o->sb->lk);
+		sbuf_unref(o->sb);
+	}
+
+	core->task(&c->task, FMED_TASK_DEL);
+	ffarr_free(&c->outs);
+	ffarr_free(&c->hist);
+	ffarr_free(&c->preroll);
+	if (c->vad_sb != NULL)
+		sbuf_free(c->vad_sb);
+	ffmem_free(c);
+}
+
+/** Get time ranges of all tracks from the queue items. */
+static int splitcue_ranges(split_ctx *c, fmed_filt *d)
+{
+	fmed_que_entry *first, *qe;
+	split_out *o;
+	uint rate = c->fmt.sample_rate;
+	uint n = fmed_getval("cue_split");
+
+	first = (void*)fmed_getval("queue_item");
+	if (first == FMED_PNULL || n == (uint)FMED_NULL)
+		return -1;
+	if (NULL == ffarr_allocT(&c->outs, n, split_out))
+		return -1;
+
+	uint64 base = fmed_apos_samples(first->from, rate);
+	uint64 inbase = fmed_apos_samples(first->from, d->audio.fmt.sample_rate);
+	qe = first;
+	for (;;) {
+		o = ffarr_pushT(&c->outs, split_out);
+		ffmem_tzero(o);
+		o->qent = qe;
+		o->from = fmed_apos_samples(qe->from, rate) - base;
+		if (qe->to != 0)
+			o->to = fmed_apos_samples(qe->to, rate) - base;
+
+		if (c->outs.len == n
+			|| 0 == qu->cmd2(FMED_QUE_LIST, &qe, 0)
+			|| !ffstr_eq2(&qe->url, &first->url))
+			break;
+	}
+
+	o = ffarr_itemT(&c->outs, c->outs.len - 1, split_out);
+	if (o->qent->to != 0)
+		d->audio.total = fmed_apos_samples(o->qent->to, d->audio.fmt.sample_rate) - inbase;
+
+	// the queue must continue with the item after the last split track
+	d->track->setval(d->trk, "queue_skip", (int64)o->qent);
+
+	dbglog(d->trk, "tracks: %L", c->outs.len);
+	return 0;
+}
+
+/** Create a track which encodes and writes PCM data for one output file. */
+static int split_start(split_ctx *c, split_out *o, fmed_filt *d)
+{
+	const char *s;
+	size_t cap = ffpcm_bytes(&c->fmt, c->buf_size);
+	if (o->to != 0)
+		cap = ffmin(cap, (o->to - o->from) * c->sampsize);
+	cap = ffmax(cap / c->sampsize, 1) * c->sampsize;
+
+	if (o->sb == NULL
+		&& NULL == (o->sb = sbuf_alloc(cap, c->sampsize, &c->task))) {
+		errlog(d->trk, "%s", ffmem_alloc_S);
+		return -1;
+	}
+	if (o->nowait)
+		o->sb->nowait = 1;
+	if (o->monitor) {
+		o->sb->nowait = 1;
+		o->sb->prefill = ffmin(ffpcm_bytes(&c->fmt, conf_tee.mon_latency) / c->sampsize * c->sampsize, cap / 2);
+		o->sb->maxfill = o->sb->prefill * 2;
+	}
+
+	void *trk = d->track->create(FMED_TRK_TYPE_SUB, NULL);
+	if (trk == NULL) {
+		sbuf_unref(o->sb);
+		sbuf_unref(o->sb);
+		o->sb = NULL;
+		return -1;
+	}
+
+	fmed_trk *t = d->track->conf(trk);
+	d->track->copy_info(t, d);
+	t->audio.fmt = c->fmt;
+	t->audio.pos = 0;
+	t->audio.seek = FMED_NULL;
+	t->audio.until = FMED_NULL;
+	t->audio.abs_seek = 0;
+	t->audio.total = FMED_NULL;
+	if (o->to != 0)
+		t->audio.total = o->to - o->from;
+	else if ((int64)d->audio.total != FMED_NULL)
+		t->audio.total = d->audio.total * c->fmt.sample_rate / d->audio.fmt.sample_rate - o->from;
+	t->datatype = "pcm";
+	t->use_dynanorm = 0;
+	t->pcm_peaks = 0;
+
+	d->track->cmd(trk, FMED_TRACK_ADDFILT_BEGIN, "split.in");
+	d->track->setval(trk, "split_buf", (int64)o->sb);
+	if (o->qent != NULL)
+		d->track->setval(trk, "queue_item", (int64)o->qent);
+	if (FMED_PNULL != (s = d->track->getvalstr(d->trk, "input")))
+		d->track->setvalstr4(trk, "input", ffsz_alcopyz(s), FMED_TRK_FACQUIRE);
+	if (o->monitor) {
+		d->track->setval(trk, "low_latency", 1); //no "output": the track plays data via audio device
+		d->track->setval(trk, "main_thread", 1); //audio output filters use the main thread's API
+	}
+	else if (c->encoder != NULL)
+		d->track->setvalstr(trk, "split_encoder", c->encoder);
+	else if (o->fn != NULL)
+		d->track->setvalstr4(trk, "output", ffsz_alcopyz(o->fn), FMED_TRK_FACQUIRE);
+	else if (FMED_PNULL != (s = d->track->getvalstr(d->trk, "output")))
+		d->track->setvalstr4(trk, "output", ffsz_alcopyz(s), FMED_TRK_FACQUIRE);
+	d->track->cmd(trk, FMED_TRACK_META_COPYFROM, d->trk);
+
+	if (0 != d->track->cmd(trk, FMED_TRACK_XSTART)) {
+		sbuf_unref(o->sb);
+		sbuf_unref(o->sb);
+		o->sb = NULL;
+		return -1;
+	}
+	c->nactive++;
+	return 0;
+}
+
+/** Release the buffers of the child tracks that have finished. */
+static void split_reap(split_ctx *c)
+{
+	split_out *o;
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (o->sb == NULL)
+			continue;
+		fflk_lock(&o->sb->lk);
+		uint closed = o->sb->child_closed;
+		fflk_unlock(&o->sb->lk);
+		if (!closed)
+			continue;
+		o->enc = o->sb->out;
+		ffarr_null(&o->sb->out);
+		if (o->nowait && c->vad_sb == NULL) {
+			// the child track has released the buffer: keep it for the next one
+			sbuf_reset(o->sb);
+			c->vad_sb = o->sb;
+		} else
+			sbuf_unref(o->sb);
+		o->sb = NULL;
+		o->done = 1;
+		c->nactive--;
+	}
+}
+
+static void splitcue_fin(split_ctx *c, split_out *o)
+{
+	if (o->sb != NULL)
+		sbuf_fin(o->sb);
+	c->iout++;
+}
+
+static int splitcue_process(void *ctx, fmed_filt *d)
+{
+	split_ctx *c = ctx;
+	split_out *o;
+	size_t n;
+
+	switch (c->state) {
+	case 0:
+		d->audio.convfmt.ileaved = 1;
+		c->state = 1;
+		return FMED_RMORE;
+
+	case 1:
+		c->fmt = d->audio.convfmt;
+		c->sampsize = ffpcm_size1(&c->fmt);
+		if (0 != splitcue_ranges(c, d))
+			return FMED_RERR;
+		c->pos = d->audio.pos * c->fmt.sample_rate / d->audio.fmt.sample_rate;
+		c->state = 2;
+		break;
+	}
+
+	split_reap(c);
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	while (d->datalen != 0 && c->iout != c->outs.len) {
+		o = ffarr_itemT(&c->outs, c->iout, split_out);
+
+		if (c->pos < o->from) {
+			// skip the data between tracks
+			n = ffmin(d->datalen, (o->from - c->pos) * c->sampsize);
+			goto next;
+		}
+
+		if (o->to != 0 && c->pos >= o->to) {
+			splitcue_fin(c, o);
+			continue;
+		}
+
+		if (o->sb == NULL && !o->done) {
+			if (c->nactive == c->maxactive)
+				return FMED_RASYNC; //wait until any child track is finished
+			if (0 != split_start(c, o, d))
+				return FMED_RERR;
+		}
+
+		n = d->datalen;
+		if (o->to != 0)
+			n = ffmin(n, (o->to - c->pos) * c->sampsize);
+		if (o->sb != NULL) {
+			n = sbuf_write(o->sb, d->data, n);
+			if (n == 0)
+				return FMED_RASYNC; //wait until the child track reads data
+		}
+
+next:
+		d->data += n;
+		d->datalen -= n;
+		c->pos += n / c->sampsize;
+	}
+
+	if (d->flags & FMED_FLAST) {
+		for (;  c->iout != c->outs.len;  ) {
+			o = ffarr_itemT(&c->outs, c->iout, split_out);
+			if (o->sb == NULL && !o->done)
+				warnlog(d->trk, "track #%u is beyond the end of input data", c->iout + 1);
+			splitcue_fin(c, o);
+		}
+	}
+
+	if (c->iout != c->outs.len)
+		return FMED_RMORE;
+
+	d->datalen = 0;
+	if (c->nactive != 0)
+		return FMED_RASYNC; //wait until all child tracks are finished
+
+	dbglog(d->trk, "all tracks are finished");
+	d->outlen = 0;
+	return FMED_RDONE;
+}
+
+
+static int splittee_conf(ffpars_ctx *ctx)
+{
+	conf_tee.buf_size = 5 * 1000;
+	conf_tee.mon_latency = 100;
+	ffpars_setargs(ctx, &conf_tee, splittee_conf_args, FFCNT(splittee_conf_args));
+	return 0;
+}
+
+static void* splittee_open(fmed_filt *d)
+{
+	split_ctx *c;
+	if (NULL == (c = ffmem_new(split_ctx)))
+		return NULL;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+	c->buf_size = conf_tee.buf_size;
+	return c;
+}
+
+static int splittee_add(split_ctx *c, const char *fn, size_t len, fmed_que_entry *qent)
+{
+	split_out *o;
+	if (NULL == (o = ffarr_pushgrowT(&c->outs, 4, split_out)))
+		return -1;
+	ffmem_tzero(o);
+	o->qent = qent;
+	if (NULL == (o->fn = ffsz_alcopy(fn, len)))
+		return -1;
+	return 0;
+}
+
+/** Get output file names from "output" and "output_tee" (ffarr of ffstr).
+Add the monitor output if "rec_monitor" is set. */
+static int splittee_outputs(split_ctx *c, fmed_filt *d)
+{
+	const char *s;
+	ffarr *tee;
+	const ffstr *fn;
+	split_out *o;
+	fmed_que_entry *qent = (void*)fmed_getval("queue_item");
+	if (qent == FMED_PNULL)
+		qent = NULL;
+
+	if (FMED_PNULL != (s = d->track->getvalstr(d->trk, "output"))
+		&& 0 != splittee_add(c, s, ffsz_len(s), qent))
+		return -1;
+
+	if (FMED_PNULL != (tee = (void*)fmed_getval("output_tee"))) {
+		FFARR_WALKT(tee, fn, ffstr) {
+			if (0 != splittee_add(c, fn->ptr, fn->len, qent))
+				return -1;
+		}
+	}
+
+	if (FMED_NULL != fmed_getval("rec_monitor")) {
+		if (NULL == (o = ffarr_pushgrowT(&c->outs, 4, split_out)))
+			return -1;
+		ffmem_tzero(o);
+		o->monitor = 1;
+	}
+
+	dbglog(d->trk, "outputs: %L", c->outs.len);
+	return 0;
+}
+
+/*
+Every child track receives the same data.
+The input block is released only after it's passed to all child tracks,
+ so the slowest encoder limits the speed of the whole chain. */
+static int splittee_process(void *ctx, fmed_filt *d)
+{
+	split_ctx *c = ctx;
+	split_out *o;
+	size_t n;
+	uint nbusy = 0;
+
+	switch (c->state) {
+	case 0:
+		d->audio.convfmt.ileaved = 1;
+		c->state = 1;
+		return FMED_RMORE;
+
+	case 1:
+		c->fmt = d->audio.convfmt;
+		c->sampsize = ffpcm_size1(&c->fmt);
+		if (0 != splittee_outputs(c, d)) {
+			errlog(d->trk, "%s", ffmem_alloc_S);
+			return FMED_RERR;
+		}
+		FFARR_WALKT(&c->outs, o, split_out) {
+			if (0 != split_start(c, o, d))
+				return FMED_RERR;
+		}
+		c->state = 2;
+		break;
+	}
+
+	split_reap(c);
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (c->state == 3)
+		goto fin;
+
+	if (c->nactive == 0) {
+		errlog(d->trk, "all output tracks are closed");
+		return FMED_RERR;
+	}
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (o->sb == NULL || o->off == d->datalen)
+			continue;
+		n = sbuf_write(o->sb, d->data + o->off, d->datalen - o->off);
+		o->off += n;
+		if (o->monitor && o->off != d->datalen) {
+			// the monitor track can't keep up: drop the rest of the block
+			o->nlost += d->datalen - o->off;
+			o->off = d->datalen;
+		}
+		if (o->off != d->datalen)
+			nbusy++;
+	}
+	if (nbusy != 0)
+		return FMED_RASYNC; //wait until the child tracks read data
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		o->off = 0;
+	}
+	d->datalen = 0;
+
+	if (!(d->flags & FMED_FLAST))
+		return FMED_RMORE;
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (o->sb != NULL)
+			sbuf_fin(o->sb);
+		if (o->nlost != 0)
+			warnlog(d->trk, "monitor: dropped %Ums of audio"
+				, ffpcm_time(o->nlost / c->sampsize, c->fmt.sample_rate));
+	}
+	c->state = 3;
+
+fin:
+	if (c->nactive != 0)
+		return FMED_RASYNC; //wait until all child tracks are finished
+
+	dbglog(d->trk, "all tracks are finished");
+	d->outlen = 0;
+	return FMED_RDONE;
+}
+
+
+static int splitvad_conf(ffpars_ctx *ctx)
+{
+	conf_vad.buf_size = 5 * 1000;
+	conf_vad.preroll = 5 * 1000;
+	conf_vad.threshold = -40;
+	conf_vad.silence = 10;
+	ffpars_setargs(ctx, &conf_vad, splitvad_conf_args, FFCNT(splitvad_conf_args));
+	return 0;
+}
+
+static void* splitvad_open(fmed_filt *d)
+{
+	split_ctx *c;
+	if (NULL == (c = ffmem_new(split_ctx)))
+		return NULL;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+	c->buf_size = conf_vad.preroll + conf_vad.buf_size;
+	c->iout = (uint)-1;
+	return c;
+}
+
+/** Allocate the buffers in advance, after the format is set:
+ nothing is allocated for the data when a new file is started. */
+static int splitvad_alloc(split_ctx *c)
+{
+	size_t n, cap;
+	n = ffmax(ffpcm_bytes(&c->fmt, conf_vad.preroll) / c->sampsize, 1) * c->sampsize;
+	cap = ffmax(ffpcm_bytes(&c->fmt, c->buf_size) / c->sampsize, 1) * c->sampsize;
+	if (NULL == ffarr_alloc(&c->preroll, n)
+		|| NULL == (c->vad_sb = sbuf_alloc(cap, c->sampsize, &c->task)))
+		return -1;
+	return 0;
+}
+
+/** Get the output file name for the next file: "$counter" is replaced with the file number.
+If there's no "$counter", "-NUMBER" is added before the extension:
+ e.g. with "$time" the files started within one second would have the same name. */
+static char* splitvad_fn(const char *fn, uint64 num)
+{
+	ffarr a = {0};
+	ffstr s, pre;
+	ssize_t i;
+	size_t k;
+
+	ffstr_setz(&s, fn);
+	if (-1 != (i = ffstr_findz(&s, "$counter"))) {
+		ffstr_set(&pre, fn, i);
+		if (0 == ffstr_catfmt(&a, "%S%U%s%Z", &pre, num, fn + i + FFSLEN("$counter")))
+			return NULL;
+		return a.ptr;
+	}
+
+	for (k = s.len;  k != 0;  k--) {
+		if (fn[k - 1] == '.' || fn[k - 1] == '/' || fn[k - 1] == '\\')
+			break;
+	}
+	if (k == 0 || fn[k - 1] != '.')
+		k = s.len + 1;
+	ffstr_set(&pre, fn, k - 1);
+	if (0 == ffstr_catfmt(&a, "%S-%U%s%Z", &pre, num, fn + k - 1))
+		return NULL;
+	return a.ptr;
+}
+
+/** Store data in pre-roll buffer, overwriting the oldest data. */
+static void splitvad_preroll(split_ctx *c, const char *data, size_t len)
+{
+	size_t cap = c->preroll.cap, n;
+	if (len >= cap) {
+		data += len - cap;
+		len = cap;
+	}
+	n = ffmin(len, cap - c->proff);
+	ffmemcpy(c->preroll.ptr + c->proff, data, n);
+	ffmemcpy(c->preroll.ptr, data + n, len - n);
+	c->proff = (c->proff + len) % cap;
+	c->preroll.len = ffmin(c->preroll.len + len, cap);
+}
+
+/** Pass pre-roll data to the child track.
+The data that doesn't fit into the child's buffer is dropped. */
+static void splitvad_passpreroll(split_ctx *c, split_out *o)
+{
+	size_t cap = c->preroll.cap, off, n, r;
+	while (c->preroll.len != 0) {
+		off = (c->proff + cap - c->preroll.len) % cap;
+		n = ffmin(c->preroll.len, cap - off);
+		r = sbuf_write(o->sb, c->preroll.ptr + off, n);
+		c->preroll.len -= r;
+		if (r != n) {
+			o->nlost += c->preroll.len;
+			c->preroll.len = 0;
+			break;
+		}
+	}
+	c->proff = 0;
+}
+
+/** Start a new output file. */
+static int splitvad_start(split_ctx *c, fmed_filt *d)
+{
+	split_out *o;
+	size_t i;
+	const char *fn;
+
+	// reuse an entry of the finished track
+	for (i = 0;  i != c->outs.len;  i++) {
+		o = ffarr_itemT(&c->outs, i, split_out);
+		if (o->done)
+			break;
+	}
+	if (i != c->outs.len) {
+		ffmem_safefree(o->fn);
+		ffarr_free(&o->enc);
+	} else if (NULL == (o = ffarr_pushgrowT(&c->outs, 4, split_out)))
+		return -1;
+	ffmem_tzero(o);
+	o->nowait = 1;
+
+	if (FMED_PNULL != (fn = d->track->getvalstr(d->trk, "output"))
+		&& NULL == (o->fn = splitvad_fn(fn, c->nfiles + 1)))
+		return -1;
+
+	if (c->vad_sb != NULL) {
+		o->sb = c->vad_sb;
+		c->vad_sb = NULL;
+	} else
+		dbglog(d->trk, "the previous file isn't finished yet: allocating a new buffer");
+
+	if (0 != split_start(c, o, d))
+		return -1;
+	c->iout = i;
+	c->nfiles++;
+	dbglog(d->trk, "signal is above threshold: starting file #%U: %s", c->nfiles, o->fn);
+	return 0;
+}
+
+/** Finish the current output file. */
+static void splitvad_fin(split_ctx *c, fmed_filt *d)
+{
+	split_out *o = ffarr_itemT(&c->outs, c->iout, split_out);
+	if (o->sb != NULL)
+		sbuf_fin(o->sb);
+	if (o->nlost != 0)
+		warnlog(d->trk, "file #%U: dropped %Ums of audio: the encoder can't keep up"
+			, c->nfiles, ffpcm_time(o->nlost / c->sampsize, c->fmt.sample_rate));
+	c->iout = (uint)-1;
+}
+
+/*
+While the signal is below threshold, input data is stored in pre-roll ring buffer.
+When a block has its peak level above threshold, a child track is created which writes a new output file:
+ it gets the pre-roll data first, then the input data.
+After 'silence' seconds below threshold, the child track is finished. */
+static int splitvad_process(void *ctx, fmed_filt *d)
+{
+	enum { I_CONV, I_INIT, I_DATA, I_FIN };
+	split_ctx *c = ctx;
+	split_out *o;
+	size_t n;
+
+	switch (c->state) {
+	case I_CONV:
+		d->audio.convfmt.ileaved = 1;
+		c->state = I_INIT;
+		return FMED_RMORE;
+
+	case I_INIT: {
+		c->fmt = d->audio.convfmt;
+		c->sampsize = ffpcm_size1(&c->fmt);
+		float peak;
+		if (0 != ffpcm_peak(&c->fmt, NULL, 0, &peak)) {
+			errlog(d->trk, "ffpcm_peak(): unsupported format");
+			return FMED_RERR;
+		}
+		c->silence_max = ffpcm_samples(conf_vad.silence * 1000, c->fmt.sample_rate);
+		if (0 != splitvad_alloc(c)) {
+			errlog(d->trk, "%s", ffmem_alloc_S);
+			return FMED_RERR;
+		}
+		c->state = I_DATA;
+		break;
+	}
+	}
+
+	split_reap(c);
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (c->state == I_FIN)
+		goto fin;
+
+	float peak;
+	ffpcm_peak(&c->fmt, d->data, d->datalen / c->sampsize, &peak);
+	if (ffpcm_gain2db(peak) >= conf_vad.threshold)
+		c->silence = 0;
+	else
+		c->silence += d->datalen / c->sampsize;
+
+	if (c->iout == (uint)-1) {
+		if (c->silence == 0
+			&& 0 != splitvad_start(c, d))
+			return FMED_RERR;
+
+	} else if (c->silence >= c->silence_max) {
+		splitvad_fin(c, d);
+		dbglog(d->trk, "signal is below threshold: finished file #%U", c->nfiles);
+	}
+
+	if (c->iout != (uint)-1) {
+		// the capture track never waits for the child track: the data it can't take is dropped
+		o = ffarr_itemT(&c->outs, c->iout, split_out);
+		if (o->sb != NULL) {
+			splitvad_passpreroll(c, o);
+			n = sbuf_write(o->sb, d->data, d->datalen);
+			o->nlost += d->datalen - n;
+		}
+	} else
+		splitvad_preroll(c, d->data, d->datalen);
+
+	d->datalen = 0;
+
+	if (!(d->flags & FMED_FLAST))
+		return FMED_RMORE;
+
+	if (c->iout != (uint)-1)
+		splitvad_fin(c, d);
+	c->state = I_FIN;
+
+fin:
+	if (c->nactive != 0)
+		return FMED_RASYNC; //wait until all child tracks are finished
+
+	dbglog(d->trk, "files: %U", c->nfiles);
+	d->outlen = 0;
+	return FMED_RDONE;
+}
+
+static int splitseg_conf(ffpars_ctx *ctx)
+{
+	conf_seg.seg_len = 30;
+	conf_seg.overlap = 2 * 1000;
+	ffpars_setargs(ctx, &conf_seg, splitseg_conf_args, FFCNT(splitseg_conf_args));
+	return 0;
+}
+
+static void* splitseg_open(fmed_filt *d)
+{
+	split_ctx *c;
+
+	if ((int64)d->audio.total != FMED_NULL
+		&& d->audio.total - d->audio.pos < (uint64)conf_seg.seg_len * 2 * d->audio.fmt.sample_rate) {
+		// the input is too short to be split
+		if (0 != d->track->cmd(d->trk, FMED_TRACK_ADDFILT, "mpeg.encode"))
+			return NULL;
+		return FMED_FILT_SKIP;
+	}
+
+	if (NULL == (c = ffmem_new(split_ctx)))
+		return NULL;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+	// the whole segment must fit into buffer, otherwise the segments are encoded one by one
+	c->buf_size = conf_seg.seg_len * 1000 + conf_seg.overlap * 2;
+	c->maxactive = ffmax(2, (int)core->getval("workers"));
+	c->encoder = "mpeg.encode";
+	return c;
+}
+
+static const ushort mpg_kbrate[2][16] = {
+	{ 0,32,40,48,56,64,80,96,112,128,160,192,224,256,320,0 }, //MPEG-1
+	{ 0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0 }, //MPEG-2, MPEG-2.5
+};
+static const ushort mpg_rate[] = { 44100, 48000, 32000 };
+
+/** Parse MPEG Layer III frame header.
+@mdb: main_data_begin - the number of bytes in the previous frames (bit reservoir)
+@xing: set if the frame contains Xing or LAME tag
+Return frame length;  0 on error. */
+static uint mpg_frame(const byte *p, size_t len, uint *mdb, uint *xing)
+{
+	if (len < 4 || p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+		return 0;
+	uint ver = (p[1] >> 3) & 3; //3: MPEG-1, 2: MPEG-2, 0: MPEG-2.5
+	uint layer = (p[1] >> 1) & 3; //1: Layer III
+	uint ibr = p[2] >> 4, irate = (p[2] >> 2) & 3;
+	if (ver == 1 || layer != 1 || ibr == 0 || ibr == 15 || irate == 3)
+		return 0;
+
+	uint v1 = (ver == 3);
+	uint rate = mpg_rate[irate] >> ((v1) ? 0 : (ver == 2) ? 1 : 2);
+	uint n = ((v1) ? 144000 : 72000) * mpg_kbrate[!v1][ibr] / rate + ((p[2] >> 1) & 1);
+	uint mono = ((p[3] >> 6) == 3);
+	uint off = (p[1] & 1) ? 4 : 4 + 2; //CRC
+	uint sisize = (v1) ? ((mono) ? 17 : 32) : ((mono) ? 9 : 17);
+	if (n > len || off + sisize + 4 > n)
+		return 0;
+
+	*mdb = (v1) ? ((p[off] << 1) | (p[off + 1] >> 7)) : p[off];
+	*xing = (!ffmemcmp(p + off + sisize, "Xing", 4) || !ffmemcmp(p + off + sisize, "Info", 4));
+	return n;
+}
+
+/** Find MPEG frames in the encoded data of a segment.
+Xing/LAME tag frame is skipped: the values in it are valid only for this segment. */
+static int splitseg_parse(split_ctx *c, split_out *o, fmed_filt *d)
+{
+	size_t off = 0;
+	uint n, mdb, xing, *fr;
+
+	while (off != o->enc.len) {
+		if (0 == (n = mpg_frame((byte*)o->enc.ptr + off, o->enc.len - off, &mdb, &xing))) {
+			warnlog(d->trk, "segment #%L: bad MPEG frame at offset %L"
+				, (size_t)(o - (split_out*)c->outs.ptr) + 1, off);
+			break;
+		}
+		if (!(xing && off == 0)) {
+			if (NULL == (fr = ffarr_pushgrowT(&o->frames, 256, uint)))
+				return -1;
+			*fr = off;
+		}
+		off += n;
+	}
+	o->enc.len = off;
+	return 0;
+}
+
+static size_t splitseg_framelen(split_out *o, uint i)
+{
+	const uint *fr = (void*)o->frames.ptr;
+	return ((i + 1 != o->frames.len) ? fr[i + 1] : o->enc.len) - fr[i];
+}
+
+/** Get the frame number (relative to the beginning of the stream) at which the segments are joined.
+The first frame taken from segment 'b' must not use bit reservoir,
+ because the previous frames from segment 'a' contain different data.
+The frames near the beginning of 'b' and near the end of 'a' are avoided:
+ they are encoded without the knowledge of the neighbouring audio data.
+Return -1 if there's no such frame. */
+static uint64 splitseg_stitch(split_ctx *c, split_out *a, split_out *b, fmed_filt *d)
+{
+	uint64 fa = a->from / c->spf, fb = b->from / c->spf;
+	uint nov = c->overlap / c->spf;
+	uint64 bound = fb + nov;
+	uint64 lo = bound - nov / 2;
+	uint64 hi = ffmin(bound + nov, fa + a->frames.len);
+	hi = ffmin(hi, fb + b->frames.len);
+	hi = (hi > 2) ? hi - 2 : 0;
+	uint mdb, xing;
+
+	for (uint64 i = lo;  i < hi;  i++) {
+		const uint *fr = (void*)b->frames.ptr;
+		uint k = i - fb;
+		if (0 != mpg_frame((byte*)b->enc.ptr + fr[k], splitseg_framelen(b, k), &mdb, &xing)
+			&& mdb == 0)
+			return i;
+	}
+
+	uint64 ms = bound * c->spf * 1000 / c->fmt.sample_rate;
+	warnlog(d->trk, "segments #%L and #%L: no frame without bit reservoir in the overlap region at %u:%02u.%03u:"
+		" encoding the rest of the input in one track"
+		, (size_t)(a - (split_out*)c->outs.ptr) + 1, (size_t)(b - (split_out*)c->outs.ptr) + 1
+		, (uint)(ms / 60000), (uint)(ms / 1000 % 60), (uint)(ms % 1000));
+	return (uint64)-1;
+}
+
+/** Discard the segment being written and all the next ones,
+ start a track which encodes all data from the beginning of this segment. */
+static int splitseg_serial(split_ctx *c, fmed_filt *d)
+{
+	split_out *o;
+	uint64 from = ffarr_itemT(&c->outs, c->iwrite, split_out)->from;
+
+	for (o = ffarr_itemT(&c->outs, c->iwrite, split_out);  o != (split_out*)ffarr_end(&c->outs);  o++) {
+		o->discard = 1;
+		ffarr_free(&o->enc);
+		ffarr_free(&o->frames);
+		if (o->sb != NULL && !o->fin) {
+			sbuf_fin(o->sb); //the child track finishes early
+			o->fin = 1;
+		}
+	}
+
+	if (NULL == (o = ffarr_pushgrowT(&c->outs, 8, split_out)))
+		return -1;
+	ffmem_tzero(o);
+	o->from = from;
+	if (0 != split_start(c, o, d))
+		return -1;
+	c->iwrite = c->outs.len - 1;
+	c->serial = 1;
+	c->replay = 1;
+	c->hist_off = (from - c->hist_from) * c->sampsize;
+	return 0;
+}
+
+/** Pass the stored input data to the serial track.
+Return 0 if all data is passed. */
+static int splitseg_replay(split_ctx *c)
+{
+	split_out *o = ffarr_itemT(&c->outs, c->outs.len - 1, split_out);
+	size_t n;
+
+	while (c->hist_off != c->hist.len) {
+		if (0 == (n = sbuf_write(o->sb, c->hist.ptr + c->hist_off, c->hist.len - c->hist_off)))
+			return FMED_RASYNC; //wait until the child track reads data
+		c->hist_off += n;
+	}
+	ffarr_free(&c->hist);
+	c->replay = 0;
+	if (c->fin_input) {
+		sbuf_fin(o->sb);
+		o->fin = 1;
+	}
+	return 0;
+}
+
+/** Remove the input data before the segment being written. */
+static void splitseg_trim(split_ctx *c)
+{
+	uint64 from = ffarr_itemT(&c->outs, c->iwrite, split_out)->from;
+	size_t n = (from - c->hist_from) * c->sampsize;
+	if (n == 0 || n > c->hist.len)
+		return;
+	ffmemmove(c->hist.ptr, c->hist.ptr + n, c->hist.len - n);
+	c->hist.len -= n;
+	c->hist_from = from;
+}
+
+/** Get the next MPEG frame in output order.
+Return 1 if there's output data;  -1 on error. */
+static int splitseg_read(split_ctx *c, fmed_filt *d)
+{
+	split_out *a, *b;
+	const uint *fr;
+
+	for (;;) {
+		if (c->iwrite == c->outs.len)
+			return 0;
+		a = ffarr_itemT(&c->outs, c->iwrite, split_out);
+		if (!a->done)
+			return 0;
+
+		if (!c->wend_ok) {
+			if (c->iwrite + 1 != c->outs.len) {
+				b = a + 1;
+				if (!b->done)
+					return 0;
+				uint64 g = splitseg_stitch(c, a, b, d);
+				if (g == (uint64)-1) {
+					if (0 != splitseg_serial(c, d))
+						return -1;
+					continue;
+				}
+				c->wend = g - a->from / c->spf;
+				c->wnext = g - b->from / c->spf;
+				dbglog(d->trk, "segment #%u: frames %u..%u"
+					, c->iwrite + 1, c->wframe, c->wend);
+
+			} else if (c->fin_input) {
+				c->wend = a->frames.len;
+				c->wnext = 0;
+
+			} else
+				return 0;
+			c->wend_ok = 1;
+		}
+
+		if (c->wframe < c->wend) {
+			fr = (void*)a->frames.ptr;
+			d->out = a->enc.ptr + fr[c->wframe];
+			d->outlen = splitseg_framelen(a, c->wframe);
+			c->wframe++;
+			return 1;
+		}
+
+		ffarr_free(&a->enc);
+		ffarr_free(&a->frames);
+		c->iwrite++;
+		c->wframe = c->wnext;
+		c->wend_ok = 0;
+		if (!c->serial && c->iwrite != c->outs.len)
+			splitseg_trim(c);
+	}
+}
+
+static uint64 splitseg_from(split_ctx *c, size_t i)
+{
+	return (i == 0) ? 0 : i * c->seglen - c->overlap;
+}
+
+/** Pass input data to the segments overlapping with it.
+Return 0 if the data is processed. */
+static int splitseg_write(split_ctx *c, fmed_filt *d)
+{
+	split_out *o;
+	uint64 end = c->pos + d->datalen / c->sampsize, from;
+	uint nbusy = 0;
+
+	while (!c->serial && (from = splitseg_from(c, c->outs.len)) < end) {
+		if (c->nactive == c->maxactive) {
+			end = from;
+			break;
+		}
+		if (NULL == (o = ffarr_pushgrowT(&c->outs, 8, split_out)))
+			return FMED_RERR;
+		ffmem_tzero(o);
+		o->from = from;
+		o->to = (c->outs.len) * (uint64)c->seglen + c->overlap;
+		if (0 != split_start(c, o, d))
+			return FMED_RERR;
+	}
+
+	if (end == c->pos)
+		return FMED_RASYNC; //wait until any child track is finished
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (o->sb == NULL || o->fin)
+			continue;
+		uint64 lo = ffmax(o->from, c->pos), hi = (o->to != 0) ? ffmin(o->to, end) : end;
+		if (lo >= hi)
+			continue;
+		size_t off = ffmax(o->off, (lo - c->pos) * c->sampsize);
+		size_t hoff = (hi - c->pos) * c->sampsize;
+		off += sbuf_write(o->sb, d->data + off, hoff - off);
+		o->off = off;
+		if (off != hoff)
+			nbusy++;
+	}
+	if (nbusy != 0)
+		return FMED_RASYNC; //wait until the child tracks read data
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		o->off = 0;
+		if (o->sb != NULL && !o->fin && o->to != 0 && o->to <= end) {
+			sbuf_fin(o->sb);
+			o->fin = 1;
+		}
+	}
+
+	size_t n = (end - c->pos) * c->sampsize;
+	if (!c->serial
+		&& NULL == ffarr_append(&c->hist, d->data, n))
+		return FMED_RERR;
+	d->data += n;
+	d->datalen -= n;
+	c->pos = end;
+	return 0;
+}
+
+static int splitseg_process(void *ctx, fmed_filt *d)
+{
+	split_ctx *c = ctx;
+	split_out *o;
+	int r;
+
+	switch (c->state) {
+	case 0:
+		d->audio.convfmt.ileaved = 1;
+		c->state = 1;
+		return FMED_RMORE;
+
+	case 1:
+		c->fmt = d->audio.convfmt;
+		c->sampsize = ffpcm_size1(&c->fmt);
+		c->spf = (c->fmt.sample_rate >= 32000) ? 1152 : 576;
+		c->overlap = ffmax(ffpcm_samples(conf_seg.overlap, c->fmt.sample_rate) / c->spf, 8) * c->spf;
+		c->seglen = ffmax(c->fmt.sample_rate * conf_seg.seg_len / c->spf, (c->overlap / c->spf) * 4) * c->spf;
+		d->datatype = "mpeg";
+		dbglog(d->trk, "segment: %u samples, overlap: %u samples", c->seglen, c->overlap);
+		c->state = 2;
+		break;
+	}
+
+	split_reap(c);
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (!o->done || o->parsed)
+			continue;
+		if (o->discard) {
+			ffarr_free(&o->enc);
+			o->parsed = 1;
+			continue;
+		}
+		if (!o->fin) {
+			errlog(d->trk, "segment #%L: child track has failed", (size_t)(o - (split_out*)c->outs.ptr) + 1);
+			return FMED_RERR;
+		}
+		if (0 != splitseg_parse(c, o, d))
+			return FMED_RERR;
+		o->parsed = 1;
+	}
+
+	if (0 != (r = splitseg_read(c, d))) {
+		if (r < 0)
+			return FMED_RERR;
+		return FMED_RDATA;
+	}
+
+	if (c->replay
+		&& 0 != (r = splitseg_replay(c)))
+		return r;
+
+	if (c->fin_input) {
+		if (c->iwrite != c->outs.len)
+			return FMED_RASYNC; //wait until all child tracks are finished
+		dbglog(d->trk, "all segments are written");
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	while (d->datalen != 0) {
+		if (0 != (r = splitseg_write(c, d)))
+			return r;
+	}
+
+	if (!(d->flags & FMED_FLAST))
+		return FMED_RMORE;
+
+	FFARR_WALKT(&c->outs, o, split_out) {
+		if (o->sb != NULL && !o->fin) {
+			sbuf_fin(o->sb);
+			o->fin = 1;
+		}
+	}
+	c->fin_input = 1;
+	return FMED_RASYNC; //wait until all child tracks are finished
+}
+
+
+static void* splitsegout_open(fmed_filt *d)
+{
+	split_buf *sb = (void*)fmed_getval("split_buf");
+	if (sb == FMED_PNULL)
+		return NULL;
+	return sb;
+}
+
+static void splitsegout_close(void *ctx)
+{
+}
+
+/** Store the encoded data in the shared buffer:
+ the parent track takes it after the child track is closed. */
+static int splitsegout_write(void *ctx, fmed_filt *d)
+{
+	split_buf *sb = ctx;
+
+	if (d->mpg_lametag) {
+		// the tag frame which must be written at the beginning of the stream
+		d->mpg_lametag = 0;
+		d->datalen = 0;
+	}
+
+	if (NULL == ffarr_append(&sb->out, d->data, d->datalen))
+		return FMED_RERR;
+	d->datalen = 0;
+
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_RMORE;
+}
+
+
+static void* splitin_open(fmed_filt *d)
+{
+	split_buf *sb = (void*)fmed_getval("split_buf");
+	if (sb == FMED_PNULL)
+		return NULL;
+	fflk_lock(&sb->lk);
+	sb->handler = d->handler;
+	sb->trk = d->trk;
+	fflk_unlock(&sb->lk);
+	return sb;
+}
+
+static void splitin_close(void *ctx)
+{
+	split_buf *sb = ctx;
+	if (sb->nskipped != 0)
+		dbglog(NULL, "monitor: skipped %L bytes to keep latency", (size_t)sb->nskipped);
+	fflk_lock(&sb->lk);
+	sb->child_closed = 1;
+	if (!sb->parent_closed)
+		core->task(sb->ptask, FMED_TASK_POST);
+	// the parent may reuse the buffer as soon as it sees 'child_closed'
+	uint n = --sb->nref;
+	fflk_unlock(&sb->lk);
+	if (n == 0)
+		sbuf_free(sb);
+}
+
+static int splitin_read(void *ctx, fmed_filt *d)
+{
+	split_buf *sb = ctx;
+
+	fflk_lock(&sb->lk);
+
+	if ((d->flags & FMED_FSTOP) || (sb->parent_closed && !sb->fin)) {
+		fflk_unlock(&sb->lk);
+		d->outlen = 0;
+		return FMED_RLASTOUT;
+	}
+
+	// release the data returned to the child track last time
+	sb->off = (sb->off + sb->taken) % sb->cap;
+	sb->len -= sb->taken;
+	sb->taken = 0;
+	if (sb->wait_out && !sb->parent_closed) {
+		sb->wait_out = 0;
+		core->task(sb->ptask, FMED_TASK_POST);
+	}
+
+	if (sb->maxfill != 0 && sb->len > sb->maxfill) {
+		// the consumer is slower than the producer: skip the oldest data
+		size_t n = sb->len - sb->prefill;
+		sb->off = (sb->off + n) % sb->cap;
+		sb->len -= n;
+		sb->pos += n / sb->sampsize;
+		sb->nskipped += n;
+	}
+
+	if (!sb->started && sb->len < sb->prefill && !sb->fin) {
+		// accumulate data for the initial latency
+		sb->wait_in = 1;
+		fflk_unlock(&sb->lk);
+		return FMED_RASYNC;
+	}
+	sb->started = 1;
+
+	if (sb->len == 0) {
+		if (sb->fin) {
+			fflk_unlock(&sb->lk);
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+		sb->wait_in = 1;
+		fflk_unlock(&sb->lk);
+		return FMED_RASYNC;
+	}
+
+	sb->taken = ffmin(sb->len, sb->cap - sb->off);
+	d->out = sb->ptr + sb->off;
+	d->outlen = sb->taken;
+	fflk_unlock(&sb->lk);
+
+	d->audio.pos = sb->pos;
+	sb->pos += d->outlen / sb->sampsize;
+	return FMED_ROK;
+}
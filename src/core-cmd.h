@@ -26,7 +26,10 @@ typedef struct fmed_cmd {
 	};
 
 	byte rec;
+	byte rec_trigger;
+	byte rec_monitor;
 	byte mix;
+	char *stations;
 	byte tags;
 	byte info;
 	uint seek_time;
@@ -58,8 +61,11 @@ typedef struct fmed_cmd {
 	byte print_time;
 	byte debug;
 	byte cue_gaps;
+	byte cue_split;
+	byte parallel_encode;
 
 	ffstr outfn;
+	ffarr out_tee; //ffstr[]: additional output files
 	byte overwrite;
 	byte out_copy;
 	byte preserve_date;
@@ -13,6 +13,7 @@ Copyright (c) 2015 Simon Zolin */
 #include <FFOS/process.h>
 #include <FFOS/timer.h>
 #include <FFOS/dir.h>
+#include <FFOS/thread.h>
 
 
 #define syswarnlog(trk, ...)  fmed_syswarnlog(core, NULL, "core", __VA_ARGS__)
@@ -30,6 +31,17 @@ typedef struct core_modinfo {
 	const fmed_mod *m;
 } core_modinfo;
 
+typedef struct worker {
+	ffthd thd;
+	fffd kq;
+	ffkevpost kqpost;
+	ffkevent evposted;
+	fftaskmgr taskmgr;
+	ffatomic stop;
+	uint njobs;
+	uint init :1;
+} worker;
+
 typedef struct core_mod {
 	//fmed_modinfo:
 	char *name;
@@ -72,6 +84,11 @@ static const fmed_modinfo* core_modbyext(const ffstr3 *map, const ffstr *ext);
 static core_modinfo* mod_load(const ffstr *ps);
 static void mod_destroy(core_modinfo *m);
 static int core_filetype(const char *fn);
+static int work_init(void);
+static void work_destroy(void);
+static uint work_assign(void);
+static void work_release(uint wid);
+static void work_task(fftask *task, uint wid, uint cmd);
 
 static const void* core_iface(const char *name);
 static int core_sig2(uint signo);
@@ -149,6 +166,7 @@ static const ffpars_arg fmed_conf_args[] = {
 	, { "output_ext",  FFPARS_TOBJ, FFPARS_DST(&fmed_conf_ext) }
 	, { "codepage",  FFPARS_TSTR, FFPARS_DST(&fmed_conf_codepage) }
 	, { "instance_mode",  FFPARS_TENUM | FFPARS_F8BIT, FFPARS_DST(&im_enum) }
+	, { "workers",  FFPARS_TINT, FFPARS_DSTOFF(fmed_config, workers) }
 	,
 	{ "include",  FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&fmed_conf_include) },
 	{ "include_user",  FFPARS_TSTR | FFPARS_FNOTEMPTY, FFPARS_DST(&fmed_conf_include) },
@@ -539,10 +557,16 @@ static void cmd_destroy(fmed_cmd *cmd)
 {
 	FFARR_FREE_ALL_PTR(&cmd->in_files, ffmem_free, char*);
 	ffstr_free(&cmd->outfn);
+	ffstr *s;
+	FFARR_WALKT(&cmd->out_tee, s, ffstr) {
+		ffstr_free(s);
+	}
+	ffarr_free(&cmd->out_tee);
 
 	ffstr_free(&cmd->meta);
 	ffmem_safefree(cmd->aac_profile);
 	ffmem_safefree(cmd->trackno);
+	ffmem_safefree(cmd->stations);
 	ffmem_safefree(cmd->conf_fn);
 
 	ffmem_safefree(cmd->globcmd_pipename);
@@ -570,6 +594,7 @@ fmed_core* core_init(fmed_cmd **ptr, char **argv, char **env)
 	if (fmed == NULL)
 		return NULL;
 	fmed->cmd.log = &log_dummy;
+	fmed->main_tid = (size_t)ffthd_curid();
 	if (0 != ffenv_init(&fmed->env, env))
 		goto err;
 
@@ -629,6 +654,7 @@ void core_free(void)
 	fftmrq_destroy(&fmed->tmrq, fmed->kq);
 
 	tracks_destroy();
+	work_destroy();
 
 	if (fmed->kq != FF_BADFD) {
 		ffkqu_post_detach(&fmed->kqpost, fmed->kq);
@@ -911,6 +937,8 @@ static int core_open(void)
 	fmed->qu = core->getmod("#queue.queue");
 	if (0 != tracks_init())
 		return 1;
+	if (0 != work_init())
+		return 1;
 	return 0;
 }
 
@@ -943,6 +971,137 @@ void core_work(void)
 	ffmem_free(ents);
 }
 
+
+static int work_init(void)
+{
+	uint n = fmed->conf.workers;
+	if (n == 0) {
+		ffsysconf sc;
+		ffsc_init(&sc);
+		n = ffsc_get(&sc, _SC_NPROCESSORS_ONLN);
+		n = ffmax(n, 1);
+	}
+	if (NULL == ffarr_allocT(&fmed->workers, n, worker))
+		return -1;
+	ffmem_zero(fmed->workers.ptr, n * sizeof(worker));
+	fmed->workers.len = n;
+	return 0;
+}
+
+static void work_destroy(void)
+{
+	worker *w;
+	FFARR_WALKT(&fmed->workers, w, worker) {
+		if (!w->init)
+			continue;
+		ffatom_set(&w->stop, 1);
+		ffkqu_post(&w->kqpost, &w->evposted);
+		ffthd_join(w->thd, -1, NULL);
+		ffkqu_post_detach(&w->kqpost, w->kq);
+		ffkqu_close(w->kq);
+	}
+	ffarr_free(&fmed->workers);
+}
+
+static FFTHDCALL int work_loop(void *param)
+{
+	worker *w = param;
+	ffkqu_entry ents[FMED_KQ_EVS];
+	ffkqu_time tm;
+	ffkqu_settm(&tm, (uint)-1);
+	dbglog(core, NULL, "core", "worker thread started");
+
+	while (0 == ffatom_get(&w->stop)) {
+
+		uint nevents = ffkqu_wait(w->kq, ents, FFCNT(ents), &tm);
+
+		if ((int)nevents < 0) {
+			if (fferr_last() != EINTR) {
+				syserrlog(core, NULL, "core", "%s", ffkqu_wait_S);
+				break;
+			}
+			continue;
+		}
+
+		for (uint i = 0;  i != nevents;  i++) {
+			ffkqu_entry *ev = &ents[i];
+			ffkev_call(ev);
+
+			fftask_run(&w->taskmgr);
+		}
+	}
+
+	dbglog(core, NULL, "core", "worker thread exited");
+	return 0;
+}
+
+static int work_start(worker *w)
+{
+	if (FF_BADFD == (w->kq = ffkqu_create())) {
+		syserrlog(core, NULL, "core", "%s", ffkqu_create_S);
+		return -1;
+	}
+	ffkqu_post_attach(&w->kqpost, w->kq);
+	ffkev_init(&w->evposted);
+	w->evposted.oneshot = 0;
+	w->evposted.handler = &core_posted;
+	fftask_init(&w->taskmgr);
+
+	if (NULL == (w->thd = ffthd_create(&work_loop, w, 0))) {
+		syserrlog(core, NULL, "core", "%s", "ffthd_create()");
+		ffkqu_post_detach(&w->kqpost, w->kq);
+		ffkqu_close(w->kq);
+		return -1;
+	}
+	w->init = 1;
+	return 0;
+}
+
+/** Get the worker with the least number of jobs.
+Return worker ID (index+1);  0 on error. */
+static uint work_assign(void)
+{
+	worker *w, *min = NULL;
+	FFARR_WALKT(&fmed->workers, w, worker) {
+		if (min == NULL || w->njobs < min->njobs)
+			min = w;
+		if (w->njobs == 0 && w->init)
+			break;
+	}
+	if (min == NULL)
+		return 0;
+
+	if (!min->init && 0 != work_start(min))
+		return 0;
+
+	min->njobs++;
+	uint wid = min - (worker*)fmed->workers.ptr + 1;
+	dbglog(core, NULL, "core", "assigned worker #%u  jobs:%u", wid, min->njobs);
+	return wid;
+}
+
+static void work_release(uint wid)
+{
+	worker *w = ffarr_itemT(&fmed->workers, wid - 1, worker);
+	FF_ASSERT(w->njobs != 0);
+	w->njobs--;
+}
+
+static void work_task(fftask *task, uint wid, uint cmd)
+{
+	worker *w = ffarr_itemT(&fmed->workers, wid - 1, worker);
+
+	switch (cmd) {
+	case FMED_TASK_XPOST:
+		if (1 == fftask_post(&w->taskmgr, task))
+			ffkqu_post(&w->kqpost, &w->evposted);
+		break;
+	case FMED_TASK_XDEL:
+		fftask_del(&w->taskmgr, task);
+		break;
+	}
+}
+
 static char* core_getpath(const char *name, size_t len)
 {
 	ffstr3 s = {0};
@@ -1055,6 +1214,22 @@ static ssize_t core_cmd(uint signo, ...)
 		break;
 	}
 #endif
+
+	case FMED_WORKER_ASSIGN:
+		r = work_assign();
+		break;
+
+	case FMED_WORKER_RELEASE:
+		work_release(va_arg(va, uint));
+		break;
+
+	case FMED_TASK_XPOST:
+	case FMED_TASK_XDEL: {
+		fftask *task = va_arg(va, fftask*);
+		uint wid = va_arg(va, uint);
+		work_task(task, wid, signo);
+		break;
+	}
 	}
 
 	va_end(va);
@@ -1092,6 +1267,11 @@ static int core_timer(fftmrq_entry *tmr, int64 _interval, uint flags)
 	dbglog(core, NULL, "core", "timer:%p  interval:%d  handler:%p  param:%p"
 		, tmr, interval, tmr->handler, tmr->param);
 
+	if ((size_t)ffthd_curid() != fmed->main_tid) {
+		errlog(core, NULL, "core", "timer:%p: can't be used from a worker thread", tmr);
+		return -1;
+	}
+
 	if (fftmrq_active(&fmed->tmrq, tmr))
 		fftmrq_rm(&fmed->tmrq, tmr);
 	else if (interval == 0)
@@ -1137,6 +1317,12 @@ static int64 core_getval(const char *name)
 		return fmed->cmd.tags;
 	else if (!ffsz_cmp(name, "cue_gaps") && fmed->cmd.cue_gaps != 255)
 		return fmed->cmd.cue_gaps;
+	else if (!ffsz_cmp(name, "cue_split"))
+		return fmed->cmd.cue_split;
+	else if (!ffsz_cmp(name, "parallel_encode"))
+		return fmed->cmd.parallel_encode;
+	else if (!ffsz_cmp(name, "workers"))
+		return fmed->workers.len;
 	else if (!ffsz_cmp(name, "instance_mode"))
 		return fmed->conf.instance_mode;
 	return FMED_NULL;
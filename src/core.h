@@ -27,6 +27,7 @@ typedef struct fmed_config {
 	ffstr3 outmap; //inmap_item[]
 	const fmed_modinfo *inmap_curmod;
 	char *usrconf_modname;
+	uint workers; //number of worker threads;  0: use the number of CPUs
 	uint skip_line :1;
 } fmed_config;
 
@@ -44,6 +45,9 @@ typedef struct fmedia {
 	uint stopped :1
 		;
 
+	ffarr workers; //worker[]
+	size_t main_tid; //ID of the main thread
+
 	ffarr bmods; //fmed_modinfo[]
 	fflist mods; //core_mod[]
 
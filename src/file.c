@@ -12,6 +12,10 @@ Copyright (c) 2015 Simon Zolin */
 #include <FFOS/dir.h>
 #include <FF/path.h>
 
+#ifdef FF_UNIX
+#include <sys/mman.h>
+#endif
+
 
 #undef dbglog
 #undef errlog
@@ -28,6 +32,12 @@ struct file_in_conf_t {
 	byte directio;
 };
 
+struct file_mmap_conf_t {
+	size_t window;
+	uint64 minsize;
+	uint enabled :1;
+};
+
 struct file_out_conf_t {
 	size_t bsize;
 	size_t prealloc;
@@ -38,6 +48,7 @@ struct file_out_conf_t {
 typedef struct filemod {
 	struct file_in_conf_t in_conf;
 	struct file_out_conf_t out_conf;
+	struct file_mmap_conf_t mmap_conf;
 } filemod;
 
 static filemod *mod;
@@ -78,6 +89,18 @@ enum {
 	FILEIN_MAX_PREBUF = 2, //maximum number of unread buffers
 };
 
+typedef struct filemap {
+	const char *fn;
+	fffd fd;
+	ffmap hmap;
+	uint64 fsize;
+	uint64 off; //current read position
+
+	char *map;
+	uint64 mapoff; //file offset of the mapped region
+	size_t maplen;
+} filemap;
+
 typedef struct fmed_fileout {
 	fmed_trk *d;
 	ffstr fname;
@@ -142,6 +165,21 @@ static const ffpars_arg file_in_conf_args[] = {
 };
 
 
+//MMAP
+static void* filemap_open(fmed_filt *d);
+static int filemap_read(void *ctx, fmed_filt *d);
+static void filemap_close(void *ctx);
+static int filemap_conf(ffpars_ctx *ctx);
+static const fmed_filter file_mmap = {
+	&filemap_open, &filemap_read, &filemap_close
+};
+
+static const ffpars_arg file_mmap_conf_args[] = {
+	{ "window",  FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct file_mmap_conf_t, window) }
+	, { "min_size",  FFPARS_TSIZE | FFPARS_F64BIT,  FFPARS_DSTOFF(struct file_mmap_conf_t, minsize) }
+};
+
+
 //OUTPUT
 static void* fileout_open(fmed_filt *d);
 static int fileout_write(void *ctx, fmed_filt *d);
@@ -200,6 +238,8 @@ static const void* file_iface(const char *name)
 		return &file_stdin;
 	else if (!ffsz_cmp(name, "stdout"))
 		return &file_stdout;
+	else if (!ffsz_cmp(name, "mmap"))
+		return &file_mmap;
 	return NULL;
 }
 
@@ -209,6 +249,8 @@ static int file_conf(const char *name, ffpars_ctx *ctx)
 		return file_in_conf(ctx);
 	else if (!ffsz_cmp(name, "out"))
 		return fileout_config(ctx);
+	else if (!ffsz_cmp(name, "mmap"))
+		return filemap_conf(ctx);
 	return -1;
 }
 
@@ -238,6 +280,17 @@ static int file_in_conf(ffpars_ctx *ctx)
 	return 0;
 }
 
+/** Return 1 if the file is a regular file (not a directory, FIFO or device). */
+static int file_isreg(fffileinfo *fi)
+{
+#ifdef FF_UNIX
+	return S_ISREG(fffile_infoattr(fi));
+#else
+	return !fffile_isdir(fffile_infoattr(fi))
+		&& !(fffile_infoattr(fi) & FILE_ATTRIBUTE_DEVICE);
+#endif
+}
+
 static void* file_open(fmed_filt *d)
 {
 	fmed_file *f;
@@ -275,6 +328,16 @@ static void* file_open(fmed_filt *d)
 	}
 	f->fsize = fffile_infosize(&fi);
 
+	if (mod->mmap_conf.enabled && mod->mmap_conf.minsize != 0
+		&& f->fsize >= mod->mmap_conf.minsize
+		&& file_isreg(&fi)) {
+		// large local file: let "#file.mmap" read it directly from page cache
+		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "#file.mmap"))
+			goto done;
+		file_close(f);
+		return FMED_FILT_SKIP;
+	}
+
 	dbglog(d->trk, "opened %s (%U kbytes)", f->fn, f->fsize / 1024);
 
 	ffaio_finit(&f->ftask, f->fd, f);
@@ -492,6 +555,130 @@ ok:
 }
 
 
+static int filemap_conf(ffpars_ctx *ctx)
+{
+	mod->mmap_conf.window = 16 * 1024 * 1024;
+	mod->mmap_conf.minsize = 16 * 1024 * 1024;
+	mod->mmap_conf.enabled = 1;
+	ffpars_setargs(ctx, &mod->mmap_conf, file_mmap_conf_args, FFCNT(file_mmap_conf_args));
+	return 0;
+}
+
+static void* filemap_open(fmed_filt *d)
+{
+	filemap *f;
+	fffileinfo fi;
+
+	if (NULL == (f = ffmem_new(filemap)))
+		return NULL;
+	f->fd = FF_BADFD;
+	f->hmap = FF_BADFD;
+	f->fn = d->track->getvalstr(d->trk, "input");
+
+	if (FF_BADFD == (f->fd = fffile_open(f->fn, O_RDONLY | O_NOATIME | FFO_NODOSNAME))) {
+		syserrlog(d->trk, "%s: %s", fffile_open_S, f->fn);
+		goto done;
+	}
+	if (0 != fffile_info(f->fd, &fi)) {
+		syserrlog(d->trk, "%s: %s", fffile_info_S, f->fn);
+		goto done;
+	}
+	f->fsize = fffile_infosize(&fi);
+
+	if (f->fsize != 0
+		&& FF_BADFD == (f->hmap = fffile_createmap(f->fd, f->fsize, FFMAP_PAGEREAD))) {
+		syserrlog(d->trk, "%s: %s", fffile_createmap_S, f->fn);
+		goto done;
+	}
+
+	dbglog(d->trk, "opened %s (%U kbytes) for memory-mapped reading", f->fn, f->fsize / 1024);
+
+	d->input.size = f->fsize;
+	if (d->out_preserve_date)
+		d->mtime = fffile_infomtime(&fi);
+	return f;
+
+done:
+	filemap_close(f);
+	return NULL;
+}
+
+static void filemap_unmap(filemap *f)
+{
+	if (f->map != NULL) {
+		fffile_unmap(f->map, f->maplen);
+		f->map = NULL;
+		f->maplen = 0;
+	}
+}
+
+static void filemap_close(void *ctx)
+{
+	filemap *f = ctx;
+	filemap_unmap(f);
+	if (f->hmap != FF_BADFD)
+		fffile_closemap(f->hmap);
+	if (f->fd != FF_BADFD)
+		fffile_close(f->fd);
+	ffmem_free(f);
+}
+
+/** Map the window containing the current read position. */
+static int filemap_remap(filemap *f, fmed_filt *d)
+{
+	filemap_unmap(f);
+
+	// window offset must be aligned to allocation granularity (64k on Windows)
+	f->mapoff = ff_align_floor2(f->off, 64 * 1024);
+	f->maplen = ffmin64((f->off - f->mapoff) + mod->mmap_conf.window, f->fsize - f->mapoff);
+
+	if (NULL == (f->map = fffile_map(f->hmap, f->mapoff, f->maplen, FFMAP_PAGEREAD, 0))) {
+		syserrlog(d->trk, "%s: %s  offset:%xU size:%L"
+			, fffile_map_S, f->fn, f->mapoff, f->maplen);
+		f->maplen = 0;
+		return -1;
+	}
+
+#ifdef FF_UNIX
+	madvise(f->map, f->maplen, MADV_SEQUENTIAL);
+#endif
+
+	dbglog(d->trk, "mapped %L bytes at offset %xU", f->maplen, f->mapoff);
+	return 0;
+}
+
+static int filemap_read(void *ctx, fmed_filt *d)
+{
+	filemap *f = ctx;
+
+	if ((int64)d->input.seek != FMED_NULL) {
+		uint64 seek = d->input.seek;
+		d->input.seek = FMED_NULL;
+		if (seek >= f->fsize) {
+			errlog(d->trk, "too big seek position %U", seek);
+			return FMED_RERR;
+		}
+		dbglog(d->trk, "seeking to %xU", seek);
+		f->off = seek;
+	}
+
+	if (f->off >= f->fsize) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (!ffint_within(f->off, f->mapoff, f->mapoff + f->maplen)
+		&& 0 != filemap_remap(f, d))
+		return FMED_RERR;
+
+	// pass the rest of the window to the next filter
+	d->out = f->map + (f->off - f->mapoff);
+	d->outlen = f->mapoff + f->maplen - f->off;
+	f->off = f->mapoff + f->maplen;
+	return FMED_ROK;
+}
+
+
 static int fileout_config(ffpars_ctx *ctx)
 {
 	mod->out_conf.bsize = 64 * 1024;
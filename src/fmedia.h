@@ -81,6 +81,18 @@ enum FMED_SIG {
 	/** Windows: remove handle from WOH.
 	args: "HANDLE h" */
 	FMED_WOH_DEL,
+
+	/** Get ID of the least busy worker thread.  The thread is started if necessary.
+	Return worker ID;  0: the main thread must be used. */
+	FMED_WORKER_ASSIGN,
+
+	/** args: "uint wid" */
+	FMED_WORKER_RELEASE,
+
+	/** Add/remove task to/from the worker thread's queue.  Thread-safe.
+	args: "fftask *task, uint wid" */
+	FMED_TASK_XPOST,
+	FMED_TASK_XDEL,
 };
 
 enum FMED_FT {
@@ -155,11 +167,13 @@ struct fmed_core {
 	const fmed_modinfo* (*insmod)(const char *name, ffpars_ctx *ctx);
 
 	/**
-	@cmd: enum FMED_TASK. */
+	@cmd: enum FMED_TASK.
+	FMED_TASK_POST is thread-safe. */
 	void (*task)(fftask *task, uint cmd);
 
 	/**
 	@interval:  >0: periodic;  <0: one-shot;  0: disable.
+	Must be called from the main thread.
 	Return 0 on success. */
 	int (*timer)(fftmrq_entry *tmr, int64 interval, uint flags);
 };
@@ -174,6 +188,11 @@ enum FMED_INSTANCE_MODE {
 struct fmed_props {
 	uint stdout_busy :1;
 	uint stdin_busy :1;
+
+	/** Set before FMED_OPEN: audio is expected to be played through the audio output module. */
+	uint playback :1;
+	uint playdev; //playback device index;  0:default
+	ffpcm playback_fmt; //output format requested by user;  0:not set
 };
 
 struct fmed_mod {
@@ -240,6 +259,17 @@ enum FMED_TRACK_CMD {
 
 	FMED_TRACK_FILT_GETPREV, // get context pointer of the previous filter
 	FMED_TRACK_FILT_INSTANCE, // get (create) filter instance.  @param: void *filter_id
+
+	/** Start the track in a worker thread.
+	Track's handler function may be called from any thread.
+	The filters of such track run in the worker thread and may use only:
+	 . track->*() for this track
+	 . core->getval(), getmod(), getmod2(), log(), task(FMED_TASK_POST), cmd(FMED_TASK_XPOST)
+	They must not use the queue (qu->*()), core->timer() and must not control other tracks.
+	Meta data from "queue_item" is copied into the track and "queue_item" is unset:
+	 use FMED_TRACK_META_ENUM.
+	If "main_thread" value is set (e.g. for audio device output), the track is processed in the main thread. */
+	FMED_TRACK_XSTART,
 };
 
 enum FMED_TRK_TYPE {
@@ -249,6 +279,7 @@ enum FMED_TRK_TYPE {
 	FMED_TRK_TYPE_MIXIN,
 	FMED_TRK_TYPE_MIXOUT,
 	FMED_TRK_TYPE_NETIN,
+	FMED_TRK_TYPE_SUB, //PCM data is received from another track
 	_FMED_TRK_TYPE_END,
 
 	//obsolete:
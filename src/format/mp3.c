@@ -445,7 +445,10 @@ static int mpeg_out_process(void *ctx, fmed_filt *d)
 			return FMED_RERR;
 		}
 
-		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, (void*)"mpeg.encode"))
+		const char *enc = "mpeg.encode";
+		if (1 == core->getval("parallel_encode"))
+			enc = "split.seg";
+		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, (void*)enc))
 			return FMED_RERR;
 		return FMED_RMORE;
 
@@ -15,6 +15,7 @@ typedef struct mp4 {
 	ffmp4 mp;
 	uint state;
 	uint seeking :1;
+	uint stmcopy :1;
 } mp4;
 
 typedef struct mp4_out {
@@ -49,6 +50,7 @@ static const fmed_filter mp4_output = {
 };
 
 static void mp4_meta(mp4 *m, fmed_filt *d);
+static int mp4_copy_init(mp4 *m, fmed_filt *d);
 static int mp4_out_addmeta(mp4_out *m, fmed_filt *d);
 
 
@@ -98,6 +100,7 @@ static void* mp4_in_create(fmed_filt *d)
 	if ((int64)d->input.size != FMED_NULL)
 		m->mp.total_size = d->input.size;
 
+	m->stmcopy = d->stream_copy;
 	return m;
 }
 
@@ -121,6 +124,31 @@ static void mp4_meta(mp4 *m, fmed_filt *d)
 	qu->meta_set((void*)fmed_getval("queue_item"), name.ptr, name.len, val.ptr, val.len, FMED_QUE_TMETA);
 }
 
+/** Prepare to pass AAC packets to mp4.output as-is (--stream-copy).
+The first data block is AAC decoder config, as for aac.decode. */
+static int mp4_copy_init(mp4 *m, fmed_filt *d)
+{
+	if (m->mp.codec != FFMP4_AAC) {
+		errlog(core, d->trk, "mp4", "%s: --stream-copy is supported only for AAC", ffmp4_codec(m->mp.codec));
+		return -1;
+	}
+
+	d->audio.decoder = "AAC";
+	d->datatype = "aac";
+	d->audio.convfmt = d->audio.fmt;
+	d->audio.bitrate = (m->mp.aac_brate != 0) ? m->mp.aac_brate : ffmp4_bitrate(&m->mp);
+	fmed_setval("audio_frame_samples", 1024);
+	fmed_setval("audio_bitrate", d->audio.bitrate);
+
+	// mp4.output uses (total - pos) as the number of samples to write into the sample table
+	d->audio.pos = 0;
+	if ((int64)d->audio.seek != FMED_NULL)
+		d->audio.pos = ffpcm_samples(d->audio.seek, m->mp.fmt.sample_rate);
+	else
+		fmed_setval("audio_enc_delay", m->mp.enc_delay); // the first frames are preserved
+	return 0;
+}
+
 static int mp4_in_decode(void *ctx, fmed_filt *d)
 {
 	enum { I_HDR, I_DATA1, I_DATA, };
@@ -145,6 +173,8 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 			m->seeking = 1;
 			uint64 seek = ffpcm_samples(d->audio.seek, m->mp.fmt.sample_rate);
 			ffmp4_seek(&m->mp, seek);
+			if (m->stmcopy)
+				d->audio.seek = FMED_NULL;
 		}
 		if (m->state == I_DATA1) {
 			m->state = I_DATA;
@@ -167,6 +197,15 @@ static int mp4_in_decode(void *ctx, fmed_filt *d)
 
 			d->audio.total = ffmp4_totalsamples(&m->mp);
 
+			if (m->stmcopy) {
+				if (0 != mp4_copy_init(m, d))
+					return FMED_RERR;
+				d->data = m->mp.data,  d->datalen = m->mp.datalen;
+				d->out = m->mp.out,  d->outlen = m->mp.outlen;
+				m->state = I_DATA1;
+				continue;
+			}
+
 			const char *filt;
 			if (m->mp.codec == FFMP4_ALAC) {
 				filt = "alac.decode";
@@ -257,26 +296,22 @@ static void mp4_out_free(void *ctx)
 
 static int mp4_out_addmeta(mp4_out *m, fmed_filt *d)
 {
-	uint i;
-	ffstr name, *val;
-	void *qent;
-
-	if (FMED_PNULL == (qent = (void*)fmed_getval("queue_item")))
-		return 0;
+	fmed_trk_meta meta;
+	ffmem_tzero(&meta);
+	meta.flags = FMED_QUE_UNIQ;
 
-	for (i = 0;  NULL != (val = qu->meta(qent, i, &name, FMED_QUE_UNIQ));  i++) {
-		if (val == FMED_QUE_SKIP
-			|| ffstr_eqcz(&name, "vendor"))
+	while (0 == d->track->cmd2(d->trk, FMED_TRACK_META_ENUM, &meta)) {
+		if (ffstr_eqcz(&meta.name, "vendor"))
 			continue;
 
 		int tag;
-		if (-1 == (tag = ffs_findarrz(ffmmtag_str, FFCNT(ffmmtag_str), name.ptr, name.len))) {
-			warnlog(core, d->trk, "mp4", "unsupported tag: %S", &name);
+		if (-1 == (tag = ffs_findarrz(ffmmtag_str, FFCNT(ffmmtag_str), meta.name.ptr, meta.name.len))) {
+			warnlog(core, d->trk, "mp4", "unsupported tag: %S", &meta.name);
 			continue;
 		}
 
-		if (0 != ffmp4_addtag(&m->mp, tag, val->ptr, val->len)) {
-			warnlog(core, d->trk, "mp4", "can't add tag: %S", &name);
+		if (0 != ffmp4_addtag(&m->mp, tag, meta.val.ptr, meta.val.len)) {
+			warnlog(core, d->trk, "mp4", "can't add tag: %S", &meta.name);
 		}
 	}
 	return 0;
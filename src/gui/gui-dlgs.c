@@ -231,7 +231,7 @@ static const struct cvt_set cvt_sets[] = {
 	{ SETT_AAC_BANDWIDTH, "AAC Frequency Cut-off (Hz)", "max=20000", CVTF_EMPTY | FFOFF(cvt_sets_t, aac_bandwidth) },
 	{ SETT_FLAC_COMP, "FLAC Compression", "0..8", FFOFF(cvt_sets_t, flac_complevel) },
 	{ SETT_FLAC_MD5, "FLAC: generate MD5 checksum of uncompressed data", "0 or 1", CVTF_EMPTY | FFOFF(cvt_sets_t, flac_md5) },
-	{ SETT_DATACOPY, "Stream copy", "Don't re-encode OGG/MP3 data (0 or 1)", FFOFF(cvt_sets_t, stream_copy) },
+	{ SETT_DATACOPY, "Stream copy", "Don't re-encode OGG/MP3/M4A/FLAC/WAV data (0 or 1)", FFOFF(cvt_sets_t, stream_copy) },
 
 	{ SETT_META, "Meta Tags", "[clear;]NAME=VAL;...", CVTF_STR | CVTF_EMPTY | CVTF_NEWGRP | FFOFF(cvt_sets_t, meta) },
 	{ SETT_OUT_OVWR, "Overwrite Output File", "0 or 1", FFOFF(cvt_sets_t, overwrite) },
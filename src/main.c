@@ -37,6 +37,7 @@ static int fmed_arg_seek(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_install(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_channels(ffparser_schem *p, void *obj, ffstr *val);
 static int fmed_arg_format(ffparser_schem *p, void *obj, ffstr *val);
+static int fmed_arg_out(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_out_copy(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_input_chk(ffparser_schem *p, void *obj, const ffstr *val);
 static int fmed_arg_out_chk(ffparser_schem *p, void *obj, const ffstr *val);
@@ -44,6 +45,7 @@ static int fmed_arg_out_chk(ffparser_schem *p, void *obj, const ffstr *val);
 static void open_input(void *udata);
 static void fmed_onsig(void *udata);
 static void rec_lpback_new_track(fmed_cmd *cmd);
+static void rec_stations(fmed_cmd *cmd, const fmed_track *track);
 
 //LOG
 static void std_log(uint flags, fmed_logdata *ld);
@@ -74,6 +76,9 @@ static const ffpars_arg fmed_cmdline_args[] = {
 
 	//INPUT
 	{ "record",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(rec) },
+	{ "rec-trigger",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(rec_trigger) },
+	{ "monitor",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(rec_monitor) },
+	{ "stations",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY | FFPARS_FNOTEMPTY,  OFF(stations) },
 	{ "mix",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(mix) },
 	{ "seek",	FFPARS_TSTR | FFPARS_FNOTEMPTY,  FFPARS_DST(&fmed_arg_seek) },
 	{ "until",	FFPARS_TSTR | FFPARS_FNOTEMPTY,  FFPARS_DST(&fmed_arg_seek) },
@@ -97,9 +102,10 @@ static const ffpars_arg fmed_cmdline_args[] = {
 	{ "aac-profile",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY | FFPARS_FNOTEMPTY,  OFF(aac_profile) },
 	{ "flac-compression",	FFPARS_TINT8,  OFF(flac_complevel) },
 	{ "stream-copy",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(stream_copy) },
+	{ "parallel-encode",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(parallel_encode) },
 
 	//OUTPUT
-	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FCOPY | FFPARS_FNOTEMPTY | FFPARS_FSTRZ,  OFF(outfn) },
+	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FCOPY | FFPARS_FNOTEMPTY | FFPARS_FSTRZ | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_out) },
 	{ "overwrite",	FFPARS_SETVAL('y') | FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(overwrite) },
 	{ "out-copy",	FFPARS_TSTR | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_out_copy) },
 	{ "preserve-date",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(preserve_date) },
@@ -118,6 +124,7 @@ static const ffpars_arg fmed_cmdline_args[] = {
 	{ "debug",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(debug) },
 	{ "help",	FFPARS_SETVAL('h') | FFPARS_TBOOL | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_usage) },
 	{ "cue-gaps",	FFPARS_TINT8,  OFF(cue_gaps) },
+	{ "cue-split",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(cue_split) },
 
 	//INSTALL
 	{ "install",	FFPARS_TBOOL | FFPARS_FALONE,  FFPARS_DST(&fmed_arg_install) },
@@ -127,7 +134,7 @@ static const ffpars_arg fmed_cmdline_args[] = {
 static const ffpars_arg fmed_cmdline_main_args[] = {
 	{ "",	FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_input_chk) },
 	{ "*",	FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_skip) },
-	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR,  FFPARS_DST(&fmed_arg_out_chk) },
+	{ "out",	FFPARS_SETVAL('o') | FFPARS_TSTR | FFPARS_FMULTI,  FFPARS_DST(&fmed_arg_out_chk) },
 	{ "conf",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY | FFPARS_FNOTEMPTY,  OFF(conf_fn) },
 	{ "notui",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(notui) },
 	{ "gui",	FFPARS_TBOOL8 | FFPARS_FALONE,  OFF(gui) },
@@ -246,6 +253,25 @@ static int fmed_arg_channels(ffparser_schem *p, void *obj, ffstr *val)
 	return 0;
 }
 
+/** The first "--out" value is the main output file.
+The next values are added to "out_tee" list. */
+static int fmed_arg_out(ffparser_schem *p, void *obj, const ffstr *val)
+{
+	fmed_cmd *cmd = obj;
+	ffstr *s;
+	if (cmd->outfn.len == 0) {
+		ffstr_set2(&cmd->outfn, val);
+		return 0;
+	}
+
+	if (NULL == (s = ffarr_pushgrowT(&cmd->out_tee, 4, ffstr))) {
+		ffmem_free(val->ptr);
+		return FFPARS_ESYS;
+	}
+	ffstr_set2(s, val);
+	return 0;
+}
+
 static const char* const outcp_str[] = { "all", "cmd" };
 
 static int fmed_arg_out_copy(ffparser_schem *p, void *obj, const ffstr *val)
@@ -367,6 +393,11 @@ static int fmed_cmdline(int argc, char **argv, uint main_only)
 		goto fail;
 	}
 
+	if (!main_only && g->cmd->stream_copy && g->cmd->out_tee.len != 0) {
+		errlog(core, NULL, "core", "--stream-copy: only one --out is supported", NULL);
+		goto fail;
+	}
+
 	ret = 0;
 
 fail:
@@ -478,6 +509,8 @@ static void qu_setprops(fmed_cmd *fmed, const fmed_queue *qu, fmed_que_entry *qe
 	} else {
 		if (fmed->outfn.len != 0 && !fmed->rec)
 			qu->meta_set(qe, FFSTR("output"), fmed->outfn.ptr, fmed->outfn.len, FMED_QUE_TRKDICT);
+		if (fmed->out_tee.len != 0 && !fmed->rec)
+			qu_setval(qu, qe, "output_tee", (size_t)&fmed->out_tee);
 	}
 
 	if (fmed->rec)
@@ -603,14 +636,23 @@ static void open_input(void *udata)
 
 		if (fmed->outfn.len != 0)
 			track->setvalstr(trk, "output", fmed->outfn.ptr);
+		if (fmed->out_tee.len != 0)
+			track->setval(trk, "output_tee", (size_t)&fmed->out_tee);
 
 		if (fmed->rec)
 			track->setval(trk, "low_latency", 1);
+		if (fmed->rec_trigger)
+			track->setval(trk, "rec_trigger", 1);
+		if (fmed->rec_monitor)
+			track->setval(trk, "rec_monitor", 1);
 
 		track->cmd(trk, FMED_TRACK_START);
 	}
 
-	if (first == NULL && !fmed->rec && !fmed->gui)
+	if (fmed->stations != NULL)
+		rec_stations(fmed, track);
+
+	if (first == NULL && !fmed->rec && !fmed->gui && fmed->stations == NULL)
 		core->sig(FMED_STOP);
 
 	return;
@@ -619,6 +661,28 @@ end:
 	return;
 }
 
+/** Create a track that records all radio stations from the list file. */
+static void rec_stations(fmed_cmd *cmd, const fmed_track *track)
+{
+	void *trk;
+
+	cmd->notui = 1; // don't print progress of each recorded file
+	if (NULL == (trk = track->create(FMED_TRK_TYPE_NONE, NULL)))
+		return;
+
+	track->setvalstr(trk, "input", cmd->stations);
+	if (cmd->outfn.len != 0)
+		track->setvalstr(trk, "out_filename", cmd->outfn.ptr);
+	if (cmd->stream_copy)
+		track->setval(trk, "out_stream_copy", 1);
+
+	if (0 != track->cmd(trk, FMED_TRACK_ADDFILT, "net.stations")) {
+		track->cmd(trk, FMED_TRACK_STOP);
+		return;
+	}
+	track->cmd(trk, FMED_TRACK_START);
+}
+
 /** Create a track to support recording from WASAPI in loopback mode.
 It generates silence and plays it via an audio device,
  so data from WASAPI in looopback mode can be read continuously. */
@@ -785,6 +849,14 @@ int main(int argc, char **argv, char **env)
 		}
 	}
 
+	if (!gcmd->rec && !gcmd->info && !gcmd->stream_copy && gcmd->outfn.len == 0) {
+		core->props->playback = 1;
+		core->props->playdev = gcmd->playdev_name;
+		core->props->playback_fmt.format = gcmd->out_format;
+		core->props->playback_fmt.sample_rate = gcmd->out_rate;
+		core->props->playback_fmt.channels = gcmd->out_channels;
+	}
+
 	if (0 != core->sig(FMED_OPEN))
 		goto end;
 
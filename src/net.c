@@ -8,6 +8,7 @@ Copyright (c) 2016 Simon Zolin */
 #include <FF/net/http.h>
 #include <FF/data/utf8.h>
 #include <FF/list.h>
+#include <FF/path.h>
 #include <FFOS/asyncio.h>
 #include <FFOS/socket.h>
 #include <FFOS/error.h>
@@ -28,18 +29,44 @@ Copyright (c) 2016 Simon Zolin */
 typedef struct net_conf {
 	uint bufsize;
 	uint nbufs;
+	uint nbufs_min;
 	uint buf_lowat;
 	uint tmout;
+	uint conn_delay;
 	byte user_agent;
 	byte max_redirect;
 	byte max_reconnect;
 	byte meta;
+	uint cache_size;
+	uint cache_block;
+	uint readahead;
+
+	uint in_bufsize;
+	byte in_overflow; //enum NETIN_OVERFLOW
+
+	uint hls_segments;
+
+	uint st_split;
+	uint st_backoff_max;
+	uint st_status_intvl;
+	char *st_status_file;
+
+	uint srv_bufsize;
+	uint srv_burst;
+	uint srv_metaint;
+	uint srv_maxclients;
+	char *srv_name;
+	uint srv_latency;
+	uint srv_rate;
+	uint srv_drop;
+	uint srv_redirects;
 } net_conf;
 
 typedef struct netmod {
 	const fmed_queue *qu;
 	const fmed_track *track;
 	fflist1 recycled_cons;
+	ffarr servers; //netsrv*[]
 	net_conf conf;
 } netmod;
 
@@ -47,23 +74,57 @@ static netmod *net;
 static const fmed_core *core;
 
 typedef struct icy icy;
+typedef struct station station;
 
 typedef struct netin {
 	uint state;
-	ffarr d[2];
-	uint idx;
+	char *buf; //ring buffer
+	size_t cap;
+	size_t r; //read offset
+	size_t len; //number of filled bytes
+	size_t locked; //number of bytes returned to the next filter
+	uint64 dropped;
 	fftask task;
 	uint fin :1;
 	uint fn_dyn :1;
+	uint overflow :1; //the last write was dropped
 	icy *c;
 } netin;
 
+enum NETIN_OVERFLOW {
+	NETIN_DROP,
+	NETIN_BLOCK,
+};
+
 struct filter {
 	const struct ffhttp_filter *iface;
 	void *p;
 };
 
-typedef struct nethttp {
+#define TCP_MAXCONN  4 //max. number of parallel connection attempts
+
+typedef struct nethttp nethttp;
+
+/** Connection attempt. */
+typedef struct tcp_conn {
+	nethttp *c;
+	ffskt sk;
+	ffaio_task aio;
+	ffaddr addr;
+	uint busy :1
+		, signalled :1 //async connect has completed
+		;
+} tcp_conn;
+
+/** Cached data of a remote file. */
+typedef struct http_blk {
+	uint64 off;
+	size_t len; //number of filled bytes
+	char *ptr;
+	uint64 used; //LRU counter
+} http_blk;
+
+struct nethttp {
 	uint state;
 	fmed_filt *d;
 
@@ -76,8 +137,14 @@ typedef struct nethttp {
 	ffip6 ip;
 	ffaddrinfo *addr;
 	ffip_iter curaddr;
+	ffaddr *addrs; //resolved addresses in connection order
+	uint naddrs, iaddr;
+	int family; //address family of the last successful connection
+	tcp_conn conns[TCP_MAXCONN];
+	uint nconns; //connection attempts in progress
+	fftmrq_entry conn_tmr;
 	ffskt sk;
-	ffaio_task aio;
+	ffaio_task *aio;
 	uint reconnects;
 	fftmrq_entry tmr;
 
@@ -87,24 +154,56 @@ typedef struct nethttp {
 	size_t curbuf_len;
 	uint lowat; //low-watermark number of filled bytes for buffer
 	ffstr data;
+	int rstatus; //result of background receiving, returned when all buffers are consumed
+
+	// adaptive buffering:
+	uint target; //number of buffers to keep filled
+	uint floor; //minimum target, raised after underrun
+	fftime clk0;
+	uint64 floor_time; //msec: when 'floor' was changed
+	uint64 wait_start; //msec: when async recv has started
+	uint wait_avg, wait_var; //msec: smoothed I/O wait time and its mean deviation
+	uint underruns;
+
+	uint64 conn_start; //msec: when the connection has started
+	uint64 ioerr_time; //msec: when the last I/O error has occurred
 
 	ffstr hbuf;
 	ffhttp_response resp;
 	uint nredirect;
 	uint max_reconnect;
 
+	// remote file:
+	http_blk *blks;
+	uint nblks;
+	uint64 used;
+	http_blk *rblk; //the block returned to the next filter
+	http_blk *wblk; //the block being filled
+	uint64 off; //the offset requested by the next filter
+	uint64 want; //the offset which should be received
+	uint64 size; //file size;  -1: unknown
+	uint64 req_start, req_end; //the range requested last time
+	uint64 roff; //file offset of the next received byte
+	uint64 rend; //the end of response body;  -1: until the connection is closed
+	size_t ra; //read-ahead size
+
 	uint buflock :1
 		, iowait :1 //waiting for I/O, all input data is consumed
 		, async :1
-		, preload :1 //fill all buffers
+		, preload :1 //fill buffers up to 'target' before returning data
+		, started :1 //data has been returned to the next filter
+		, conn_next :1 //start the next connection attempt
 		, icy_meta_req :1
+		, file :1 //seekable input from a remote file (not a stream)
+		, conn_close :1 //the server will close the connection after response
+		, no_ranges :1 //the server doesn't support Range requests
 		;
 
 	fftask_handler handler;
 	void *udata;
 	uint status;
 	struct filter f;
-} nethttp;
+};
 
 struct icy {
 	fmed_filt *d;
@@ -115,9 +214,14 @@ struct icy {
 	netin *netin;
 	ffstr artist;
 	ffstr title;
+	ffstr blocked; //data waiting until "net.in" has free space
+	fftask task;
+	station *st;
+	uint64 split_at; //time (in seconds) when the next output file is started
 
 	uint out_copy :1;
 	uint save_oncmd :1;
+	uint rec_only :1; //don't pass data to the next filter
 };
 
 //FMEDIA MODULE
@@ -131,14 +235,20 @@ static const fmed_mod fmed_net_mod = {
 };
 
 static int ip_resolve(nethttp *c);
-static int tcp_prepare(nethttp *c, ffaddr *a);
-static int tcp_connect(nethttp *c, const struct sockaddr *addr, socklen_t addr_size);
+static int tcp_prepare(nethttp *c);
+static int tcp_connect(nethttp *c);
+static void tcp_close(nethttp *c);
+static void tcp_wake(nethttp *c);
 static int tcp_recv(nethttp *c);
 static void tcp_ontmr(void *param);
 static int tcp_recvhdrs(nethttp *c);
 static int tcp_send(nethttp *c);
 static int tcp_getdata(nethttp *c, ffstr *dst);
 static int tcp_ioerr(nethttp *c);
+static uint64 http_now(nethttp *c);
+static uint buf_filled(nethttp *c, size_t *bytes);
+static void jbuf_raise(nethttp *c);
+static void jbuf_check(nethttp *c);
 
 //HTTP
 static int http_config(ffpars_ctx *ctx);
@@ -153,6 +263,7 @@ static int http_conf_done(ffparser_schem *p, void *obj);
 static int http_prepreq(nethttp *c, ffstr *dst);
 static int http_parse(nethttp *c);
 static int http_recv(nethttp *c, uint tcpfin);
+static int httpf_process(nethttp *c, fmed_filt *d);
 
 // HTTP IFACE
 static void* http_if_request(const char *method, const char *url, uint flags);
@@ -184,8 +295,40 @@ static const fmed_filter fmed_netin = {
 	&netin_open, &netin_process, &netin_close
 };
 
+static int netin_config(ffpars_ctx *ctx);
 static void* netin_create(icy *c);
-static void netin_write(netin *n, const ffstr *data);
+static int netin_write(netin *n, const ffstr *data);
+
+//HLS
+static void* hls_open(fmed_filt *d);
+static int hls_process(void *ctx, fmed_filt *d);
+static void hls_close(void *ctx);
+static int hls_config(ffpars_ctx *ctx);
+static const fmed_filter fmed_hls = {
+	&hls_open, &hls_process, &hls_close
+};
+
+//SERVER
+static void* srvout_open(fmed_filt *d);
+static int srvout_process(void *ctx, fmed_filt *d);
+static void srvout_close(void *ctx);
+static int srv_config(ffpars_ctx *ctx);
+static const fmed_filter fmed_srvout = {
+	&srvout_open, &srvout_process, &srvout_close
+};
+
+static void srv_free(void *p);
+
+//STATIONS
+static void* st_open(fmed_filt *d);
+static int st_process(void *ctx, fmed_filt *d);
+static void st_close(void *ctx);
+static int st_config(ffpars_ctx *ctx);
+static const fmed_filter fmed_stations = {
+	&st_open, &st_process, &st_close
+};
+
+static void st_ended(station *st);
 
 
 enum {
@@ -206,11 +349,16 @@ static const ffpars_enumlist ua_enum = { ua_enumstr, FFCNT(ua_enumstr), FFPARS_D
 static const ffpars_arg net_conf_args[] = {
 	{ "bufsize",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, bufsize) },
 	{ "buffers",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, nbufs) },
+	{ "buffers_min",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, nbufs_min) },
 	{ "buffer_lowat",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, buf_lowat) },
 	{ "timeout",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, tmout) },
+	{ "connect_delay",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, conn_delay) },
 	{ "user_agent",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&ua_enum) },
 	{ "max_redirect",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(net_conf, max_redirect) },
 	{ "max_reconnect",	FFPARS_TINT8,  FFPARS_DSTOFF(net_conf, max_reconnect) },
+	{ "cache_size",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, cache_size) },
+	{ "cache_block",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, cache_block) },
+	{ "readahead",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, readahead) },
 	{ NULL,	FFPARS_TCLOSE,	FFPARS_DST(&http_conf_done) },
 };
 
@@ -232,6 +380,12 @@ static const void* net_iface(const char *name)
 		return &fmed_http;
 	else if (!ffsz_cmp(name, "httpif"))
 		return &http_iface;
+	else if (!ffsz_cmp(name, "hls"))
+		return &fmed_hls;
+	else if (!ffsz_cmp(name, "server"))
+		return &fmed_srvout;
+	else if (!ffsz_cmp(name, "stations"))
+		return &fmed_stations;
 	return NULL;
 }
 
@@ -239,8 +393,16 @@ static int net_mod_conf(const char *name, ffpars_ctx *ctx)
 {
 	if (!ffsz_cmp(name, "icy"))
 		return icy_config(ctx);
+	else if (!ffsz_cmp(name, "in"))
+		return netin_config(ctx);
 	else if (!ffsz_cmp(name, "http"))
 		return http_config(ctx);
+	else if (!ffsz_cmp(name, "hls"))
+		return hls_config(ctx);
+	else if (!ffsz_cmp(name, "server"))
+		return srv_config(ctx);
+	else if (!ffsz_cmp(name, "stations"))
+		return st_config(ctx);
 	return -1;
 }
 
@@ -273,6 +435,9 @@ static void net_destroy(void)
 	while (NULL != (c = (void*)fflist1_pop(&net->recycled_cons))) {
 		ffmem_free(FF_GETPTR(nethttp, recycled, c));
 	}
+	FFARR_FREE_ALL_PTR(&net->servers, srv_free, void*);
+	ffmem_safefree(net->conf.srv_name);
+	ffmem_safefree(net->conf.st_status_file);
 	ffmem_free0(net);
 	ffhttp_freeheaders();
 }
@@ -325,15 +490,11 @@ static void http_if_close(void *con)
 		c->f.iface->close(c->f.p);
 
 	FF_SAFECLOSE(c->addr, NULL, ffaddr_free);
-	if (c->sk != FF_BADSKT) {
-		ffskt_fin(c->sk);
-		ffskt_close(c->sk);
-		c->sk = FF_BADSKT;
-	}
+	tcp_close(c);
+	ffmem_safefree(c->addrs);
 	if (c->host != c->orighost)
 		ffmem_safefree(c->host);
 	ffmem_safefree(c->orighost);
-	ffaio_fin(&c->aio);
 	ffhttp_respfree(&c->resp);
 
 	uint i;
@@ -344,9 +505,14 @@ static void http_if_close(void *con)
 
 	ffstr_free(&c->hbuf);
 
-	uint inst = c->aio.instance;
+	uint inst[TCP_MAXCONN];
+	for (i = 0;  i != TCP_MAXCONN;  i++) {
+		inst[i] = c->conns[i].aio.instance;
+	}
 	ffmem_tzero(c);
-	c->aio.instance = inst;
+	for (i = 0;  i != TCP_MAXCONN;  i++) {
+		c->conns[i].aio.instance = inst[i];
+	}
 	fflist1_push(&net->recycled_cons, &c->recycled);
 }
 
@@ -358,9 +524,10 @@ static void http_if_sethandler(void *con, fftask_handler func, void *udata)
 }
 
 enum {
-	I_ADDR, I_NEXTADDR, I_CONN,
+	I_ADDR, I_CONN,
 	I_HTTP_REQ, I_HTTP_REQ_SEND, I_HTTP_RESP, I_HTTP_RESP_PARSE, I_HTTP_RECVBODY1, I_HTTP_RECVBODY, I_HTTP_RESPBODY,
 	I_DONE, I_ERR,
+	I_FILE_IDLE, I_FILE_BODY,
 };
 
 static void call_handler(nethttp *c, uint status)
@@ -372,7 +539,6 @@ static void call_handler(nethttp *c, uint status)
 static void http_if_process(nethttp *c)
 {
 	int r;
-	ffaddr a = {0};
 
 	for (;;) {
 	switch (c->state) {
@@ -384,11 +550,7 @@ static void http_if_process(nethttp *c)
 			continue;
 		}
 		call_handler(c, FMED_NET_IP_WAIT);
-		c->state = I_NEXTADDR;
-		// fall through
-
-	case I_NEXTADDR:
-		if (0 != tcp_prepare(c, &a)) {
+		if (0 != tcp_prepare(c)) {
 			c->state = I_ERR;
 			continue;
 		}
@@ -396,11 +558,11 @@ static void http_if_process(nethttp *c)
 		// fall through
 
 	case I_CONN:
-		r = tcp_connect(c, &a.a, a.len);
+		r = tcp_connect(c);
 		if (r == FMED_RASYNC)
 			return;
-		else if (r == FMED_RMORE) {
-			c->state = I_NEXTADDR;
+		else if (r == FMED_RERR) {
+			c->state = I_ERR;
 			continue;
 		}
 		call_handler(c, FMED_NET_REQ_WAIT);
@@ -575,12 +737,17 @@ static int http_if_recv(void *con, ffhttp_response **resp, ffstr *data)
 static int http_config(ffpars_ctx *ctx)
 {
 	net->conf.bufsize = 16 * 1024;
-	net->conf.nbufs = 2;
+	net->conf.nbufs = 8;
+	net->conf.nbufs_min = 2;
 	net->conf.buf_lowat = 8 * 1024;
 	net->conf.tmout = 5000;
+	net->conf.conn_delay = 250;
 	net->conf.user_agent = UA_OFF;
 	net->conf.max_redirect = 10;
 	net->conf.max_reconnect = 3;
+	net->conf.cache_size = 4 * 1024 * 1024;
+	net->conf.cache_block = 64 * 1024;
+	net->conf.readahead = 1024 * 1024;
 	ffpars_setargs(ctx, &net->conf, net_conf_args, FFCNT(net_conf_args));
 	return 0;
 }
@@ -588,6 +755,8 @@ static int http_config(ffpars_ctx *ctx)
 static int http_conf_done(ffparser_schem *p, void *obj)
 {
 	net->conf.buf_lowat = ffmin(net->conf.buf_lowat, net->conf.bufsize);
+	net->conf.nbufs_min = ffmin(net->conf.nbufs_min, net->conf.nbufs);
+	net->conf.readahead = ffmax(net->conf.readahead, net->conf.cache_block);
 	return 0;
 }
 
@@ -632,6 +801,21 @@ static void* http_open(fmed_filt *d)
 	c->method = "GET";
 	c->max_reconnect = net->conf.max_reconnect;
 	c->icy_meta_req = net->conf.meta;
+	c->target = c->floor = net->conf.nbufs_min;
+	ffclk_get(&c->clk0);
+
+	if (FMED_NULL == d->track->getval(d->trk, "http_stream")) {
+		// remote file: cache the received data, so the next filters may seek
+		c->file = 1;
+		c->state = I_FILE_IDLE;
+		c->icy_meta_req = 0;
+		c->size = (uint64)-1;
+		c->nblks = ffmax(net->conf.cache_size / net->conf.cache_block, 3);
+		if (NULL == (c->blks = ffmem_callocT(c->nblks, http_blk))) {
+			syserrlog(d->trk, "%s", ffmem_alloc_S);
+			goto done;
+		}
+	}
 
 	return c;
 
@@ -646,15 +830,11 @@ static void http_close(void *ctx)
 
 	core->timer(&c->tmr, 0, 0);
 	FF_SAFECLOSE(c->addr, NULL, ffaddr_free);
-	if (c->sk != FF_BADSKT) {
-		ffskt_fin(c->sk);
-		ffskt_close(c->sk);
-		c->sk = FF_BADSKT;
-	}
+	tcp_close(c);
+	ffmem_safefree(c->addrs);
 	if (c->host != c->orighost)
 		ffmem_safefree(c->host);
 	ffmem_safefree(c->orighost);
-	ffaio_fin(&c->aio);
 	ffhttp_respfree(&c->resp);
 
 	uint i;
@@ -665,9 +845,21 @@ static void http_close(void *ctx)
 
 	ffstr_free(&c->hbuf);
 
-	uint inst = c->aio.instance;
+	if (c->blks != NULL) {
+		for (i = 0;  i != c->nblks;  i++) {
+			ffmem_safefree(c->blks[i].ptr);
+		}
+		ffmem_free(c->blks);
+	}
+
+	uint inst[TCP_MAXCONN];
+	for (i = 0;  i != TCP_MAXCONN;  i++) {
+		inst[i] = c->conns[i].aio.instance;
+	}
 	ffmem_tzero(c);
-	c->aio.instance = inst;
+	for (i = 0;  i != TCP_MAXCONN;  i++) {
+		c->conns[i].aio.instance = inst[i];
+	}
 	fflist1_push(&net->recycled_cons, &c->recycled);
 }
 
@@ -729,76 +921,257 @@ done:
 	return -1;
 }
 
-static int tcp_prepare(nethttp *c, ffaddr *a)
+/* Connection racing (RFC 8305):
+The resolved addresses are ordered so that IPv6 and IPv4 addresses alternate.
+A new connection attempt is started after "connect_delay" msec or as soon as the previous one fails,
+ while at most TCP_MAXCONN attempts are in progress.
+The first connected socket wins, the other attempts are cancelled.
+The family of the winner is tried first on reconnection.
+*/
+
+/** Get the list of addresses to connect to. */
+static int tcp_prepare(nethttp *c)
 {
 	void *ip;
 	int family;
-	while (0 != (family = ffip_next(&c->curaddr, &ip))) {
+	ffarr a6 = {0}, a4 = {0};
+	ffaddr *a;
+	int rc = -1;
 
+	while (0 != (family = ffip_next(&c->curaddr, &ip))) {
+		if (NULL == (a = ffarr_pushgrowT((family == AF_INET6) ? &a6 : &a4, 4, ffaddr))) {
+			syserrlog(c->d->trk, "%s", ffmem_alloc_S);
+			goto end;
+		}
+		ffaddr_init(a);
 		ffaddr_setip(a, family, ip);
 		ffip_setport(a, c->url.port);
+	}
+
+	ffmem_safefree(c->addrs);
+	c->naddrs = a6.len + a4.len;
+	c->iaddr = 0;
+	if (NULL == (c->addrs = ffmem_allocT(c->naddrs + 1, ffaddr))) {
+		syserrlog(c->d->trk, "%s", ffmem_alloc_S);
+		goto end;
+	}
+
+	// interleave the families, the preferred one goes first
+	ffarr *first = (c->family == AF_INET) ? &a4 : &a6;
+	ffarr *second = (first == &a6) ? &a4 : &a6;
+	size_t i1 = 0, i2 = 0;
+	for (uint i = 0;  i != c->naddrs;  i++) {
+		if (i1 != first->len && (i2 == second->len || i % 2 == 0))
+			c->addrs[i] = ((ffaddr*)first->ptr)[i1++];
+		else
+			c->addrs[i] = ((ffaddr*)second->ptr)[i2++];
+	}
+	rc = 0;
+
+end:
+	ffarr_free(&a6);
+	ffarr_free(&a4);
+	FF_SAFECLOSE(c->addr, NULL, ffaddr_free);
+	ffmem_tzero(&c->curaddr);
+	return rc;
+}
+
+static void tcp_conn_close(tcp_conn *k)
+{
+	ffskt_close(k->sk);
+	ffaio_fin(&k->aio);
+	k->busy = 0;
+	k->signalled = 0;
+}
+
+/** Close all sockets. */
+static void tcp_close(nethttp *c)
+{
+	if (c->sk != FF_BADSKT)
+		ffskt_fin(c->sk);
+	for (uint i = 0;  i != TCP_MAXCONN;  i++) {
+		if (c->conns[i].busy)
+			tcp_conn_close(&c->conns[i]);
+	}
+	c->nconns = 0;
+	c->sk = FF_BADSKT;
+	c->aio = NULL;
+	core->timer(&c->conn_tmr, 0, 0);
+}
+
+static void tcp_conn_a(void *udata)
+{
+	tcp_conn *k = udata;
+	nethttp *c = k->c;
+	k->signalled = 1;
+	c->async = 0;
+	tcp_wake(c);
+}
+
+static void tcp_conn_ontmr(void *param)
+{
+	nethttp *c = param;
+	c->conn_next = 1;
+	c->async = 0;
+	tcp_wake(c);
+}
+
+/** Use the connected socket. */
+static int tcp_connected(nethttp *c, tcp_conn *k)
+{
+	char saddr[FF_MAXIP6];
+	size_t n = ffaddr_tostr(&k->addr, saddr, sizeof(saddr), FFADDR_USEPORT);
+	uint t = http_now(c) - c->conn_start;
+	dbglog(c->d->trk, "%s ok: %*s  (%ums)", ffskt_connect_S, n, saddr, t);
+	c->d->track->setval(c->d->trk, "net_connect_ms", t);
+
+	core->timer(&c->conn_tmr, 0, 0);
+	core->timer(&c->tmr, 0, 0);
+	for (uint i = 0;  i != TCP_MAXCONN;  i++) {
+		if (c->conns[i].busy && &c->conns[i] != k)
+			tcp_conn_close(&c->conns[i]);
+	}
+	c->nconns = 1;
+
+	c->sk = k->sk;
+	c->aio = &k->aio;
+	k->aio.udata = c;
+	c->family = ffaddr_family(&k->addr);
+	ffmem_free0(c->addrs);
+	c->naddrs = 0;
+	return 0;
+}
+
+/** Start a connection attempt to the next address.
+Return 0 if connected;  FMED_RASYNC;  FMED_RMORE if there are no more addresses. */
+static int tcp_conn_start(nethttp *c)
+{
+	tcp_conn *k = NULL;
+	int r;
+
+	for (uint i = 0;  i != TCP_MAXCONN;  i++) {
+		if (!c->conns[i].busy) {
+			k = &c->conns[i];
+			break;
+		}
+	}
+	if (k == NULL)
+		return FMED_RASYNC;
+
+	while (c->iaddr != c->naddrs) {
+		k->addr = c->addrs[c->iaddr++];
 
 		char saddr[FF_MAXIP6];
-		size_t n = ffaddr_tostr(a, saddr, sizeof(saddr), FFADDR_USEPORT);
+		size_t n = ffaddr_tostr(&k->addr, saddr, sizeof(saddr), FFADDR_USEPORT);
 		ffstr host = ffurl_get(&c->url, c->host, FFURL_HOST);
 		infolog(c->d->trk, "connecting to %S (%*s)...", &host, n, saddr);
 
-		if (FF_BADSKT == (c->sk = ffskt_create(family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))) {
+		if (FF_BADSKT == (k->sk = ffskt_create(ffaddr_family(&k->addr), SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))) {
 			syswarnlog(c->d->trk, "%s", ffskt_create_S);
-			ffskt_close(c->sk);
-			c->sk = FF_BADSKT;
 			continue;
 		}
 
-		if (0 != ffskt_setopt(c->sk, IPPROTO_TCP, TCP_NODELAY, 1))
+		if (0 != ffskt_setopt(k->sk, IPPROTO_TCP, TCP_NODELAY, 1))
 			syswarnlog(c->d->trk, "%s", ffskt_setopt_S);
 
-		ffaio_init(&c->aio);
-		c->aio.sk = c->sk;
-		c->aio.udata = c;
-		if (0 != ffaio_attach(&c->aio, core->kq, FFKQU_READ | FFKQU_WRITE)) {
-			syserrlog(c->d->trk, "%s", ffkqu_attach_S);
-			return -1;
+		k->c = c;
+		k->busy = 1;
+		ffaio_init(&k->aio);
+		k->aio.sk = k->sk;
+		k->aio.udata = k;
+		if (0 != ffaio_attach(&k->aio, core->kq, FFKQU_READ | FFKQU_WRITE)) {
+			syswarnlog(c->d->trk, "%s", ffkqu_attach_S);
+			tcp_conn_close(k);
+			continue;
 		}
-		return 0;
+
+		r = ffaio_connect(&k->aio, &tcp_conn_a, &k->addr.a, k->addr.len);
+		if (r == FFAIO_ERROR) {
+			syswarnlog(c->d->trk, "%s", ffskt_connect_S);
+			tcp_conn_close(k);
+			continue;
+		} else if (r == 0)
+			return tcp_connected(c, k);
+
+		if (c->nconns++ == 0)
+			core->timer(&c->tmr, -(int)net->conf.tmout, 0);
+		if (c->iaddr != c->naddrs && net->conf.conn_delay != 0)
+			core->timer(&c->conn_tmr, -(int)net->conf.conn_delay, 0);
+		return FMED_RASYNC;
 	}
 
-	errlog(c->d->trk, "no next address to connect");
-	return -1;
+	return FMED_RMORE;
 }
 
-static void tcp_aio(void *udata)
+/**
+Return 0 if connected;  FMED_RASYNC;  FMED_RERR if all attempts have failed. */
+static int tcp_connect(nethttp *c)
+{
+	int r;
+
+	c->conn_tmr.handler = &tcp_conn_ontmr;
+	c->conn_tmr.param = c;
+
+	// get the results of the completed attempts
+	for (uint i = 0;  i != TCP_MAXCONN;  i++) {
+		tcp_conn *k = &c->conns[i];
+		if (!k->signalled)
+			continue;
+		k->signalled = 0;
+
+		r = ffaio_connect(&k->aio, &tcp_conn_a, &k->addr.a, k->addr.len);
+		if (r == FFAIO_ASYNC)
+			continue;
+		else if (r == FFAIO_ERROR) {
+			syswarnlog(c->d->trk, "%s", ffskt_connect_S);
+			tcp_conn_close(k);
+			c->nconns--;
+			c->conn_next = 1; //don't wait for the timer
+			continue;
+		}
+		return tcp_connected(c, k);
+	}
+
+	if (c->nconns == 0)
+		c->conn_next = 1;
+
+	if (c->conn_next) {
+		c->conn_next = 0;
+		if (0 == tcp_conn_start(c))
+			return 0;
+	}
+
+	if (c->nconns == 0) {
+		errlog(c->d->trk, "no next address to connect");
+		core->timer(&c->tmr, 0, 0);
+		return FMED_RERR;
+	}
+
+	c->async = 1;
+	return FMED_RASYNC;
+}
+
+/** Continue processing after asynchronous I/O has completed. */
+static void tcp_wake(nethttp *c)
 {
-	nethttp *c = udata;
-	c->async = 0;
-	core->timer(&c->tmr, 0, 0);
 	if (c->d->handler == NULL)
 		http_if_process(c);
-	else
+	else if (c->file) {
+		// read-ahead doesn't wake the track if it doesn't wait for data
+		if (!c->iowait)
+			return;
+		c->iowait = 0;
+		c->d->handler(c->d->trk);
+	} else
 		c->d->handler(c->d->trk);
 }
 
-static int tcp_connect(nethttp *c, const struct sockaddr *addr, socklen_t addr_size)
+static void tcp_aio(void *udata)
 {
-	int r;
-	r = ffaio_connect(&c->aio, &tcp_aio, addr, addr_size);
-	if (r == FFAIO_ERROR) {
-		syswarnlog(c->d->trk, "%s", ffskt_connect_S);
-		ffskt_close(c->sk);
-		c->sk = FF_BADSKT;
-		ffaio_fin(&c->aio);
-		return FMED_RMORE;
-
-	} else if (r == FFAIO_ASYNC) {
-		c->async = 1;
-		core->timer(&c->tmr, -(int)net->conf.tmout, 0);
-		return FMED_RASYNC;
-	}
-
-	dbglog(c->d->trk, "%s ok", ffskt_connect_S);
-	FF_SAFECLOSE(c->addr, NULL, ffaddr_free);
-	ffmem_tzero(&c->curaddr);
-	return 0;
+	nethttp *c = udata;
+	c->async = 0;
+	core->timer(&c->tmr, 0, 0);
+	tcp_wake(c);
 }
 
 static void tcp_ontmr(void *param)
@@ -807,10 +1180,7 @@ static void tcp_ontmr(void *param)
 	warnlog(c->d->trk, "I/O timeout", 0);
 	c->async = 0;
 	tcp_ioerr(c);
-	if (c->d->handler == NULL)
-		http_if_process(c);
-	else
-		c->d->handler(c->d->trk);
+	tcp_wake(c);
 }
 
 static int tcp_recvhdrs(nethttp *c)
@@ -822,7 +1192,7 @@ static int tcp_recvhdrs(nethttp *c)
 		return FMED_RMORE;
 	}
 
-	r = ffaio_recv(&c->aio, &tcp_aio, ffarr_end(&c->bufs[0]), net->conf.bufsize - c->bufs[0].len);
+	r = ffaio_recv(c->aio, &tcp_aio, ffarr_end(&c->bufs[0]), net->conf.bufsize - c->bufs[0].len);
 	if (r == FFAIO_ASYNC) {
 		dbglog(c->d->trk, "async recv...");
 		c->async = 1;
@@ -854,9 +1224,20 @@ static int tcp_getdata(nethttp *c, ffstr *dst)
 	}
 
 	if (c->bufs[c->rbuf].len == 0) {
-		FF_ASSERT(!c->async);
-		r = tcp_recv(c);
+		if (c->rstatus != 0) {
+			r = c->rstatus;
+			c->rstatus = 0;
+		} else if (c->async)
+			r = FMED_RASYNC; //background recv is in progress
+		else
+			r = tcp_recv(c);
+
 		if (r == FMED_RASYNC) {
+			if (c->started) {
+				c->underruns++;
+				jbuf_raise(c);
+				c->d->track->setval(c->d->trk, "net_underruns", c->underruns);
+			}
 			infolog(c->d->trk, "precaching data...");
 			c->iowait = 1;
 			c->preload = 1;
@@ -881,7 +1262,18 @@ static int tcp_getdata(nethttp *c, ffstr *dst)
 
 	ffstr_set2(dst, &c->bufs[c->rbuf]);
 	c->buflock = 1;
+	c->started = 1;
 	dbglog(c->d->trk, "lock buf #%u", c->rbuf);
+
+	jbuf_check(c);
+
+	// continue receiving while the next filters process this buffer
+	if (!c->async && c->bufs[c->wbuf].len == 0) {
+		r = tcp_recv(c);
+		if (r != FMED_RASYNC && r != FMED_RDATA)
+			c->rstatus = r;
+	}
+
 	return FMED_RDATA;
 }
 
@@ -893,10 +1285,8 @@ static int tcp_ioerr(nethttp *c)
 		return 1;
 	}
 
-	ffskt_fin(c->sk);
-	ffskt_close(c->sk);
-	c->sk = FF_BADSKT;
-	ffaio_fin(&c->aio);
+	tcp_close(c);
+	ffmem_free0(c->addrs);
 
 	if (c->host != c->orighost) {
 		ffmem_free(c->host);
@@ -906,27 +1296,161 @@ static int tcp_ioerr(nethttp *c)
 	ffmem_tzero(&c->iplist);
 	ffmem_tzero(&c->ip);
 
-	c->bufs[0].len = 0;
+	for (uint i = 0;  i != net->conf.nbufs;  i++) {
+		c->bufs[i].len = 0;
+	}
+	c->buflock = 0;
+	c->rstatus = 0;
 	c->curbuf_len = 0;
 	c->wbuf = c->rbuf = 0;
 	c->lowat = 0;
 
 	ffhttp_respfree(&c->resp);
 	ffhttp_respinit(&c->resp);
+	c->ioerr_time = http_now(c);
 	c->state = I_ADDR;
+	if (c->file) {
+		c->wblk = NULL;
+		c->state = I_FILE_IDLE; //request the data again
+	}
 	dbglog(c->d->trk, "reconnecting...", 0);
 	return 0;
 }
 
+/* Adaptive buffering:
+The time spent waiting for network data is measured the same way TCP estimates RTT:
+ smoothed average and mean deviation.
+The number of buffers kept filled is enough to play audio for 'avg + 4 * dev' msec.
+An underrun (or a predicted underrun) raises the minimum, which then slowly decreases
+ while the network is stable.
+*/
+
+#define JBUF_SHRINK_MS  30000
+
+static uint64 http_now(nethttp *c)
+{
+	fftime t;
+	ffclk_get(&t);
+	ffclk_diff(&c->clk0, &t);
+	return fftime_ms(&t);
+}
+
+/** Get the number of bytes per second consumed by the next filters.
+Return 0 if unknown. */
+static uint http_byterate(nethttp *c)
+{
+	uint br = c->d->audio.bitrate;
+	if (br == 0 || (int)br == FMED_NULL)
+		return 0;
+	return br / 8;
+}
+
+/** Get the number of filled buffers. */
+static uint buf_filled(nethttp *c, size_t *bytes)
+{
+	uint n = 0;
+	size_t sz = c->curbuf_len;
+	for (uint i = 0;  i != net->conf.nbufs;  i++) {
+		if (c->bufs[i].len != 0) {
+			n++;
+			sz += c->bufs[i].len;
+		}
+	}
+	if (bytes != NULL)
+		*bytes = sz;
+	return n;
+}
+
+/** Set the number of buffers to fill. */
+static void jbuf_adjust(nethttp *c)
+{
+	uint64 now = http_now(c);
+	uint byterate = http_byterate(c);
+
+	if (c->floor > net->conf.nbufs_min && now - c->floor_time > JBUF_SHRINK_MS) {
+		c->floor--;
+		c->floor_time = now;
+	}
+
+	uint n = c->floor;
+	if (byterate != 0) {
+		uint64 bytes = (uint64)byterate * (c->wait_avg + 4 * c->wait_var) / 1000;
+		n = ffmax(n, bytes / net->conf.bufsize + 1);
+	}
+	n = ffmin(n, net->conf.nbufs);
+	if (n != c->target) {
+		dbglog(c->d->trk, "buffers: %u -> %u  (wait: %ums +/-%ums)"
+			, c->target, n, c->wait_avg, c->wait_var);
+		c->target = n;
+		c->d->track->setval(c->d->trk, "net_buffers", n);
+	}
+}
+
+/** Async recv has completed: update the wait time estimate. */
+static void jbuf_wait(nethttp *c)
+{
+	uint t = http_now(c) - c->wait_start;
+	if (c->wait_avg == 0 && c->wait_var == 0) {
+		c->wait_avg = t;
+		c->wait_var = t / 2;
+	} else {
+		uint d = (c->wait_avg > t) ? c->wait_avg - t : t - c->wait_avg;
+		c->wait_var = (3 * c->wait_var + d) / 4;
+		c->wait_avg = (7 * c->wait_avg + t) / 8;
+	}
+	jbuf_adjust(c);
+}
+
+/** Increase the minimum number of buffers after underrun. */
+static void jbuf_raise(nethttp *c)
+{
+	if (c->floor != net->conf.nbufs)
+		c->floor++;
+	c->floor_time = http_now(c);
+	infolog(c->d->trk, "buffer underrun #%u", c->underruns);
+	jbuf_adjust(c);
+}
+
+/** Predict underrun: the buffered data will be consumed before the expected network wait is over. */
+static void jbuf_check(nethttp *c)
+{
+	size_t bytes;
+	uint byterate = http_byterate(c);
+	if (byterate == 0)
+		return;
+
+	buf_filled(c, &bytes);
+	uint ms = (uint64)bytes * 1000 / byterate;
+	c->d->track->setval(c->d->trk, "net_buffer_ms", ms);
+
+	if (c->async
+		&& ms < c->wait_avg + 2 * c->wait_var
+		&& c->floor != net->conf.nbufs
+		&& http_now(c) - c->floor_time > 1000) {
+		dbglog(c->d->trk, "predicted underrun: %ums buffered, expected wait %ums"
+			, ms, c->wait_avg + 2 * c->wait_var);
+		c->floor++;
+		c->floor_time = http_now(c);
+		jbuf_adjust(c);
+	}
+}
+
 static void tcp_recv_a(void *udata)
 {
 	nethttp *c = udata;
 	core->timer(&c->tmr, 0, 0);
 	c->async = 0;
+	if (c->d->handler != NULL)
+		jbuf_wait(c);
 	int r = tcp_recv(c);
 	if (r == FMED_RASYNC)
 		return;
-	else if (r == FMED_RERR)
+	else if (c->d->handler != NULL && !c->iowait) {
+		// the track still has the data to process
+		if (r != FMED_RDATA)
+			c->rstatus = r;
+		return;
+	} else if (r == FMED_RERR)
 		tcp_ioerr(c);
 	else if (r == FMED_RDONE)
 		c->state = I_DONE;
@@ -951,11 +1475,12 @@ static int tcp_recv(nethttp *c)
 	for (;;) {
 
 		dbglog(c->d->trk, "buf #%u recv...  rpending:%u  size:%u"
-			, c->wbuf, c->aio.rpending
+			, c->wbuf, c->aio->rpending
 			, (int)net->conf.bufsize - (int)c->curbuf_len);
-		r = ffaio_recv(&c->aio, &tcp_recv_a, c->bufs[c->wbuf].ptr + c->curbuf_len, net->conf.bufsize - c->curbuf_len);
+		r = ffaio_recv(c->aio, &tcp_recv_a, c->bufs[c->wbuf].ptr + c->curbuf_len, net->conf.bufsize - c->curbuf_len);
 		if (r == FFAIO_ASYNC) {
 			dbglog(c->d->trk, "buf #%u async recv...", c->wbuf);
+			c->wait_start = http_now(c);
 			c->async = 1;
 			core->timer(&c->tmr, -(int)net->conf.tmout, 0);
 			return FMED_RASYNC;
@@ -977,7 +1502,7 @@ static int tcp_recv(nethttp *c)
 		c->bufs[c->wbuf].len = c->curbuf_len;
 		c->curbuf_len = 0;
 		c->wbuf = ffint_cycleinc(c->wbuf, net->conf.nbufs);
-		if (c->preload && c->bufs[c->wbuf].len == 0) {
+		if (c->bufs[c->wbuf].len == 0 && buf_filled(c, NULL) < c->target) {
 			// the next buffer is free, so start filling it
 			continue;
 		}
@@ -993,7 +1518,7 @@ static int tcp_send(nethttp *c)
 	int r;
 
 	for (;;) {
-		r = ffaio_send(&c->aio, &tcp_aio, c->data.ptr, c->data.len);
+		r = ffaio_send(c->aio, &tcp_aio, c->data.ptr, c->data.len);
 		if (r == FFAIO_ERROR) {
 			syserrlog(c->d->trk, "%s", ffskt_send_S);
 			return FMED_RERR;
@@ -1032,6 +1557,20 @@ static int http_prepreq(nethttp *c, ffstr *dst)
 		ffstr_setz(&s, "1");
 		ffhttp_addhdr_str(&ck, &fficy_shdr[FFICY_HMETADATA], &s);
 	}
+	if (c->file) {
+		char buf[64];
+		ffstr name;
+		ffstr_setcz(&name, "Connection");
+		ffstr_setcz(&s, "keep-alive");
+		ffhttp_addhdr_str(&ck, &name, &s);
+		if (!c->no_ranges) {
+			ffstr_setcz(&name, "Range");
+			s.ptr = buf;
+			s.len = ffs_fmt(buf, buf + sizeof(buf), "bytes=%U-%U", c->req_start, c->req_end - 1);
+			ffhttp_addhdr_str(&ck, &name, &s);
+			dbglog(c->d->trk, "range: %S", &s);
+		}
+	}
 	ffhttp_cookfin(&ck);
 	ffstr_acqstr3(&c->hbuf, &ck.buf);
 	ffstr_set2(dst, &c->hbuf);
@@ -1062,12 +1601,7 @@ static int http_parse(nethttp *c)
 		&& 0 != ffhttp_findihdr(&c->resp.h, FFHTTP_LOCATION, &s)) {
 
 		infolog(c->d->trk, "HTTP redirect: %S", &s);
-		if (c->sk != FF_BADSKT) {
-			ffskt_fin(c->sk);
-			ffskt_close(c->sk);
-			c->sk = FF_BADSKT;
-		}
-		ffaio_fin(&c->aio);
+		tcp_close(c);
 		if (c->host != c->orighost)
 			ffmem_free(c->host);
 		if (NULL == (c->host = ffsz_alcopy(s.ptr, s.len))) {
@@ -1080,7 +1614,8 @@ static int http_parse(nethttp *c)
 		ffhttp_respinit(&c->resp);
 		return 2;
 
-	} else if (c->resp.code != 200) {
+	} else if (c->resp.code != 200
+		&& !(c->file && c->resp.code == 206)) {
 		ffstr ln = ffhttp_respstatus(&c->resp);
 		errlog(c->d->trk, "resource unavailable: %S", &ln);
 		return -2;
@@ -1089,39 +1624,50 @@ static int http_parse(nethttp *c)
 	return 0;
 }
 
+/** Store the time until the first data after the track start or after I/O error. */
+static void http_timing(nethttp *c)
+{
+	uint64 now = http_now(c);
+	if (c->ioerr_time != 0) {
+		uint t = now - c->ioerr_time;
+		dbglog(c->d->trk, "recovered after I/O error in %ums", t);
+		c->d->track->setval(c->d->trk, "net_reconnect_ms", t);
+		c->ioerr_time = 0;
+	} else if (FMED_NULL == c->d->track->getval(c->d->trk, "net_ttfa_ms")) {
+		dbglog(c->d->trk, "time to first data: %Ums", now);
+		c->d->track->setval(c->d->trk, "net_ttfa_ms", now);
+	}
+}
+
 static int http_process(void *ctx, fmed_filt *d)
 {
 	nethttp *c = ctx;
 	ssize_t r;
-	ffaddr a = {0};
 
 	if (d->flags & FMED_FSTOP) {
 		d->outlen = 0;
 		return FMED_RLASTOUT;
 	}
 
+	if (c->file)
+		return httpf_process(c, d);
+
 	for (;;) {
 	switch (c->state) {
 	case I_ADDR:
-		if (0 != ip_resolve(c))
-			goto done;
-		c->state = I_NEXTADDR;
-		// break
-
-	case I_NEXTADDR:
-		if (0 != tcp_prepare(c, &a))
+		c->conn_start = http_now(c);
+		if (0 != ip_resolve(c)
+			|| 0 != tcp_prepare(c))
 			goto done;
 		c->state = I_CONN;
 		// break
 
 	case I_CONN:
-		r = tcp_connect(c, &a.a, a.len);
+		r = tcp_connect(c);
 		if (r == FMED_RASYNC)
 			return FMED_RASYNC;
-		else if (r == FMED_RMORE) {
-			c->state = I_NEXTADDR;
-			continue;
-		}
+		else if (r == FMED_RERR)
+			goto done;
 		c->state = I_HTTP_REQ;
 		// break
 
@@ -1174,6 +1720,7 @@ static int http_process(void *ctx, fmed_filt *d)
 			continue;
 		}
 
+		http_timing(c);
 		ffstr_set2(&c->data, &c->bufs[0]);
 		ffstr_shift(&c->data, c->resp.h.len);
 		c->bufs[0].len = 0;
@@ -1220,41 +1767,443 @@ static int http_findhdr(nethttp *c, const ffstr *name, ffstr *dst)
 }
 
 
-static const ffpars_arg icy_conf_args[] = {
-	{ "meta",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(net_conf, meta) },
-};
+/* Remote file:
+The data is received into the blocks of fixed size, which are then returned to the next filter.
+The least recently used block is reused when the cache is full.
+On seek request the data is returned from cache, or a new Range request is sent
+ on the same connection (if the server supports keep-alive).
+While the next filter reads the data sequentially,
+ the next range is requested in advance with the size doubled each time up to "readahead".
+*/
 
-static int icy_config(ffpars_ctx *ctx)
+static void httpf_sockclose(nethttp *c)
 {
-	net->conf.meta = 1;
-	ffpars_setargs(ctx, &net->conf, icy_conf_args, FFCNT(icy_conf_args));
-	return 0;
+	if (c->sk == FF_BADSKT)
+		return;
+	tcp_close(c);
+	c->wblk = NULL;
 }
 
-static void* icy_open(fmed_filt *d)
+/** Find cached block containing the offset. */
+static http_blk* httpf_find(nethttp *c, uint64 off)
 {
-	icy *c;
-	if (NULL == (c = ffmem_new(icy)))
-		return NULL;
-	c->d = d;
-
-	if (0 != net->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, "net.http"))
-		goto end;
-
-	int v = net->track->getval(d->trk, "out-copy");
-	c->out_copy = (v != FMED_NULL);
-	c->save_oncmd = (v == FMED_OUTCP_CMD);
-
-	return c;
-
-end:
-	icy_close(c);
+	uint64 boff = off / net->conf.cache_block * net->conf.cache_block;
+	for (uint i = 0;  i != c->nblks;  i++) {
+		if (c->blks[i].ptr != NULL && c->blks[i].off == boff)
+			return &c->blks[i];
+	}
 	return NULL;
 }
 
-static void icy_close(void *ctx)
+/** Get block for the offset.  Reuse the least recently used block if necessary. */
+static http_blk* httpf_alloc(nethttp *c, uint64 off)
 {
-	icy *c = ctx;
+	http_blk *b, *lru = NULL;
+
+	if (NULL != (b = httpf_find(c, off)))
+		return b;
+
+	for (uint i = 0;  i != c->nblks;  i++) {
+		b = &c->blks[i];
+		if (b == c->rblk || b == c->wblk)
+			continue;
+		if (b->ptr == NULL) {
+			if (NULL == (b->ptr = ffmem_alloc(net->conf.cache_block))) {
+				syserrlog(c->d->trk, "%s", ffmem_alloc_S);
+				return NULL;
+			}
+			lru = b;
+			break;
+		}
+		if (lru == NULL || b->used < lru->used)
+			lru = b;
+	}
+
+	lru->off = off / net->conf.cache_block * net->conf.cache_block;
+	lru->len = 0;
+	lru->used = ++c->used;
+	return lru;
+}
+
+/** Get cached data at the current offset. */
+static int httpf_cached(nethttp *c, ffstr *dst)
+{
+	http_blk *b = httpf_find(c, c->off);
+	if (b == NULL || c->off >= b->off + b->len)
+		return 0;
+	b->used = ++c->used;
+	c->rblk = b;
+	ffstr_set(dst, b->ptr + (c->off - b->off), b->off + b->len - c->off);
+	return 1;
+}
+
+/** Get the offset of the next block to read in advance.
+Return -1 if there's nothing to read. */
+static uint64 httpf_nextblock(nethttp *c)
+{
+	http_blk *b;
+	uint64 off = c->off / net->conf.cache_block * net->conf.cache_block;
+	for (;;) {
+		if (off >= c->off + net->conf.readahead
+			|| (c->size != (uint64)-1 && off >= c->size))
+			return (uint64)-1;
+		b = httpf_find(c, off);
+		if (b == NULL
+			|| !(b->len == net->conf.cache_block || b->off + b->len == c->size))
+			break;
+		off += net->conf.cache_block;
+	}
+	return off;
+}
+
+/** Set the range for the next request. */
+static void httpf_setrange(nethttp *c)
+{
+	uint64 start = (c->no_ranges) ? 0 : c->want / net->conf.cache_block * net->conf.cache_block;
+	if (start == c->req_end && c->ra != 0)
+		c->ra = ffmin(c->ra * 2, net->conf.readahead); //sequential reading
+	else
+		c->ra = net->conf.cache_block;
+	c->req_start = start;
+	c->req_end = start + c->ra;
+	if (c->size != (uint64)-1)
+		c->req_end = ffmin(c->req_end, c->size);
+}
+
+/** Process response headers. */
+static int httpf_resp(nethttp *c)
+{
+	ffstr s, val;
+	uint64 total = (uint64)-1, len = (uint64)-1, start = 0;
+
+	if (0 != ffhttp_findihdr(&c->resp.h, FFHTTP_CONTENT_LENGTH, &s)
+		&& !ffstr_toint(&s, &len, FFS_INT64)) {
+		errlog(c->d->trk, "bad Content-Length: %S", &s);
+		return -1;
+	}
+
+	if (c->resp.code == 206) {
+		// Content-Range: bytes START-END/TOTAL
+		ffstr_setcz(&val, "Content-Range");
+		if (0 == http_findhdr(c, &val, &s)
+			|| !ffstr_match(&s, "bytes ", 6)) {
+			errlog(c->d->trk, "bad Content-Range in partial response");
+			return -1;
+		}
+		ffstr_shift(&s, 6);
+		ffs_split2by(s.ptr, s.len, '-', &val, &s);
+		if (!ffstr_toint(&val, &start, FFS_INT64)) {
+			errlog(c->d->trk, "bad Content-Range in partial response");
+			return -1;
+		}
+		ffs_split2by(s.ptr, s.len, '/', NULL, &val);
+		if (!ffstr_eqcz(&val, "*") && !ffstr_toint(&val, &total, FFS_INT64))
+			total = (uint64)-1;
+
+	} else {
+		if (c->req_start != 0 && !c->no_ranges)
+			warnlog(c->d->trk, "server doesn't support Range requests");
+		c->no_ranges = 1;
+		total = len;
+	}
+
+	if (c->size == (uint64)-1 && total != (uint64)-1) {
+		c->size = total;
+		c->d->input.size = total;
+		dbglog(c->d->trk, "file size: %U", total);
+	}
+
+	c->roff = start;
+	c->rend = (len != (uint64)-1) ? start + len : (uint64)-1;
+	c->conn_close = (c->rend == (uint64)-1);
+	if (0 != ffhttp_findihdr(&c->resp.h, FFHTTP_CONNECTION, &s) && ffstr_ieqz(&s, "close"))
+		c->conn_close = 1;
+	c->reconnects = 0;
+
+	// store the body data received together with the headers
+	ffstr_set2(&s, &c->bufs[0]);
+	ffstr_shift(&s, c->resp.h.len);
+	c->bufs[0].len = 0;
+	while (s.len != 0 && c->roff != c->rend) {
+		http_blk *b;
+		if (NULL == (b = httpf_alloc(c, c->roff)))
+			return -1;
+		size_t boff = c->roff - b->off;
+		size_t n = ffmin(s.len, net->conf.cache_block - boff);
+		n = ffmin(n, c->rend - c->roff);
+		ffmemcpy(b->ptr + boff, s.ptr, n);
+		ffstr_shift(&s, n);
+		c->roff += n;
+		b->len = ffmax(b->len, boff + n);
+	}
+
+	ffhttp_respfree(&c->resp);
+	ffhttp_respinit(&c->resp);
+	return 0;
+}
+
+/** Receive response body data into cache. */
+static int httpf_recv(nethttp *c)
+{
+	ssize_t r;
+	http_blk *b;
+
+	if (NULL == (b = httpf_alloc(c, c->roff)))
+		return FMED_RERR;
+	c->wblk = b;
+	size_t boff = c->roff - b->off;
+	size_t n = net->conf.cache_block - boff;
+	if (c->rend != (uint64)-1)
+		n = ffmin(n, c->rend - c->roff);
+
+	r = ffaio_recv(c->aio, &tcp_aio, b->ptr + boff, n);
+	if (r == FFAIO_ASYNC) {
+		c->async = 1;
+		core->timer(&c->tmr, -(int)net->conf.tmout, 0);
+		return FMED_RASYNC;
+	} else if (r == 0) {
+		dbglog(c->d->trk, "server has closed connection");
+		return FMED_RDONE;
+	} else if (r < 0) {
+		syserrlog(c->d->trk, "%s", ffskt_recv_S);
+		return FMED_RERR;
+	}
+
+	c->roff += r;
+	b->len = ffmax(b->len, boff + r);
+	if (b->len == net->conf.cache_block)
+		c->wblk = NULL;
+	return 0;
+}
+
+/** Perform the next I/O step to get the data at 'c->want'.
+Return 0 if some progress is made;  FMED_RASYNC;  FMED_RERR. */
+static int httpf_io(nethttp *c)
+{
+	ssize_t r;
+
+	for (;;) {
+	switch (c->state) {
+	case I_FILE_IDLE:
+		httpf_setrange(c);
+		c->state = (c->sk == FF_BADSKT) ? I_ADDR : I_HTTP_REQ;
+		continue;
+
+	case I_ADDR:
+		if (0 != ip_resolve(c)
+			|| 0 != tcp_prepare(c))
+			return FMED_RERR;
+		c->state = I_CONN;
+		// break
+
+	case I_CONN:
+		r = tcp_connect(c);
+		if (r == FMED_RASYNC)
+			return FMED_RASYNC;
+		else if (r == FMED_RERR)
+			return FMED_RERR;
+		c->state = I_HTTP_REQ;
+		// break
+
+	case I_HTTP_REQ:
+		http_prepreq(c, &c->data);
+		c->state = I_HTTP_REQ_SEND;
+		// break
+
+	case I_HTTP_REQ_SEND:
+		r = tcp_send(c);
+		if (r == FMED_RASYNC)
+			return FMED_RASYNC;
+		else if (r == FMED_RERR) {
+			tcp_ioerr(c);
+			continue;
+		}
+		c->state = I_HTTP_RESP;
+		// break
+
+	case I_HTTP_RESP:
+		r = tcp_recvhdrs(c);
+		if (r == FMED_RASYNC)
+			return FMED_RASYNC;
+		else if (r == FMED_RMORE) {
+			c->state = I_ERR;
+			continue;
+		} else if (r == FMED_RERR) {
+			tcp_ioerr(c);
+			continue;
+		}
+		c->state = I_HTTP_RESP_PARSE;
+		//fall through
+
+	case I_HTTP_RESP_PARSE:
+		r = http_parse(c);
+		switch (r) {
+		case 0:
+			break;
+		case -1:
+		case -2:
+			c->state = I_ERR;
+			continue;
+		case 1:
+			c->state = I_HTTP_RESP;
+			continue;
+		case 2:
+			c->state = I_ADDR;
+			continue;
+		}
+		if (0 != httpf_resp(c)) {
+			c->state = I_ERR;
+			continue;
+		}
+		c->state = I_FILE_BODY;
+		return 0;
+
+	case I_FILE_BODY:
+		if (c->roff == c->rend) {
+			// the whole response is received
+			if (c->conn_close)
+				httpf_sockclose(c);
+			c->wblk = NULL;
+			c->state = I_FILE_IDLE;
+			return 0;
+		}
+
+		if (c->want < c->roff
+			|| (!c->no_ranges && c->want >= c->roff + net->conf.readahead
+				&& c->rend - c->roff > net->conf.readahead)) {
+			// the data we need is far from the current position: don't wait until the whole response is received
+			dbglog(c->d->trk, "cancelling request at %U", c->roff);
+			httpf_sockclose(c);
+			c->state = I_FILE_IDLE;
+			continue;
+		}
+
+		r = httpf_recv(c);
+		if (r == FMED_RASYNC)
+			return FMED_RASYNC;
+		else if (r == FMED_RDONE) {
+			if (c->rend != (uint64)-1) {
+				tcp_ioerr(c);
+				continue;
+			}
+			c->size = c->roff;
+			httpf_sockclose(c);
+			c->state = I_FILE_IDLE;
+			return 0;
+		} else if (r == FMED_RERR) {
+			tcp_ioerr(c);
+			continue;
+		}
+		return 0;
+
+	case I_ERR:
+		return FMED_RERR;
+	}
+	}
+}
+
+static int httpf_process(nethttp *c, fmed_filt *d)
+{
+	ffstr s;
+	int r;
+
+	if ((int64)d->input.seek != FMED_NULL) {
+		dbglog(d->trk, "seek: %U", d->input.seek);
+		c->off = d->input.seek;
+		d->input.seek = FMED_NULL;
+	}
+
+	for (;;) {
+		if (c->size != (uint64)-1 && c->off >= c->size) {
+			d->outlen = 0;
+			return FMED_RDONE;
+		}
+
+		if (httpf_cached(c, &s)) {
+			c->off += s.len;
+			d->out = s.ptr,  d->outlen = s.len;
+
+			if (!c->async && c->state != I_ERR) {
+				// continue receiving data while the next filters process this block
+				uint64 off = httpf_nextblock(c);
+				if (c->state == I_FILE_BODY) {
+					c->want = c->roff;
+					httpf_io(c);
+				} else if (c->state == I_FILE_IDLE && off == c->req_end) {
+					c->want = off;
+					httpf_io(c);
+				}
+			}
+			return FMED_RDATA;
+		}
+
+		c->want = c->off;
+		if (c->async) {
+			c->iowait = 1;
+			return FMED_RASYNC;
+		}
+
+		r = httpf_io(c);
+		if (r == FMED_RASYNC) {
+			c->iowait = 1;
+			return FMED_RASYNC;
+		} else if (r == FMED_RERR)
+			return FMED_RERR;
+	}
+}
+
+
+static const ffpars_arg icy_conf_args[] = {
+	{ "meta",	FFPARS_TBOOL | FFPARS_F8BIT,  FFPARS_DSTOFF(net_conf, meta) },
+};
+
+static int icy_config(ffpars_ctx *ctx)
+{
+	net->conf.meta = 1;
+	ffpars_setargs(ctx, &net->conf, icy_conf_args, FFCNT(icy_conf_args));
+	return 0;
+}
+
+static void* icy_open(fmed_filt *d)
+{
+	icy *c;
+	if (NULL == (c = ffmem_new(icy)))
+		return NULL;
+	c->d = d;
+	c->task.handler = d->handler;
+	c->task.param = d->trk;
+
+	int v = net->track->getval(d->trk, "out-copy");
+	c->out_copy = (v != FMED_NULL);
+	c->save_oncmd = (v == FMED_OUTCP_CMD);
+
+	int64 st = net->track->getval(d->trk, "net_station");
+	if (st != FMED_NULL) {
+		// recording-only track created by "net.stations"
+		c->st = (void*)(size_t)st;
+		c->st->c = c;
+		c->rec_only = 1;
+		c->out_copy = 1;
+	}
+
+	net->track->setval(d->trk, "http_stream", 1);
+	if (0 != net->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, "net.http"))
+		goto end;
+
+	return c;
+
+end:
+	icy_close(c);
+	return NULL;
+}
+
+static void icy_close(void *ctx)
+{
+	icy *c = ctx;
+	if (c->st != NULL) {
+		c->st->c = NULL;
+		st_ended(c->st);
+	}
 	ffstr_free(&c->artist);
 	ffstr_free(&c->title);
 
@@ -1262,6 +2211,7 @@ static void icy_close(void *ctx)
 		netin_write(c->netin, NULL);
 		c->netin = NULL;
 	}
+	core->task(&c->task, FMED_TASK_DEL);
 
 	ffmem_free(c);
 }
@@ -1289,7 +2239,9 @@ static int icy_reset(icy *c, fmed_filt *d)
 		dbglog(d->trk, "no Content-Type HTTP header in response, assuming MPEG");
 	}
 
-	if (c->next_filt_ext.len == 0) {
+	if (c->rec_only) {
+		c->next_filt_ext = ext;
+	} else if (c->next_filt_ext.len == 0) {
 		const fmed_modinfo *mi;
 		if (NULL == (mi = core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len))) {
 			errlog(d->trk, "no module configured to open .%S stream", &ext);
@@ -1321,6 +2273,8 @@ static int icy_reset(icy *c, fmed_filt *d)
 	return FMED_RDATA;
 }
 
+static void icy_st_data(icy *c, size_t len);
+
 static int icy_process(void *ctx, fmed_filt *d)
 {
 	icy *c = ctx;
@@ -1342,6 +2296,17 @@ static int icy_process(void *ctx, fmed_filt *d)
 		d->datalen = 0;
 	}
 
+	if (c->blocked.len != 0) {
+		if (c->netin != NULL && 0 != netin_write(c->netin, &c->blocked))
+			return FMED_RASYNC;
+		ffstr blk = c->blocked;
+		c->blocked.len = 0;
+		if (!c->rec_only) {
+			d->out = blk.ptr,  d->outlen = blk.len;
+			return FMED_RDATA;
+		}
+	}
+
 	for (;;) {
 		if (c->data.len == 0)
 			return FMED_RMORE;
@@ -1351,10 +2316,19 @@ static int icy_process(void *ctx, fmed_filt *d)
 		ffstr_shift(&c->data, n);
 		switch (r) {
 		case FFICY_RDATA:
-			if (c->netin != NULL) {
-				netin_write(c->netin, &s);
+			if (c->st != NULL)
+				icy_st_data(c, s.len);
+
+			if (c->netin != NULL
+				&& 0 != netin_write(c->netin, &s)) {
+				// wait until the child track consumes some data
+				c->blocked = s;
+				return FMED_RASYNC;
 			}
 
+			if (c->rec_only)
+				break;
+
 			d->out = s.ptr;
 			d->outlen = s.len;
 			return FMED_RDATA;
@@ -1435,6 +2409,24 @@ static int icy_setmeta(icy *c, const ffstr *_data)
 
 enum { IN_WAIT = 1, IN_DATANEXT };
 
+static const char *const netin_overflow_enumstr[] = {
+	"drop", "block",
+};
+static const ffpars_enumlist netin_overflow_enum = { netin_overflow_enumstr, FFCNT(netin_overflow_enumstr), FFPARS_DSTOFF(net_conf, in_overflow) };
+
+static const ffpars_arg netin_conf_args[] = {
+	{ "buffer",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, in_bufsize) },
+	{ "overflow",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&netin_overflow_enum) },
+};
+
+static int netin_config(ffpars_ctx *ctx)
+{
+	net->conf.in_bufsize = 1 * 1024 * 1024;
+	net->conf.in_overflow = NETIN_DROP;
+	ffpars_setargs(ctx, &net->conf, netin_conf_args, FFCNT(netin_conf_args));
+	return 0;
+}
+
 static void* netin_create(icy *c)
 {
 	netin *n;
@@ -1442,12 +2434,18 @@ static void* netin_create(icy *c)
 	fmed_trk *trkconf;
 	if (NULL == (n = ffmem_tcalloc1(netin)))
 		return NULL;
+	n->cap = (net->conf.in_bufsize != 0) ? net->conf.in_bufsize : 1 * 1024 * 1024;
+
+	if (NULL == (n->buf = ffmem_alloc(n->cap)))
+		goto fail;
 
 	if (NULL == (trk = net->track->create(FMED_TRACK_NET, "")))
-		return NULL;
+		goto fail;
 
-	if (0 != net->track->cmd2(trk, FMED_TRACK_ADDFILT_BEGIN, "net.in"))
-		return NULL;
+	if (0 != net->track->cmd2(trk, FMED_TRACK_ADDFILT_BEGIN, "net.in")) {
+		net->track->cmd(trk, FMED_TRACK_STOP);
+		goto fail;
+	}
 
 	trkconf = net->track->conf(trk);
 	trkconf->out_overwrite = c->d->out_overwrite;
@@ -1477,17 +2475,42 @@ static void* netin_create(icy *c)
 
 	net->track->cmd(trk, FMED_TRACK_START);
 	return n;
+
+fail:
+	ffmem_safefree(n->buf);
+	ffmem_free(n);
+	return NULL;
 }
 
-static void netin_write(netin *n, const ffstr *data)
+/** Copy data into the ring buffer of the child track.
+Return 0 on success;  -1 if there's no free space and the writer must wait. */
+static int netin_write(netin *n, const ffstr *data)
 {
 	if (data == NULL) {
 		n->fin = 1;
 		n->c = NULL;
-	} else
-		ffarr_append(&n->d[n->idx], data->ptr, data->len);
+
+	} else if (data->len > n->cap - n->len) {
+		if (net->conf.in_overflow == NETIN_BLOCK && data->len <= n->cap)
+			return -1;
+		if (!n->overflow)
+			warnlog(n->task.param, "buffer is full, dropping data");
+		n->overflow = 1;
+		n->dropped += data->len;
+		return 0;
+
+	} else {
+		size_t w = (n->r + n->len) % n->cap;
+		size_t n1 = ffmin(data->len, n->cap - w);
+		ffmemcpy(n->buf + w, data->ptr, n1);
+		ffmemcpy(n->buf, data->ptr + n1, data->len - n1);
+		n->len += data->len;
+		n->overflow = 0;
+	}
+
 	if (n->state == IN_WAIT)
 		core->task(&n->task, FMED_TASK_POST);
+	return 0;
 }
 
 static void* netin_open(fmed_filt *d)
@@ -1503,20 +2526,34 @@ static void* netin_open(fmed_filt *d)
 static void netin_close(void *ctx)
 {
 	netin *n = ctx;
-	ffarr_free(&n->d[0]);
-	ffarr_free(&n->d[1]);
+	if (n->dropped != 0)
+		warnlog(n->task.param, "dropped %U bytes: buffer overflow", n->dropped);
+	ffmem_free(n->buf);
 	core->task(&n->task, FMED_TASK_DEL);
-	if (n->c != NULL && n->c->netin == n)
+	if (n->c != NULL && n->c->netin == n) {
 		n->c->netin = NULL;
+		if (n->c->blocked.len != 0)
+			core->task(&n->c->task, FMED_TASK_POST);
+	}
 	ffmem_free(n);
 }
 
 static int netin_process(void *ctx, fmed_filt *d)
 {
 	netin *n = ctx;
+
+	// release the data returned last time
+	if (n->locked != 0) {
+		n->r = (n->r + n->locked) % n->cap;
+		n->len -= n->locked;
+		n->locked = 0;
+		if (n->c != NULL && n->c->blocked.len != 0)
+			core->task(&n->c->task, FMED_TASK_POST);
+	}
+
 	switch (n->state) {
 	case IN_DATANEXT:
-		if (n->d[n->idx].len == 0 && !n->fin) {
+		if (n->len == 0 && !n->fin) {
 			n->state = IN_WAIT;
 			return FMED_RASYNC;
 		}
@@ -1526,17 +2563,1687 @@ static int netin_process(void *ctx, fmed_filt *d)
 		break;
 	}
 	n->state = IN_DATANEXT;
-	d->out = n->d[n->idx].ptr,  d->outlen = n->d[n->idx].len;
-	n->d[n->idx].len = 0;
-	n->idx = ffint_cycleinc(n->idx, 2);
-	if (n->fin)
+
+	// return the data directly from the ring buffer, up to its end
+	n->locked = ffmin(n->len, n->cap - n->r);
+	d->out = n->buf + n->r,  d->outlen = n->locked;
+	d->track->setval(d->trk, "netin_filled", n->len * 100 / n->cap);
+	d->track->setval(d->trk, "netin_dropped", n->dropped);
+	dbglog(d->trk, "buffer: %L/%L bytes", n->len, n->cap);
+	if (n->fin && n->locked == n->len)
 		return FMED_RDONE;
 
 	// get cmd from master track
-	if (n->c->save_oncmd && n->c->d->save_trk) {
+	if (n->c != NULL && n->c->save_oncmd && n->c->d->save_trk) {
 		n->c->d->save_trk = 0;
 		d->out_file_del = 0;
 	}
 
 	return FMED_RDATA;
 }
+
+
+/* HLS:
+The media playlist is requested, then the segments are downloaded in parallel (at most "segments" at once)
+ and passed to the next filter in their sequence order as a continuous stream of bytes.
+A live playlist is reloaded every "target duration" seconds.
+*/
+
+typedef struct hls hls;
+
+typedef struct hls_seg {
+	hls *h;
+	uint64 seq;
+	char *url;
+	void *con;
+	ffarr data;
+	uint done :1
+		, err :1
+		;
+} hls_seg;
+
+struct hls {
+	fmed_filt *d;
+	char *url; //current playlist URL
+	void *plcon; //playlist request
+	ffarr pldata;
+	ffarr segs; //hls_seg*[] in sequence order
+	hls_seg *cur; //the segment returned to the next filter
+	uint64 next_seq; //the sequence number of the next segment to add from playlist
+	uint target_dur; //sec
+	fftmrq_entry tmr;
+	fftask task;
+	uint waiting :1
+		, endlist :1
+		, err :1
+		, master :1 //master playlist has been loaded
+		, filt_added :1
+		;
+};
+
+static int hls_reqplist(hls *h);
+static int hls_plparse(hls *h);
+static int hls_startdl(hls *h);
+static void hls_ontmr(void *param);
+
+static const ffpars_arg hls_conf_args[] = {
+	{ "segments",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, hls_segments) },
+};
+
+static int hls_config(ffpars_ctx *ctx)
+{
+	net->conf.hls_segments = 3;
+	ffpars_setargs(ctx, &net->conf, hls_conf_args, FFCNT(hls_conf_args));
+	return 0;
+}
+
+static void hls_seg_free(hls_seg *s)
+{
+	FF_SAFECLOSE(s->con, NULL, http_if_close);
+	ffmem_safefree(s->url);
+	ffarr_free(&s->data);
+	ffmem_free(s);
+}
+
+static void* hls_open(fmed_filt *d)
+{
+	hls *h;
+	if (NULL == (h = ffmem_new(hls)))
+		return NULL;
+	h->d = d;
+	h->task.handler = d->handler;
+	h->task.param = d->trk;
+	h->next_seq = (uint64)-1;
+	h->tmr.handler = &hls_ontmr;
+	h->tmr.param = h;
+
+	if (NULL == (h->url = ffsz_alcopyz(d->track->getvalstr(d->trk, "input"))))
+		goto end;
+	if (0 != hls_reqplist(h))
+		goto end;
+	return h;
+
+end:
+	hls_close(h);
+	return NULL;
+}
+
+static void hls_close(void *ctx)
+{
+	hls *h = ctx;
+	hls_seg **s;
+
+	core->timer(&h->tmr, 0, 0);
+	core->task(&h->task, FMED_TASK_DEL);
+	FF_SAFECLOSE(h->plcon, NULL, http_if_close);
+	FFARR_WALKT(&h->segs, s, hls_seg*) {
+		hls_seg_free(*s);
+	}
+	ffarr_free(&h->segs);
+	FF_SAFECLOSE(h->cur, NULL, hls_seg_free);
+	ffarr_free(&h->pldata);
+	ffmem_safefree(h->url);
+	ffmem_free(h);
+}
+
+/** Wake up the track if it's waiting for data. */
+static void hls_wake(hls *h)
+{
+	if (!h->waiting)
+		return;
+	h->waiting = 0;
+	core->task(&h->task, FMED_TASK_POST);
+}
+
+/** Get absolute URL for a playlist entry. */
+static char* hls_url(hls *h, const ffstr *uri)
+{
+	ffstr base;
+
+	const char *slash;
+
+	if (ffs_match(uri->ptr, uri->len, "http://", 7))
+		return ffsz_alcopy(uri->ptr, uri->len);
+
+	ffstr_setz(&base, h->url);
+	ffs_split2by(base.ptr, base.len, '?', &base, NULL);
+	if (uri->len != 0 && uri->ptr[0] == '/') {
+		// "http://host/path" -> "http://host"
+		if (NULL != (slash = ffs_split2by(base.ptr + 7, base.len - 7, '/', NULL, NULL)))
+			base.len = slash - base.ptr;
+	} else {
+		// "http://host/dir/file" -> "http://host/dir/"
+		if (NULL != (slash = ffs_rsplit2by(base.ptr + 7, base.len - 7, '/', NULL, NULL)))
+			base.len = slash + 1 - base.ptr;
+	}
+
+	ffarr a = {0};
+	if (0 == ffstr_catfmt(&a, "%S%s%S%Z"
+		, &base, (uri->ptr[0] != '/' && ffarr_back(&base) != '/') ? "/" : "", uri))
+		return NULL;
+	return a.ptr;
+}
+
+static void hls_plist_sig(void *udata)
+{
+	hls *h = udata;
+	ffhttp_response *resp;
+	ffstr d;
+	int r = http_if_recv(h->plcon, &resp, &d);
+	switch (r) {
+	case FMED_NET_RESP_RECV:
+	case FMED_NET_DONE:
+		if (resp->code == 200 && d.len != 0
+			&& NULL == ffarr_append(&h->pldata, d.ptr, d.len)) {
+			syserrlog(h->d->trk, "%s", ffmem_alloc_S);
+			r = FMED_NET_ERR;
+			break;
+		}
+		break;
+	}
+
+	if (r == FMED_NET_DONE && resp->code != 200) {
+		ffstr ln = ffhttp_respstatus(resp);
+		errlog(h->d->trk, "playlist: resource unavailable: %S", &ln);
+		r = FMED_NET_ERR;
+	}
+
+	if (r == FMED_NET_ERR) {
+		FF_SAFECLOSE(h->plcon, NULL, http_if_close);
+		if (h->next_seq == (uint64)-1) {
+			// nothing to play
+			h->err = 1;
+			hls_wake(h);
+		} else if (!h->endlist)
+			core->timer(&h->tmr, -(int)ffmax(h->target_dur, 1) * 1000, 0);
+		return;
+
+	} else if (r != FMED_NET_DONE)
+		return;
+
+	FF_SAFECLOSE(h->plcon, NULL, http_if_close);
+	if (0 != hls_plparse(h)) {
+		h->err = 1;
+		hls_wake(h);
+		return;
+	}
+	h->pldata.len = 0;
+
+	if (h->plcon != NULL)
+		return; //requesting media playlist
+	hls_startdl(h);
+	if (!h->endlist)
+		core->timer(&h->tmr, -(int)ffmax(h->target_dur, 1) * 1000, 0);
+	hls_wake(h);
+}
+
+/** Request the playlist (again). */
+static int hls_reqplist(hls *h)
+{
+	if (h->plcon != NULL)
+		return 0;
+	dbglog(h->d->trk, "requesting playlist %s", h->url);
+	if (NULL == (h->plcon = http_if_request("GET", h->url, 0)))
+		return -1;
+	http_if_sethandler(h->plcon, &hls_plist_sig, h);
+	http_if_send(h->plcon, NULL);
+	return 0;
+}
+
+static void hls_ontmr(void *param)
+{
+	hls *h = param;
+	if (0 != hls_reqplist(h))
+		warnlog(h->d->trk, "can't reload playlist");
+}
+
+/** Add a segment to the queue. */
+static int hls_addseg(hls *h, uint64 seq, const ffstr *uri)
+{
+	hls_seg *s, **ps;
+	if (NULL == (s = ffmem_new(hls_seg))
+		|| NULL == (ps = ffarr_pushgrowT(&h->segs, 8, hls_seg*))) {
+		ffmem_safefree(s);
+		syserrlog(h->d->trk, "%s", ffmem_alloc_S);
+		return -1;
+	}
+	*ps = s;
+	s->h = h;
+	s->seq = seq;
+	if (NULL == (s->url = hls_url(h, uri))) {
+		syserrlog(h->d->trk, "%s", ffmem_alloc_S);
+		return -1;
+	}
+	dbglog(h->d->trk, "segment #%U: %s", seq, s->url);
+	return 0;
+}
+
+/** Parse playlist: get the variant stream (master playlist) or the new segments (media playlist). */
+static int hls_plparse(hls *h)
+{
+	ffstr data, ln, val, uri_variant = {0};
+	uint64 seq = 0, bandwidth = 0, bw = 0;
+	ffarr uris = {0}; //ffstr[]
+	ffstr *u;
+	uint variant = 0, inf = 0;
+	int rc = -1;
+
+	ffstr_set2(&data, &h->pldata);
+	while (data.len != 0) {
+		ffstr_nextval3(&data, &ln, '\n');
+		if (ln.len != 0 && ffarr_back(&ln) == '\r')
+			ln.len--;
+		if (ln.len == 0)
+			continue;
+
+		if (ln.ptr[0] != '#') {
+			if (variant) {
+				// use the variant stream with the highest bitrate
+				if (uri_variant.len == 0 || bw > bandwidth) {
+					uri_variant = ln;
+					bandwidth = bw;
+				}
+				variant = 0;
+			} else if (inf) {
+				if (NULL == (u = ffarr_pushgrowT(&uris, 16, ffstr)))
+					goto end;
+				*u = ln;
+				inf = 0;
+			}
+			continue;
+		}
+
+		if (ffstr_matchz(&ln, "#EXTINF:")) {
+			inf = 1;
+
+		} else if (ffstr_matchz(&ln, "#EXT-X-STREAM-INF:")) {
+			variant = 1;
+			bw = 0;
+			ssize_t i = ffstr_findz(&ln, "BANDWIDTH=");
+			if (i >= 0) {
+				ffstr_set(&val, ln.ptr + i + FFSLEN("BANDWIDTH="), ln.len - i - FFSLEN("BANDWIDTH="));
+				ffs_split2by(val.ptr, val.len, ',', &val, NULL);
+				ffstr_toint(&val, &bw, FFS_INT64);
+			}
+
+		} else if (ffstr_matchz(&ln, "#EXT-X-TARGETDURATION:")) {
+			ffstr_set(&val, ln.ptr + FFSLEN("#EXT-X-TARGETDURATION:"), ln.len - FFSLEN("#EXT-X-TARGETDURATION:"));
+			ffstr_toint(&val, &h->target_dur, FFS_INT32);
+
+		} else if (ffstr_matchz(&ln, "#EXT-X-MEDIA-SEQUENCE:")) {
+			ffstr_set(&val, ln.ptr + FFSLEN("#EXT-X-MEDIA-SEQUENCE:"), ln.len - FFSLEN("#EXT-X-MEDIA-SEQUENCE:"));
+			ffstr_toint(&val, &seq, FFS_INT64);
+
+		} else if (ffstr_matchz(&ln, "#EXT-X-ENDLIST")) {
+			h->endlist = 1;
+
+		} else if (ffstr_matchz(&ln, "#EXT-X-KEY:")
+			&& -1 == ffstr_findz(&ln, "METHOD=NONE")) {
+			errlog(h->d->trk, "encrypted HLS streams are not supported");
+			goto end;
+		}
+	}
+
+	if (uri_variant.len != 0) {
+		if (h->master) {
+			errlog(h->d->trk, "bad playlist: nested variant streams");
+			goto end;
+		}
+		h->master = 1;
+		char *url;
+		if (NULL == (url = hls_url(h, &uri_variant))) {
+			syserrlog(h->d->trk, "%s", ffmem_alloc_S);
+			goto end;
+		}
+		ffmem_free(h->url);
+		h->url = url;
+		dbglog(h->d->trk, "using variant stream (%U bit/s): %s", bandwidth, url);
+		rc = hls_reqplist(h);
+		goto end;
+	}
+
+	if (uris.len == 0 && h->next_seq == (uint64)-1) {
+		errlog(h->d->trk, "bad playlist: no segments");
+		goto end;
+	}
+
+	if (h->next_seq == (uint64)-1) {
+		// start playing a live stream 3 segments before its end
+		h->next_seq = seq;
+		if (!h->endlist && uris.len > 3)
+			h->next_seq = seq + uris.len - 3;
+
+	} else if (h->next_seq < seq) {
+		warnlog(h->d->trk, "missed %U segments", seq - h->next_seq);
+		h->next_seq = seq;
+	}
+
+	uint i = 0;
+	FFARR_WALKT(&uris, u, ffstr) {
+		if (seq + i++ < h->next_seq)
+			continue;
+		if (0 != hls_addseg(h, h->next_seq, u))
+			goto end;
+		h->next_seq++;
+	}
+	rc = 0;
+
+end:
+	ffarr_free(&uris);
+	return rc;
+}
+
+/** Remove ID3v2 tag preceding the audio data of a segment. */
+static void hls_skipid3(hls_seg *s)
+{
+	const byte *d = (void*)s->data.ptr;
+	if (s->data.len < 10 || ffmemcmp(d, "ID3", 3))
+		return;
+	size_t n = 10 + (((uint)d[6] & 0x7f) << 21 | ((uint)d[7] & 0x7f) << 14 | ((uint)d[8] & 0x7f) << 7 | (d[9] & 0x7f));
+	if (d[5] & 0x10)
+		n += 10; //footer
+	n = ffmin(n, s->data.len);
+	ffmemmove(s->data.ptr, s->data.ptr + n, s->data.len - n);
+	s->data.len -= n;
+}
+
+static void hls_seg_sig(void *udata)
+{
+	hls_seg *s = udata;
+	hls *h = s->h;
+	ffhttp_response *resp;
+	ffstr d;
+	int r = http_if_recv(s->con, &resp, &d);
+	switch (r) {
+	case FMED_NET_RESP_RECV:
+	case FMED_NET_DONE:
+		if (resp->code == 200 && d.len != 0
+			&& NULL == ffarr_append(&s->data, d.ptr, d.len)) {
+			syserrlog(h->d->trk, "%s", ffmem_alloc_S);
+			r = FMED_NET_ERR;
+		}
+		break;
+	}
+
+	if (r == FMED_NET_DONE && resp->code != 200) {
+		ffstr ln = ffhttp_respstatus(resp);
+		warnlog(h->d->trk, "segment #%U: %S", s->seq, &ln);
+		r = FMED_NET_ERR;
+	}
+
+	if (r == FMED_NET_ERR) {
+		s->err = 1;
+	} else if (r == FMED_NET_DONE) {
+		s->done = 1;
+		hls_skipid3(s);
+		dbglog(h->d->trk, "segment #%U: received %L bytes", s->seq, s->data.len);
+	} else
+		return;
+
+	FF_SAFECLOSE(s->con, NULL, http_if_close);
+	hls_startdl(h);
+	hls_wake(h);
+}
+
+/** Start downloading the next segments. */
+static int hls_startdl(hls *h)
+{
+	hls_seg **ps;
+	uint n = 0, max = (net->conf.hls_segments != 0) ? net->conf.hls_segments : 3;
+	FFARR_WALKT(&h->segs, ps, hls_seg*) {
+		hls_seg *s = *ps;
+		if (n++ == max)
+			break;
+		if (s->con != NULL || s->done || s->err)
+			continue;
+
+		if (NULL == (s->con = http_if_request("GET", s->url, 0))) {
+			s->err = 1;
+			continue;
+		}
+		http_if_sethandler(s->con, &hls_seg_sig, s);
+		http_if_send(s->con, NULL);
+	}
+	return 0;
+}
+
+/** Add the input filter for the format of the segments. */
+static int hls_addfilt(hls *h, hls_seg *s)
+{
+	ffstr name, ext;
+	ffstr_setz(&name, s->url);
+	ffs_split2by(name.ptr, name.len, '?', &name, NULL);
+	ffpath_split2(name.ptr, name.len, NULL, &name);
+	ffpath_splitname(name.ptr, name.len, NULL, &ext);
+	if (ffstr_ieqz(&ext, "ts")) {
+		errlog(h->d->trk, "MPEG-TS segments are not supported");
+		return -1;
+	}
+	if (ext.len == 0)
+		ffstr_setz(&ext, "aac");
+
+	const fmed_modinfo *mi;
+	if (NULL == (mi = core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len))) {
+		errlog(h->d->trk, "no module configured to open .%S stream", &ext);
+		return -1;
+	}
+	if (0 != net->track->cmd2(h->d->trk, FMED_TRACK_ADDFILT, mi->name))
+		return -1;
+	return 0;
+}
+
+static int hls_process(void *ctx, fmed_filt *d)
+{
+	hls *h = ctx;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RLASTOUT;
+	}
+
+	// the previous segment is consumed by the next filter
+	FF_SAFECLOSE(h->cur, NULL, hls_seg_free);
+
+	if (h->err)
+		return FMED_RERR;
+
+	for (;;) {
+		if (h->segs.len == 0) {
+			if (h->endlist && h->plcon == NULL) {
+				d->outlen = 0;
+				return FMED_RDONE;
+			}
+			break;
+		}
+
+		hls_seg *s = *(hls_seg**)h->segs.ptr;
+		if (!(s->done || s->err))
+			break;
+
+		ffmemmove(h->segs.ptr, h->segs.ptr + sizeof(hls_seg*), (h->segs.len - 1) * sizeof(hls_seg*));
+		h->segs.len--;
+		hls_startdl(h);
+
+		if (s->err || s->data.len == 0) {
+			warnlog(d->trk, "skipping segment #%U", s->seq);
+			hls_seg_free(s);
+			continue;
+		}
+
+		if (!h->filt_added) {
+			if (0 != hls_addfilt(h, s)) {
+				hls_seg_free(s);
+				return FMED_RERR;
+			}
+			h->filt_added = 1;
+		}
+
+		h->cur = s;
+		d->out = s->data.ptr,  d->outlen = s->data.len;
+		return FMED_RDATA;
+	}
+
+	h->waiting = 1;
+	return FMED_RASYNC;
+}
+
+
+/* HTTP streaming server:
+The encoded data written by "net.server" filter is stored in a ring buffer shared by all clients
+ connected to the same listening address.  Each client has its own read position in the buffer.
+A client that falls behind by more than the buffer size is disconnected.
+A new client starts receiving data "burst" bytes behind the current write position.
+ICY metadata is inserted every "metaint" bytes for a client that sends "Icy-MetaData: 1".
+The server stays alive when the track is finished, so the next track in queue continues the same stream.
+
+To test HTTP clients (net.http, net.icy) without a real radio server, the server can simulate bad network:
+ delay the response ("latency"), limit bandwidth per client ("rate_limit"),
+ disconnect a client after N bytes ("drop_after"), redirect a client N times ("redirects").
+
+Ogg: the header pages of the current logical stream are sent to a new client
+ before the data that starts at the nearest page boundary.
+*/
+
+#define SRV_LEAD_MS  1000 //max. time the written data can be ahead of real time
+#define SRV_MAXREQ  4096
+
+typedef struct netsrv netsrv;
+typedef struct srvout srvout;
+
+typedef struct srv_client {
+	netsrv *s;
+	ffskt sk;
+	ffaio_task aio;
+	char peer[FF_MAXIP6];
+	ffarr req; //request data
+	ffarr hdr; //response headers + Ogg header pages
+	ffarr mbuf; //ICY metadata block
+	ffstr out; //data being sent (headers or metadata)
+	ffstr pfx; //Ogg header pages being sent
+	uint64 rpos; //read position in the stream
+	uint metaleft; //bytes until the next metadata block
+	uint meta_ver;
+	uint state;
+	fftmrq_entry tmr;
+	fftime t0; //when the response has started
+	uint64 nsent; //bytes sent after the response headers
+	uint async :1
+		, metaint :1 //client wants ICY metadata
+		, delayed :1 //"latency" has been applied
+		, sleeping :1 //waiting for timer
+		;
+} srv_client;
+
+struct netsrv {
+	char *addr; //"IP:PORT"
+	ffaddr sa;
+	ffskt lsk;
+	ffaio_acceptor acc;
+	char *path; //request path to serve
+	const char *ctype;
+	ffarr clients; //srv_client*[]
+	srvout *writer;
+
+	char *buf; //ring buffer
+	size_t cap;
+	uint64 wpos; //total bytes written
+
+	ffarr meta; //the current ICY metadata block
+	uint meta_ver;
+
+	uint64 bos; //stream position of the current Ogg stream's first page
+	ffarr oggpfx; //header pages of the current Ogg stream
+	uint ogg :1
+		, oggpfx_done :1
+		;
+};
+
+struct srvout {
+	netsrv *s;
+	fmed_filt *d;
+	fftime t0;
+	uint64 pos0;
+	ffarr title;
+	fftmrq_entry tmr;
+	fftask task;
+	uint started :1;
+};
+
+enum { C_REQ, C_DATA, C_FIN };
+
+static void srv_cl_a(void *param);
+static void srv_cl_process(srv_client *c);
+static void srv_cl_close(srv_client *c);
+
+static const ffpars_arg srv_conf_args[] = {
+	{ "buffer",	FFPARS_TSIZE | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, srv_bufsize) },
+	{ "burst",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, srv_burst) },
+	{ "metaint",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, srv_metaint) },
+	{ "max_clients",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, srv_maxclients) },
+	{ "name",	FFPARS_TCHARPTR | FFPARS_FNOTEMPTY | FFPARS_FSTRZ | FFPARS_FRECOPY,  FFPARS_DSTOFF(net_conf, srv_name) },
+
+	// testing
+	{ "latency",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, srv_latency) },
+	{ "rate_limit",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, srv_rate) },
+	{ "drop_after",	FFPARS_TSIZE,  FFPARS_DSTOFF(net_conf, srv_drop) },
+	{ "redirects",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, srv_redirects) },
+};
+
+static int srv_config(ffpars_ctx *ctx)
+{
+	net->conf.srv_bufsize = 1 * 1024 * 1024;
+	net->conf.srv_burst = 64 * 1024;
+	net->conf.srv_metaint = 16000;
+	net->conf.srv_maxclients = 100;
+	if (NULL == (net->conf.srv_name = ffsz_alcopyz("fmedia")))
+		return -1;
+	ffpars_setargs(ctx, &net->conf, srv_conf_args, FFCNT(srv_conf_args));
+	return 0;
+}
+
+static const char *const srv_ctypes[] = {
+	"mp3", "audio/mpeg",
+	"ogg", "application/ogg",
+	"opus", "audio/ogg",
+	"aac", "audio/aac",
+};
+
+static void srv_free(void *p)
+{
+	netsrv *s = p;
+	srv_client **pc;
+
+	FFARR_WALKT(&s->clients, pc, srv_client*) {
+		srv_client *c = *pc;
+		c->s = NULL;
+		srv_cl_close(c);
+	}
+	ffarr_free(&s->clients);
+
+	if (s->lsk != FF_BADSKT) {
+		ffskt_close(s->lsk);
+		ffaio_acceptfin(&s->acc);
+	}
+	ffmem_safefree(s->addr);
+	ffmem_safefree(s->path);
+	ffmem_safefree(s->buf);
+	ffarr_free(&s->meta);
+	ffarr_free(&s->oggpfx);
+	ffmem_free(s);
+}
+
+static void srv_accept_a(void *param);
+
+/** Start listening on the address from "http://IP:PORT/..." URL. */
+static netsrv* srv_create(const char *url, fmed_filt *d)
+{
+	netsrv *s;
+	ffurl u;
+	ffip6 ip;
+	int family;
+	ffstr host;
+
+	ffurl_init(&u);
+	if (0 != ffurl_parse(&u, url, ffsz_len(url))) {
+		errlog(d->trk, "ffurl_parse: %s", url);
+		return NULL;
+	}
+	host = ffurl_get(&u, url, FFURL_HOST);
+	if (0 >= (family = ffurl_parse_ip(&u, url, &ip))) {
+		errlog(d->trk, "listening address must be an IP address: %S", &host);
+		return NULL;
+	}
+
+	if (NULL == (s = ffmem_new(netsrv)))
+		return NULL;
+	s->lsk = FF_BADSKT;
+	ffaddr_init(&s->sa);
+	ffaddr_setip(&s->sa, family, &ip);
+	ffip_setport(&s->sa, (u.port != 0) ? u.port : FFHTTP_PORT);
+
+	ffstr hp = ffurl_get(&u, url, FFURL_FULLHOST);
+	if (NULL == (s->addr = ffsz_alcopystr(&hp)))
+		goto err;
+
+	s->cap = net->conf.srv_bufsize;
+	if (NULL == (s->buf = ffmem_alloc(s->cap)))
+		goto err;
+
+	if (FF_BADSKT == (s->lsk = ffskt_create(family, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP))) {
+		syserrlog(d->trk, "%s", ffskt_create_S);
+		goto err;
+	}
+	if (0 != ffskt_setopt(s->lsk, SOL_SOCKET, SO_REUSEADDR, 1))
+		syswarnlog(d->trk, "%s", ffskt_setopt_S);
+	if (0 != ffskt_bind(s->lsk, &s->sa.a, s->sa.len)) {
+		syserrlog(d->trk, "%s: %s", ffskt_bind_S, s->addr);
+		goto err;
+	}
+	if (0 != ffskt_listen(s->lsk, SOMAXCONN)) {
+		syserrlog(d->trk, "%s", ffskt_listen_S);
+		goto err;
+	}
+
+	if (0 != ffaio_acceptinit(&s->acc, core->kq, s->lsk, s, family, SOCK_STREAM)) {
+		syserrlog(d->trk, "%s", ffkqu_attach_S);
+		goto err;
+	}
+
+	if (NULL == ffarr_growT(&net->servers, 1, 4, netsrv*))
+		goto err;
+	*ffarr_pushT(&net->servers, netsrv*) = s;
+
+	infolog(d->trk, "listening on %s", s->addr);
+	srv_accept_a(s);
+	return s;
+
+err:
+	srv_free(s);
+	return NULL;
+}
+
+/** Find an existing server by the listening address or create a new one. */
+static netsrv* srv_get(const char *url, fmed_filt *d)
+{
+	netsrv **ps;
+	ffurl u;
+	ffstr hp;
+
+	ffurl_init(&u);
+	if (0 != ffurl_parse(&u, url, ffsz_len(url))) {
+		errlog(d->trk, "ffurl_parse: %s", url);
+		return NULL;
+	}
+	hp = ffurl_get(&u, url, FFURL_FULLHOST);
+
+	FFARR_WALKT(&net->servers, ps, netsrv*) {
+		if (ffstr_eqz(&hp, (*ps)->addr))
+			return *ps;
+	}
+	return srv_create(url, d);
+}
+
+static void srv_accept_a(void *param)
+{
+	netsrv *s = param;
+	srv_client *c;
+	ffskt sk;
+	ffaddr local, peer;
+
+	for (;;) {
+		sk = ffaio_accept(&s->acc, &local, &peer, SOCK_NONBLOCK, &srv_accept_a);
+		if (sk == FF_BADSKT) {
+			if (!fferr_again(fferr_last()))
+				syserrlog(NULL, "%s", ffskt_accept_S);
+			return;
+		}
+
+		if (s->clients.len == net->conf.srv_maxclients) {
+			warnlog(NULL, "%s: reached max. clients limit", s->addr);
+			ffskt_close(sk);
+			continue;
+		}
+
+		if (NULL == (c = ffmem_new(srv_client))
+			|| NULL == ffarr_growT(&s->clients, 1, 8, srv_client*)) {
+			ffmem_safefree(c);
+			ffskt_close(sk);
+			continue;
+		}
+		*ffarr_pushT(&s->clients, srv_client*) = c;
+		c->s = s;
+		c->sk = sk;
+		ffaddr_tostr(&peer, c->peer, sizeof(c->peer), FFADDR_USEPORT);
+
+		ffaio_init(&c->aio);
+		c->aio.sk = sk;
+		c->aio.udata = c;
+		if (0 != ffaio_attach(&c->aio, core->kq, FFKQU_READ | FFKQU_WRITE)) {
+			syswarnlog(NULL, "%s", ffkqu_attach_S);
+			srv_cl_close(c);
+			continue;
+		}
+
+		dbglog(NULL, "%s: client %s connected  [%L]", s->addr, c->peer, s->clients.len);
+		srv_cl_process(c);
+	}
+}
+
+static void srv_cl_close(srv_client *c)
+{
+	netsrv *s = c->s;
+
+	if (s != NULL) {
+		srv_client **pc;
+		FFARR_WALKT(&s->clients, pc, srv_client*) {
+			if (*pc == c) {
+				*pc = *ffarr_itemT(&s->clients, s->clients.len - 1, srv_client*);
+				s->clients.len--;
+				break;
+			}
+		}
+		dbglog(NULL, "%s: client %s disconnected  [%L]", s->addr, c->peer, s->clients.len);
+	}
+
+	core->timer(&c->tmr, 0, 0);
+	ffskt_close(c->sk);
+	ffaio_fin(&c->aio);
+	ffarr_free(&c->req);
+	ffarr_free(&c->hdr);
+	ffarr_free(&c->mbuf);
+	ffmem_free(c);
+}
+
+static void srv_cl_a(void *param)
+{
+	srv_client *c = param;
+	c->async = 0;
+	srv_cl_process(c);
+}
+
+/** Find the first Ogg page in the ring buffer starting at 'pos'.
+Return stream position;  -1 if not found. */
+static int64 srv_oggpage(netsrv *s, uint64 pos)
+{
+	static const char sync[4] = "OggS";
+	uint i;
+	for (;  pos + 4 <= s->wpos;  pos++) {
+		for (i = 0;  i != 4;  i++) {
+			if (s->buf[(pos + i) % s->cap] != sync[i])
+				break;
+		}
+		if (i == 4)
+			return pos;
+	}
+	return -1;
+}
+
+/** Parse request and prepare response headers. */
+static int srv_cl_req(srv_client *c)
+{
+	netsrv *s = c->s;
+	ffstr req, line, meth, path, qs, name, val, host = {0};
+	ssize_t i;
+	int code = 200;
+	uint nredir = 0;
+
+	ffstr_set2(&req, &c->req);
+	if (0 > (i = ffstr_findz(&req, "\r\n\r\n")))
+		return FMED_RMORE;
+	req.len = i;
+
+	ffstr_nextval3(&req, &line, '\n');
+	ffstr_nextval3(&line, &meth, ' ');
+	ffstr_nextval3(&line, &path, ' ');
+	ffs_split2by(path.ptr, path.len, '?', &path, &qs);
+	if (ffstr_matchcz(&qs, "r=")) {
+		ffstr_shift(&qs, FFSLEN("r="));
+		if (!ffstr_toint(&qs, &nredir, FFS_INT32))
+			nredir = 0;
+	}
+
+	while (req.len != 0) {
+		ffstr_nextval3(&req, &line, '\n');
+		ffstr_nextval3(&line, &name, ':');
+		ffstr_set2(&val, &line);
+		ffstr_trimwhite(&name);
+		ffstr_trimwhite(&val);
+		if (ffstr_ieqcz(&name, "Icy-MetaData") && ffstr_eqcz(&val, "1"))
+			c->metaint = (net->conf.srv_metaint != 0);
+		else if (ffstr_ieqcz(&name, "Host"))
+			host = val;
+	}
+
+	if (!ffstr_eqcz(&meth, "GET"))
+		code = 405;
+	else if (s->path == NULL || !ffstr_eqz(&path, s->path))
+		code = 404;
+	else if (nredir < net->conf.srv_redirects)
+		code = 302;
+
+	dbglog(NULL, "%s: client %s: %S %S: %u", s->addr, c->peer, &meth, &path, code);
+
+	if (code == 302) {
+		if (host.len == 0)
+			ffstr_setz(&host, s->addr);
+		c->hdr.len = 0;
+		if (0 == ffstr_catfmt(&c->hdr, "HTTP/1.0 302 Found\r\nLocation: http://%S%s?r=%u\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+			, &host, s->path, nredir + 1))
+			return FMED_RERR;
+		ffstr_set2(&c->out, &c->hdr);
+		c->state = C_FIN;
+		return 0;
+	}
+
+	if (code != 200) {
+		c->hdr.len = 0;
+		if (0 == ffstr_catfmt(&c->hdr, "HTTP/1.0 %u %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+			, code, (code == 404) ? "Not Found" : "Method Not Allowed"))
+			return FMED_RERR;
+		ffstr_set2(&c->out, &c->hdr);
+		c->state = C_FIN;
+		return 0;
+	}
+
+	c->hdr.len = 0;
+	if (0 == ffstr_catfmt(&c->hdr, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Server: fmedia/" FMED_VER "\r\n"
+		"Cache-Control: no-cache\r\n"
+		"icy-name: %s\r\n"
+		, s->ctype, net->conf.srv_name))
+		return FMED_RERR;
+	if (c->metaint
+		&& 0 == ffstr_catfmt(&c->hdr, "icy-metaint: %u\r\n", net->conf.srv_metaint))
+		return FMED_RERR;
+	if (0 == ffstr_catfmt(&c->hdr, "\r\n"))
+		return FMED_RERR;
+	size_t hdrlen = c->hdr.len;
+
+	// burst-on-connect: start behind the write position
+	uint64 pos = s->wpos - ffmin(s->wpos, ffmin(net->conf.srv_burst, s->cap / 2));
+	if (s->ogg) {
+		if (pos <= s->bos + s->oggpfx.len && s->bos + s->cap >= s->wpos) {
+			pos = s->bos;
+		} else {
+			int64 pg = srv_oggpage(s, pos);
+			pos = (pg >= 0) ? (uint64)pg : s->wpos;
+			if (0 == ffstr_cat(&c->hdr, s->oggpfx.ptr, s->oggpfx.len))
+				return FMED_RERR;
+		}
+	}
+	c->rpos = pos;
+	c->metaleft = net->conf.srv_metaint;
+	c->meta_ver = (uint)-1;
+
+	ffstr_set(&c->out, c->hdr.ptr, hdrlen);
+	ffstr_set(&c->pfx, c->hdr.ptr + hdrlen, c->hdr.len - hdrlen);
+	c->state = C_DATA;
+	return 0;
+}
+
+/** Get the next chunk of data to send.
+Return 0 if data is ready;  1 if there's no more data;  -1 on error. */
+static int srv_cl_next(srv_client *c, ffstr *data)
+{
+	netsrv *s = c->s;
+
+	if (c->out.len != 0) {
+		*data = c->out;
+		return 0;
+	}
+
+	if (c->metaint && c->metaleft == 0) {
+		c->metaleft = net->conf.srv_metaint;
+		if (c->meta_ver != s->meta_ver && s->meta.len != 0) {
+			c->mbuf.len = 0;
+			if (0 == ffstr_cat(&c->mbuf, s->meta.ptr, s->meta.len))
+				return -1;
+			c->meta_ver = s->meta_ver;
+		} else {
+			c->mbuf.len = 0;
+			if (0 == ffstr_cat(&c->mbuf, "\0", 1))
+				return -1;
+		}
+		ffstr_set2(&c->out, &c->mbuf);
+		*data = c->out;
+		return 0;
+	}
+
+	if (c->pfx.len != 0) {
+		*data = c->pfx;
+	} else {
+		if (c->rpos == s->wpos)
+			return 1;
+		size_t off = c->rpos % s->cap;
+		ffstr_set(data, s->buf + off, ffmin(s->wpos - c->rpos, s->cap - off));
+	}
+
+	if (c->metaint)
+		data->len = ffmin(data->len, c->metaleft);
+	return 0;
+}
+
+static void srv_cl_ontmr(void *param)
+{
+	srv_client *c = param;
+	c->sleeping = 0;
+	srv_cl_process(c);
+}
+
+static void srv_cl_sleep(srv_client *c, uint ms)
+{
+	c->sleeping = 1;
+	c->tmr.handler = &srv_cl_ontmr;
+	c->tmr.param = c;
+	core->timer(&c->tmr, -(int)ffmax(ms, 1), 0);
+}
+
+/** Don't send more than "rate_limit" bytes per second.
+Return 1 if the client must wait. */
+static int srv_cl_ratelimit(srv_client *c, ffstr *data)
+{
+	uint rate = net->conf.srv_rate;
+	fftime t;
+	ffclk_get(&t);
+	ffclk_diff(&c->t0, &t);
+	uint64 allowed = rate * fftime_ms(&t) / 1000 + rate / 10;
+	if (c->nsent >= allowed) {
+		srv_cl_sleep(c, (c->nsent - allowed) * 1000 / rate + 1);
+		return 1;
+	}
+	data->len = ffmin(data->len, allowed - c->nsent);
+	return 0;
+}
+
+static void srv_cl_process(srv_client *c)
+{
+	netsrv *s = c->s;
+	ffstr data;
+	ssize_t r;
+
+	switch (c->state) {
+	case C_REQ:
+		for (;;) {
+			if (NULL == ffarr_growT(&c->req, 512, 0, char))
+				goto err;
+			r = ffaio_recv(&c->aio, &srv_cl_a, ffarr_end(&c->req), ffarr_unused(&c->req));
+			if (r == FFAIO_ASYNC) {
+				c->async = 1;
+				return;
+			} else if (r <= 0) {
+				if (r < 0)
+					syswarnlog(NULL, "%s: client %s: %s", s->addr, c->peer, ffskt_recv_S);
+				goto err;
+			}
+			c->req.len += r;
+
+			r = srv_cl_req(c);
+			if (r == FMED_RERR)
+				goto err;
+			else if (r == 0)
+				break;
+
+			if (c->req.len >= SRV_MAXREQ) {
+				warnlog(NULL, "%s: client %s: too large request", s->addr, c->peer);
+				goto err;
+			}
+		}
+		ffarr_free(&c->req);
+		ffclk_get(&c->t0);
+		// fallthrough
+
+	case C_DATA:
+	case C_FIN:
+		if (net->conf.srv_latency != 0 && !c->delayed) {
+			c->delayed = 1;
+			srv_cl_sleep(c, net->conf.srv_latency);
+			return;
+		}
+
+		for (;;) {
+			if (c->state == C_DATA && s->wpos - c->rpos > s->cap) {
+				warnlog(NULL, "%s: client %s is too slow, disconnecting", s->addr, c->peer);
+				goto err;
+			}
+
+			r = srv_cl_next(c, &data);
+			if (r < 0)
+				goto err;
+			else if (r == 1)
+				return; // wait for more data from srv_write()
+
+			if (net->conf.srv_drop != 0) {
+				if (c->nsent >= net->conf.srv_drop) {
+					dbglog(NULL, "%s: client %s: dropping connection after %U bytes", s->addr, c->peer, c->nsent);
+					goto err;
+				}
+				data.len = ffmin(data.len, net->conf.srv_drop - c->nsent);
+			}
+
+			if (net->conf.srv_rate != 0 && 0 != srv_cl_ratelimit(c, &data))
+				return;
+
+			r = ffaio_send(&c->aio, &srv_cl_a, data.ptr, data.len);
+			if (r == FFAIO_ASYNC) {
+				c->async = 1;
+				return;
+			} else if (r == FFAIO_ERROR) {
+				dbglog(NULL, "%s: client %s: %s: %E", s->addr, c->peer, ffskt_send_S, fferr_last());
+				goto err;
+			}
+			c->nsent += r;
+
+			if (c->out.len != 0) {
+				ffstr_shift(&c->out, r);
+				if (c->out.len == 0 && c->state == C_FIN)
+					goto err;
+				continue;
+			}
+
+			if (c->pfx.len != 0)
+				ffstr_shift(&c->pfx, r);
+			else
+				c->rpos += r;
+			c->metaleft -= (c->metaint) ? r : 0;
+		}
+	}
+	return;
+
+err:
+	srv_cl_close(c);
+}
+
+/** Copy data into the ring buffer and notify the idle clients. */
+static void srv_write(netsrv *s, const char *data, size_t len)
+{
+	srv_client **pc;
+
+	if (len > s->cap) {
+		data += len - s->cap;
+		s->wpos += len - s->cap;
+		len = s->cap;
+	}
+
+	size_t off = s->wpos % s->cap;
+	size_t n = ffmin(len, s->cap - off);
+	ffmemcpy(s->buf + off, data, n);
+	ffmemcpy(s->buf, data + n, len - n);
+	s->wpos += len;
+
+	// clients may be removed from the array while iterating
+	for (size_t i = 0;  i < s->clients.len;  ) {
+		pc = ffarr_itemT(&s->clients, i, srv_client*);
+		srv_client *c = *pc;
+		if (c->state == C_REQ || c->async || c->sleeping) {
+			i++;
+			continue;
+		}
+		srv_cl_process(c);
+		if (i < s->clients.len && *pc == c)
+			i++;
+	}
+}
+
+/** Rebuild ICY metadata block when the track's meta data has changed. */
+static void srv_meta(srvout *o, fmed_filt *d)
+{
+	netsrv *s = o->s;
+	ffstr *artist, *title;
+	char buf[255 * 16];
+	size_t n;
+
+	artist = d->track->getvalstr3(d->trk, "artist", FMED_TRK_META | FMED_TRK_VALSTR);
+	title = d->track->getvalstr3(d->trk, "title", FMED_TRK_META | FMED_TRK_VALSTR);
+	if (title == FMED_PNULL)
+		return;
+
+	if (artist != FMED_PNULL && artist->len != 0)
+		n = ffs_fmt(buf, buf + sizeof(buf), "%S - %S", artist, title);
+	else
+		n = ffs_fmt(buf, buf + sizeof(buf), "%S", title);
+
+	n = ffmin(n, 255 * 16 - FFSLEN("StreamTitle='';"));
+	if (o->title.len == n && !ffmemcmp(o->title.ptr, buf, n))
+		return;
+	o->title.len = 0;
+	if (0 == ffstr_cat(&o->title, buf, n))
+		return;
+
+	// "N StreamTitle='...';" padded with zeros to N*16 bytes
+	s->meta.len = 0;
+	if (NULL == ffarr_realloc(&s->meta, 1 + 255 * 16))
+		return;
+	n = ffs_fmt(s->meta.ptr + 1, s->meta.ptr + s->meta.cap, "StreamTitle='%S';", &o->title);
+	uint nblk = (n + 15) / 16;
+	ffmem_zero(s->meta.ptr + 1 + n, nblk * 16 - n);
+	s->meta.ptr[0] = (byte)nblk;
+	s->meta.len = 1 + nblk * 16;
+	s->meta_ver++;
+	dbglog(d->trk, "%s: meta: %S", s->addr, &o->title);
+}
+
+/** Store the header pages of a new Ogg stream (their granule position is 0). */
+static void srv_oggpage_hdr(netsrv *s, const char *data, size_t len)
+{
+	if (s->oggpfx_done)
+		return;
+	if (len < 14 || ffs_cmp(data, "OggS", 4) || 0 != ffmemcmp(data + 6, "\0\0\0\0\0\0\0\0", 8)) {
+		s->oggpfx_done = 1;
+		return;
+	}
+	ffstr_cat(&s->oggpfx, data, len);
+}
+
+static void srvout_ontmr(void *param)
+{
+	srvout *o = param;
+	core->task(&o->task, FMED_TASK_POST);
+}
+
+static void* srvout_open(fmed_filt *d)
+{
+	srvout *o;
+	netsrv *s;
+	const char *url = d->track->getvalstr(d->trk, "output");
+	ffstr name, ext, path, tmp;
+	size_t i;
+
+	if (NULL == (s = srv_get(url, d)))
+		return NULL;
+	if (s->writer != NULL) {
+		errlog(d->trk, "%s: the stream is already being written by another track", s->addr);
+		return NULL;
+	}
+
+	ffpath_split2(url, ffsz_len(url), NULL, &name);
+	ffs_rsplit2by(name.ptr, name.len, '.', &tmp, &ext);
+	s->ctype = "application/octet-stream";
+	for (i = 0;  i != FFCNT(srv_ctypes);  i += 2) {
+		if (ffstr_ieqz(&ext, srv_ctypes[i])) {
+			s->ctype = srv_ctypes[i + 1];
+			break;
+		}
+	}
+	s->ogg = (ffstr_ieqcz(&ext, "ogg") || ffstr_ieqcz(&ext, "opus"));
+	s->oggpfx.len = 0;
+	s->oggpfx_done = 0;
+	s->bos = s->wpos;
+
+	ffurl u;
+	ffurl_init(&u);
+	ffurl_parse(&u, url, ffsz_len(url));
+	path = ffurl_get(&u, url, FFURL_PATH);
+	ffmem_safefree(s->path);
+	if (NULL == (s->path = ffsz_alcopystr(&path)))
+		return NULL;
+
+	if (NULL == (o = ffmem_new(srvout)))
+		return NULL;
+	o->s = s;
+	o->d = d;
+	o->task.handler = d->handler;
+	o->task.param = d->trk;
+	o->tmr.handler = &srvout_ontmr;
+	o->tmr.param = o;
+	s->writer = o;
+	return o;
+}
+
+static void srvout_close(void *ctx)
+{
+	srvout *o = ctx;
+	core->timer(&o->tmr, 0, 0);
+	core->task(&o->task, FMED_TASK_DEL);
+	o->s->writer = NULL;
+	ffarr_free(&o->title);
+	ffmem_free(o);
+}
+
+/** Don't let the data get ahead of real time, otherwise it will overflow clients' buffers.
+Return 0 or FMED_RASYNC. */
+static int srvout_pace(srvout *o, fmed_filt *d)
+{
+	fftime t;
+	uint64 pos_ms, now;
+
+	if (d->audio.fmt.sample_rate == 0)
+		return 0;
+
+	if (!o->started || d->audio.pos < o->pos0) {
+		o->started = 1;
+		ffclk_get(&o->t0);
+		o->pos0 = d->audio.pos;
+		return 0;
+	}
+
+	ffclk_get(&t);
+	ffclk_diff(&o->t0, &t);
+	now = fftime_ms(&t);
+	pos_ms = ffpcm_time(d->audio.pos - o->pos0, d->audio.fmt.sample_rate);
+	if (pos_ms > now + SRV_LEAD_MS) {
+		core->timer(&o->tmr, -(int)(pos_ms - now - SRV_LEAD_MS / 2), 0);
+		return FMED_RASYNC;
+	}
+	return 0;
+}
+
+static int srvout_process(void *ctx, fmed_filt *d)
+{
+	srvout *o = ctx;
+	netsrv *s = o->s;
+	int r;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	srv_meta(o, d);
+
+	if (d->datalen != 0) {
+		if (0 != (r = srvout_pace(o, d)))
+			return r;
+
+		if (s->ogg)
+			srv_oggpage_hdr(s, d->data, d->datalen);
+		srv_write(s, d->data, d->datalen);
+		dbglog(d->trk, "%s: written %L bytes  clients:%L", s->addr, d->datalen, s->clients.len);
+		d->datalen = 0;
+	}
+
+	if (d->flags & FMED_FLAST)
+		return FMED_RDONE;
+	return FMED_ROK;
+}
+
+
+/* Stations recorder:
+"net.stations" filter reads a list of radio stations and starts a recording track for each of them.
+A station's track (net.http -> net.icy) doesn't decode audio: net.icy only passes the stream data to "net.in" child tracks,
+ which write output files.  A new file is started on ICY title change (if the output file name contains "$" variables)
+ and on "split_time" boundary.
+If a station's track is finished (e.g. after net.http has exceeded "max_reconnect" limit),
+ it's restarted after a delay that grows twice on each failure, up to "backoff_max".
+Memory per station is bounded by net.http buffers and net.in buffer size.
+
+Station list file: "URL [NAME]" per line.  Empty lines and lines starting with '#' are skipped.
+NAME is available as $station variable for output file name.
+*/
+
+#define ST_BACKOFF_MIN  1000 //ms
+#define ST_HEALTHY_TIME  60 //sec: reset backoff if a track has been running this long
+
+enum ST_STATE {
+	ST_IDLE,
+	ST_CONNECTING,
+	ST_OK,
+	ST_STALLED,
+	ST_WAITING, //waiting before reconnect
+};
+
+static const char *const st_state_str[] = {
+	"idle", "connecting", "ok", "stalled", "waiting",
+};
+
+typedef struct stations stations;
+
+struct station {
+	stations *sts;
+	char *url;
+	char *name;
+	void *trk;
+	icy *c;
+	uint state; //enum ST_STATE
+	uint64 bytes; //total bytes received
+	uint64 bytes_prev;
+	uint kbps;
+	uint restarts;
+	uint backoff; //ms
+	uint64 started; //sec
+	fftmrq_entry tmr;
+};
+
+struct stations {
+	fmed_filt *d;
+	station *list;
+	size_t n;
+	char *out;
+	fftmrq_entry tmr;
+	uint stream_copy :1;
+	uint closing :1;
+};
+
+static const ffpars_arg st_conf_args[] = {
+	{ "split_time",	FFPARS_TINT,  FFPARS_DSTOFF(net_conf, st_split) },
+	{ "backoff_max",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, st_backoff_max) },
+	{ "status_interval",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(net_conf, st_status_intvl) },
+	{ "status_file",	FFPARS_TCHARPTR | FFPARS_FSTRZ | FFPARS_FCOPY,  FFPARS_DSTOFF(net_conf, st_status_file) },
+};
+
+static int st_config(ffpars_ctx *ctx)
+{
+	net->conf.st_split = 0;
+	net->conf.st_backoff_max = 300;
+	net->conf.st_status_intvl = 10;
+	ffpars_setargs(ctx, &net->conf, st_conf_args, FFCNT(st_conf_args));
+	return 0;
+}
+
+/** Parse station list. */
+static int st_load(stations *sts, const char *fn)
+{
+	fffd f;
+	ffarr buf = {0}, list = {0};
+	ffstr data, ln, url;
+	station *st;
+	int r = -1;
+
+	if (FF_BADFD == (f = fffile_open(fn, O_RDONLY))) {
+		syserrlog(sts->d->trk, "%s: %s", fffile_open_S, fn);
+		return -1;
+	}
+	if (NULL == ffarr_alloc(&buf, fffile_size(f)))
+		goto end;
+	ssize_t n = fffile_read(f, buf.ptr, buf.cap);
+	if (n < 0) {
+		syserrlog(sts->d->trk, "%s: %s", fffile_read_S, fn);
+		goto end;
+	}
+	buf.len = n;
+
+	ffstr_set2(&data, &buf);
+	while (data.len != 0) {
+		ffstr_nextval3(&data, &ln, '\n');
+		ffstr_trimwhite(&ln);
+		if (ln.len == 0 || ln.ptr[0] == '#')
+			continue;
+
+		ffs_split2by(ln.ptr, ln.len, ' ', &url, &ln);
+		ffstr_trimwhite(&ln);
+
+		if (NULL == (st = ffarr_pushgrowT(&list, 16, station)))
+			goto end;
+		ffmem_tzero(st);
+		st->sts = sts;
+		st->url = ffsz_alcopystr(&url);
+		if (ln.len != 0)
+			st->name = ffsz_alcopystr(&ln);
+		else {
+			char num[FFINT_MAXCHARS];
+			size_t nn = ffs_fromint(list.len, num, sizeof(num), 0);
+			st->name = ffsz_alcopy(num, nn);
+		}
+		if (st->url == NULL || st->name == NULL)
+			goto end;
+	}
+
+	sts->list = (void*)list.ptr;
+	sts->n = list.len;
+	ffarr_null(&list);
+	r = 0;
+
+end:
+	FFARR_WALKT(&list, st, station) {
+		ffmem_safefree(st->url);
+		ffmem_safefree(st->name);
+	}
+	ffarr_free(&list);
+	ffarr_free(&buf);
+	fffile_close(f);
+	return r;
+}
+
+static uint64 st_now(void)
+{
+	fftime t;
+	fftime_now(&t);
+	return fftime_sec(&t);
+}
+
+/** Start recording track for a station. */
+static void st_start(station *st)
+{
+	stations *sts = st->sts;
+	void *trk;
+
+	if (NULL == (trk = net->track->create(FMED_TRK_TYPE_NONE, NULL)))
+		goto fail;
+
+	net->track->setvalstr(trk, "input", st->url);
+	net->track->setvalstr(trk, "out_filename", sts->out);
+	net->track->setval(trk, "out-copy", FMED_OUTCP_ALL);
+	if (sts->stream_copy)
+		net->track->setval(trk, "out_stream_copy", 1);
+	net->track->setval(trk, "net_station", (size_t)st);
+	ffstr val;
+	ffstr_setz(&val, st->name);
+	net->track->setvalstr4(trk, "station", (void*)&val, FMED_TRK_META | FMED_TRK_VALSTR);
+
+	if (0 != net->track->cmd(trk, FMED_TRACK_ADDFILT, "net.icy")) {
+		net->track->cmd(trk, FMED_TRACK_STOP);
+		goto fail;
+	}
+
+	st->trk = trk;
+	st->state = ST_CONNECTING;
+	st->bytes_prev = st->bytes;
+	st->started = st_now();
+	net->track->cmd(trk, FMED_TRACK_START);
+	return;
+
+fail:
+	errlog(sts->d->trk, "%s: can't start recording", st->name);
+	st_ended(st);
+}
+
+/** Count received bytes;  start a new output file on time boundary. */
+static void icy_st_data(icy *c, size_t len)
+{
+	uint split = net->conf.st_split;
+
+	c->st->bytes += len;
+	if (split == 0)
+		return;
+
+	uint64 now = st_now();
+	if (c->split_at == 0) {
+		c->split_at = (now / split + 1) * split;
+		return;
+	} else if (now < c->split_at)
+		return;
+	c->split_at = (now / split + 1) * split;
+
+	if (c->netin != NULL) {
+		netin_write(c->netin, NULL);
+		c->netin = NULL;
+	}
+	c->netin = netin_create(c);
+}
+
+static void st_ontmr(void *param)
+{
+	station *st = param;
+	st_start(st);
+}
+
+/** A station's track is finished: schedule restart. */
+static void st_ended(station *st)
+{
+	stations *sts = st->sts;
+
+	st->trk = NULL;
+	if (sts == NULL || sts->closing)
+		return;
+
+	if (st->state != ST_WAITING && st->started != 0
+		&& st_now() - st->started >= ST_HEALTHY_TIME)
+		st->backoff = 0;
+	st->backoff = (st->backoff == 0) ? ST_BACKOFF_MIN
+		: ffmin(st->backoff * 2, net->conf.st_backoff_max * 1000);
+	st->state = ST_WAITING;
+	st->kbps = 0;
+	st->restarts++;
+
+	warnlog(sts->d->trk, "%s: recording has stopped, restarting in %ums", st->name, st->backoff);
+	st->tmr.handler = &st_ontmr;
+	st->tmr.param = st;
+	core->timer(&st->tmr, -(int)st->backoff, 0);
+}
+
+/** Update counters and write status file. */
+static void st_status(void *param)
+{
+	stations *sts = param;
+	station *st;
+	ffarr buf = {0};
+	uint i, nok = 0;
+	uint64 total_kbps = 0;
+
+	ffstr_catfmt(&buf, "#name\tstate\tkbps\tbytes\trestarts\turl\n");
+	for (i = 0;  i != sts->n;  i++) {
+		st = &sts->list[i];
+		if (st->trk != NULL) {
+			uint64 n = st->bytes - st->bytes_prev;
+			st->bytes_prev = st->bytes;
+			st->kbps = n * 8 / 1000 / net->conf.st_status_intvl;
+			if (n != 0)
+				st->state = ST_OK;
+			else if (st->state == ST_OK)
+				st->state = ST_STALLED;
+		}
+		if (st->state == ST_OK)
+			nok++;
+		total_kbps += st->kbps;
+
+		ffstr_catfmt(&buf, "%s\t%s\t%u\t%U\t%u\t%s\n"
+			, st->name, st_state_str[st->state], st->kbps, st->bytes, st->restarts, st->url);
+	}
+
+	dbglog(sts->d->trk, "stations: %u/%L ok, %Ukbps total", nok, sts->n, total_kbps);
+
+	if (net->conf.st_status_file != NULL) {
+		fffd f = fffile_open(net->conf.st_status_file, O_CREAT | O_TRUNC | O_WRONLY);
+		if (f == FF_BADFD) {
+			syswarnlog(sts->d->trk, "%s: %s", fffile_open_S, net->conf.st_status_file);
+		} else {
+			if (buf.len != (size_t)fffile_write(f, buf.ptr, buf.len))
+				syswarnlog(sts->d->trk, "%s: %s", fffile_write_S, net->conf.st_status_file);
+			fffile_close(f);
+		}
+	}
+
+	ffarr_free(&buf);
+}
+
+static void* st_open(fmed_filt *d)
+{
+	stations *sts;
+	const char *fn;
+
+	if (NULL == (sts = ffmem_new(stations)))
+		return NULL;
+	sts->d = d;
+
+	fn = d->track->getvalstr(d->trk, "input");
+	if (FMED_PNULL == (sts->out = (void*)d->track->getvalstr(d->trk, "out_filename"))) {
+		errlog(d->trk, "output file name must be specified");
+		goto end;
+	}
+	sts->stream_copy = (1 == d->track->getval(d->trk, "out_stream_copy"));
+
+	if (0 != st_load(sts, fn))
+		goto end;
+	if (sts->n == 0) {
+		errlog(d->trk, "%s: no stations", fn);
+		goto end;
+	}
+	infolog(d->trk, "recording %L stations from %s", sts->n, fn);
+	return sts;
+
+end:
+	st_close(sts);
+	return NULL;
+}
+
+static void st_close(void *ctx)
+{
+	stations *sts = ctx;
+	station *st;
+
+	sts->closing = 1;
+	core->timer(&sts->tmr, 0, 0);
+	for (size_t i = 0;  i != sts->n;  i++) {
+		st = &sts->list[i];
+		core->timer(&st->tmr, 0, 0);
+		if (st->c != NULL)
+			st->c->st = NULL; // the track may be closed after us
+		if (st->trk != NULL)
+			net->track->cmd(st->trk, FMED_TRACK_STOP);
+		ffmem_free(st->url);
+		ffmem_free(st->name);
+	}
+	ffmem_safefree(sts->list);
+	ffmem_free(sts);
+}
+
+static int st_process(void *ctx, fmed_filt *d)
+{
+	stations *sts = ctx;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (sts->tmr.handler == NULL) {
+		for (size_t i = 0;  i != sts->n;  i++) {
+			st_start(&sts->list[i]);
+		}
+		sts->tmr.handler = &st_status;
+		sts->tmr.param = sts;
+		core->timer(&sts->tmr, net->conf.st_status_intvl * 1000, 0);
+	}
+
+	return FMED_RASYNC;
+}
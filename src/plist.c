@@ -47,7 +47,10 @@ typedef struct cue {
 	uint gmeta;
 	uint i_glob_artist; // meta index of global PERFORMER
 	uint artist_trk[2]; // whether track PERFORMER is specified for the current and next track
+	fmed_que_entry *split_first; // the first item of the group of tracks from the same file
+	uint split_n;
 	uint utf8 :1;
+	uint split :1; // --cue-split
 } cue;
 
 
@@ -86,6 +89,8 @@ static const fmed_filter fmed_cue_input = {
 };
 
 static int cue_trackno(cue *c, fmed_filt *d, ffarr *arr);
+static void cue_split_add(cue *c, fmed_que_entry *qe);
+static void cue_split_mark(cue *c);
 
 //DIR INPUT
 static void* dir_open(fmed_filt *d);
@@ -401,6 +406,13 @@ static void* cue_open(fmed_filt *d)
 			gaps = cue_opts[val];
 	}
 
+	if (1 == core->getval("cue_split") && !d->stream_copy) {
+		if (FMED_PNULL != d->track->getvalstr(d->trk, "output"))
+			c->split = 1;
+		else
+			warnlog(core, d->trk, "cue", "--cue-split requires --out");
+	}
+
 	ffcue_init(&c->cue);
 	c->qu_cur = (void*)fmed_getval("queue_item");
 	c->cu.options = gaps;
@@ -422,6 +434,27 @@ static void cue_close(void *ctx)
 	ffmem_free(c);
 }
 
+/** Group consecutive tracks from the same file. */
+static void cue_split_add(cue *c, fmed_que_entry *qe)
+{
+	if (c->split_first != NULL && ffstr_eq2(&c->split_first->url, &qe->url)) {
+		c->split_n++;
+		return;
+	}
+	cue_split_mark(c);
+	c->split_first = qe;
+	c->split_n = 1;
+}
+
+/** The first track of the group will decode the file and encode all tracks of the group. */
+static void cue_split_mark(cue *c)
+{
+	if (c->split_n < 2)
+		return;
+	int64 n = c->split_n;
+	qu->meta_set(c->split_first, FFSTR("cue_split"), (void*)&n, sizeof(int64), FMED_QUE_TRKDICT | FMED_QUE_NUM);
+}
+
 static int cue_process(void *ctx, fmed_filt *d)
 {
 	cue *c = ctx;
@@ -569,6 +602,8 @@ add:
 		}
 		qu->cmd2(FMED_QUE_ADD | FMED_QUE_ADD_DONE, cur, 0);
 		c->qu_cur = cur;
+		if (c->split)
+			cue_split_add(c, cur);
 
 next:
 		/* 'metas': GLOBAL TRACK_N TRACK_N+1
@@ -583,6 +618,8 @@ next:
 		c->nmeta = c->metas.len;
 	}
 
+	if (c->split)
+		cue_split_mark(c);
 	qu->cmd(FMED_QUE_RM, (void*)fmed_getval("queue_item"));
 	rc = FMED_RFIN;
 
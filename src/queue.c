@@ -845,8 +845,13 @@ static void que_trk_close(void *ctx)
 	int stopped = t->track->getval(t->trk, "stopped");
 	int err = t->track->getval(t->trk, "error");
 
-	if (stopped == FMED_NULL && (err == FMED_NULL || qu->next_if_err))
-		next = que_getnext(t->e);
+	if (stopped == FMED_NULL && (err == FMED_NULL || qu->next_if_err)) {
+		entry *from = t->e;
+		int64 skip = t->track->getval(t->trk, "queue_skip");
+		if (skip != FMED_NULL)
+			from = FF_GETPTR(entry, e, (void*)skip); //the items up to this one were processed by the track
+		next = que_getnext(from);
+	}
 
 	if (t->e->stop_after) {
 		t->e->stop_after = 0;
@@ -0,0 +1,986 @@
+/** RTP output and input: PCM (L16, L24) or Opus payload over UDP.
+Copyright (c) 2018 Simon Zolin */
+
+/*
+rtp.out:  ... -> #soundmod.autoconv -> [opus.encode ->] rtp.out -> UDP socket
+rtp.in:  UDP socket -> rtp.in (jitter buffer) -> [opus.decode ->] ... -> audio device
+
+URL: rtp://IP:PORT[/PAYLOAD],  PAYLOAD: L16 | L24 | opus
+Both sides must use the same payload, sample rate and number of channels.
+
+RTP timestamp of a packet is the audio position (d->audio.pos, in output samples) of its first sample.
+rtp.out sends packets no faster than real time.
+rtp.in holds 'jitter' msec of audio data;
+ the packets that arrive after their play time are dropped, the lost packets are replaced with silence (PCM).
+*/
+
+#include <fmedia.h>
+
+#include <FF/audio/pcm.h>
+#include <FF/net/url.h>
+#include <FF/array.h>
+#include <FFOS/asyncio.h>
+#include <FFOS/socket.h>
+#include <FFOS/random.h>
+#include <FFOS/error.h>
+
+
+#undef dbglog
+#undef errlog
+#undef warnlog
+#undef syserrlog
+#define dbglog(trk, ...)  fmed_dbglog(core, trk, "rtp", __VA_ARGS__)
+#define infolog(trk, ...)  fmed_infolog(core, trk, "rtp", __VA_ARGS__)
+#define warnlog(trk, ...)  fmed_warnlog(core, trk, "rtp", __VA_ARGS__)
+#define errlog(trk, ...)  fmed_errlog(core, trk, "rtp", __VA_ARGS__)
+#define syserrlog(trk, ...)  fmed_syserrlog(core, trk, "rtp", __VA_ARGS__)
+#define syswarnlog(trk, ...)  fmed_syswarnlog(core, trk, "rtp", __VA_ARGS__)
+
+
+static const fmed_core *core;
+
+enum RTP_PL {
+	RTP_L16,
+	RTP_L24,
+	RTP_OPUS,
+};
+
+static const char *const rtp_pl_str[] = {
+	"L16", "L24", "opus",
+};
+
+enum {
+	RTP_HDR = 12,
+	RTP_MAXPAYLOAD = 1500 - 40 - 8 - RTP_HDR, //fit into Ethernet MTU with IPv6 and UDP headers
+	RTP_MAXPKT = 4 * 1024, //max. payload accepted by rtp.in
+	RTP_NSLOTS = 256, //jitter buffer capacity (packets)
+	RTP_RBUF = 64 * 1024,
+};
+
+static struct rtp_out_conf_t {
+	byte payload; //enum RTP_PL
+	byte pt; //payload type
+	float ptime; //packet duration, msec
+	uint rate;
+	uint channels;
+} rtp_out_conf;
+
+static struct rtp_in_conf_t {
+	byte payload; //enum RTP_PL
+	uint rate;
+	uint channels;
+	uint jitter; //msec
+	uint jitter_max; //msec
+} rtp_in_conf;
+
+typedef struct rtp_hdr {
+	uint pt;
+	uint marker;
+	uint seq;
+	uint ts;
+	uint ssrc;
+} rtp_hdr;
+
+//FMEDIA MODULE
+static const void* rtp_iface(const char *name);
+static int rtp_conf(const char *name, ffpars_ctx *ctx);
+static int rtp_sig(uint signo);
+static void rtp_destroy(void);
+static const fmed_mod fmed_rtp_mod = {
+	.ver = FMED_VER_FULL, .ver_core = FMED_VER_CORE,
+	&rtp_iface, &rtp_sig, &rtp_destroy, &rtp_conf
+};
+
+//OUTPUT
+static void* rtpout_open(fmed_filt *d);
+static int rtpout_process(void *ctx, fmed_filt *d);
+static void rtpout_close(void *ctx);
+static int rtpout_config(ffpars_ctx *ctx);
+static const fmed_filter fmed_rtp_out = {
+	&rtpout_open, &rtpout_process, &rtpout_close
+};
+
+static const ffpars_enumlist rtp_out_plenum = { rtp_pl_str, FFCNT(rtp_pl_str), FFPARS_DSTOFF(struct rtp_out_conf_t, payload) };
+
+static const ffpars_arg rtp_out_conf_args[] = {
+	{ "payload",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&rtp_out_plenum) },
+	{ "payload_type",	FFPARS_TINT | FFPARS_F8BIT,  FFPARS_DSTOFF(struct rtp_out_conf_t, pt) },
+	{ "packet_time",	FFPARS_TFLOAT,  FFPARS_DSTOFF(struct rtp_out_conf_t, ptime) },
+	{ "rate",	FFPARS_TINT,  FFPARS_DSTOFF(struct rtp_out_conf_t, rate) },
+	{ "channels",	FFPARS_TINT,  FFPARS_DSTOFF(struct rtp_out_conf_t, channels) },
+};
+
+//INPUT
+static void* rtpin_open(fmed_filt *d);
+static int rtpin_process(void *ctx, fmed_filt *d);
+static void rtpin_close(void *ctx);
+static int rtpin_config(ffpars_ctx *ctx);
+static const fmed_filter fmed_rtp_in = {
+	&rtpin_open, &rtpin_process, &rtpin_close
+};
+
+static const ffpars_enumlist rtp_in_plenum = { rtp_pl_str, FFCNT(rtp_pl_str), FFPARS_DSTOFF(struct rtp_in_conf_t, payload) };
+
+static const ffpars_arg rtp_in_conf_args[] = {
+	{ "payload",	FFPARS_TENUM | FFPARS_F8BIT,  FFPARS_DST(&rtp_in_plenum) },
+	{ "rate",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct rtp_in_conf_t, rate) },
+	{ "channels",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct rtp_in_conf_t, channels) },
+	{ "jitter",	FFPARS_TINT,  FFPARS_DSTOFF(struct rtp_in_conf_t, jitter) },
+	{ "jitter_max",	FFPARS_TINT | FFPARS_FNOTZERO,  FFPARS_DSTOFF(struct rtp_in_conf_t, jitter_max) },
+};
+
+
+FF_EXP const fmed_mod* fmed_getmod(const fmed_core *_core)
+{
+	core = _core;
+	return &fmed_rtp_mod;
+}
+
+
+static const void* rtp_iface(const char *name)
+{
+	if (!ffsz_cmp(name, "out"))
+		return &fmed_rtp_out;
+	else if (!ffsz_cmp(name, "in"))
+		return &fmed_rtp_in;
+	return NULL;
+}
+
+static int rtp_conf(const char *name, ffpars_ctx *ctx)
+{
+	if (!ffsz_cmp(name, "out"))
+		return rtpout_config(ctx);
+	else if (!ffsz_cmp(name, "in"))
+		return rtpin_config(ctx);
+	return -1;
+}
+
+static int rtp_sig(uint signo)
+{
+	switch (signo) {
+	case FMED_SIG_INIT: {
+		ffmem_init();
+		fftime t;
+		fftime_now(&t);
+		ffrnd_seed(fftime_sec(&t));
+		return 0;
+	}
+
+	case FMED_OPEN:
+		if (0 != ffskt_init(FFSKT_WSA))
+			return -1;
+		break;
+	}
+	return 0;
+}
+
+static void rtp_destroy(void)
+{
+}
+
+
+/** Parse "rtp://IP:PORT[/PAYLOAD]".
+Return address family;  0 on error. */
+static int rtp_url(const char *url, ffaddr *a, uint *payload, fmed_filt *d)
+{
+	ffurl u;
+	ffip6 ip;
+	int family;
+	ffstr s;
+	uint i;
+
+	ffurl_init(&u);
+	if (0 != ffurl_parse(&u, url, ffsz_len(url))) {
+		errlog(d->trk, "ffurl_parse: %s", url);
+		return 0;
+	}
+	if (0 >= (family = ffurl_parse_ip(&u, url, &ip))) {
+		s = ffurl_get(&u, url, FFURL_HOST);
+		errlog(d->trk, "address must be an IP address: %S", &s);
+		return 0;
+	}
+	if (u.port == 0) {
+		errlog(d->trk, "port number is required: %s", url);
+		return 0;
+	}
+	ffaddr_init(a);
+	ffaddr_setip(a, family, &ip);
+	ffip_setport(a, u.port);
+
+	s = ffurl_get(&u, url, FFURL_PATH);
+	if (s.len != 0 && s.ptr[0] == '/')
+		ffstr_shift(&s, 1);
+	if (s.len != 0) {
+		for (i = 0;  i != FFCNT(rtp_pl_str);  i++) {
+			if (ffstr_ieqz(&s, rtp_pl_str[i]))
+				break;
+		}
+		if (i == FFCNT(rtp_pl_str)) {
+			errlog(d->trk, "unsupported payload: %S", &s);
+			return 0;
+		}
+		*payload = i;
+	}
+	return family;
+}
+
+static void rtp_hdr_write(char *p, const rtp_hdr *h)
+{
+	p[0] = 0x80; //version 2
+	p[1] = (h->marker << 7) | (h->pt & 0x7f);
+	p[2] = h->seq >> 8;
+	p[3] = h->seq;
+	p[4] = h->ts >> 24;
+	p[5] = h->ts >> 16;
+	p[6] = h->ts >> 8;
+	p[7] = h->ts;
+	p[8] = h->ssrc >> 24;
+	p[9] = h->ssrc >> 16;
+	p[10] = h->ssrc >> 8;
+	p[11] = h->ssrc;
+}
+
+static uint rtp_be32(const byte *p)
+{
+	return ((uint)p[0] << 24) | ((uint)p[1] << 16) | ((uint)p[2] << 8) | p[3];
+}
+
+/** Parse RTP header and set 'data' to the payload. */
+static int rtp_hdr_read(rtp_hdr *h, ffstr *data)
+{
+	const byte *p = (void*)data->ptr;
+	size_t n = RTP_HDR, len = data->len;
+
+	if (len < RTP_HDR || (p[0] >> 6) != 2)
+		return -1;
+	h->marker = p[1] >> 7;
+	h->pt = p[1] & 0x7f;
+	h->seq = ((uint)p[2] << 8) | p[3];
+	h->ts = rtp_be32(p + 4);
+	h->ssrc = rtp_be32(p + 8);
+
+	n += (p[0] & 0x0f) * 4; //CSRC list
+	if (p[0] & 0x10) {
+		//header extension
+		if (len < n + 4)
+			return -1;
+		n += 4 + (((uint)p[n + 2] << 8) | p[n + 3]) * 4;
+	}
+	if (p[0] & 0x20) {
+		//padding
+		if (len == 0 || len < p[len - 1])
+			return -1;
+		len -= p[len - 1];
+	}
+	if (len < n)
+		return -1;
+
+	ffstr_set(data, data->ptr + n, len - n);
+	return 0;
+}
+
+/** Convert PCM samples between host (little-endian) and network byte order. */
+static void rtp_pcm_swap(char *dst, const char *src, size_t len, uint width)
+{
+	size_t i;
+	if (width == 2) {
+		for (i = 0;  i + 2 <= len;  i += 2) {
+			dst[i] = src[i + 1];
+			dst[i + 1] = src[i];
+		}
+	} else {
+		for (i = 0;  i + 3 <= len;  i += 3) {
+			dst[i] = src[i + 2];
+			dst[i + 1] = src[i + 1];
+			dst[i + 2] = src[i];
+		}
+	}
+}
+
+/** Get the number of samples (48kHz) in Opus packet from its TOC byte. */
+static uint rtp_opus_samples(const byte *d, size_t len)
+{
+	static const byte silk[] = { 10, 20, 40, 60 };
+	uint cfg, frame, n;
+
+	if (len == 0)
+		return 0;
+	cfg = d[0] >> 3;
+	if (cfg < 12)
+		frame = silk[cfg % 4] * 48;
+	else if (cfg < 16)
+		frame = (cfg % 2) ? 20 * 48 : 10 * 48;
+	else
+		frame = 120 << (cfg % 4); // 2.5, 5, 10, 20 msec
+
+	switch (d[0] & 0x03) {
+	case 0:
+		n = 1;  break;
+	case 1:
+	case 2:
+		n = 2;  break;
+	default:
+		if (len < 2)
+			return 0;
+		n = d[1] & 0x3f;
+	}
+	return frame * n;
+}
+
+
+typedef struct rtpout {
+	uint state;
+	ffskt sk;
+	ffaddr addr;
+	uint payload;
+	ffpcm fmt;
+	uint sampsize;
+	uint pktsize; //payload bytes per packet (PCM)
+	rtp_hdr hdr;
+	uint ts0; //random timestamp offset
+	ffarr pkt; //RTP header + payload
+	uint64 pos; //samples: the position of the next input sample
+	uint64 pktpos; //samples: the position of the first sample in 'pkt'
+	uint64 granpos; //Opus: the position of the next packet
+
+	fftime t0;
+	uint64 pos0; //samples: the position at 't0'
+	fftmrq_entry tmr;
+	fftask task;
+
+	uint64 npkts, nerr;
+	uint started :1
+		, chunk :1 //the current input data is partially processed
+		;
+} rtpout;
+
+static int rtpout_config(ffpars_ctx *ctx)
+{
+	rtp_out_conf.payload = RTP_L16;
+	rtp_out_conf.pt = 96;
+	rtp_out_conf.ptime = 5;
+	rtp_out_conf.rate = 48000;
+	rtp_out_conf.channels = 2;
+	ffpars_setargs(ctx, &rtp_out_conf, rtp_out_conf_args, FFCNT(rtp_out_conf_args));
+	return 0;
+}
+
+static void rtpout_ontmr(void *param)
+{
+	rtpout *o = param;
+	core->task(&o->task, FMED_TASK_POST);
+}
+
+static void* rtpout_open(fmed_filt *d)
+{
+	rtpout *o;
+	const char *url = d->track->getvalstr(d->trk, "output");
+	int family;
+
+	if (!(rtp_out_conf.ptime >= 2.5 && rtp_out_conf.ptime <= 20)) {
+		errlog(d->trk, "packet_time must be within 2.5..20 msec");
+		return NULL;
+	}
+
+	if (NULL == (o = ffmem_new(rtpout)))
+		return NULL;
+	o->sk = FF_BADSKT;
+	o->task.handler = d->handler;
+	o->task.param = d->trk;
+	o->tmr.handler = &rtpout_ontmr;
+	o->tmr.param = o;
+
+	o->payload = rtp_out_conf.payload;
+	if (0 == (family = rtp_url(url, &o->addr, &o->payload, d)))
+		goto err;
+
+	if (FF_BADSKT == (o->sk = ffskt_create(family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP))) {
+		syserrlog(d->trk, "%s", ffskt_create_S);
+		goto err;
+	}
+	// the socket is connected so that send() can be used
+	if (0 != ffskt_connect(o->sk, &o->addr.a, o->addr.len)) {
+		syserrlog(d->trk, "%s", ffskt_connect_S);
+		goto err;
+	}
+
+	if (NULL == ffarr_alloc(&o->pkt, RTP_HDR + RTP_MAXPAYLOAD))
+		goto err;
+	o->pkt.len = RTP_HDR;
+
+	o->hdr.pt = rtp_out_conf.pt;
+	o->hdr.seq = ffrnd_get() & 0xffff;
+	o->hdr.ssrc = ffrnd_get();
+	o->hdr.marker = 1;
+	o->ts0 = ffrnd_get();
+
+	infolog(d->trk, "sending %s to %s", rtp_pl_str[o->payload], url);
+	return o;
+
+err:
+	rtpout_close(o);
+	return NULL;
+}
+
+static void rtpout_close(void *ctx)
+{
+	rtpout *o = ctx;
+	if (o->npkts != 0)
+		infolog(NULL, "packets sent: %U, send errors: %U", o->npkts, o->nerr);
+	core->timer(&o->tmr, 0, 0);
+	core->task(&o->task, FMED_TASK_DEL);
+	if (o->sk != FF_BADSKT)
+		ffskt_close(o->sk);
+	ffarr_free(&o->pkt);
+	ffmem_free(o);
+}
+
+/** Don't send packets ahead of real time: the receiver's buffer is small. */
+static int rtpout_pace(rtpout *o, uint64 pos, uint rate)
+{
+	fftime t;
+	uint64 pos_ms, now;
+
+	if (!o->started || pos < o->pos0) {
+		o->started = 1;
+		ffclk_get(&o->t0);
+		o->pos0 = pos;
+		return 0;
+	}
+
+	ffclk_get(&t);
+	ffclk_diff(&o->t0, &t);
+	now = fftime_ms(&t);
+	pos_ms = ffpcm_time(pos - o->pos0, rate);
+	if (pos_ms > now) {
+		core->timer(&o->tmr, -(int)(pos_ms - now), 0);
+		return FMED_RASYNC;
+	}
+	return 0;
+}
+
+static void rtpout_send(rtpout *o, fmed_filt *d, uint64 pos)
+{
+	o->hdr.ts = o->ts0 + (uint)pos;
+	rtp_hdr_write(o->pkt.ptr, &o->hdr);
+
+	// a send error isn't fatal: e.g. the receiver isn't running yet
+	if (0 > ffskt_send(o->sk, o->pkt.ptr, o->pkt.len, 0)) {
+		if (o->nerr++ == 0)
+			syswarnlog(d->trk, "%s", ffskt_send_S);
+	}
+
+	dbglog(d->trk, "sent packet #%u  ts:%u  size:%L"
+		, o->hdr.seq, o->hdr.ts, o->pkt.len);
+	o->hdr.seq = (o->hdr.seq + 1) & 0xffff;
+	o->hdr.marker = 0;
+	o->npkts++;
+	o->pkt.len = RTP_HDR;
+}
+
+static int rtpout_pcm(rtpout *o, fmed_filt *d)
+{
+	size_t n;
+	uint64 pos;
+	int r;
+
+	if (!o->chunk && (d->flags & FMED_FFWD)) {
+		// synchronize with the position of the new input data
+		pos = d->audio.pos * o->fmt.sample_rate / d->audio.fmt.sample_rate;
+		if (pos > o->pos + o->pktsize / o->sampsize || pos + o->pktsize / o->sampsize < o->pos) {
+			if (o->npkts != 0)
+				dbglog(d->trk, "position: %U -> %U", o->pos, pos);
+			o->pos = pos;
+			o->pkt.len = RTP_HDR;
+			o->hdr.marker = 1;
+			o->started = 0;
+		}
+		o->chunk = 1;
+	}
+
+	for (;;) {
+
+		if (o->pkt.len == RTP_HDR + o->pktsize
+			|| (o->pkt.len != RTP_HDR && d->datalen == 0 && (d->flags & FMED_FLAST))) {
+			if (0 != (r = rtpout_pace(o, o->pktpos, o->fmt.sample_rate)))
+				return r;
+			rtpout_send(o, d, o->pktpos);
+			continue;
+		}
+
+		if (d->datalen == 0)
+			break;
+
+		if (o->pkt.len == RTP_HDR)
+			o->pktpos = o->pos;
+		n = ffmin(d->datalen, RTP_HDR + o->pktsize - o->pkt.len);
+		rtp_pcm_swap(ffarr_end(&o->pkt), d->data, n, o->sampsize / o->fmt.channels);
+		o->pkt.len += n;
+		d->data += n;
+		d->datalen -= n;
+		o->pos += n / o->sampsize;
+	}
+
+	o->chunk = 0;
+	return (d->flags & FMED_FLAST) ? FMED_RDONE : FMED_ROK;
+}
+
+static int rtpout_opus(rtpout *o, fmed_filt *d)
+{
+	int r;
+
+	if (d->datalen >= 8
+		&& (!ffmemcmp(d->data, "OpusHead", 8) || !ffmemcmp(d->data, "OpusTags", 8))) {
+		// header packets aren't sent: rtp.in generates them
+		d->datalen = 0;
+		return FMED_RMORE;
+	}
+
+	if (d->datalen != 0) {
+		if (0 != (r = rtpout_pace(o, o->granpos, 48000)))
+			return r;
+
+		if (NULL == ffarr_realloc(&o->pkt, RTP_HDR + d->datalen))
+			return FMED_RERR;
+		ffmemcpy(ffarr_end(&o->pkt), d->data, d->datalen);
+		o->pkt.len += d->datalen;
+		rtpout_send(o, d, o->granpos);
+		o->granpos += rtp_opus_samples((void*)d->data, d->datalen);
+		d->datalen = 0;
+	}
+
+	return (d->flags & FMED_FLAST) ? FMED_RDONE : FMED_ROK;
+}
+
+static int rtpout_process(void *ctx, fmed_filt *d)
+{
+	enum { W_CONV, W_CREATE, W_DATA };
+	rtpout *o = ctx;
+
+	switch (o->state) {
+	case W_CONV:
+		if (!ffsz_eq(d->datatype, "pcm")) {
+			errlog(d->trk, "unsupported input data format: %s", d->datatype);
+			return FMED_RERR;
+		}
+		if (rtp_out_conf.rate != 0)
+			d->audio.convfmt.sample_rate = rtp_out_conf.rate;
+		if (rtp_out_conf.channels != 0)
+			d->audio.convfmt.channels = rtp_out_conf.channels;
+		d->audio.convfmt.ileaved = 1;
+
+		if (o->payload == RTP_OPUS) {
+			// Opus supports 2.5..60msec frames, but "opus.encode" accepts integer values only
+			if (d->opus.frame_size == -1)
+				d->opus.frame_size = (rtp_out_conf.ptime >= 20) ? 20
+					: (rtp_out_conf.ptime >= 10) ? 10 : 5;
+			if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT_PREV, "opus.encode"))
+				return FMED_RERR;
+		} else {
+			d->audio.convfmt.format = (o->payload == RTP_L24) ? FFPCM_24 : FFPCM_16;
+		}
+		o->state = W_CREATE;
+		return FMED_RMORE;
+
+	case W_CREATE:
+		ffpcm_fmtcopy(&o->fmt, &d->audio.convfmt);
+		if (o->payload != RTP_OPUS) {
+			if (o->fmt.format != ((o->payload == RTP_L24) ? FFPCM_24 : FFPCM_16)
+				|| !d->audio.convfmt.ileaved) {
+				errlog(d->trk, "input format must be %s interleaved", rtp_pl_str[o->payload]);
+				return FMED_RERR;
+			}
+			o->sampsize = ffpcm_size1(&o->fmt);
+			uint spp = o->fmt.sample_rate * rtp_out_conf.ptime / 1000;
+			if (spp * o->sampsize > RTP_MAXPAYLOAD) {
+				spp = RTP_MAXPAYLOAD / o->sampsize;
+				infolog(d->trk, "packet time is limited to %.2Fmsec by MTU"
+					, (double)spp * 1000 / o->fmt.sample_rate);
+			}
+			o->pktsize = spp * o->sampsize;
+			o->pos = d->audio.pos * o->fmt.sample_rate / d->audio.fmt.sample_rate;
+		}
+		dbglog(d->trk, "%s %uHz %uch, packet: %u bytes"
+			, rtp_pl_str[o->payload], o->fmt.sample_rate, o->fmt.channels, o->pktsize);
+		o->state = W_DATA;
+		// break
+
+	case W_DATA:
+		break;
+	}
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RDONE;
+	}
+
+	if (o->payload == RTP_OPUS)
+		return rtpout_opus(o, d);
+	return rtpout_pcm(o, d);
+}
+
+
+typedef struct rtp_slot {
+	uint seq;
+	uint ts;
+	uint samples;
+	uint len;
+	uint used :1;
+} rtp_slot;
+
+typedef struct rtpin {
+	uint state;
+	ffskt sk;
+	ffaio_task aio;
+	fftask task;
+	char addr[FF_MAXIP6];
+	uint payload;
+	uint rate;
+	uint sampsize;
+	char *rbuf; //received datagram
+	rtp_slot *slots; //jitter buffer
+	char *sdata; //slots' payload: RTP_NSLOTS * RTP_MAXPKT
+	ffarr out; //PCM in host byte order or silence
+
+	uint ssrc;
+	uint next_seq; //the next packet to play
+	uint next_ts; //the next sample to play
+	uint hi_ts; //the end of the newest received packet
+	uint target; //samples: jitter buffer length
+	uint max; //samples: jitter buffer limit
+	uint64 pos; //samples played
+
+	uint64 nrecv, nlost, nlate, ndropped, nbad;
+	uint async :1
+		, have_seq :1 //the first packet has been received
+		;
+} rtpin;
+
+static int rtpin_config(ffpars_ctx *ctx)
+{
+	rtp_in_conf.payload = RTP_L16;
+	rtp_in_conf.rate = 48000;
+	rtp_in_conf.channels = 2;
+	rtp_in_conf.jitter = 10;
+	rtp_in_conf.jitter_max = 30;
+	ffpars_setargs(ctx, &rtp_in_conf, rtp_in_conf_args, FFCNT(rtp_in_conf_args));
+	return 0;
+}
+
+static void* rtpin_open(fmed_filt *d)
+{
+	rtpin *r;
+	ffaddr a;
+	int family;
+	const char *url = d->track->getvalstr(d->trk, "input");
+
+	if (NULL == (r = ffmem_new(rtpin)))
+		return NULL;
+	r->sk = FF_BADSKT;
+	r->task.handler = d->handler;
+	r->task.param = d->trk;
+
+	r->payload = rtp_in_conf.payload;
+	if (0 == (family = rtp_url(url, &a, &r->payload, d)))
+		goto err;
+	ffaddr_tostr(&a, r->addr, sizeof(r->addr), FFADDR_USEPORT);
+
+	if (NULL == (r->rbuf = ffmem_alloc(RTP_RBUF))
+		|| NULL == (r->slots = ffmem_callocT(RTP_NSLOTS, rtp_slot))
+		|| NULL == (r->sdata = ffmem_alloc(RTP_NSLOTS * RTP_MAXPKT)))
+		goto err;
+
+	if (FF_BADSKT == (r->sk = ffskt_create(family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP))) {
+		syserrlog(d->trk, "%s", ffskt_create_S);
+		goto err;
+	}
+	if (0 != ffskt_setopt(r->sk, SOL_SOCKET, SO_REUSEADDR, 1))
+		syswarnlog(d->trk, "%s", ffskt_setopt_S);
+	if (0 != ffskt_bind(r->sk, &a.a, a.len)) {
+		syserrlog(d->trk, "%s: %s", ffskt_bind_S, r->addr);
+		goto err;
+	}
+
+	ffaio_init(&r->aio);
+	r->aio.sk = r->sk;
+	r->aio.udata = r;
+	if (0 != ffaio_attach(&r->aio, core->kq, FFKQU_READ)) {
+		syserrlog(d->trk, "%s", ffkqu_attach_S);
+		goto err;
+	}
+
+	if (r->payload == RTP_OPUS) {
+		r->rate = 48000;
+	} else {
+		d->audio.fmt.format = (r->payload == RTP_L24) ? FFPCM_24 : FFPCM_16;
+		d->audio.fmt.channels = rtp_in_conf.channels;
+		d->audio.fmt.sample_rate = rtp_in_conf.rate;
+		d->audio.fmt.ileaved = 1;
+		d->audio.decoder = rtp_pl_str[r->payload];
+		d->datatype = "pcm";
+		r->rate = rtp_in_conf.rate;
+		r->sampsize = ffpcm_size1(&d->audio.fmt);
+		d->audio.bitrate = r->rate * r->sampsize * 8;
+	}
+	r->target = ffpcm_samples(rtp_in_conf.jitter, r->rate);
+	r->max = ffpcm_samples(ffmax(rtp_in_conf.jitter_max, rtp_in_conf.jitter), r->rate);
+
+	infolog(d->trk, "receiving %s on %s", rtp_pl_str[r->payload], r->addr);
+	return r;
+
+err:
+	rtpin_close(r);
+	return NULL;
+}
+
+static void rtpin_close(void *ctx)
+{
+	rtpin *r = ctx;
+	if (r->nrecv != 0)
+		infolog(NULL, "%s: packets received: %U, lost: %U, late: %U, dropped: %U, bad: %U"
+			, r->addr, r->nrecv, r->nlost, r->nlate, r->ndropped, r->nbad);
+	core->task(&r->task, FMED_TASK_DEL);
+	if (r->sk != FF_BADSKT) {
+		ffskt_close(r->sk);
+		ffaio_fin(&r->aio);
+	}
+	ffmem_safefree(r->rbuf);
+	ffmem_safefree(r->slots);
+	ffmem_safefree(r->sdata);
+	ffarr_free(&r->out);
+	ffmem_free(r);
+}
+
+static void rtpin_a(void *param)
+{
+	rtpin *r = param;
+	r->async = 0;
+	core->task(&r->task, FMED_TASK_POST);
+}
+
+/** Start a new stream with this packet. */
+static void rtpin_reset(rtpin *r, const rtp_hdr *h)
+{
+	uint i;
+	for (i = 0;  i != RTP_NSLOTS;  i++) {
+		r->slots[i].used = 0;
+	}
+	r->ssrc = h->ssrc;
+	r->next_seq = h->seq;
+	r->next_ts = h->ts;
+	r->hi_ts = h->ts;
+	r->have_seq = 1;
+}
+
+/** Put packet into jitter buffer. */
+static void rtpin_put(rtpin *r, fmed_filt *d, const char *data, size_t len)
+{
+	rtp_hdr h;
+	ffstr pl;
+	rtp_slot *sl;
+	int diff;
+	uint i;
+
+	ffstr_set(&pl, data, len);
+	if (0 != rtp_hdr_read(&h, &pl) || pl.len == 0 || pl.len > RTP_MAXPKT) {
+		r->nbad++;
+		dbglog(d->trk, "bad packet: %L bytes", len);
+		return;
+	}
+	r->nrecv++;
+
+	if (!r->have_seq || h.ssrc != r->ssrc) {
+		if (r->have_seq)
+			infolog(d->trk, "new stream: SSRC %xu", h.ssrc);
+		rtpin_reset(r, &h);
+	}
+
+	diff = (short)(h.seq - r->next_seq);
+	if (diff < 0) {
+		r->nlate++;
+		dbglog(d->trk, "late packet #%u", h.seq);
+		return;
+	} else if (diff >= RTP_NSLOTS) {
+		infolog(d->trk, "stream discontinuity: packet #%u, expected #%u", h.seq, r->next_seq);
+		rtpin_reset(r, &h);
+	}
+
+	i = h.seq % RTP_NSLOTS;
+	sl = &r->slots[i];
+	if (sl->used && sl->seq == h.seq)
+		return; //duplicate
+	sl->seq = h.seq;
+	sl->ts = h.ts;
+	sl->len = pl.len;
+	sl->samples = (r->payload == RTP_OPUS) ? rtp_opus_samples((void*)pl.ptr, pl.len) : pl.len / r->sampsize;
+	sl->used = 1;
+	ffmemcpy(r->sdata + i * RTP_MAXPKT, pl.ptr, pl.len);
+
+	if ((int)(h.ts + sl->samples - r->hi_ts) > 0)
+		r->hi_ts = h.ts + sl->samples;
+}
+
+/** Receive all pending packets. */
+static int rtpin_recv(rtpin *r, fmed_filt *d)
+{
+	ssize_t n;
+
+	for (;;) {
+		n = ffaio_recv(&r->aio, &rtpin_a, r->rbuf, RTP_RBUF);
+		if (n == FFAIO_ASYNC) {
+			r->async = 1;
+			return 0;
+		} else if (n < 0) {
+			syserrlog(d->trk, "%s", ffskt_recv_S);
+			return -1;
+		}
+		rtpin_put(r, d, r->rbuf, n);
+	}
+}
+
+/** Get the next portion of audio data from jitter buffer.
+Return 1 if more packets are needed. */
+static int rtpin_get(rtpin *r, fmed_filt *d, ffstr *out)
+{
+	rtp_slot *sl;
+	uint i, n;
+	char *data;
+
+	if (!r->have_seq)
+		return 1;
+
+	while ((uint)(r->hi_ts - r->next_ts) > r->max) {
+		// the buffer has grown too large (the sender's clock is faster or a burst of packets):
+		//  drop the oldest packets
+		sl = &r->slots[r->next_seq % RTP_NSLOTS];
+		if (sl->used && sl->seq == r->next_seq) {
+			sl->used = 0;
+			r->next_ts = sl->ts + sl->samples;
+			r->ndropped++;
+		}
+		r->next_seq = (r->next_seq + 1) & 0xffff;
+	}
+
+	if ((uint)(r->hi_ts - r->next_ts) < r->target)
+		return 1;
+
+	sl = &r->slots[r->next_seq % RTP_NSLOTS];
+	if (!(sl->used && sl->seq == r->next_seq)) {
+		// the packet is lost: continue with the next received packet
+		for (i = 1;  i != RTP_NSLOTS;  i++) {
+			sl = &r->slots[(r->next_seq + i) % RTP_NSLOTS];
+			if (sl->used && sl->seq == ((r->next_seq + i) & 0xffff))
+				break;
+		}
+		if (i == RTP_NSLOTS)
+			return 1;
+		dbglog(d->trk, "lost %u packets at #%u", i, r->next_seq);
+		r->nlost += i;
+		r->next_seq = sl->seq;
+
+		n = sl->ts - r->next_ts;
+		r->next_ts = sl->ts;
+		if (r->payload != RTP_OPUS && n != 0 && n <= r->rate) {
+			if (NULL == ffarr_realloc(&r->out, n * r->sampsize))
+				return 1;
+			ffmem_zero(r->out.ptr, n * r->sampsize);
+			ffstr_set(out, r->out.ptr, n * r->sampsize);
+			r->pos += n;
+			return 0;
+		}
+	}
+
+	data = r->sdata + (r->next_seq % RTP_NSLOTS) * RTP_MAXPKT;
+	if (r->payload == RTP_OPUS) {
+		ffstr_set(out, data, sl->len);
+	} else {
+		if (NULL == ffarr_realloc(&r->out, sl->len))
+			return 1;
+		rtp_pcm_swap(r->out.ptr, data, sl->len, r->sampsize / rtp_in_conf.channels);
+		ffstr_set(out, r->out.ptr, sl->len);
+	}
+	sl->used = 0;
+	r->next_ts = sl->ts + sl->samples;
+	r->next_seq = (r->next_seq + 1) & 0xffff;
+	r->pos += sl->samples;
+	return 0;
+}
+
+/** Opus identification and comment headers for "opus.decode". */
+static void rtpin_opus_hdr(rtpin *r, uint i, ffstr *out)
+{
+	char *p;
+
+	if (NULL == ffarr_realloc(&r->out, 64)) {
+		ffstr_null(out);
+		return;
+	}
+	p = r->out.ptr;
+
+	if (i == 0) {
+		ffmem_zero(p, 19);
+		ffmemcpy(p, "OpusHead", 8);
+		p[8] = 1; //version
+		p[9] = rtp_in_conf.channels;
+		p[10] = (byte)312, p[11] = 312 >> 8; //pre-skip
+		p[12] = (byte)48000, p[13] = (byte)(48000 >> 8), p[14] = 48000 >> 16; //input sample rate
+		ffstr_set(out, p, 19);
+
+	} else {
+		ffmem_zero(p, 22);
+		ffmemcpy(p, "OpusTags", 8);
+		p[8] = 6; //vendor length
+		ffmemcpy(p + 12, "fmedia", 6);
+		ffstr_set(out, p, 22);
+	}
+}
+
+static int rtpin_process(void *ctx, fmed_filt *d)
+{
+	enum { R_INIT, R_HDR, R_TAGS, R_DATA };
+	rtpin *r = ctx;
+	ffstr out;
+
+	if (d->flags & FMED_FSTOP) {
+		d->outlen = 0;
+		return FMED_RLASTOUT;
+	}
+
+	switch (r->state) {
+	case R_INIT:
+		if (r->payload != RTP_OPUS) {
+			r->state = R_DATA;
+			break;
+		}
+		if (0 != d->track->cmd2(d->trk, FMED_TRACK_ADDFILT, "opus.decode"))
+			return FMED_RERR;
+		r->state = R_HDR;
+		// break
+
+	case R_HDR:
+	case R_TAGS:
+		rtpin_opus_hdr(r, r->state - R_HDR, &out);
+		if (out.len == 0)
+			return FMED_RERR;
+		r->state++;
+		d->audio.pos = 0;
+		goto data;
+
+	case R_DATA:
+		break;
+	}
+
+	if (!r->async && 0 != rtpin_recv(r, d))
+		return FMED_RERR;
+
+	d->audio.pos = r->pos;
+	if (0 != rtpin_get(r, d, &out))
+		return FMED_RASYNC; //wait for packets
+
+data:
+	d->track->setval(d->trk, "net_buffer_ms", ffpcm_time(r->hi_ts - r->next_ts, r->rate));
+	dbglog(d->trk, "output: %L bytes, buffered: %ums"
+		, out.len, (uint)ffpcm_time(r->hi_ts - r->next_ts, r->rate));
+	d->out = out.ptr,  d->outlen = out.len;
+	return FMED_RDATA;
+}
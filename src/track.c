@@ -12,6 +12,7 @@ Copyright (c) 2016 Simon Zolin */
 #include <FFOS/error.h>
 #include <FFOS/process.h>
 #include <FFOS/timer.h>
+#include <FFOS/thread.h>
 
 
 #undef dbglog
@@ -74,6 +75,9 @@ typedef struct fm_trk {
 	ffrbtree meta;
 	struct ffps_perf psperf;
 	fftask tsk;
+	fftask wtsk; //task in the worker thread
+	uint wid; //worker ID;  0: the track is processed in the main thread
+	ffatomic xstop; //enum FMED_TRACK_CMD: the track must be stopped by the worker thread
 
 	ffstr id;
 	char sid[FFSLEN("*") + FFINT_MAXCHARS];
@@ -90,12 +94,16 @@ static int filt_call(fm_trk *t, fmed_f *f);
 static int trk_open(fm_trk *t, const char *fn);
 static void trk_open_capt(fm_trk *t);
 static void trk_free(fm_trk *t);
+static void trk_fin(void *udata);
 static void trk_process(void *udata);
+static void trk_xprocess(void *udata);
+static void trk_post(void *udata);
 static void trk_stop(fm_trk *t, uint flags);
 static fmed_f* trk_modbyext(fm_trk *t, uint flags, const ffstr *ext);
 static void trk_printtime(fm_trk *t);
 static int trk_meta_enum(fm_trk *t, fmed_trk_meta *meta);
 static int trk_meta_copy(fm_trk *t, fm_trk *src);
+static void trk_meta_detach(fm_trk *t);
 static fmed_f* filt_add(fm_trk *t, uint cmd, const char *name);
 
 static dict_ent* dict_add(fm_trk *t, const char *name, uint *f);
@@ -136,6 +144,27 @@ void tracks_destroy(void)
 	if (g == NULL)
 		return;
 	trk_cmd(NULL, FMED_TRACK_STOPALL);
+	g->stop_sig = 0;
+
+	// the tracks in worker threads are closed asynchronously and then trk_fin() is posted to the main thread
+	fm_trk *t;
+	uint n, i;
+	for (i = 0;  ;  i++) {
+		fftask_run(&fmed->taskmgr);
+		n = 0;
+		FFLIST_WALK(&g->trks, t, sib) {
+			if (t->wid != 0)
+				n++;
+		}
+		if (n == 0)
+			break;
+		if (i == 500) {
+			errlog(NULL, "%u tracks in worker threads haven't finished", n);
+			break;
+		}
+		ffthd_sleep(10);
+	}
+
 	ffmem_free0(g);
 }
 
@@ -185,8 +214,33 @@ static int trk_open(fm_trk *t, const char *fn)
 		return 0;
 	}
 
-	if (ffs_match(fn, ffsz_len(fn), "http://", 7)) {
-		addfilter(t, "net.icy");
+	if (ffs_match(fn, ffsz_len(fn), "rtp://", 6)) {
+		addfilter(t, "rtp.in");
+
+	} else if (ffs_match(fn, ffsz_len(fn), "http://", 7)) {
+		// HLS playlist;
+		//  a remote file of known format is read with Range requests, so it can be seeked;
+		//  everything else is an internet radio stream
+		ffstr url;
+		ffstr_setz(&url, fn);
+		ffs_split2by(url.ptr, url.len, '?', &url, NULL);
+		ffstr_shift(&url, FFSLEN("http://"));
+		if (NULL != ffs_split2by(url.ptr, url.len, '/', NULL, &url)) {
+			ffpath_split2(url.ptr, url.len, NULL, &name);
+			ffpath_splitname(name.ptr, name.len, NULL, &ext);
+		} else
+			ffstr_null(&ext);
+
+		if (ffstr_ieqz(&ext, "m3u8"))
+			addfilter(t, "net.hls");
+		else if (ext.len != 0
+			&& !ffstr_ieqz(&ext, "mp3") && !ffstr_ieqz(&ext, "aac")
+			&& NULL != core->getmod2(FMED_MOD_INEXT, ext.ptr, ext.len)) {
+			addfilter(t, "net.http");
+			if (NULL == trk_modbyext(t, FMED_MOD_INEXT, &ext))
+				return 1;
+		} else
+			addfilter(t, "net.icy");
 	} else {
 		uint have_path = (NULL != ffpath_split2(fn, ffsz_len(fn), NULL, &name));
 		ffpath_splitname(name.ptr, name.len, &name, &ext);
@@ -222,6 +276,11 @@ static int trk_setout(fm_trk *t)
 	ffstr name, ext;
 	const char *s;
 	ffbool stream_copy = t->props.stream_copy;
+	ffbool split = (FMED_NULL != trk_getval(t, "cue_split"));
+	ffbool monitor = (t->props.type == FMED_TRK_TYPE_REC && FMED_NULL != trk_getval(t, "rec_monitor"));
+	ffbool tee = ((FMED_NULL != trk_getval(t, "output_tee") || monitor)
+		&& t->props.type != FMED_TRK_TYPE_SUB && !stream_copy);
+	ffbool vad = (t->props.type == FMED_TRK_TYPE_REC && FMED_NULL != trk_getval(t, "rec_trigger"));
 
 	if (t->props.type == FMED_TRK_TYPE_NETIN) {
 		ffstr ext;
@@ -233,8 +292,8 @@ static int trk_setout(fm_trk *t)
 	} else if (t->props.type == FMED_TRK_TYPE_NONE) {
 		return 0;
 
-	} else if (t->props.type != FMED_TRK_TYPE_MIXIN) {
-		if (t->props.type != FMED_TRK_TYPE_REC)
+	} else if (t->props.type != FMED_TRK_TYPE_MIXIN && t->props.type != FMED_TRK_TYPE_SUB) {
+		if (t->props.type != FMED_TRK_TYPE_REC && !split)
 			addfilter(t, "#soundmod.until");
 		if (fmed->cmd.gui)
 			addfilter(t, "gui.gui");
@@ -242,21 +301,56 @@ static int trk_setout(fm_trk *t)
 			addfilter(t, "tui.tui");
 	}
 
-	if (t->props.type != FMED_TRK_TYPE_MIXOUT && !stream_copy) {
+	if (t->props.type != FMED_TRK_TYPE_MIXOUT && t->props.type != FMED_TRK_TYPE_SUB && !stream_copy) {
 		addfilter(t, "#soundmod.gain");
 	}
 
 	if (t->props.use_dynanorm)
 		addfilter(t, "dynanorm.filter");
 
+	if (t->props.type != FMED_TRK_TYPE_MIXIN && t->props.type != FMED_TRK_TYPE_SUB && !stream_copy
+		&& NULL != core->getmod2(FMED_MOD_INFO | FMED_MOD_NOLOG, "meter.tap", -1)) {
+		addfilter(t, "meter.tap");
+	}
+
 	addfilter(t, "#soundmod.autoconv");
 
+	if (split) {
+		// "split.cue" passes PCM data to the tracks which encode and write the output files
+		t->props.audio.until = FMED_NULL;
+		addfilter(t, "split.cue");
+		return 0;
+
+	} else if (vad) {
+		// "split.vad" creates a track which writes a new output file when the signal is above threshold
+		addfilter(t, "split.vad");
+		return 0;
+
+	} else if (tee) {
+		// "split.tee" passes the same PCM data to the tracks which encode and write each output file
+		//  and to the track which plays it via audio device (--monitor)
+		addfilter(t, "split.tee");
+		return 0;
+	}
+
 	if (t->props.type == FMED_TRK_TYPE_MIXIN) {
 		addfilter(t, "mixer.in");
 
+	} else if (t->props.type == FMED_TRK_TYPE_SUB
+		&& FMED_PNULL != (s = trk_getvalstr(t, "split_encoder"))) {
+		// the encoded data is returned to the parent track
+		addfilter(t, s);
+		addfilter(t, "split.segout");
+
 	} else if (t->props.pcm_peaks) {
 		addfilter(t, "#soundmod.peaks");
 
+	} else if (FMED_PNULL != (s = trk_getvalstr(t, "output"))
+		&& ffs_match(s, ffsz_len(s), "rtp://", 6)) {
+		// PCM is packed into RTP packets (or encoded by "opus.encode") by "rtp.out" itself
+		addfilter(t, "rtp.out");
+		t->props.out_seekable = 0;
+
 	} else if (FMED_PNULL != (s = trk_getvalstr(t, "output"))) {
 		uint have_path = (NULL != ffpath_split2(s, ffsz_len(s), NULL, &name));
 		ffs_rsplit2by(name.ptr, name.len, '.', &name, &ext);
@@ -267,12 +361,24 @@ static int trk_setout(fm_trk *t)
 		if (!have_path && ffstr_eqcz(&name, "@stdout")) {
 			addfilter(t, "#file.stdout");
 			t->props.out_seekable = 0;
+		} else if (ffs_match(s, ffsz_len(s), "http://", 7)) {
+			// serve the encoded stream to HTTP clients
+			addfilter(t, "net.server");
+			t->props.out_seekable = 0;
 		} else {
 			addfilter(t, "#file.out");
 			t->props.out_seekable = 1;
 		}
 
 	} else if (fmed->conf.output != NULL) {
+		const char *input = trk_getvalstr(t, "input");
+		size_t n = (input != FMED_PNULL) ? ffsz_len(input) : 0;
+		if ((ffs_match(input, n, "http://", 7) || ffs_match(input, n, "https://", 8)
+			|| ffs_match(input, n, "rtp://", 6))
+			&& NULL != core->getmod2(FMED_MOD_INFO | FMED_MOD_NOLOG, "#soundmod.drift", -1)) {
+			// the source and the audio device are clocked independently
+			addfilter(t, "#soundmod.drift");
+		}
 		addfilter1(t, fmed->conf.output);
 	}
 
@@ -399,6 +505,16 @@ static void trk_copy_info(fmed_trk *dst, const fmed_trk *src)
 
 static void trk_stop(fm_trk *t, uint flags)
 {
+	if (t->wid != 0) {
+		// the track will be closed by the worker thread
+		if (t->state == TRK_ST_ACTIVE) {
+			// "stopped" is set by the worker thread: the track's data is not shared
+			ffatom_set(&t->xstop, flags);
+			core->cmd(FMED_TASK_XPOST, &t->wtsk, t->wid);
+		}
+		return;
+	}
+
 	trk_setval(t, "stopped", flags);
 	t->props.flags |= FMED_FSTOP;
 	if (t->state != TRK_ST_ACTIVE)
@@ -442,9 +558,12 @@ static void trk_free(fm_trk *t)
 	fmed_f *pf;
 	dict_ent *e;
 	fftree_node *node, *next;
-	int type = t->props.type;
 
-	core->task(&t->tsk, FMED_TASK_DEL);
+	if (t->wid == 0)
+		core->task(&t->tsk, FMED_TASK_DEL);
+	else
+		core->cmd(FMED_TASK_XDEL, &t->wtsk, t->wid);
+	t->state = TRK_ST_STOPPED;
 
 	if (fmed->cmd.print_time) {
 		struct ffps_perf i2 = {};
@@ -485,6 +604,24 @@ static void trk_free(fm_trk *t)
 		dict_ent_free(e);
 	}
 
+	if (t->wid != 0) {
+		// the list of tracks is accessed only from the main thread
+		fftask_set(&t->tsk, &trk_fin, t);
+		core->task(&t->tsk, FMED_TASK_POST);
+		return;
+	}
+
+	trk_fin(t);
+}
+
+static void trk_fin(void *udata)
+{
+	fm_trk *t = udata;
+	int type = t->props.type;
+
+	if (t->wid != 0)
+		core->cmd(FMED_WORKER_RELEASE, t->wid);
+
 	if (fflist_exists(&g->trks, &t->sib))
 		fflist_rm(&g->trks, &t->sib);
 
@@ -575,7 +712,14 @@ static void trk_process(void *udata)
 			return;
 		}
 
-		if (fmed->taskmgr.tasks.len != ntasks) {
+		if (t->wid != 0) {
+			uint stop = ffatom_get(&t->xstop);
+			if (stop != 0 && !(t->props.flags & FMED_FSTOP)) {
+				trk_setval(t, "stopped", stop);
+				t->props.flags |= FMED_FSTOP;
+			}
+
+		} else if (fmed->taskmgr.tasks.len != ntasks) {
 			core->task(&t->tsk, FMED_TASK_POST);
 			return;
 		}
@@ -685,6 +829,20 @@ fin:
 	trk_free(t);
 }
 
+/** Wake up the track processed in a worker thread. */
+static void trk_xprocess(void *udata)
+{
+	fm_trk *t = udata;
+	core->cmd(FMED_TASK_XPOST, &t->wtsk, t->wid);
+}
+
+/** Wake up the track started by FMED_TRACK_XSTART but processed in the main thread. */
+static void trk_post(void *udata)
+{
+	fm_trk *t = udata;
+	core->task(&t->tsk, FMED_TASK_POST);
+}
+
 
 static dict_ent* dict_findstr(fm_trk *t, const ffstr *name)
 {
@@ -795,6 +953,25 @@ static int trk_meta_enum(fm_trk *t, fmed_trk_meta *meta)
 	return 0;
 }
 
+/** Copy meta data from the queue item into the track and unlink the track from the queue.
+The queue isn't thread-safe: filters in a worker thread read meta data via FMED_TRACK_META_ENUM. */
+static void trk_meta_detach(fm_trk *t)
+{
+	void *qent;
+	ffstr name, *val;
+	uint i;
+
+	if (FMED_PNULL == (qent = (void*)trk_getval(t, "queue_item")))
+		return;
+
+	for (i = 0;  NULL != (val = fmed->qu->meta(qent, i, &name, FMED_QUE_UNIQ));  i++) {
+		if (val == FMED_QUE_SKIP)
+			continue;
+		trk_setvalstr4(t, name.ptr, (void*)val, FMED_TRK_META | FMED_TRK_VALSTR);
+	}
+	trk_setval(t, "queue_item", FMED_NULL);
+}
+
 static int trk_meta_copy(fm_trk *t, fm_trk *src)
 {
 	fmed_trk_meta meta;
@@ -883,6 +1060,16 @@ static ssize_t trk_cmd(void *trk, uint cmd, ...)
 		trk_stop(t, FMED_TRACK_STOP);
 		break;
 
+	case FMED_TRACK_XSTART:
+		if (FMED_NULL == trk_getval(t, "main_thread")
+			&& 0 != (t->wid = core->cmd(FMED_WORKER_ASSIGN))) {
+			fftask_set(&t->wtsk, &trk_process, t);
+			t->props.handler = &trk_xprocess;
+			trk_meta_detach(t);
+		} else
+			t->props.handler = &trk_post;
+		// break
+
 	case FMED_TRACK_START:
 		if (0 != trk_setout(t)) {
 			trk_setval(t, "error", 1);
@@ -893,9 +1080,18 @@ static ssize_t trk_cmd(void *trk, uint cmd, ...)
 			break;
 		}
 
-		if (fmed->cmd.print_time)
+		if (fmed->cmd.print_time) {
+			fftime now;
 			ffps_perf(&t->psperf, FFPS_PERF_REALTIME | FFPS_PERF_CPUTIME | FFPS_PERF_RUSAGE);
+			// audio output prints the time to first sound
+			fftime_now(&now);
+			trk_setval(t, "start_time", fftime_mcs(&now));
+		}
 
+		if (t->wid != 0) {
+			trk_xprocess(t);
+			break;
+		}
 		trk_process(t);
 		break;
 
@@ -458,6 +458,13 @@ static int tui_process(void *ctx, fmed_filt *d)
 			, (size_t)(10 - pos), '.'
 			, db, t->maxdb);
 
+		int64 in_lat, out_lat;
+		if (FMED_NULL != (in_lat = d->track->getval(d->trk, "input_latency"))) {
+			if (FMED_NULL != (out_lat = d->track->getval(d->trk, "output_latency")))
+				in_lat += out_lat;
+			ffstr_catfmt(&t->buf, "latency: %Ums  ", in_lat);
+		}
+
 		goto print;
 	}
 